@@ -33,8 +33,27 @@ IRCNetworkPlugin::IRCNetworkPlugin(Config *config, Swift::QtEventLoop *loop, con
 	m_currentServer = 0;
 	m_firstPing = true;
 
-	m_socket = new QTcpSocket();
-	m_socket->connectToHost(FROM_UTF8(host), port);
+	m_socket = NULL;
+#ifndef WIN32
+	// Use Unix socket if spectrum2 provides it, otherwise fallback to TCP.
+	std::string socketPath = CONFIG_STRING(m_config, "service.backend_socket");
+	if (!socketPath.empty()) {
+		QLocalSocket *socket = new QLocalSocket();
+		socket->connectToServer(FROM_UTF8(socketPath));
+		if (socket->waitForConnected()) {
+			m_socket = socket;
+		}
+		else {
+			LOG4CXX_WARN(logger, "Can't connect Unix socket " << socketPath << ", using TCP");
+			delete socket;
+		}
+	}
+#endif
+	if (!m_socket) {
+		QTcpSocket *socket = new QTcpSocket();
+		socket->connectToHost(FROM_UTF8(host), port);
+		m_socket = socket;
+	}
 	connect(m_socket, SIGNAL(readyRead()), this, SLOT(readData()));
 
 	std::string server = CONFIG_STRING_DEFAULTED(m_config, "service.irc_server", "");
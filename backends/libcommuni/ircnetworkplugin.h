@@ -68,7 +68,7 @@ class IRCNetworkPlugin : public QObject, public NetworkPlugin {
 
 	private:
 		Config *m_config;
-		QTcpSocket *m_socket;
+		QIODevice *m_socket;
 		std::map<std::string, MyIrcSession *> m_sessions;
 		std::vector<std::string> m_servers;
 		int m_currentServer;
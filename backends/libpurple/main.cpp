@@ -992,9 +992,11 @@ void buddyListNewNode(PurpleBlistNode *node);
 static gboolean new_node_cache(void *data) {
 	NodeCache *cache = (NodeCache *) data;
 	caching = false;
+	np->beginBuddyBatch();
 	for (std::map<PurpleBlistNode *, int>::const_iterator it = cache->nodes.begin(); it != cache->nodes.end(); it++) {
 		buddyListNewNode(it->first);
 	}
+	np->endBuddyBatch();
 	caching = true;
 
 	cache->account->ui_data = NULL;
@@ -2252,6 +2254,23 @@ static void transportDataReceived(gpointer data, gint source, PurpleInputConditi
 	}
 }
 
+static int initStorageBackend() {
+	if (CONFIG_STRING(config, "service.protocol") == "prpl-hangouts") {
+		std::string error;
+		storagebackend = StorageBackend::createBackend(config.get(), error);
+		if (storagebackend == NULL) {
+			LOG4CXX_ERROR(logger, "Error creating StorageBackend! " << error);
+			LOG4CXX_ERROR(logger, "Hangouts backend needs storage backend configured to work! " << error);
+			return NetworkPlugin::StorageBackendNeeded;
+		}
+		else if (!storagebackend->connect()) {
+			LOG4CXX_ERROR(logger, "Can't connect to database!")
+				return -1;
+		}
+	}
+	return 0;
+}
+
 int main(int argc, char **argv) {
 	boost::locale::generator gen;
 	std::locale::global(gen("en_GB.UTF-8"));
@@ -2279,22 +2298,47 @@ int main(int argc, char **argv) {
 	config = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Config>(cfg);
  
 	Logging::initBackendLogging(config.get());
-	if (CONFIG_STRING(config, "service.protocol") == "prpl-hangouts") {
-		storagebackend = StorageBackend::createBackend(config.get(), error);
-		if (storagebackend == NULL) {
-			LOG4CXX_ERROR(logger, "Error creating StorageBackend! " << error);
-			LOG4CXX_ERROR(logger, "Hangouts backend needs storage backend configured to work! " << error);
-			return NetworkPlugin::StorageBackendNeeded;
-		}
-		else if (!storagebackend->connect()) {
-			LOG4CXX_ERROR(logger, "Can't connect to database!")
-				return -1;
-		}
+
+	std::string zygoteSocket;
+#ifndef WIN32
+	zygoteSocket = CONFIG_STRING(config, "service.zygote_socket");
+#endif
+
+#ifndef WIN32
+	// In zygote mode this process only forks backends when spectrum2 asks
+	// for them, which saves executing and loading the binary. Just the
+	// forked backends get past run_zygote(). The fork is done before
+	// libpurple, glib and the storage are initialized, so every backend has
+	// its own main loop, threads and database connection.
+	if (!zygoteSocket.empty()) {
+		std::string id = run_zygote(zygoteSocket.c_str());
+		config->setUnregistered("service.backend_id", id);
+		Logging::reloadBackendLogging(config.get());
+		LOG4CXX_INFO(logger, "Forked from zygote as backend " << id);
+	}
+#endif
+
+	int ret = initStorageBackend();
+	if (ret != 0) {
+		return ret;
 	}
 
 	initPurple();
  
-	main_socket = create_socket(host.c_str(), port);
+	main_socket = 0;
+#ifndef WIN32
+	// Use Unix socket if spectrum2 provides it, otherwise fallback to TCP.
+	std::string socketPath = CONFIG_STRING(config, "service.backend_socket");
+	if (!socketPath.empty()) {
+		main_socket = create_unix_socket(socketPath.c_str());
+		if (main_socket == 0) {
+			LOG4CXX_WARN(logger, "Can't connect Unix socket " << socketPath << ", using TCP");
+		}
+	}
+#endif
+	if (main_socket == 0) {
+		main_socket = create_socket(host.c_str(), port);
+	}
 	purple_input_add_wrapped(main_socket, PURPLE_INPUT_READ, &transportDataReceived, NULL);
 	purple_timeout_add_seconds_wrapped(30, pingTimeout, NULL);
  
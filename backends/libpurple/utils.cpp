@@ -46,6 +46,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/un.h>
 #else 
 #include <process.h>
 #define getpid _getpid 
@@ -165,6 +166,103 @@ int create_socket(const char *host, int portno) {
 	return SocketFD;
 }
 
+#ifndef WIN32
+int create_unix_socket(const char *path) {
+	struct sockaddr_un stSockAddr;
+	if (strlen(path) >= sizeof(stSockAddr.sun_path)) {
+		return 0;
+	}
+
+	int SocketFD = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (-1 == SocketFD) {
+		return 0;
+	}
+
+	memset(&stSockAddr, 0, sizeof(stSockAddr));
+	stSockAddr.sun_family = AF_UNIX;
+	strcpy(stSockAddr.sun_path, path);
+
+	if (-1 == connect(SocketFD, (struct sockaddr *)&stSockAddr, sizeof(stSockAddr))) {
+		close(SocketFD);
+		return 0;
+	}
+
+	return SocketFD;
+}
+
+static bool read_line(int fd, std::string &line) {
+	line.clear();
+	char c;
+	while (true) {
+		ssize_t ret = read(fd, &c, 1);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret != 1) {
+			return false;
+		}
+		if (c == '\n') {
+			return true;
+		}
+		line += c;
+	}
+}
+
+std::string run_zygote(const char *path) {
+	struct sockaddr_un stSockAddr;
+	if (strlen(path) >= sizeof(stSockAddr.sun_path)) {
+		std::cerr << "Zygote socket path is too long: " << path << "\n";
+		exit(1);
+	}
+
+	int listenFD = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (-1 == listenFD) {
+		exit(1);
+	}
+
+	memset(&stSockAddr, 0, sizeof(stSockAddr));
+	stSockAddr.sun_family = AF_UNIX;
+	strcpy(stSockAddr.sun_path, path);
+	unlink(path);
+
+	if (-1 == bind(listenFD, (struct sockaddr *)&stSockAddr, sizeof(stSockAddr)) || -1 == listen(listenFD, 1)) {
+		std::cerr << "Can't listen on zygote socket " << path << ": " << strerror(errno) << "\n";
+		exit(1);
+	}
+
+	// spectrum2 keeps single connection for the whole time it runs.
+	int connFD;
+	do {
+		connFD = accept(listenFD, NULL, NULL);
+	} while (connFD == -1 && errno == EINTR);
+	if (connFD == -1) {
+		exit(1);
+	}
+	close(listenFD);
+	unlink(path);
+
+	// Each request is single line with backend ID, we answer with pid of
+	// the forked backend or 0 if fork failed.
+	std::string id;
+	while (read_line(connFD, id)) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(connFD);
+			return id;
+		}
+
+		char reply[32];
+		int len = snprintf(reply, sizeof(reply), "%d\n", pid < 0 ? 0 : (int) pid);
+		if (write(connFD, reply, len) != len) {
+			break;
+		}
+	}
+
+	// spectrum2 disconnected, there is nothing to do for us anymore.
+	exit(0);
+}
+#endif
+
 #ifdef _WIN32
 std::wstring utf8ToUtf16(const std::string& str)
 {
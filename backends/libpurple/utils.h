@@ -28,6 +28,14 @@ void spectrum_sigchld_handler(int sig);
 #endif
 
 int create_socket(const char *host, int portno);
+#ifndef WIN32
+int create_unix_socket(const char *path);
+
+/// Runs the zygote fork server on the Unix socket path. Every request
+/// forks a child which returns from this function with the backend ID it
+/// got from spectrum2. The zygote itself exits once spectrum2 disconnects.
+std::string run_zygote(const char *path);
+#endif
 GHashTable *spectrum_ui_get_info(void);
 
 void execute_purple_plugin_action(PurpleConnection *gc, const std::string &name);
@@ -8,6 +8,7 @@
 // Swiften
 #include "Swiften/Swiften.h"
 #include "Swiften/SwiftenCompat.h"
+#include "Swiften/Network/UnixConnection.h"
 #include <Swiften/Version.h>
 #define HAVE_SWIFTEN_3  (SWIFTEN_VERSION >= 0x030000)
 
@@ -87,13 +88,29 @@ class SwiftenPlugin : public NetworkPlugin, Swift::XMPPParserClient {
 			this->config = config;
 			m_firstPing = true;
 			m_factories = new Swift::BoostNetworkFactories(loop);
-			m_conn = m_factories->getConnectionFactory()->createConnection();
-			m_conn->onDataRead.connect(boost::bind(&SwiftenPlugin::_handleDataRead, this, _1));
-			auto hostAddress = Swift::HostAddress::fromString(host);
-			if (!hostAddress) {
-				hostAddress = Swift::HostAddress::fromString("127.0.0.1");
+#ifndef WIN32
+			// Use Unix socket if spectrum2 provides it, otherwise fallback to TCP.
+			std::string socketPath = CONFIG_STRING(config, "service.backend_socket");
+			if (!socketPath.empty()) {
+				Swift::UnixConnection::ref conn = Swift::UnixConnection::create(m_factories->getIOServiceThread()->getIOService(), loop);
+				conn->onDataRead.connect(boost::bind(&SwiftenPlugin::_handleDataRead, this, _1));
+				if (conn->connect(socketPath)) {
+					m_conn = conn;
+				}
+				else {
+					LOG4CXX_WARN(logger, "Can't connect Unix socket " << socketPath << ", using TCP");
+				}
+			}
+#endif
+			if (!m_conn) {
+				m_conn = m_factories->getConnectionFactory()->createConnection();
+				m_conn->onDataRead.connect(boost::bind(&SwiftenPlugin::_handleDataRead, this, _1));
+				auto hostAddress = Swift::HostAddress::fromString(host);
+				if (!hostAddress) {
+					hostAddress = Swift::HostAddress::fromString("127.0.0.1");
+				}
+				m_conn->connect(Swift::HostAddressPort(*hostAddress, port));
 			}
-			m_conn->connect(Swift::HostAddressPort(*hostAddress, port));
 #if HAVE_SWIFTEN_3
 			serializer = new Swift::XMPPSerializer(&collection, Swift::ClientStreamType, false);
 #else
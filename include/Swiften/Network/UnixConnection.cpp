@@ -0,0 +1,166 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _WIN32
+
+#include <Swiften/Network/UnixConnection.h>
+
+#include <boost/bind.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/placeholders.hpp>
+
+#include <Swiften/EventLoop/EventLoop.h>
+#include <Swiften/Network/HostAddressPort.h>
+
+namespace Swift {
+
+static const size_t BUFFER_SIZE = 65536;
+
+UnixConnection::UnixConnection(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService, EventLoop* eventLoop) :
+	eventLoop(eventLoop), ioService(ioService), socket_(*ioService), writeInProgress_(false), closeSocketAfterWrite_(false) {
+}
+
+UnixConnection::~UnixConnection() {
+}
+
+void UnixConnection::listen() {
+	ioService->post(boost::bind(&UnixConnection::doRead, shared_from_this()));
+}
+
+void UnixConnection::connect(const HostAddressPort&) {
+	eventLoop->postEvent(boost::bind(boost::ref(onConnectFinished), false), shared_from_this());
+}
+
+bool UnixConnection::connect(const std::string &path) {
+	boost::system::error_code error;
+	socket_.connect(boost::asio::local::stream_protocol::endpoint(path), error);
+	if (error) {
+		return false;
+	}
+
+	listen();
+	return true;
+}
+
+void UnixConnection::disconnect() {
+	ioService->post(boost::bind(&UnixConnection::doDisconnect, shared_from_this()));
+}
+
+void UnixConnection::doDisconnect() {
+	// Send the data which are already queued before closing the socket,
+	// spectrum2 sends TYPE_EXIT right before disconnecting the backend.
+	if (writeInProgress_) {
+		closeSocketAfterWrite_ = true;
+		return;
+	}
+
+	boost::system::error_code error;
+	socket_.shutdown(boost::asio::local::stream_protocol::socket::shutdown_both, error);
+	socket_.close(error);
+}
+
+void UnixConnection::write(const SafeByteArray& data) {
+	ioService->post(boost::bind(&UnixConnection::queueWrite, shared_from_this(), data));
+}
+
+void UnixConnection::queueWrite(const SafeByteArray& data) {
+	writeQueue_.insert(writeQueue_.end(), data.begin(), data.end());
+	if (!writeInProgress_) {
+		doWrite();
+	}
+}
+
+void UnixConnection::doWrite() {
+	writeInProgress_ = true;
+	writing_.swap(writeQueue_);
+	writeQueue_.clear();
+	boost::asio::async_write(socket_, boost::asio::buffer(&writing_[0], writing_.size()),
+		boost::bind(&UnixConnection::handleDataWritten, shared_from_this(), boost::asio::placeholders::error));
+}
+
+void UnixConnection::handleDataWritten(const boost::system::error_code& error) {
+	writeInProgress_ = false;
+	writing_.clear();
+
+	if (error) {
+		if (error != boost::asio::error::operation_aborted) {
+			emitDisconnected(true);
+		}
+		return;
+	}
+
+	eventLoop->postEvent(boost::bind(boost::ref(onDataWritten)), shared_from_this());
+
+	if (!writeQueue_.empty()) {
+		doWrite();
+	}
+	else if (closeSocketAfterWrite_) {
+		doDisconnect();
+	}
+}
+
+void UnixConnection::doRead() {
+	readBuffer_ = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SafeByteArray>(new SafeByteArray(BUFFER_SIZE));
+	socket_.async_read_some(boost::asio::buffer(&(*readBuffer_)[0], readBuffer_->size()),
+		boost::bind(&UnixConnection::handleDataRead, shared_from_this(), boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void UnixConnection::handleDataRead(const boost::system::error_code& error, size_t bytesTransferred) {
+	if (!error) {
+		readBuffer_->resize(bytesTransferred);
+		eventLoop->postEvent(boost::bind(&UnixConnection::emitDataRead, shared_from_this(), readBuffer_), shared_from_this());
+		doRead();
+		return;
+	}
+
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	// EOF means the other side closed the socket, which is not an error.
+	emitDisconnected(error != boost::asio::error::eof);
+}
+
+void UnixConnection::emitDataRead(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SafeByteArray> data) {
+	onDataRead(data);
+}
+
+void UnixConnection::emitDisconnected(bool error) {
+	boost::optional<Connection::Error> e;
+	if (error) {
+		e = Connection::ReadError;
+	}
+	eventLoop->postEvent(boost::bind(boost::ref(onDisconnected), e), shared_from_this());
+}
+
+HostAddressPort UnixConnection::getLocalAddress() const {
+	return HostAddressPort();
+}
+
+#if (SWIFTEN_VERSION >= 0x040000)
+HostAddressPort UnixConnection::getRemoteAddress() const {
+	return HostAddressPort();
+}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <string>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+
+#include <Swiften/Network/Connection.h>
+#include <Swiften/EventLoop/EventOwner.h>
+#include <Swiften/Base/SafeByteArray.h>
+#include <Swiften/Version.h>
+
+#include "Swiften/SwiftenCompat.h"
+
+namespace Swift {
+	class EventLoop;
+
+	/// Swift::Connection over Unix domain stream socket.
+
+	/// It is used for the connection between spectrum2 and backends running
+	/// on the same host, where going through the loopback TCP stack is
+	/// not needed. Like Swift::BoostConnection, socket operations run in
+	/// the io_service thread and signals are emitted from the event loop.
+	class UnixConnection : public Connection, public EventOwner, public SWIFTEN_SHRPTR_NAMESPACE::enable_shared_from_this<UnixConnection> {
+		public:
+			typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<UnixConnection> ref;
+
+			virtual ~UnixConnection();
+
+			static ref create(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService, EventLoop* eventLoop) {
+				return ref(new UnixConnection(ioService, eventLoop));
+			}
+
+			virtual void listen();
+
+			/// Unix sockets are not reachable by host and port, use connect(path).
+			/// It always fails with onConnectFinished(false).
+			virtual void connect(const HostAddressPort&);
+
+			/// Connects the Unix socket synchronously.
+			/// \param path Path to the Unix socket.
+			/// \return false if the socket can't be connected.
+			bool connect(const std::string &path);
+
+			virtual void disconnect();
+			virtual void write(const SafeByteArray& data);
+
+			virtual HostAddressPort getLocalAddress() const;
+#if (SWIFTEN_VERSION >= 0x040000)
+			virtual HostAddressPort getRemoteAddress() const;
+#endif
+
+			boost::asio::local::stream_protocol::socket& getSocket() {
+				return socket_;
+			}
+
+		private:
+			UnixConnection(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService, EventLoop* eventLoop);
+
+			void doRead();
+			void doWrite();
+			void doDisconnect();
+			void queueWrite(const SafeByteArray& data);
+			void handleDataRead(const boost::system::error_code& error, size_t bytesTransferred);
+			void handleDataWritten(const boost::system::error_code& error);
+			void emitDataRead(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SafeByteArray> data);
+			void emitDisconnected(bool error);
+
+		private:
+			EventLoop* eventLoop;
+			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService;
+			boost::asio::local::stream_protocol::socket socket_;
+			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SafeByteArray> readBuffer_;
+			SafeByteArray writeQueue_;
+			SafeByteArray writing_;
+			bool writeInProgress_;
+			bool closeSocketAfterWrite_;
+	};
+}
+
+#endif
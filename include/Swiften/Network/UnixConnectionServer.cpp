@@ -0,0 +1,98 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _WIN32
+
+#include <Swiften/Network/UnixConnectionServer.h>
+
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/asio/placeholders.hpp>
+
+#include <Swiften/EventLoop/EventLoop.h>
+
+namespace Swift {
+
+UnixConnectionServer::UnixConnectionServer(const std::string &path, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService, EventLoop* eventLoop) :
+	path_(path), ioService_(ioService), eventLoop(eventLoop), acceptor_(NULL) {
+}
+
+UnixConnectionServer::~UnixConnectionServer() {
+	delete acceptor_;
+}
+
+bool UnixConnectionServer::start() {
+	// Socket file can stay there after crash. Only the socket nobody is
+	// listening on is removed, so another running instance keeps its own.
+	boost::system::error_code error;
+	boost::asio::local::stream_protocol::socket probe(*ioService_);
+	probe.connect(boost::asio::local::stream_protocol::endpoint(path_), error);
+	if (!error) {
+		probe.close(error);
+		return false;
+	}
+	if (error == boost::asio::error::connection_refused) {
+		unlink(path_.c_str());
+	}
+
+	try {
+		acceptor_ = new boost::asio::local::stream_protocol::acceptor(*ioService_, boost::asio::local::stream_protocol::endpoint(path_));
+	}
+	catch (const boost::system::system_error&) {
+		delete acceptor_;
+		acceptor_ = NULL;
+		return false;
+	}
+
+	acceptNextConnection();
+	return true;
+}
+
+void UnixConnectionServer::stop() {
+	if (acceptor_) {
+		ioService_->post(boost::bind(&UnixConnectionServer::stopAcceptor, shared_from_this()));
+		unlink(path_.c_str());
+	}
+}
+
+void UnixConnectionServer::stopAcceptor() {
+	boost::system::error_code error;
+	acceptor_->close(error);
+}
+
+void UnixConnectionServer::acceptNextConnection() {
+	UnixConnection::ref connection = UnixConnection::create(ioService_, eventLoop);
+	acceptor_->async_accept(connection->getSocket(),
+		boost::bind(&UnixConnectionServer::handleNewConnection, shared_from_this(), boost::asio::placeholders::error, connection));
+}
+
+void UnixConnectionServer::handleNewConnection(const boost::system::error_code& error, UnixConnection::ref connection) {
+	if (error) {
+		return;
+	}
+
+	eventLoop->postEvent(boost::bind(boost::ref(onNewConnection), connection), shared_from_this());
+	connection->listen();
+	acceptNextConnection();
+}
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <string>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/signal.hpp>
+
+#include <Swiften/Network/UnixConnection.h>
+#include <Swiften/EventLoop/EventOwner.h>
+
+#include "Swiften/SwiftenCompat.h"
+
+namespace Swift {
+	/// Accepts connections on Unix domain socket and emits them as UnixConnection.
+	class UnixConnectionServer : public EventOwner, public SWIFTEN_SHRPTR_NAMESPACE::enable_shared_from_this<UnixConnectionServer> {
+		public:
+			typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<UnixConnectionServer> ref;
+
+			static ref create(const std::string &path, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService, EventLoop* eventLoop) {
+				return ref(new UnixConnectionServer(path, ioService, eventLoop));
+			}
+
+			virtual ~UnixConnectionServer();
+
+			/// Starts listening. Stale socket file from previous run is removed,
+			/// but the socket of another running instance is kept.
+			/// \return false if the socket can't be created or is in use.
+			bool start();
+			void stop();
+
+			const std::string &getPath() const {
+				return path_;
+			}
+
+			boost::signal<void (SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Connection>)> onNewConnection;
+
+		private:
+			UnixConnectionServer(const std::string &path, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService, EventLoop* eventLoop);
+
+			void acceptNextConnection();
+			void handleNewConnection(const boost::system::error_code& error, UnixConnection::ref connection);
+			void stopAcceptor();
+
+		private:
+			std::string path_;
+			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<boost::asio::io_service> ioService_;
+			EventLoop* eventLoop;
+			boost::asio::local::stream_protocol::acceptor* acceptor_;
+	};
+}
+
+#endif
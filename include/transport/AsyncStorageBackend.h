@@ -0,0 +1,166 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <vector>
+#include <time.h>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "Swiften/EventLoop/EventLoop.h"
+#include "Swiften/SwiftenCompat.h"
+#include "transport/StorageBackend.h"
+
+namespace Transport {
+
+class Config;
+
+/// Executes StorageBackend requests on a pool of database connections.
+
+/// StorageBackend implementations are not thread-safe, so every connection in
+/// the pool is separate StorageBackend created from the configuration in the
+/// same way as the main one and served by its own thread. Requests are
+/// assigned to connections by user ID or JID, so requests with the same key
+/// are executed in the order they have been made, while requests of different
+/// users proceed concurrently. Results are delivered to the callbacks on the
+/// main event loop.
+///
+/// Connections which have been idle for a while are checked by
+/// StorageBackend::ping() before they are used and replaced by new ones when
+/// they are broken.
+///
+/// When no connection can be opened (database.pool_size is 0, the connection
+/// fails or StorageBackend::supportsConnectionPool() returns false), requests
+/// are executed on the main StorageBackend and the callbacks are called
+/// before the request method returns.
+class AsyncStorageBackend {
+	public:
+		typedef boost::function<void (bool registered, const UserInfo &user)> UserCallback;
+		typedef boost::function<void (const std::string &value)> SettingCallback;
+		typedef boost::function<void (const std::list<BuddyInfo> &roster)> BuddiesCallback;
+		typedef boost::function<void (bool stored, const std::list<std::pair<long, BuddyInfo> > &buddies)> StoreBuddiesCallback;
+		typedef boost::function<void (bool stored)> StoreCallback;
+
+		/// Creates new AsyncStorageBackend.
+		/// \param loop Event loop the callbacks are called from.
+		/// \param config Config used to create connections of the pool.
+		/// \param storageBackend Main StorageBackend used when there is no pool.
+		/// \param poolSize Number of connections.
+		AsyncStorageBackend(Swift::EventLoop *loop, Config *config, StorageBackend *storageBackend, int poolSize);
+
+		/// Executes all queued requests and stops the worker threads.
+		/// Callbacks which have not been called yet are dropped.
+		virtual ~AsyncStorageBackend();
+
+		/// Fetches user.
+		void getUser(const std::string &barejid, UserCallback callback);
+
+		/// Stores user and fetches it again to get its ID.
+		void setUser(const UserInfo &user, UserCallback callback);
+
+		void setUserOnline(long id, bool online);
+
+		/// Changes online state of many users by StorageBackend::setUsersOnline().
+		/// Users are split between connections in the same way as in
+		/// storeBuddies().
+		/// \param callback Called with false if any of the statements failed.
+		virtual void setUsersOnline(const std::vector<long> &ids, bool online, StoreCallback callback);
+
+		/// Fetches user setting. The setting is stored with the value and type
+		/// if it does not exist yet.
+		void getUserSetting(long userId, const std::string &variable, int type, const std::string &value, SettingCallback callback);
+
+		void getBuddies(long id, BuddiesCallback callback);
+
+		/// Stores buddies of many users by StorageBackend::storeBuddies().
+		/// Buddies of each user are stored by the connection executing the
+		/// other requests of that user, so they are ordered with getBuddies()
+		/// and removeBuddy(). Buddies served by different connections are
+		/// stored in separate transactions.
+		/// \param callback Called with the buddies in the same order, with IDs
+		/// of the added ones set. stored is false if any transaction failed.
+		void storeBuddies(const std::list<std::pair<long, BuddyInfo> > &buddies, StoreBuddiesCallback callback);
+
+		void removeBuddy(long userId, long id);
+
+		/// Returns true if the requests are executed by the pool.
+		bool isAsync() const {
+			return !m_workers.empty();
+		}
+
+	private:
+		typedef boost::function<void (StorageBackend *storageBackend)> Job;
+
+		/// storeBuddies() request split between connections.
+		struct StoreBuddiesRequest {
+			std::vector<std::pair<long, BuddyInfo> > buddies;
+			size_t pending;
+			bool stored;
+			StoreBuddiesCallback callback;
+		};
+		typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<StoreBuddiesRequest> StoreBuddiesRequestRef;
+
+		/// setUsersOnline() request split between connections.
+		struct StoreRequest {
+			size_t pending;
+			bool stored;
+			StoreCallback callback;
+		};
+		typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<StoreRequest> StoreRequestRef;
+
+		struct Worker {
+			boost::thread *thread;
+			StorageBackend *storageBackend;
+			// Time the connection has been used last time.
+			time_t lastUsed;
+			boost::mutex mutex;
+			boost::condition_variable cond;
+			std::list<Job> jobs;
+			bool stop;
+		};
+
+		void queueJob(unsigned long key, const Job &job);
+		void complete(const boost::function<void ()> &callback);
+		void run(Worker *worker);
+		StorageBackend *connectBackend();
+		void checkConnection(Worker *worker);
+
+		void doGetUser(StorageBackend *storageBackend, const std::string &barejid, UserCallback callback);
+		void doSetUser(StorageBackend *storageBackend, const UserInfo &user, UserCallback callback);
+		void doGetUserSetting(StorageBackend *storageBackend, long userId, const std::string &variable, int type, const std::string &value, SettingCallback callback);
+		void doGetBuddies(StorageBackend *storageBackend, long id, BuddiesCallback callback);
+		void doStoreBuddies(StorageBackend *storageBackend, std::list<std::pair<long, BuddyInfo> > buddies, const std::vector<size_t> &positions, StoreBuddiesRequestRef request);
+		void handleBuddiesStored(bool stored, const std::list<std::pair<long, BuddyInfo> > &buddies, const std::vector<size_t> &positions, StoreBuddiesRequestRef request);
+		void doSetUsersOnline(StorageBackend *storageBackend, const std::vector<long> &ids, bool online, StoreRequestRef request);
+		void handleStored(bool stored, StoreRequestRef request);
+
+		Swift::EventLoop *m_loop;
+		Config *m_config;
+		StorageBackend *m_storageBackend;
+		std::vector<Worker *> m_workers;
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner> m_owner;
+};
+
+}
@@ -0,0 +1,111 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/lockfree/queue.hpp>
+#include "Swiften/EventLoop/EventLoop.h"
+#include "Swiften/SwiftenCompat.h"
+#include "transport/NetworkPluginServer.h"
+
+namespace Transport {
+
+/// Splits and decodes frames received from backends on separate threads.
+
+/// Data read from backend connections is handed to one of the decoder
+/// threads, each of them serving every N-th backend. Decoded frames are
+/// passed back through lock-free queue and delivered to the handler on the
+/// main event loop in batches, in the order they were received from each
+/// backend.
+class BackendDecoder {
+	public:
+		typedef boost::function<void (NetworkPluginServer::Backend *c, int type, const std::string &payload)> FrameHandler;
+
+		/// Creates new BackendDecoder.
+		/// \param loop Event loop the handler is called from.
+		/// \param threads Number of decoder threads.
+		/// \param handler Called for every decoded frame.
+		BackendDecoder(Swift::EventLoop *loop, int threads, FrameHandler handler);
+
+		virtual ~BackendDecoder();
+
+		void addBackend(NetworkPluginServer::Backend *c);
+
+		/// Forgets the backend. Its frames which have not been delivered yet
+		/// are dropped.
+		void removeBackend(NetworkPluginServer::Backend *c);
+
+		/// Queues data received from the backend for decoding.
+		void decode(NetworkPluginServer::Backend *c, const Swift::SafeByteArray &data);
+
+	private:
+		struct Chunk {
+			unsigned long id;
+			std::string data;
+			bool remove;
+		};
+
+		struct Frame {
+			unsigned long id;
+			int type;
+			std::string payload;
+			/// Size of the payload before decompression, 0 if it has not been compressed.
+			unsigned long compressedSize;
+		};
+
+		struct Worker {
+			boost::thread *thread;
+			boost::mutex mutex;
+			boost::condition_variable cond;
+			std::list<Chunk> chunks;
+			bool stop;
+		};
+
+		Worker *getWorker(unsigned long id) {
+			return m_workers[id % m_workers.size()];
+		}
+
+		void queueChunk(const Chunk &chunk);
+		void run(Worker *worker);
+		void deliverFrames();
+
+		Swift::EventLoop *m_loop;
+		FrameHandler m_handler;
+		std::vector<Worker *> m_workers;
+		boost::lockfree::queue<Frame *> m_frames;
+		// Backends are identified by ID in the decoder threads, so frames of
+		// removed backend are never delivered to new backend allocated at the
+		// same address.
+		std::map<NetworkPluginServer::Backend *, unsigned long> m_ids;
+		std::map<unsigned long, NetworkPluginServer::Backend *> m_backends;
+		unsigned long m_nextId;
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner> m_owner;
+};
+
+}
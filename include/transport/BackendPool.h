@@ -0,0 +1,107 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <set>
+#include "transport/NetworkPluginServer.h"
+
+namespace Transport {
+
+/// Decides which backend new user is placed to.
+class BackendPlacement {
+	public:
+		virtual ~BackendPlacement() {}
+
+		/// Returns score of the backend. Users are placed to the backend
+		/// with the lowest score.
+		virtual double getScore(const NetworkPluginServer::Backend *c) = 0;
+
+		/// Creates placement by its name ("first_fit", "least_loaded" or "memory").
+		/// \return NULL if there is no placement with this name.
+		static BackendPlacement *createPlacement(const std::string &name);
+};
+
+/// Index of backends which can accept new users.
+
+/// Backends are kept in sorted sets by their BackendPlacement score, so the
+/// best backend is found in O(log n). Backends which are full, dying or not
+/// connected are not indexed at all. The index has to be refreshed by
+/// updateBackend() whenever anything the score or eligibility depends on
+/// changes (users, acceptUsers, willDie, memory usage).
+class BackendPool {
+	public:
+		/// Creates new BackendPool.
+		/// \param placement Placement policy, BackendPool takes ownership of it.
+		/// \param usersPerBackend Maximum number of users per backend.
+		BackendPool(BackendPlacement *placement, unsigned long usersPerBackend);
+
+		virtual ~BackendPool();
+
+		void addBackend(NetworkPluginServer::Backend *c);
+		void removeBackend(NetworkPluginServer::Backend *c);
+
+		/// Refreshes position of the backend in the index. Backends which
+		/// have not been added by addBackend() are ignored.
+		void updateBackend(NetworkPluginServer::Backend *c);
+
+		/// Returns the backend with the lowest score or NULL if there is no
+		/// backend which can accept another user.
+		NetworkPluginServer::Backend *getBackend(bool acceptUsers, bool longRun);
+
+		size_t size() const {
+			return m_entries.size();
+		}
+
+	private:
+		struct Key {
+			double score;
+			// Backends with the same score are ordered from the newest one.
+			unsigned long order;
+			NetworkPluginServer::Backend *backend;
+
+			bool operator<(const Key &other) const {
+				if (score != other.score)
+					return score < other.score;
+				return order > other.order;
+			}
+		};
+
+		struct Entry {
+			Key key;
+			bool indexed;
+			bool acceptUsers;
+			bool longRun;
+		};
+
+		std::set<Key> &getIndex(bool acceptUsers, bool longRun) {
+			return m_index[acceptUsers ? 1 : 0][longRun ? 1 : 0];
+		}
+
+		BackendPlacement *m_placement;
+		unsigned long m_usersPerBackend;
+		unsigned long m_order;
+		std::map<NetworkPluginServer::Backend *, Entry> m_entries;
+		std::set<Key> m_index[2][2];
+};
+
+}
@@ -0,0 +1,183 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <list>
+#include <boost/thread/mutex.hpp>
+#include "Swiften/SwiftenCompat.h"
+#include "transport/StorageBackend.h"
+
+namespace Transport {
+
+/// Least recently used user and buddy settings shared by CachingStorageBackends.
+
+/// Settings are identified by user ID, buddy ID and variable name. User
+/// settings are stored with buddy ID -1. When there are more than limit
+/// settings, the least recently used ones are evicted. The cache can be used
+/// from many threads.
+///
+/// Every write or removal changes the version of the cache. Settings read
+/// from the database are cached only if the version did not change while
+/// they were read, so a value read by one thread cannot replace a newer
+/// one written by another.
+class SettingsCache {
+	public:
+		/// Creates new SettingsCache.
+		/// \param limit Maximum number of cached settings.
+		SettingsCache(unsigned long limit);
+
+		/// Finds the setting.
+		/// \return false if the setting is not cached.
+		bool get(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
+
+		/// Returns the current version of the cache.
+		unsigned long getVersion();
+
+		/// Caches the setting read from the database.
+		/// \param version Version returned by getVersion() before the
+		/// setting was read. The setting is not cached if any setting has
+		/// been written or removed since then.
+		void set(long userId, long buddyId, const std::string &variable, int type, const std::string &value, unsigned long version);
+
+		/// Changes value of the setting if it's cached. Settings being read
+		/// from the database at the same time are not cached.
+		/// \return false if the setting is not cached.
+		bool update(long userId, long buddyId, const std::string &variable, const std::string &value);
+
+		/// Removes the setting.
+		void remove(long userId, long buddyId, const std::string &variable);
+
+		/// Removes all settings of the buddy.
+		/// \param userId ID of the user or -1 if it's not known.
+		void removeBuddy(long userId, long buddyId);
+
+		/// Removes all settings of the user and his buddies.
+		void removeUser(long userId);
+
+		size_t size();
+
+		unsigned long getHits() const { return m_hits; }
+		unsigned long getMisses() const { return m_misses; }
+		unsigned long getEvicted() const { return m_evicted; }
+
+	private:
+		struct Key {
+			long buddyId;
+			long userId;
+			std::string variable;
+
+			bool operator<(const Key &other) const;
+		};
+
+		struct Setting;
+		typedef std::map<Key, Setting> SettingMap;
+		typedef std::list<SettingMap::iterator> SettingList;
+
+		struct Setting {
+			int type;
+			std::string value;
+			// Position in m_lru.
+			SettingList::iterator lru;
+		};
+
+		void erase(SettingMap::iterator it);
+		void eraseRange(const Key &from, const Key &to);
+
+		boost::mutex m_mutex;
+		unsigned long m_limit;
+		unsigned long m_version;
+		SettingMap m_settings;
+		// Settings from the most recently used.
+		SettingList m_lru;
+		unsigned long m_hits;
+		unsigned long m_misses;
+		unsigned long m_evicted;
+};
+
+/// StorageBackend caching user and buddy settings of another StorageBackend.
+
+/// Settings are read from the cache and written to both the cache and the
+/// wrapped StorageBackend, so the database is always up to date. Buddy
+/// settings the database does not have are cached too, but settings which
+/// could not be read are not. Cached settings are
+/// invalidated when the user or buddy they belong to is changed or removed.
+/// All other requests are passed to the wrapped StorageBackend.
+///
+/// Connections opened by AsyncStorageBackend for CachingStorageBackend are
+/// wrapped too and share its SettingsCache. Changes done to the database by
+/// other processes are not seen until the settings are evicted.
+class CachingStorageBackend : public StorageBackend
+{
+	public:
+		/// Creates new CachingStorageBackend.
+		/// \param storageBackend Wrapped StorageBackend, it is deleted
+		/// together with the CachingStorageBackend.
+		/// \param cache Cache of settings.
+		CachingStorageBackend(StorageBackend *storageBackend, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> cache);
+
+		/// Deletes the wrapped StorageBackend.
+		~CachingStorageBackend();
+
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> getCache() {
+			return m_cache;
+		}
+
+		StorageBackend *getStorageBackend() {
+			return m_storageBackend;
+		}
+
+		bool connect();
+		bool ping();
+		bool supportsConnectionPool();
+		bool createDatabase();
+
+		void setUser(const UserInfo &user);
+		bool getUser(const std::string &barejid, UserInfo &user);
+		bool setUserOnline(long id, bool online);
+		bool setUsersOnline(const std::vector<long> &ids, bool online);
+		bool removeUser(long id);
+		bool getOnlineUsers(std::vector<std::string> &users);
+		bool getUsers(std::vector<std::string> &users);
+
+		bool getBuddies(long id, std::list<BuddyInfo> &roster);
+		long addBuddy(long userId, const BuddyInfo &buddyInfo);
+		bool updateBuddy(long userId, const BuddyInfo &buddyInfo);
+		void removeBuddy(long id);
+		bool storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
+
+		bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
+		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value);
+
+		bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
+		void updateUserSetting(long userId, const std::string &variable, const std::string &value);
+
+		void beginTransaction();
+		bool commitTransaction();
+
+	private:
+		StorageBackend *m_storageBackend;
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> m_cache;
+};
+
+}
@@ -127,6 +127,12 @@ class Config {
 		boost::signal<void ()> onConfigReloaded;
 
 		void updateBackendConfig(const std::string &backendConfig);
+
+		/// Overrides value of variable which is not registered in Config.
+		/// Backends forked by zygote use it to set their service.backend_id.
+		void setUnregistered(const std::string &key, const std::string &value) {
+			m_unregistered[key] = boost::program_options::variable_value(value, false);
+		}
 		boost::signal<void ()> onBackendConfigUpdated;
 
 		static Config *createFromArgs(int argc, char **argv, std::string &error, std::string &host, int &port);
@@ -0,0 +1,106 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <vector>
+#include <boost/unordered_map.hpp>
+
+namespace Transport {
+
+/// Remembers which resource sent IQ forwarded to backend, so the reply can be
+/// routed back to it.
+
+/// Routes are identified by user's bare JID and IQ ID. Every route expires
+/// after ttl ticks of tick(); expiration is handled by timer wheel with one
+/// slot per tick, so single tick() only touches the routes expiring in it.
+/// When there are more than limit routes, the least recently added ones are
+/// evicted.
+class IQRouteTable {
+	public:
+		/// Creates new IQRouteTable.
+		/// \param ttl Number of tick() calls after which route expires.
+		/// \param limit Maximum number of routes.
+		IQRouteTable(unsigned long ttl, unsigned long limit);
+
+		void addRoute(const std::string &user, const std::string &id, const std::string &resource);
+
+		/// Finds the route and removes it.
+		/// \return false if there is no such route.
+		bool takeRoute(const std::string &user, const std::string &id, std::string &resource);
+
+		/// Expires routes added ttl ticks ago.
+		void tick();
+
+		size_t size() const {
+			return m_routes.size();
+		}
+
+		unsigned long getHits() const { return m_hits; }
+		unsigned long getMisses() const { return m_misses; }
+		unsigned long getExpired() const { return m_expired; }
+		unsigned long getEvicted() const { return m_evicted; }
+
+	private:
+		struct Key {
+			std::string user;
+			std::string id;
+
+			bool operator==(const Key &other) const {
+				return id == other.id && user == other.user;
+			}
+		};
+
+		struct KeyHash {
+			size_t operator()(const Key &key) const;
+		};
+
+		struct Route;
+		typedef boost::unordered_map<Key, Route, KeyHash> RouteMap;
+		typedef std::list<RouteMap::value_type *> RouteList;
+
+		struct Route {
+			std::string resource;
+			// Position in m_lru.
+			RouteList::iterator lru;
+			// Position in m_wheel[slot].
+			size_t slot;
+			RouteList::iterator timer;
+		};
+
+		void removeRoute(RouteMap::iterator it);
+
+		unsigned long m_ttl;
+		unsigned long m_limit;
+		RouteMap m_routes;
+		// Routes from the least recently added.
+		RouteList m_lru;
+		std::vector<RouteList> m_wheel;
+		size_t m_slot;
+		unsigned long m_hits;
+		unsigned long m_misses;
+		unsigned long m_expired;
+		unsigned long m_evicted;
+};
+
+}
@@ -0,0 +1,183 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#ifndef _WIN32
+
+#include <string>
+#include <map>
+#include <set>
+#include <time.h>
+#include <boost/unordered_map.hpp>
+#include "transport/StorageBackend.h"
+
+namespace Transport {
+
+class Config;
+
+/// Embedded storage backend keeping all data in memory and persisting them
+/// in an append-only log file.
+
+/// Every change is appended to the log as a single record. Records of changes
+/// done in a transaction are written by single write() followed by single
+/// fdatasync() in commitTransaction(), so storing rosters of many users costs
+/// one disk flush. Changes done outside of a transaction are written
+/// immediately, but flushed to the disk only by the next change done more
+/// than LOG_SYNC_INTERVAL after the last flush, by the next transaction or
+/// when the backend is destroyed.
+///
+/// Changes are applied in memory before they are written. Records which can't
+/// be written stay queued and are written before the following ones, so the
+/// order in the log is kept. Until then, the methods reporting a result fail.
+///
+/// The log is replayed to rebuild the in-memory indexes in connect().
+/// Incomplete or damaged last record is removed as a write torn by a crash.
+/// connect() fails if a damaged record is followed by other ones, so they are
+/// not lost.
+///
+/// When the log contains much more records than there are live rows, it is
+/// compacted by writing the live rows to a new log which replaces the old one.
+///
+/// The log file is locked, so it can be opened only by one LogStorageBackend
+/// at a time and connections can't be pooled. Every request therefore runs
+/// in the thread calling it, which is the main loop in Spectrum 2. The loop
+/// stalls for the fdatasync() of every commit and for whole compaction,
+/// which writes and flushes all live rows at once.
+class LogStorageBackend : public StorageBackend
+{
+	public:
+		/// Creates new LogStorageBackend instance.
+		/// \param config cofiguration, this class uses following Config values:
+		/// 	- database.database - path to the log file, it is created automatically
+		LogStorageBackend(Config *config);
+
+		/// Destructor.
+		~LogStorageBackend();
+
+		/// Opens and locks the log file and replays it.
+		/// \return true if the log is opened successfully, false also if
+		/// it contains damaged record in the middle.
+		bool connect();
+
+		/// Writes queued records and flushes them to the disk.
+		bool ping();
+
+		/// Does nothing, the log file is created by connect().
+		bool createDatabase();
+
+		void setUser(const UserInfo &user);
+		bool getUser(const std::string &barejid, UserInfo &user);
+		bool setUserOnline(long id, bool online);
+		bool getOnlineUsers(std::vector<std::string> &users);
+		bool getUsers(std::vector<std::string> &users);
+		bool removeUser(long id);
+
+		bool getBuddies(long id, std::list<BuddyInfo> &roster);
+		long addBuddy(long userId, const BuddyInfo &buddyInfo);
+		bool updateBuddy(long userId, const BuddyInfo &buddyInfo);
+		void removeBuddy(long id);
+
+		/// Buddies which are already stored are updated even when their ID
+		/// is -1, so buddies of failed call are not added twice on retry.
+		bool storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
+
+		bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
+		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value);
+
+		bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
+		void updateUserSetting(long userId, const std::string &variable, const std::string &value);
+
+		void beginTransaction();
+		bool commitTransaction();
+
+		bool supportsConnectionPool() { return false; }
+
+		/// Returns size of the log file in bytes.
+		unsigned long getLogSize() { return m_logSize; }
+
+		/// Rewrites the log so it contains only the live rows.
+		/// \return false if the new log could not be written.
+		bool compact();
+
+	private:
+		struct UserSetting {
+			int type;
+			std::string value;
+		};
+
+		struct UserRow {
+			UserRow() : online(false) {}
+			UserInfo info;
+			bool online;
+			std::map<std::string, UserSetting> settings;
+		};
+
+		typedef boost::unordered_map<std::string, long> JidIndex;
+		typedef boost::unordered_map<long, UserRow> UserMap;
+		typedef boost::unordered_map<long, std::pair<long, BuddyInfo> > BuddyMap;
+		typedef boost::unordered_map<std::pair<long, std::string>, long> BuddyIndex;
+		typedef boost::unordered_map<long, std::set<long> > RosterMap;
+
+		bool replay(const std::string &data, unsigned long &valid);
+		bool apply(const std::string &record);
+		bool write(const std::string &data);
+		bool writePending();
+		bool sync(bool force);
+		bool append(const std::string &record);
+		void compactIfNeeded();
+		unsigned long getLiveRecords();
+
+		std::string userRecord(const UserInfo &user);
+		std::string userOnlineRecord(long id, bool online);
+		std::string userSettingRecord(long userId, const std::string &variable, const UserSetting &setting);
+		std::string buddyRecord(long userId, const BuddyInfo &buddy);
+
+		void doSetUser(const UserInfo &user);
+		void doRemoveUser(long id);
+		void doSetBuddy(long userId, const BuddyInfo &buddy);
+		void doRemoveBuddy(long id);
+
+		Config *m_config;
+		std::string m_path;
+		int m_fd;
+		unsigned long m_logSize;
+		unsigned long m_records;
+		unsigned long m_compactAt;
+		int m_transaction;
+		// Records of the current transaction and records which could not be
+		// written yet.
+		std::string m_pending;
+		bool m_dirty;
+		time_t m_lastSync;
+		long m_lastUserId;
+		long m_lastBuddyId;
+
+		JidIndex m_jids;
+		UserMap m_users;
+		BuddyMap m_buddies;
+		BuddyIndex m_buddyIndex;
+		RosterMap m_rosters;
+};
+
+}
+
+#endif
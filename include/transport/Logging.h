@@ -55,6 +55,8 @@ class Config;
 namespace Logging {
 
 void initBackendLogging(Config *config);
+/// Reloads logging configuration in backend after its service.backend_id changed.
+void reloadBackendLogging(Config *config);
 void initMainLogging(Config *config);
 void initManagerLogging(Config *config);
 void shutdownLogging();
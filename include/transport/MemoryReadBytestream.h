@@ -21,7 +21,9 @@
 #pragma once
 
 #include <string>
-#include <map>
+#include <deque>
+#include <vector>
+#include <stdio.h>
 #include <boost/signal.hpp>
 
 #include "Swiften/FileTransfer/ReadBytestream.h"
@@ -29,11 +31,32 @@
 
 namespace Transport {
 
+/// Bytestream with the file data received from backend which are waiting to
+/// be sent to XMPP user.
+
+/// Received data are kept as a queue of chunks. Chunks which fit into the
+/// requested block are handed out by read() as they are, bigger ones are
+/// consumed from the front without moving the rest of the data.
+///
+/// When the number of buffered bytes reaches the high watermark, onBufferFull
+/// is emitted so the backend can stop sending data. onDataNeeded is emitted
+/// once the buffered data drop to the low watermark again.
+///
+/// When the buffered data do not fit into the memory limit, further data are
+/// stored in the temporary file until everything stored there is read.
 class MemoryReadBytestream : public Swift::ReadBytestream {
 	public:
-		MemoryReadBytestream(unsigned long size);
+		/// Creates new MemoryReadBytestream.
+		/// \param size Size of the whole transferred file.
+		/// \param lowWatermark Number of buffered bytes at which onDataNeeded is emitted.
+		/// \param highWatermark Number of buffered bytes at which onBufferFull is emitted, 0 means never.
+		/// \param memoryLimit Number of bytes kept in memory before the data are
+		/// stored in the temporary file, 0 means the data are never stored there.
+		MemoryReadBytestream(unsigned long size, unsigned long lowWatermark = 500000, unsigned long highWatermark = 5000000, unsigned long memoryLimit = 0);
 		virtual ~MemoryReadBytestream();
 
+		/// Appends data received from backend.
+		/// \return number of buffered bytes.
 		unsigned long appendData(const std::string &data);
 
 		virtual SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> > read(size_t size);
@@ -41,14 +64,43 @@ class MemoryReadBytestream : public Swift::ReadBytestream {
 		void setFinished() { m_finished = true; }
 		bool isFinished() const;
 
+		/// Returns number of buffered bytes.
+		unsigned long getBufferedSize() const {
+			return m_buffered;
+		}
+
+		/// Returns number of buffered bytes stored in the temporary file.
+		unsigned long getSpilledSize() const {
+			return m_spillWrite - m_spillRead;
+		}
+
+		/// Emitted when the backend can send more data.
 		boost::signal<void ()> onDataNeeded;
 
+		/// Emitted when the backend should stop sending data.
+		boost::signal<void ()> onBufferFull;
+
 	private:
+		typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> > Chunk;
+
+		bool spill(const std::string &data);
+		void loadSpilled(size_t size);
+
 		bool m_finished;
-		std::string m_data;
-		bool neededData;
+		bool m_paused;
+		std::deque<Chunk> m_chunks;
+		// Number of bytes already read from the first chunk.
+		size_t m_offset;
+		unsigned long m_buffered;
+		unsigned long m_memory;
 		unsigned long m_sent;
 		unsigned long m_size;
+		unsigned long m_lowWatermark;
+		unsigned long m_highWatermark;
+		unsigned long m_memoryLimit;
+		FILE *m_spill;
+		unsigned long m_spillRead;
+		unsigned long m_spillWrite;
 };
 
 }
@@ -49,6 +49,11 @@ class MySQLBackend : public StorageBackend
 		bool connect();
 		void disconnect();
 
+		/// Returns false if the connection has been lost. The connection is
+		/// considered lost also when it has been re-established by
+		/// MYSQL_OPT_RECONNECT, because the prepared statements are gone.
+		bool ping();
+
 		/// Creates database structure.
 		/// \see connect()
 		/// \return true if database structure has been created successfully. Note that it returns True also if database structure
@@ -68,7 +73,10 @@ class MySQLBackend : public StorageBackend
 		/// Changes users online state variable in database.
 		/// \param id id of user - UserInfo.id
 		/// \param online online state
-		void setUserOnline(long id, bool online);
+		bool setUserOnline(long id, bool online);
+
+		/// Changes online state of many users by single statement.
+		bool setUsersOnline(const std::vector<long> &ids, bool online);
 
 		/// Removes user and all connected data from database.
 		/// \param id id of user - UserInfo.id
@@ -87,20 +95,33 @@ class MySQLBackend : public StorageBackend
 
 		long addBuddy(long userId, const BuddyInfo &buddyInfo);
 
-		void updateBuddy(long userId, const BuddyInfo &buddyInfo);
+		bool updateBuddy(long userId, const BuddyInfo &buddyInfo);
 		void removeBuddy(long id);
 
-		void getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
+		/// Stores buddies using multi-row upserts in single transaction.
+		bool storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
+
+		bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
 		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value);
 
-		void getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
+		bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
 		void updateUserSetting(long userId, const std::string &variable, const std::string &value);
 
 		void beginTransaction();
-		void commitTransaction();
+		bool commitTransaction();
 
 	private:
 		bool exec(const std::string &query);
+		bool upgradeDatabase();
+		bool hasRows(const std::string &query);
+		bool getBuddySettings(long userId, long buddyId, std::map<std::string, SettingVariableInfo> &settings);
+		std::string quote(const std::string &str);
+
+		/// Buddies stored by single statement, identified by user ID and legacy name.
+		typedef std::map<std::pair<long, std::string>, BuddyInfo *> BuddyChunk;
+		/// Fetches ID and settings of the buddies from the chunk which exist.
+		bool getStoredBuddies(const BuddyChunk &chunk, std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored);
+		bool upsertBuddies(const BuddyChunk &chunk, const std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored);
 
 		class Statement {
 			public:
@@ -134,6 +155,10 @@ class MySQLBackend : public StorageBackend
 		};
 
 		MYSQL m_conn;
+		bool m_connected;
+		// Result of the last EXEC, kept per connection, so connections
+		// can be used from different threads.
+		bool m_execOk;
 		Config *m_config;
 		std::string m_prefix;
 
@@ -147,15 +172,12 @@ class MySQLBackend : public StorageBackend
 		Statement *m_removeUser;
 		Statement *m_removeUserBuddies;
 		Statement *m_removeUserSettings;
-		Statement *m_removeUserBuddiesSettings;
 		Statement *m_addBuddy;
 		Statement *m_removeBuddy;
-		Statement *m_removeBuddySettings;
 		Statement *m_updateBuddy;
 		Statement *m_updateBuddySetting;
 		Statement *m_getBuddySetting;
 		Statement *m_getBuddies;
-		Statement *m_getBuddiesSettings;
 		Statement *m_setUserOnline;
 		Statement *m_getOnlineUsers;
 		Statement *m_getUsers;
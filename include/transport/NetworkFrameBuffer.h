@@ -0,0 +1,142 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stddef.h>
+
+namespace google {
+namespace protobuf {
+class MessageLite;
+}
+}
+
+/// Version of the protocol between spectrum2 and backends.
+/// Version 2 adds NETWORK_FRAME_V2 frames.
+/// Version 3 adds session migration (TYPE_EXPORT_SESSION, TYPE_IMPORT_SESSION).
+/// Version 4 adds TYPE_BUDDIES_CHANGED.
+#define NETWORK_PLUGIN_API_VERSION (4)
+
+/// Set in the size field of frames using protocol v2 framing. Such frame
+/// contains 2 bytes of big-endian WrapperMessage::Type followed by the
+/// serialized payload, so the payload is encoded and decoded only once.
+/// Frames without this bit contain serialized WrapperMessage.
+#define NETWORK_FRAME_V2 (0x80000000)
+
+/// Set in the type field of v2 frames with payload compressed by raw deflate
+/// using the preset dictionary from NetworkFrameBuffer.cpp. Such frames are
+/// sent only to the side which offered compressionThreshold in APIVersion.
+#define NETWORK_FRAME_COMPRESSED (0x8000)
+
+/// Maximum size of NETWORK_FRAME_COMPRESSED frame payload after
+/// decompression. Bigger payloads are sent uncompressed. Compressed frame
+/// which would decompress to more is a protocol error.
+#define NETWORK_FRAME_MAX_DECOMPRESSED_SIZE (16 * 1024 * 1024)
+
+/// Reused receive buffers and messages bigger than this are released before
+/// handling next received data, so single big message does not keep the
+/// memory allocated forever.
+#define REUSED_BUFFER_LIMIT (65536)
+
+namespace Transport {
+
+/// Receive buffer for length-prefixed frames exchanged between spectrum2 and backends.
+
+/// Each frame is 4 bytes of big-endian size followed by that many bytes of
+/// serialized WrapperMessage. Incoming data is appended at the write cursor
+/// and complete frames are handed out as pointers into the buffer, so they can
+/// be parsed in place. Consumed bytes are reclaimed only when the buffer would
+/// otherwise have to grow, which keeps the per-frame cost independent of the
+/// amount of buffered data. Buffer grown bigger than REUSED_BUFFER_LIMIT is
+/// shrunk again once the big frame has been consumed. Frames can carry
+/// passwords, so the memory is cleared before it is freed.
+///
+/// Both v1 and v2 (NETWORK_FRAME_V2) frames are accepted at any time, the side
+/// which sends v2 frames only has to know the other side understands them.
+class NetworkFrameBuffer {
+	public:
+		NetworkFrameBuffer();
+		~NetworkFrameBuffer();
+
+		/// Appends v1 frame with already serialized WrapperMessage to out.
+		static void appendFrame(std::string &out, const std::string &wrapper);
+
+		/// Appends v2 frame with raw payload to out.
+		static void appendFrame(std::string &out, int type, const std::string &payload);
+
+		/// Appends v2 frame to out. The payload is serialized directly to out.
+		static void appendFrame(std::string &out, int type, const google::protobuf::MessageLite &payload);
+
+		/// Appends v2 frame with compressed payload to out.
+		/// \return false if the payload has not been appended, because it
+		/// cannot be compressed to smaller size, it's bigger than
+		/// NETWORK_FRAME_MAX_DECOMPRESSED_SIZE or compression is not available.
+		static bool appendCompressedFrame(std::string &out, int type, const std::string &payload);
+
+		/// Decompresses payload of NETWORK_FRAME_COMPRESSED frame to out.
+		/// \return false if the payload is not valid or it decompresses to
+		/// more than NETWORK_FRAME_MAX_DECOMPRESSED_SIZE bytes.
+		static bool decompress(const char *data, size_t size, std::string &out);
+
+		/// Returns true if compression is available in this build.
+		static bool isCompressionSupported();
+
+		/// Appends received data to the buffer.
+		void append(const char *data, size_t size);
+
+		void append(const std::string &data) {
+			append(data.data(), data.size());
+		}
+
+		/// Returns next complete frame.
+		/// \param frame set to the first byte of frame payload (without header).
+		/// \param size set to the size of frame payload.
+		/// \param type set to WrapperMessage::Type of v2 frame or to -1 if the
+		/// frame contains serialized WrapperMessage.
+		/// \return false if there is no complete frame in the buffer.
+		/// Returned pointer is valid until the next append() or clear() call.
+		bool nextFrame(const char *&frame, unsigned int &size, int &type);
+
+		/// Returns number of buffered bytes which have not been consumed yet.
+		size_t size() const {
+			return m_end - m_start;
+		}
+
+		/// Returns number of allocated bytes.
+		size_t capacity() const {
+			return m_buffer.size();
+		}
+
+		/// Drops all buffered data.
+		void clear();
+
+	private:
+		void reserve(size_t size);
+		/// Moves unconsumed data to the beginning of new buffer of given size.
+		void reallocate(size_t size);
+
+		std::vector<char> m_buffer;
+		size_t m_start;
+		size_t m_end;
+};
+
+}
@@ -23,9 +23,11 @@
 #include <time.h>
 #undef TYPE_BOOL
 #include "transport/protocol.pb.h"
+#include "transport/NetworkFrameBuffer.h"
 // #include "conversation.h"
 #include <iostream>
 #include <list>
+#include <map>
 
 namespace Transport {
 
@@ -89,6 +91,15 @@ class NetworkPlugin {
 			bool blocked = false
 		);
 
+		/// Starts collecting buddies passed to handleBuddyChanged(), so they are
+		/// sent to Spectrum2 in single message and Spectrum2 can update the
+		/// roster in one pass. Calls can be nested.
+		void beginBuddyBatch();
+
+		/// Ends the block started by beginBuddyBatch(). Collected buddies are
+		/// sent once the outermost block ends.
+		void endBuddyBatch();
+
 		/// Call this method when buddy is removed from legacy network contact list.
 		/// \param user XMPP JID of user for which this event occurs. You can get it from NetworkPlugin::handleLoginRequest(). (eg. "user%gmail.com@xmpp.domain.tld")
 		/// \param buddyName Name of legacy network buddy. (eg. "user2@gmail.com")
@@ -207,6 +218,35 @@ class NetworkPlugin {
 		/// \param legacyName Legacy network name of this user used for login.
 		virtual void handleLogoutRequest(const std::string &user, const std::string &legacyName) = 0;
 
+		/// Returns true if the backend overrides handleExportSessionRequest() and
+		/// handleImportSessionRequest() to move sessions without new login to
+		/// legacy network. Spectrum 2 moves sessions only between backends
+		/// returning true, users of other backends are logged in again.
+		virtual bool supportsSessionResume() {
+			return false;
+		}
+
+		/// Called when Spectrum 2 moves the user to another backend.
+		/// You should disconnect him from legacy network without calling handleDisconnected()
+		/// and store into data anything the other backend needs to resume the session
+		/// without new login, for example authentication token.
+		/// Called only if supportsSessionResume() returns true.
+		/// Default implementation calls handleLogoutRequest().
+		/// \param user XMPP JID of user for which this event occurs.
+		/// \param legacyName Legacy network name of this user used for login.
+		/// \param data Backend-specific session data passed to handleImportSessionRequest().
+		virtual void handleExportSessionRequest(const std::string &user, const std::string &legacyName, std::string &/*data*/) {
+			handleLogoutRequest(user, legacyName);
+		}
+
+		/// Called when the user is moved to this backend from another one.
+		/// Called only if supportsSessionResume() returns true.
+		/// Default implementation logs him in by handleLoginRequest() and joins
+		/// his rooms by handleJoinRoomRequest().
+		/// \param state Session state with data from handleExportSessionRequest() and
+		/// user's roster and rooms as known by Spectrum 2.
+		virtual void handleImportSessionRequest(const pbnetwork::SessionState &state);
+
 		/// Called when XMPP user sends message to legacy network.
 		/// \param user XMPP JID of user for which this event occurs.
 		/// \param legacyName Legacy network name of buddy or room.
@@ -262,6 +302,33 @@ class NetworkPlugin {
 		void handleDataRead(std::string &data);
 		virtual void sendData(const std::string &string) {}
 
+		/// Starts collecting outgoing messages instead of passing them to sendData() one by one.
+		/// Calls can be nested. Incoming data passed to handleDataRead() is always handled
+		/// in corked state, so all the responses are sent together.
+		void corkOutput();
+
+		/// Ends the block started by corkOutput(). Collected messages are passed
+		/// to single sendData() call once the outermost block ends.
+		void uncorkOutput();
+
+		/// Passes all collected messages to sendData().
+		void flushOutput();
+
+		/// Sets number of collected bytes which triggers flushOutput() even in corked state.
+		void setOutputBufferSize(unsigned long size) { m_outputBufferSize = size; }
+
+		/// Returns number of sendData() calls done by flushOutput().
+		unsigned long getFlushCount() const { return m_flushes; }
+
+		/// Returns number of messages sent by flushOutput().
+		unsigned long getFlushedFrames() const { return m_flushedFrames; }
+
+		/// Returns size of compressed frames exchanged with Spectrum2 after compression.
+		unsigned long getCompressedBytes() const { return m_compressedBytes; }
+
+		/// Returns size of compressed frames exchanged with Spectrum2 before compression.
+		unsigned long getUncompressedBytes() const { return m_uncompressedBytes; }
+
 		void checkPing();
 
 	private:
@@ -282,12 +349,47 @@ class NetworkPlugin {
 		void handleFTContinuePayload(const std::string &payload);
 		void handleRoomSubjectChangedPayload(const std::string &payload);
 
-		void send(const std::string &data);
+		void handleAPIVersionPayload(const std::string &payload);
+		void handleExportSessionPayload(const std::string &payload);
+		unsigned int getSessionId(const std::string &user);
+		void handleImportSessionPayload(const std::string &payload);
+
+		void handleFrames();
+		void send(int type, const google::protobuf::MessageLite &payload);
+		void send(int type, const std::string &payload = "");
+		void appendCompressedFrame(std::string &out, int type, const std::string &payload);
+		void queueFrame(const std::string &frame);
 		void sendPong();
 		void sendMemoryUsage();
 
-		std::string m_data;
+		NetworkFrameBuffer m_data;
+
+		// Messages reused for every received frame, so their string fields
+		// keep the allocated memory.
+		pbnetwork::WrapperMessage m_wrapper;
+		std::string m_payload;
+		pbnetwork::Buddy m_buddy;
+		pbnetwork::ConversationMessage m_conversationMessage;
+		pbnetwork::Status m_status;
+
+		std::string m_output;
+		int m_corked;
+		unsigned long m_outputFrames;
+		unsigned long m_outputBufferSize;
+		unsigned long m_flushes;
+		unsigned long m_flushedFrames;
 		bool m_pingReceived;
+		int m_apiVersion;
+		/// Buddies collected between beginBuddyBatch() and endBuddyBatch().
+		pbnetwork::Buddies m_buddyBatch;
+		int m_buddyBatchDepth;
+		/// Frames bigger than this are compressed, 0 if Spectrum2 did not
+		/// offer compression.
+		unsigned long m_compressionThreshold;
+		unsigned long m_compressedBytes;
+		unsigned long m_uncompressedBytes;
+		/// Session IDs assigned to users by spectrum2 at login.
+		std::map<std::string, unsigned int> m_sessionIds;
 		double m_init_res;
 
 };
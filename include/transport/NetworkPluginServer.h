@@ -21,12 +21,15 @@
 #pragma once
 
 #include "transport/FileTransferManager.h"
+#include "transport/NetworkFrameBuffer.h"
 
 #include <time.h>
 #include "Swiften/Presence/PresenceOracle.h"
 #include "Swiften/Disco/EntityCapsManager.h"
 #include "Swiften/Network/BoostConnectionServer.h"
 #include "Swiften/Network/Connection.h"
+#include "Swiften/Network/UnixConnectionServer.h"
+#include "Swiften/Network/UnixConnection.h"
 #include "Swiften/Elements/ChatState.h"
 #include "Swiften/Elements/RosterItemPayload.h"
 #include "Swiften/Elements/VCard.h"
@@ -34,6 +37,7 @@
 #include "Swiften/Elements/Presence.h"
 #include "Swiften/Elements/IQ.h"
 #include "Swiften/Network/Timer.h"
+#include "Swiften/EventLoop/EventOwner.h"
 #include "Swiften/Parser/PayloadParsers/FullPayloadParserFactoryCollection.h"
 #include "Swiften/Serializer/PayloadSerializers/FullPayloadSerializerCollection.h"
 #include "Swiften/Parser/XMPPParser.h"
@@ -44,8 +48,6 @@
 #include <Swiften/FileTransfer/FileTransfer.h>
 #define HAVE_SWIFTEN_3  (SWIFTEN_VERSION >= 0x030000)
 
-#define NETWORK_PLUGIN_API_VERSION (1)
-
 namespace Transport {
 
 class UserManager;
@@ -62,13 +64,37 @@ class DummyReadBytestream;
 class AdminInterface;
 class FileTransferManager;
 class FileTransfer;
+class BackendPool;
+class BackendDecoder;
+class IQRouteTable;
 
 class NetworkPluginServer : Swift::XMPPParserClient {
 	public:
+		/// Priority classes of frames sent to backends. Frames of higher
+		/// priority class are written first when the backend is slow to read,
+		/// frames of the same class are always written in order.
+		enum Priority {
+			/// Frames which are not related to any user.
+			PRIORITY_CONTROL = 0,
+			/// Session lifecycle, messages and everything else which changes
+			/// the state of user's session.
+			PRIORITY_MESSAGE,
+			/// Typing notifications.
+			PRIORITY_TYPING,
+			/// File transfers.
+			PRIORITY_FT,
+			PRIORITY_COUNT
+		};
+
 		struct Backend {
+			Backend() : pongReceived(-1), res(0), init_res(0), shared(0), acceptUsers(true),
+				longRun(false), willDie(true), incoming(0), queued(0), outputFrames(0), flushes(0), flushedFrames(0),
+				writing(false), congested(false), shed(0), apiVersion(1), sessionResume(false), compressionThreshold(0),
+				compressedBytes(0), uncompressedBytes(0) {}
+
 			int pongReceived;
 			std::list<User *> users;
-			Swift::SafeByteArray data;
+			NetworkFrameBuffer data;
 			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Connection> connection;
 			unsigned long res;
 			unsigned long init_res;
@@ -76,7 +102,41 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 			bool acceptUsers;
 			bool longRun;
 			bool willDie;
+			/// Number of users being moved to this backend whose session
+			/// has not been exported by their old backend yet. They count
+			/// against service.users_per_backend already.
+			unsigned long incoming;
 			std::string id;
+			/// Frames waiting to be written to the connection, one buffer per Priority.
+			std::string output[PRIORITY_COUNT];
+			/// Number of bytes in output.
+			size_t queued;
+			/// Number of frames in output.
+			unsigned long outputFrames;
+			/// Number of writes done to the connection.
+			unsigned long flushes;
+			/// Number of frames written to the connection; flushedFrames / flushes
+			/// is the average number of frames coalesced into single write.
+			unsigned long flushedFrames;
+			/// True while the connection has not finished the last write.
+			bool writing;
+			/// True after output reached the high watermark, until it drops
+			/// below the low watermark again.
+			bool congested;
+			/// Number of frames dropped because the backend was congested.
+			unsigned long shed;
+			/// Protocol version negotiated with the backend.
+			int apiVersion;
+			/// True if the backend can export and import sessions without
+			/// logging the user in to the legacy network again.
+			bool sessionResume;
+			/// Frames bigger than this are compressed, 0 if compression
+			/// has not been negotiated.
+			unsigned long compressionThreshold;
+			/// Size of compressed frames sent to and received from the backend
+			/// after and before compression.
+			unsigned long compressedBytes;
+			unsigned long uncompressedBytes;
 		};
 
 		NetworkPluginServer(Component *component, Config *config, UserManager *userManager, FileTransferManager *ftManager);
@@ -93,6 +153,10 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 			return m_clients.size();
 		}
 
+		IQRouteTable *getIQRouteTable() {
+			return m_iqRoutes;
+		}
+
 		const std::list<Backend *> &getBackends() {
 			return m_clients;
 		}
@@ -105,6 +169,18 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 
 		bool moveToLongRunBackend(User *user);
 
+		/// Moves the user to target backend. If both backends support session
+		/// resume, the session is handed over and the user does not have to
+		/// log in to legacy network again.
+		/// \param relogin If true and session resume is not supported, the
+		/// user is logged in again on the target backend.
+		/// \return false if the user has not been moved.
+		bool migrateUser(User *user, Backend *target, bool relogin);
+
+		/// Forgets the migration and releases the place it reserved on the
+		/// target backend.
+		void eraseMigration(std::map<std::string, Backend *>::iterator it);
+
 		void handleMessageReceived(NetworkConversation *conv, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Message> &message);
 
 	public:
@@ -112,10 +188,13 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 		void handleSessionFinished(Backend *c);
 		void handlePongReceived(Backend *c);
 		void handleDataRead(Backend *c, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray> data);
+		void handleDataWritten(Backend *c);
+		void handleFrame(Backend *c, int type, const std::string &payload);
 
 		void handleConnectedPayload(const std::string &payload);
 		void handleDisconnectedPayload(const std::string &payload);
 		void handleBuddyChangedPayload(const std::string &payload);
+		void handleBuddiesChangedPayload(const std::string &payload);
 		void handleBuddyRemovedPayload(const std::string &payload);
 		void handleConvMessagePayload(const std::string &payload, bool subject = false);
 		void handleConvMessageAckPayload(const std::string &payload);
@@ -126,6 +205,8 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 		void handleAuthorizationPayload(const std::string &payload);
 		void handleAttentionPayload(const std::string &payload);
 		void handleStatsPayload(Backend *c, const std::string &payload);
+		void handleAPIVersionPayload(Backend *c, const std::string &payload);
+		void handleSessionExportedPayload(Backend *c, const std::string &payload);
 		void handleFTStartPayload(const std::string &payload);
 		void handleFTFinishPayload(const std::string &payload);
 		void handleFTDataPayload(Backend *b, const std::string &payload);
@@ -156,15 +237,41 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 		void handleFTAccepted(User *user, const std::string &buddyName, const std::string &fileName, unsigned long size, unsigned long ftID);
 		void handleFTRejected(User *user, const std::string &buddyName, const std::string &fileName, unsigned long size);
 		void handleFTDataNeeded(Backend *b, unsigned long ftid);
+		void handleFTBufferFull(Backend *b, unsigned long ftid);
 
 		void handlePIDTerminated(unsigned long pid);
+		void send(Backend *c, int type, const google::protobuf::MessageLite &payload);
+		void send(Backend *c, int type, const std::string &payload = "");
+
 	private:
-		void send(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Connection> &, const std::string &data);
+		User *getUser(unsigned int sessionId, const std::string &name);
+		void appendCompressedFrame(Backend *c, std::string &output, int type, const std::string &payload);
+		void handleFrameQueued(Backend *c, bool pending, size_t size);
+		void flush(Backend *c, bool all = false);
+		void flushBackends();
+		std::string getBackendSocket();
 
 		void pingTimeout();
+		void iqRouteTimeout();
 		void sendPing(Backend *c);
 		void sendAPIVersion(Backend *c);
 		Backend *getFreeClient(bool acceptUsers = true, bool longRun = false, bool check = false);
+		void spawnBackend(bool longRun);
+		void startZygote();
+		/// Asks backend zygote to fork new backend. The pid is received later
+		/// in handleZygoteDataRead().
+		/// \return false if the zygote is not available.
+		bool requestFromZygote(const std::string &log_id);
+		void handleZygoteDataRead(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray> data);
+		void handleZygoteDisconnected();
+		/// Sets the pid of backend which has been requested from the zygote.
+		/// If pid is 0, the backend is started directly.
+		void setZygoteBackendPid(size_t index, unsigned long pid);
+		void spawnBackends(bool longRun);
+		unsigned long getStartingBackendsCount(bool longRun);
+		void expireStartingBackends(bool all);
+		bool isIdleBackend(Backend *c);
+		void spawnIdleBackends();
 		void connectWaitingUsers();
 		void loginDelayFinished();
 		void handleRawIQReceived(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::IQ> iq);
@@ -184,26 +291,66 @@ class NetworkPluginServer : Swift::XMPPParserClient {
 		BlockResponder *m_blockResponder;
 		Config *m_config;
 		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::ConnectionServer> m_server;
+#ifndef _WIN32
+		Swift::UnixConnectionServer::ref m_unixServer;
+#endif
 		std::list<Backend *>  m_clients;
 		std::vector<unsigned long> m_pids;
 		Swift::Timer::ref m_pingTimer;
 		Swift::Timer::ref m_collectTimer;
 		Swift::Timer::ref m_loginTimer;
+		Swift::Timer::ref m_iqRouteTimer;
 		Component *m_component;
 		std::list<User *> m_waitingUsers;
-		bool m_isNextLongRun;
+		/// Users waiting for TYPE_SESSION_EXPORTED and the backends they are
+		/// moved to. Backend is NULL if it disconnected in the meantime.
+		std::map<std::string, Backend *> m_migrations;
 		std::map<unsigned long, FileTransferManager::Transfer> m_filetransfers;
 		FileTransferManager *m_ftManager;
 		std::vector<std::string> m_crashedBackends;
 		AdminInterface *m_adminInterface;
-		bool m_startingBackend;
+		/// Backend process which has been spawned, but did not connect yet.
+		struct StartingBackend {
+			unsigned long pid;
+			/// Index of the pid in m_pids (log_id - 1).
+			size_t index;
+			bool longRun;
+			time_t started;
+		};
+		std::list<StartingBackend> m_startingBackends;
+		unsigned long m_maxStartingBackends;
+		/// Path to the control socket of backend zygote, empty if zygote is not used.
+		std::string m_zygotePath;
+#ifndef _WIN32
+		Swift::UnixConnection::ref m_zygote;
+		/// Incomplete line received from the zygote.
+		std::string m_zygoteReply;
+		/// Indexes in m_pids of backends requested from the zygote, in the
+		/// order of requests.
+		std::list<size_t> m_zygoteRequests;
+#endif
+		unsigned long m_zygotePid;
 		time_t m_lastLogin;
 		Swift::XMPPParser *m_xmppParser;
 		Swift::FullPayloadParserFactoryCollection m_collection;
 		Swift::XMPPSerializer *m_serializer;
 		Swift::FullPayloadSerializerCollection m_collection2;
-		std::map <std::string, std::string> m_id2resource;
+		/// Resources which sent IQ-gets forwarded to backends.
+		IQRouteTable *m_iqRoutes;
 		bool m_firstPong;
+		std::list<Backend *> m_pendingFlush;
+		bool m_flushScheduled;
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner> m_flushOwner;
+		unsigned long m_outputBufferSize;
+		unsigned long m_queueHighWatermark;
+		unsigned long m_queueLowWatermark;
+		unsigned long m_compressionThreshold;
+		struct ReusedMessages;
+		ReusedMessages *m_messages;
+		BackendPool *m_pool;
+		BackendDecoder *m_decoder;
+		unsigned long m_idleBackends;
+		unsigned long m_idleLongRunBackends;
 };
 
 }
@@ -0,0 +1,121 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <list>
+#include <fstream>
+#include "Swiften/Network/Timer.h"
+#include "Swiften/SwiftenCompat.h"
+
+namespace Transport {
+
+class Component;
+class AsyncStorageBackend;
+
+/// Stores online state of users in batches.
+
+/// Logins and logouts only change the state kept in memory. Changed states
+/// are stored by AsyncStorageBackend::setUsersOnline() once per interval, so
+/// reconnecting many users costs few UPDATE statements instead of one per
+/// user and the main loop does not wait for them. Failed stores are retried
+/// with increasing delay.
+///
+/// Every change is also appended to the journal file. The journal is
+/// rewritten to contain only the changes which have not been stored yet once
+/// no store is in progress, so after unclean shutdown it contains the changes
+/// which may not have reached the database and they are stored when the next
+/// OnlineUsersFlusher is created. StorageBackend::getOnlineUsers() then
+/// returns the users which were really online.
+class OnlineUsersFlusher {
+	public:
+		/// Creates new OnlineUsersFlusher and stores changes left in the journal.
+		/// \param component Component used to create timers.
+		/// \param storage AsyncStorageBackend the online state is stored by.
+		/// \param interval Time in seconds after which changed states are stored.
+		/// \param journal Path to the journal file, empty string disables the journal.
+		OnlineUsersFlusher(Component *component, AsyncStorageBackend *storage, int interval, const std::string &journal);
+
+		/// Starts storing all changed states. It has to be destroyed before
+		/// the AsyncStorageBackend, which finishes the writes.
+		virtual ~OnlineUsersFlusher();
+
+		/// Changes the online state of user.
+		void setUserOnline(long id, bool online);
+
+		/// Starts storing all changed states.
+		void flush();
+
+		/// Returns number of users whose state has not been sent to the
+		/// database yet.
+		unsigned long getQueueSize() {
+			return m_pending.size();
+		}
+
+		/// Returns number of flushes which have not finished yet.
+		size_t getPendingCount() {
+			return m_batches.size();
+		}
+
+	private:
+		/// States sent to the database by single flush.
+		struct Batch {
+			unsigned long id;
+			std::map<long, bool> states;
+			// Number of requests which have not finished yet.
+			size_t pending;
+			bool stored;
+		};
+		typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Batch> BatchRef;
+
+		/// Last batch with the state of single user.
+		struct Sent {
+			unsigned long batch;
+			// Number of batches with the state which have not finished yet.
+			int pending;
+		};
+
+		void store(BatchRef batch, const std::vector<long> &ids, bool online);
+		void handleStored(BatchRef batch, bool stored);
+		void loadJournal();
+		void rewriteJournal();
+		void schedule();
+		void scheduledFlush();
+
+		Component *m_component;
+		AsyncStorageBackend *m_storage;
+		int m_interval;
+		std::string m_journalPath;
+		std::ofstream m_journal;
+		std::map<long, bool> m_pending;
+		std::list<BatchRef> m_batches;
+		// Users whose state is being stored, failed batch is put back
+		// only for users which have not been sent by later batch.
+		std::map<long, Sent> m_sent;
+		unsigned long m_lastBatch;
+		// Number of failed flushes in row, used to delay the retries.
+		int m_failures;
+		Swift::Timer::ref m_timer;
+};
+
+}
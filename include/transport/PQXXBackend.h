@@ -24,6 +24,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include "boost/date_time/posix_time/posix_time.hpp"
 #include "transport/StorageBackend.h"
 #include "transport/Config.h"
 #include <pqxx/pqxx>
@@ -49,6 +51,9 @@ class PQXXBackend : public StorageBackend
 		bool connect();
 		void disconnect();
 
+		/// Returns false if the connection has been lost.
+		bool ping();
+
 		/// Creates database structure.
 		/// \see connect()
 		/// \return true if database structure has been created successfully. Note that it returns True also if database structure
@@ -68,7 +73,10 @@ class PQXXBackend : public StorageBackend
 		/// Changes users online state variable in database.
 		/// \param id id of user - UserInfo.id
 		/// \param online online state
-		void setUserOnline(long id, bool online);
+		bool setUserOnline(long id, bool online);
+
+		/// Changes online state of many users by single statement.
+		bool setUsersOnline(const std::vector<long> &ids, bool online);
 
 		/// Removes user and all connected data from database.
 		/// \param id id of user - UserInfo.id
@@ -87,28 +95,53 @@ class PQXXBackend : public StorageBackend
 
 		long addBuddy(long userId, const BuddyInfo &buddyInfo);
 
-		void updateBuddy(long userId, const BuddyInfo &buddyInfo);
-		void removeBuddy(long id) {}
+		bool updateBuddy(long userId, const BuddyInfo &buddyInfo);
+		void removeBuddy(long id);
 
-		void getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {}
-		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {}
+		/// Stores buddies using multi-row upserts in single transaction.
+		bool storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
 
-		void getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
+		bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
+		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value);
+
+		bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
 		void updateUserSetting(long userId, const std::string &variable, const std::string &value);
 
 		void beginTransaction();
-		void commitTransaction();
+		bool commitTransaction();
+
+		struct StatementTiming {
+			StatementTiming() : count(0), total(0), max(0) {}
+			unsigned long count;
+			/// Time spent executing the statement in microseconds.
+			long total;
+			long max;
+		};
+
+		/// Returns execution times of the prepared statements executed
+		/// by this connection.
+		const std::map<std::string, StatementTiming> &getStatementTimings() {
+			return m_timings;
+		}
 
 	private:
 		bool exec(const std::string &query, bool show_error = true);
 		bool exec(pqxx::nontransaction &txn, const std::string &query, bool show_error = true);
 		template<typename T>
-		std::string quote(pqxx::nontransaction &txn, const T &t);
+		std::string quote(pqxx::transaction_base &txn, const T &t);
+
+		bool upgradeDatabase();
+		void prepareStatements();
+		// Settings are locked until the end of the transaction if lock is true.
+		bool getBuddySettings(pqxx::transaction_base &txn, long userId, long buddyId, std::map<std::string, SettingVariableInfo> &settings, bool lock = false);
+		void recordTiming(const std::string &statement, const boost::posix_time::ptime &start);
+		void logTimings();
 
 		Config *m_config;
 		std::string m_prefix;
 
 		pqxx::connection *m_conn;
+		std::map<std::string, StatementTiming> m_timings;
 };
 
 }
@@ -0,0 +1,118 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#pragma once
+
+#include <string>
+#include <list>
+#include <set>
+#include <vector>
+#include "Swiften/Network/Timer.h"
+#include "Swiften/EventLoop/EventOwner.h"
+#include "Swiften/SwiftenCompat.h"
+
+namespace Transport {
+
+class Component;
+class AsyncStorageBackend;
+class RosterStorage;
+struct BuddyInfo;
+
+/// Writes buddies queued by RosterStorage of all users in batches.
+
+/// Buddies are collected from all users and written by
+/// AsyncStorageBackend::storeBuddies() in transactions of about batchSize
+/// buddies, either once per interval or as soon as batchSize buddies are
+/// queued. The transactions are executed by the database connection pool,
+/// so the main loop does not wait for them. Buddies which could not be
+/// stored are queued again and the flush is retried with increasing delay.
+/// Everything is flushed when the RosterFlusher is destroyed.
+class RosterFlusher {
+	public:
+		/// Creates new RosterFlusher.
+		/// \param component Component used to create timers.
+		/// \param storage AsyncStorageBackend buddies are stored by.
+		/// \param interval Time in seconds after which queued buddies are stored.
+		/// \param batchSize Number of queued buddies which triggers the flush
+		/// immediately and maximum number of buddies stored by single transaction.
+		RosterFlusher(Component *component, AsyncStorageBackend *storage, int interval, unsigned long batchSize);
+
+		/// Starts storing all queued buddies. It has to be destroyed before
+		/// the AsyncStorageBackend, which finishes the writes.
+		virtual ~RosterFlusher();
+
+		/// Called by RosterStorage when new buddy has been queued.
+		void handleBuddyQueued(RosterStorage *storage);
+
+		/// Forgets the RosterStorage. Its buddies which are being stored are
+		/// still written, but the result is not reported to it.
+		void removeStorage(RosterStorage *storage);
+
+		/// Starts storing queued buddies of all users.
+		void flush();
+
+		/// Starts storing queued buddies of single user immediately.
+		/// \return true if some buddies are being stored.
+		bool flush(RosterStorage *storage);
+
+		/// Removes buddy from the database after its pending writes.
+		void removeBuddy(long userId, long id);
+
+		/// Returns number of buddies queued since the last flush.
+		unsigned long getQueueSize() {
+			return m_queued;
+		}
+
+		/// Returns number of transactions which have not finished yet.
+		size_t getPendingCount() {
+			return m_pending.size();
+		}
+
+	private:
+		/// Buddies of several users stored in single request.
+		struct Batch {
+			/// NULL once the RosterStorage is removed.
+			std::vector<RosterStorage *> storages;
+			/// Number of buddies of each RosterStorage in the request.
+			std::vector<size_t> sizes;
+		};
+		typedef SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Batch> BatchRef;
+
+		void store(const std::vector<RosterStorage *> &storages);
+		void handleStored(BatchRef batch, bool stored, const std::list<std::pair<long, BuddyInfo> > &buddies);
+		void schedule();
+		void scheduledFlush();
+
+		Component *m_component;
+		AsyncStorageBackend *m_storage;
+		int m_interval;
+		unsigned long m_batchSize;
+		std::set<RosterStorage *> m_dirty;
+		unsigned long m_queued;
+		std::list<BatchRef> m_pending;
+		// Number of failed flushes in row, used to delay the retries.
+		int m_failures;
+		bool m_flushPosted;
+		Swift::Timer::ref m_timer;
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner> m_owner;
+};
+
+}
@@ -23,6 +23,9 @@
 #include <string>
 #include <algorithm>
 #include <map>
+#include <list>
+#include <vector>
+#include <set>
 #include <boost/signal.hpp>
 #include <boost/pool/pool_alloc.hpp>
 #include <boost/pool/object_pool.hpp>
@@ -40,6 +43,7 @@ class User;
 class Component;
 class StorageBackend;
 class RosterStorage;
+struct BuddyInfo;
 
 /// Manages roster of one XMPP user.
 class RosterManager {
@@ -57,6 +61,12 @@ class RosterManager {
 		virtual void doAddBuddy(Buddy *buddy) = 0;
 		virtual void doUpdateBuddy(Buddy *buddy) = 0;
 
+		/// Sends buddies added and updated during the batch to the XMPP user.
+		/// Default implementation calls doAddBuddy() and doUpdateBuddy() for
+		/// each of them. It's used by the XMPP frontend too, because roster
+		/// push can contain only one item.
+		virtual void doUpdateBuddies(const std::vector<Buddy *> &added, const std::vector<Buddy *> &updated);
+
 		/// Associates the buddy with this roster,
 		/// and if the buddy is not already in XMPP user's server-side roster, the proper requests
 		/// are sent to XMPP user (subscribe presences, Roster Item Exchange stanza or
@@ -76,8 +86,26 @@ class RosterManager {
 
 		void setStorageBackend(StorageBackend *storageBackend);
 
+		/// Sets StorageBackend and adds buddies from the roster already
+		/// fetched from it, so the StorageBackend is not queried again.
+		void setStorageBackend(StorageBackend *storageBackend, const std::list<BuddyInfo> &roster);
+
 		void storeBuddy(Buddy *buddy);
 
+		/// Sends the changed buddy to XMPP user, or remembers it if the
+		/// batch is in progress.
+		void updateBuddy(Buddy *buddy);
+
+		/// Starts collecting buddies added by setBuddy() and updated by
+		/// updateBuddy(), so each of them is sent to XMPP user only once
+		/// when the batch ends.
+		/// Calls can be nested.
+		void beginBatch();
+
+		/// Ends the block started by beginBatch(). Collected buddies are
+		/// passed to doUpdateBuddies() once the outermost block ends.
+		void endBatch();
+
 		Swift::RosterPayload::ref generateRosterPayload();
 
 		/// Returns user associated with this roster.
@@ -131,6 +159,11 @@ class RosterManager {
 		Swift::Timer::ref m_RIETimer;
 		std::list <Swift::SetRosterRequest::ref> m_requests;
 		bool m_supportRemoteRoster;
+		int m_batchDepth;
+		std::vector<Buddy *> m_batchAdded;
+		std::vector<Buddy *> m_batchUpdated;
+		// Buddies in m_batchAdded or m_batchUpdated.
+		std::set<Buddy *> m_batchBuddies;
 };
 
 }
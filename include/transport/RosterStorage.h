@@ -23,19 +23,21 @@
 #include <string>
 #include <algorithm>
 #include <map>
-
-#include "Swiften/Network/Timer.h"
+#include <set>
+#include <list>
 
 namespace Transport {
 
 class User;
-class StorageBackend;
 class Buddy;
+class RosterFlusher;
+struct BuddyInfo;
 
-// Stores buddies into DB Backend.
+// Stores buddies into DB Backend. Queued buddies are stored
+// together with buddies of other users by RosterFlusher.
 class RosterStorage {
 	public:
-		RosterStorage(User *user, StorageBackend *storageBackend);
+		RosterStorage(User *user, RosterFlusher *flusher);
 		virtual ~RosterStorage();
 
 		// Add buddy to store queue and store it in future. Nothing
@@ -51,11 +53,29 @@ class RosterStorage {
 		// Remove buddy from storage queue.
 		void removeBuddyFromQueue(Buddy *buddy);
 
+		size_t getQueueSize() {
+			return m_buddies.size();
+		}
+
+		// Appends queued buddies together with user ID to the list and
+		// marks them as being stored. Returns number of appended buddies.
+		// Buddies which are not in the database yet and are already being
+		// added stay queued.
+		size_t getQueuedBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
+
+		// Called once the count buddies returned by getQueuedBuddies() are
+		// written. Sets IDs of newly added buddies and moves the iterator past
+		// them. If stored is false, the buddies are queued again.
+		void handleBuddiesStored(std::list<std::pair<long, BuddyInfo> >::const_iterator &it, size_t count, bool stored);
+
 	private:
 		User *m_user;
-		StorageBackend *m_storageBackend;
+		RosterFlusher *m_flusher;
 		std::map<std::string, Buddy *> m_buddies;
-		Swift::Timer::ref m_storageTimer;
+		// Buddies which are being stored.
+		std::map<std::string, Buddy *> m_storing;
+		// Buddies removed while they were being added to the database.
+		std::set<std::string> m_removed;
 };
 
 }
@@ -68,7 +68,10 @@ class SQLite3Backend : public StorageBackend
 		/// Changes users online state variable in database.
 		/// \param id id of user - UserInfo.id
 		/// \param online online state
-		void setUserOnline(long id, bool online);
+		bool setUserOnline(long id, bool online);
+
+		/// Changes online state of many users by single statement.
+		bool setUsersOnline(const std::vector<long> &ids, bool online);
 
 		bool getOnlineUsers(std::vector<std::string> &users);
 
@@ -87,20 +90,40 @@ class SQLite3Backend : public StorageBackend
 
 		long addBuddy(long userId, const BuddyInfo &buddyInfo);
 
-		void updateBuddy(long userId, const BuddyInfo &buddyInfo);
+		bool updateBuddy(long userId, const BuddyInfo &buddyInfo);
 		void removeBuddy(long id);
 
-		void getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
+		/// Stores buddies using multi-row upserts in single transaction.
+		bool storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
+
+		bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value);
 		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value);
 
-		void getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
+		bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value);
 		void updateUserSetting(long userId, const std::string &variable, const std::string &value);
 
 		void beginTransaction();
-		void commitTransaction();
+		bool commitTransaction();
+
+		/// In-memory database exists only in the connection which has opened
+		/// it, so the connections of the pool would not share the data.
+		/// Connections to file database share it, but only one of them can
+		/// write at a time and the others wait for it up to the busy timeout.
+		bool supportsConnectionPool();
 
 	private:
 		bool exec(const std::string &query);
+		int getDatabaseVersion();
+		bool upgradeDatabase();
+		/// \param found Set to false if the buddy does not exist.
+		/// \return false if the query failed.
+		bool getBuddySettings(long userId, long buddyId, std::map<std::string, SettingVariableInfo> &settings, bool &found);
+
+		/// Buddies stored by single statement, identified by user ID and legacy name.
+		typedef std::map<std::pair<long, std::string>, BuddyInfo *> BuddyChunk;
+		/// Fetches ID and settings of the buddies from the chunk which exist.
+		bool getStoredBuddies(const BuddyChunk &chunk, std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored);
+		bool upsertBuddies(const BuddyChunk &chunk, const std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored);
 
 		sqlite3 *m_db;
 		Config *m_config;
@@ -115,15 +138,12 @@ class SQLite3Backend : public StorageBackend
 		sqlite3_stmt *m_removeUser;
 		sqlite3_stmt *m_removeUserBuddies;
 		sqlite3_stmt *m_removeUserSettings;
-		sqlite3_stmt *m_removeUserBuddiesSettings;
 		sqlite3_stmt *m_removeBuddy;
-		sqlite3_stmt *m_removeBuddySettings;
 		sqlite3_stmt *m_addBuddy;
 		sqlite3_stmt *m_updateBuddy;
 		sqlite3_stmt *m_updateBuddySetting;
 		sqlite3_stmt *m_getBuddySetting;
 		sqlite3_stmt *m_getBuddies;
-		sqlite3_stmt *m_getBuddiesSettings;
 		sqlite3_stmt *m_setUserOnline;
 		sqlite3_stmt *m_getOnlineUsers;
 		sqlite3_stmt *m_getUsers;
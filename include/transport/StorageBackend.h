@@ -94,6 +94,29 @@ class StorageBackend
 
 		static std::vector<std::string> deserializeGroups(std::string &groups);
 
+		/// Joins IDs by comma, so they can be used in "IN (...)" SQL clause.
+		static std::string serializeIds(const std::vector<long> &ids);
+
+		/// Serializes buddy settings to the compact form stored in the
+		/// settings column of the buddies table. Each setting is stored as
+		/// "<type>:<key length>:<key><value length>:<value>" with lengths in bytes.
+		/// Settings of other types than TYPE_BOOLEAN and TYPE_STRING are skipped.
+		static std::string serializeSettings(const std::map<std::string, SettingVariableInfo> &settings);
+
+		/// Parses settings serialized by serializeSettings().
+		/// \return false if the data are malformed. Settings parsed before
+		/// the malformed part are kept.
+		static bool deserializeSettings(const std::string &data, std::map<std::string, SettingVariableInfo> &settings);
+
+		/// Replaces settings by the changed ones with the same key. Settings
+		/// missing in changes are kept.
+		/// \return false if none of the settings changed.
+		static bool mergeSettings(std::map<std::string, SettingVariableInfo> &settings, const std::map<std::string, SettingVariableInfo> &changes);
+
+		/// Fills the setting from value stored in the database.
+		/// \return false if the type is not supported.
+		static bool parseSetting(int type, const std::string &value, SettingVariableInfo &var);
+
 		/// Virtual desctructor.
 		virtual ~StorageBackend() {}
 
@@ -102,6 +125,15 @@ class StorageBackend
 		/// connect
 		virtual bool connect() = 0;
 
+		/// Checks the connection to the database.
+		/// \return false if the connection is broken and the backend has to be replaced.
+		virtual bool ping() { return true; }
+
+		/// Returns false if the database can be opened only by one backend
+		/// at a time, so database requests can't be executed by pool of
+		/// database connections.
+		virtual bool supportsConnectionPool() { return true; }
+
 		/// createDatabase
 		virtual bool createDatabase() = 0;
 
@@ -112,7 +144,12 @@ class StorageBackend
 		virtual bool getUser(const std::string &barejid, UserInfo &user) = 0;
 
 		/// setUserOnline
-		virtual void setUserOnline(long id, bool online) = 0;
+		/// \return false if the state could not be stored.
+		virtual bool setUserOnline(long id, bool online) = 0;
+
+		/// Changes online state of many users at once.
+		/// \return false if the state could not be stored.
+		virtual bool setUsersOnline(const std::vector<long> &ids, bool online);
 
 		/// removeUser
 		virtual bool removeUser(long id) = 0;
@@ -126,17 +163,34 @@ class StorageBackend
 		virtual bool getUsers(std::vector<std::string> &users) = 0;
 
 		virtual long addBuddy(long userId, const BuddyInfo &buddyInfo) = 0;
-		virtual void updateBuddy(long userId, const BuddyInfo &buddyInfo) = 0;
+		/// Updates buddy with the same legacyName. Settings in
+		/// buddyInfo.settings are merged into the stored settings of the
+		/// buddy with buddyInfo.id, other stored settings are kept.
+		/// \return false if the query failed.
+		virtual bool updateBuddy(long userId, const BuddyInfo &buddyInfo) = 0;
 		virtual void removeBuddy(long id) = 0;
 
-		virtual void getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) = 0;
+		/// Stores buddies of possibly many users in single transaction.
+		/// Buddies are passed together with the ID of user they belong to.
+		/// Buddies with ID -1 are added and their ID is set to the one
+		/// assigned by the database.
+		/// \return false if the buddies could not be stored.
+		virtual bool storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies);
+
+		/// Type and value are not changed if the buddy does not have the setting.
+		/// \return false if the setting could not be read.
+		virtual bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) = 0;
 		virtual void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) = 0;
 
-		virtual void getUserSetting(long userId, const std::string &variable, int &type, std::string &value) = 0;
+		/// Stores the setting with the given type and value if the user does
+		/// not have it.
+		/// \return false if the setting could not be read or stored.
+		virtual bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value) = 0;
 		virtual void updateUserSetting(long userId, const std::string &variable, const std::string &value) = 0;
 
 		virtual void beginTransaction() = 0;
-		virtual void commitTransaction() = 0;
+		/// \return false if the transaction could not be committed.
+		virtual bool commitTransaction() = 0;
 
 		/// onStorageError
 // 		boost::signal<void (const std::string &statement, const std::string &error)> onStorageError;
@@ -87,6 +87,11 @@ namespace Transport {
 			/// \return Swift::NetworkFactories which can be used to create new connections.
 			Swift::NetworkFactories *getNetworkFactories() { return m_factories; }
 
+			/// Returns event loop this transport runs in.
+
+			/// \return event loop this transport runs in.
+			Swift::EventLoop *getEventLoop() { return m_loop; }
+
 			/// Returns Transport Factory used to create basic Transport components.
 
 			/// \return Transport Factory used to create basic Transport components.
@@ -85,6 +85,11 @@ class User {
 		void setData(void *data) { m_data = data; }
 		void *getData() { return m_data; }
 
+		/// Returns ID assigned to this user by UserManager, which backends use
+		/// instead of user's JID.
+		unsigned int getSessionId() { return m_sessionId; }
+		void setSessionId(unsigned int sessionId) { m_sessionId = sessionId; }
+
 		/// Handles presence from XMPP JID associated with this user.
 		/// \param presence Swift::Presence.
 		void handlePresence(Swift::Presence::ref presence, bool forceJoin = false);
@@ -167,6 +172,7 @@ class User {
 		PresenceOracle *m_presenceOracle;
 		UserInfo m_userInfo;
 		void *m_data;
+		unsigned int m_sessionId;
 		bool m_connected;
 		bool m_readyForConnect;
 		bool m_ignoreDisconnect;
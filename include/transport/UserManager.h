@@ -23,6 +23,8 @@
 #include <boost/signal.hpp>
 #include <string>
 #include <map>
+#include <list>
+#include <vector>
 #include "Swiften/Elements/Message.h"
 #include "Swiften/Elements/Presence.h"
 #include "Swiften/JID/JID.h"
@@ -37,6 +39,11 @@ namespace Transport {
 class User;
 class Component;
 class StorageBackend;
+class AsyncStorageBackend;
+class RosterFlusher;
+class OnlineUsersFlusher;
+struct UserInfo;
+struct BuddyInfo;
 class StorageResponder;
 class RosterResponder;
 class UserRegistration;
@@ -50,10 +57,11 @@ class UserRegistry;
 /// Basic user creation process:
 /**
 	\msc
-	Component,UserManager,User,StorageBackend,Slot;
+	Component,UserManager,User,AsyncStorageBackend,Slot;
 	---  [ label = "Available presence received"];
 	Component->UserManager [label="handlePresence(...)", URL="\ref UserManager::handlePresence()"];
-	UserManager->StorageBackend [label="getUser(...)", URL="\ref StorageBackend::getUser()"];
+	UserManager->AsyncStorageBackend [label="getUser(...)", URL="\ref AsyncStorageBackend::getUser()"];
+	AsyncStorageBackend->UserManager [label="handleLoginUserInfo(...)"];
 	UserManager->User [label="User::User(...)", URL="\ref User"];
 	UserManager->Slot [label="onUserCreated(...)", URL="\ref UserManager::onUserCreated()"];
 	UserManager->User [label="handlePresence(...)", URL="\ref User::handlePresence()"];
@@ -78,6 +86,17 @@ class UserManager /*: public Swift::EntityCapsProvider*/ {
 		/// \return User class associated with this user
 		User *getUser(const std::string &barejid);
 
+		/// Returns user according to his session ID.
+		/// \param sessionId ID returned by User::getSessionId()
+		/// \return User class or NULL if there is no user with this session ID.
+		User *getUserBySessionId(unsigned int sessionId) {
+			unsigned int slot = (sessionId & SESSION_SLOT_MASK) - 1;
+			if (slot >= m_sessions.size() || m_sessions[slot].id != sessionId) {
+				return NULL;
+			}
+			return m_sessions[slot].user;
+		}
+
 		/// Returns map with all connected users.
 		/// \return All connected users.
 		const std::map<std::string, User *> &getUsers() {
@@ -121,6 +140,18 @@ class UserManager /*: public Swift::EntityCapsProvider*/ {
 			return m_component;
 		}
 
+		/// Returns RosterFlusher storing rosters of all users.
+		/// \return RosterFlusher or NULL if there is no StorageBackend.
+		RosterFlusher *getRosterFlusher() {
+			return m_rosterFlusher;
+		}
+
+		/// Returns OnlineUsersFlusher storing online state of users.
+		/// \return OnlineUsersFlusher or NULL if there is no StorageBackend.
+		OnlineUsersFlusher *getOnlineUsersFlusher() {
+			return m_onlineUsersFlusher;
+		}
+
 		/// Connects user manually.
 		/// \param user JID of user.
 		void connectUser(const Swift::JID &user);
@@ -138,6 +169,13 @@ class UserManager /*: public Swift::EntityCapsProvider*/ {
 
 	private:
 		void handlePresence(Swift::Presence::ref presence);
+		void handleLoginUserInfo(Swift::Presence::ref presence, bool registered, UserInfo res);
+		void handleLoginUserRegistered(Swift::Presence::ref presence, bool registered, UserInfo res);
+		void handleLoginTransportEnabled(Swift::Presence::ref presence, UserInfo res, const std::string &value);
+		void handleLoginRoster(Swift::Presence::ref presence, UserInfo res, const std::list<BuddyInfo> &roster);
+		void finishLogin(Swift::Presence::ref presence, bool created);
+		void handleUserPresence(Swift::Presence::ref presence);
+		void handleSubscribeUserInfo(Swift::Presence::ref presence, bool registered);
 		void handleMessageReceived(Swift::Message::ref message);
 		void handleGeneralPresenceReceived(Swift::Presence::ref presence);
 		void handleProbePresence(Swift::Presence::ref presence);
@@ -147,12 +185,34 @@ class UserManager /*: public Swift::EntityCapsProvider*/ {
 		void handleRemoveTimeout(const std::string jid, User *user, bool reconnect);
 		void handleDiscoInfo(const Swift::JID& jid, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::DiscoInfo> info);
 		void addUser(User *user);
+		void addSession(User *user);
+		void removeSession(User *user);
+
+		// Session ID is index to m_sessions (+1) in the lower bits and
+		// generation in the upper bits, so the ID of removed user never
+		// matches the next user using the same slot.
+		enum {
+			SESSION_SLOT_BITS = 20,
+			SESSION_SLOT_MASK = (1 << SESSION_SLOT_BITS) - 1
+		};
+
+		struct Session {
+			User *user;
+			unsigned int id;
+		};
 
 		long m_onlineBuddies;
 		User *m_cachedUser;
 		std::map<std::string, User *> m_users;
+		std::vector<Session> m_sessions;
+		std::vector<unsigned int> m_freeSessions;
 		Component *m_component;
 		StorageBackend *m_storageBackend;
+		AsyncStorageBackend *m_asyncStorage;
+		RosterFlusher *m_rosterFlusher;
+		OnlineUsersFlusher *m_onlineUsersFlusher;
+		// Presences received while the user is being loaded from the database.
+		std::map<std::string, std::list<Swift::Presence::ref> > m_pendingLogins;
 		StorageResponder *m_storageResponder;
 		UserRegistry *m_userRegistry;
 		Swift::Timer::ref m_removeTimer;
@@ -23,8 +23,10 @@
 #include "transport/User.h"
 #include "transport/Transport.h"
 #include "transport/StorageBackend.h"
+#include "transport/CachingStorageBackend.h"
 #include "transport/UserManager.h"
 #include "transport/NetworkPluginServer.h"
+#include "transport/IQRouteTable.h"
 #include "transport/Logging.h"
 #include "transport/UserRegistration.h"
 #include "transport/Frontend.h"
@@ -304,6 +306,178 @@ class HasOnlineUserCommand : public AdminInterfaceCommand {
 		UserManager *m_userManager;
 };
 
+class BackendsQueueSizeCommand : public AdminInterfaceCommand {
+	public:
+
+		BackendsQueueSizeCommand(NetworkPluginServer *server) :
+												AdminInterfaceCommand("backends_queue_size",
+												AdminInterfaceCommand::Backends,
+												AdminInterfaceCommand::GlobalContext,
+												AdminInterfaceCommand::AdminMode,
+												AdminInterfaceCommand::Get) {
+			m_server = server;
+			setDescription("Number of bytes queued for all backends");
+		}
+
+		virtual std::string handleGetRequest(UserInfo &uinfo, User *user, std::vector<std::string> &args) {
+			std::string ret = AdminInterfaceCommand::handleGetRequest(uinfo, user, args);
+			if (!ret.empty()) {
+				return ret;
+			}
+
+			unsigned long queued = 0;
+			const std::list <NetworkPluginServer::Backend *> &backends = m_server->getBackends();
+			BOOST_FOREACH(NetworkPluginServer::Backend * backend, backends) {
+				queued += backend->queued;
+			}
+
+			return boost::lexical_cast<std::string>(queued);
+		}
+
+	private:
+		NetworkPluginServer *m_server;
+};
+
+class QueueSizePerBackendCommand : public AdminInterfaceCommand {
+	public:
+
+		QueueSizePerBackendCommand(NetworkPluginServer *server) :
+												AdminInterfaceCommand("queue_size_per_backend",
+												AdminInterfaceCommand::Backends,
+												AdminInterfaceCommand::GlobalContext,
+												AdminInterfaceCommand::AdminMode,
+												AdminInterfaceCommand::Get) {
+			m_server = server;
+			setDescription("Bytes queued, frames queued and frames dropped per backend");
+		}
+
+		virtual std::string handleGetRequest(UserInfo &uinfo, User *user, std::vector<std::string> &args) {
+			std::string ret = AdminInterfaceCommand::handleGetRequest(uinfo, user, args);
+			if (!ret.empty()) {
+				return ret;
+			}
+
+			std::string lst;
+			int id = 1;
+			const std::list <NetworkPluginServer::Backend *> &backends = m_server->getBackends();
+			BOOST_FOREACH(NetworkPluginServer::Backend * backend, backends) {
+				lst += "Backend " + boost::lexical_cast<std::string>(id) + " (ID=" + backend->id + "): ";
+				lst += boost::lexical_cast<std::string>(backend->queued) + " bytes, ";
+				lst += boost::lexical_cast<std::string>(backend->outputFrames) + " frames, ";
+				lst += boost::lexical_cast<std::string>(backend->shed) + " dropped";
+				lst += backend->congested ? " - congested\n" : "\n";
+				id++;
+			}
+
+			return lst;
+		}
+
+	private:
+		NetworkPluginServer *m_server;
+};
+
+class BackendsCompressionCommand : public AdminInterfaceCommand {
+	public:
+
+		BackendsCompressionCommand(NetworkPluginServer *server) :
+												AdminInterfaceCommand("backends_compression",
+												AdminInterfaceCommand::Backends,
+												AdminInterfaceCommand::GlobalContext,
+												AdminInterfaceCommand::AdminMode,
+												AdminInterfaceCommand::Get) {
+			m_server = server;
+			setDescription("Size of compressed frames exchanged with backends before and after compression");
+		}
+
+		virtual std::string handleGetRequest(UserInfo &uinfo, User *user, std::vector<std::string> &args) {
+			std::string ret = AdminInterfaceCommand::handleGetRequest(uinfo, user, args);
+			if (!ret.empty()) {
+				return ret;
+			}
+
+			unsigned long compressed = 0;
+			unsigned long uncompressed = 0;
+			const std::list <NetworkPluginServer::Backend *> &backends = m_server->getBackends();
+			BOOST_FOREACH(NetworkPluginServer::Backend * backend, backends) {
+				compressed += backend->compressedBytes;
+				uncompressed += backend->uncompressedBytes;
+			}
+
+			return boost::lexical_cast<std::string>(uncompressed) + " bytes compressed to " + boost::lexical_cast<std::string>(compressed) + " bytes";
+		}
+
+	private:
+		NetworkPluginServer *m_server;
+};
+
+class SettingsCacheCommand : public AdminInterfaceCommand {
+	public:
+
+		SettingsCacheCommand(CachingStorageBackend *storageBackend) :
+												AdminInterfaceCommand("settings_cache",
+												AdminInterfaceCommand::General,
+												AdminInterfaceCommand::GlobalContext,
+												AdminInterfaceCommand::AdminMode,
+												AdminInterfaceCommand::Get) {
+			m_storageBackend = storageBackend;
+			setDescription("User and buddy settings cached in memory");
+		}
+
+		virtual std::string handleGetRequest(UserInfo &uinfo, User *user, std::vector<std::string> &args) {
+			std::string ret = AdminInterfaceCommand::handleGetRequest(uinfo, user, args);
+			if (!ret.empty()) {
+				return ret;
+			}
+
+			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> cache = m_storageBackend->getCache();
+			unsigned long hits = cache->getHits();
+			unsigned long misses = cache->getMisses();
+			std::string lst;
+			lst += boost::lexical_cast<std::string>(cache->size()) + " cached, ";
+			lst += boost::lexical_cast<std::string>(hits) + " hits, ";
+			lst += boost::lexical_cast<std::string>(misses) + " misses, ";
+			lst += boost::lexical_cast<std::string>(hits + misses == 0 ? 0 : hits * 100 / (hits + misses)) + "% hit rate, ";
+			lst += boost::lexical_cast<std::string>(cache->getEvicted()) + " evicted";
+			return lst;
+		}
+
+	private:
+		CachingStorageBackend *m_storageBackend;
+};
+
+class IQRoutesCommand : public AdminInterfaceCommand {
+	public:
+
+		IQRoutesCommand(NetworkPluginServer *server) :
+												AdminInterfaceCommand("iq_routes",
+												AdminInterfaceCommand::Backends,
+												AdminInterfaceCommand::GlobalContext,
+												AdminInterfaceCommand::AdminMode,
+												AdminInterfaceCommand::Get) {
+			m_server = server;
+			setDescription("IQs forwarded to backends waiting for response");
+		}
+
+		virtual std::string handleGetRequest(UserInfo &uinfo, User *user, std::vector<std::string> &args) {
+			std::string ret = AdminInterfaceCommand::handleGetRequest(uinfo, user, args);
+			if (!ret.empty()) {
+				return ret;
+			}
+
+			IQRouteTable *routes = m_server->getIQRouteTable();
+			std::string lst;
+			lst += boost::lexical_cast<std::string>(routes->size()) + " waiting, ";
+			lst += boost::lexical_cast<std::string>(routes->getHits()) + " routed, ";
+			lst += boost::lexical_cast<std::string>(routes->getMisses()) + " unknown, ";
+			lst += boost::lexical_cast<std::string>(routes->getExpired()) + " expired, ";
+			lst += boost::lexical_cast<std::string>(routes->getEvicted()) + " evicted";
+			return lst;
+		}
+
+	private:
+		NetworkPluginServer *m_server;
+};
+
 class ResMemoryCommand : public AdminInterfaceCommand {
 	public:
 		
@@ -1096,6 +1270,10 @@ AdminInterface::AdminInterface(Component *component, UserManager *userManager, N
 // 	addCommand(new OnlineUsersPerBackendCommand(m_server));
 	addCommand(new HasOnlineUserCommand(m_userManager));
 	addCommand(new BackendsCountCommand(m_server));
+	addCommand(new BackendsQueueSizeCommand(m_server));
+	addCommand(new QueueSizePerBackendCommand(m_server));
+	addCommand(new IQRoutesCommand(m_server));
+	addCommand(new BackendsCompressionCommand(m_server));
 	addCommand(new ResMemoryCommand(m_server));
 	addCommand(new ShrMemoryCommand(m_server));
 	addCommand(new UsedMemoryCommand(m_server));
@@ -1115,6 +1293,11 @@ AdminInterface::AdminInterface(Component *component, UserManager *userManager, N
 	addCommand(new CommandsCommand(&m_commands));
 	addCommand(new VariablesCommand(&m_commands));
 
+	CachingStorageBackend *cachingBackend = dynamic_cast<CachingStorageBackend *>(m_storageBackend);
+	if (cachingBackend) {
+		addCommand(new SettingsCacheCommand(cachingBackend));
+	}
+
 	if (m_userRegistration) {
 		addCommand(new RegisterCommand(m_userRegistration, m_component));
 		addCommand(new UnregisterCommand(m_userRegistration, m_component));
@@ -0,0 +1,334 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "transport/AsyncStorageBackend.h"
+#include "transport/CachingStorageBackend.h"
+#include "transport/Logging.h"
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <algorithm>
+
+namespace Transport {
+
+DEFINE_LOGGER(logger, "AsyncStorageBackend");
+
+// Idle connections are checked before they are used again, so requests
+// are not sent to connection closed by the server in the meantime.
+#define PING_INTERVAL 30
+
+AsyncStorageBackend::AsyncStorageBackend(Swift::EventLoop *loop, Config *config, StorageBackend *storageBackend, int poolSize) {
+	m_loop = loop;
+	m_config = config;
+	m_storageBackend = storageBackend;
+	m_owner = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner>(new Swift::EventOwner());
+
+	if (storageBackend && !storageBackend->supportsConnectionPool()) {
+		poolSize = 0;
+	}
+
+	for (int i = 0; i < poolSize; i++) {
+		StorageBackend *workerBackend = connectBackend();
+		if (!workerBackend) {
+			break;
+		}
+
+		Worker *worker = new Worker();
+		worker->storageBackend = workerBackend;
+		worker->lastUsed = time(NULL);
+		worker->stop = false;
+		worker->thread = new boost::thread(boost::bind(&AsyncStorageBackend::run, this, worker));
+		m_workers.push_back(worker);
+	}
+
+	if (m_workers.empty()) {
+		LOG4CXX_INFO(logger, "Database requests are executed on the main thread");
+	}
+	else {
+		LOG4CXX_INFO(logger, "Opened " << m_workers.size() << " database connections");
+	}
+}
+
+AsyncStorageBackend::~AsyncStorageBackend() {
+	for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); it++) {
+		{
+			boost::mutex::scoped_lock lock((*it)->mutex);
+			(*it)->stop = true;
+		}
+		(*it)->cond.notify_one();
+		(*it)->thread->join();
+		delete (*it)->thread;
+		delete (*it)->storageBackend;
+		delete *it;
+	}
+
+	m_loop->removeEventsFromOwner(m_owner);
+}
+
+void AsyncStorageBackend::queueJob(unsigned long key, const Job &job) {
+	if (m_workers.empty()) {
+		job(m_storageBackend);
+		return;
+	}
+
+	Worker *worker = m_workers[key % m_workers.size()];
+	{
+		boost::mutex::scoped_lock lock(worker->mutex);
+		worker->jobs.push_back(job);
+	}
+	worker->cond.notify_one();
+}
+
+void AsyncStorageBackend::complete(const boost::function<void ()> &callback) {
+	if (m_workers.empty()) {
+		callback();
+		return;
+	}
+	m_loop->postEvent(callback, m_owner);
+}
+
+StorageBackend *AsyncStorageBackend::connectBackend() {
+	std::string error;
+	StorageBackend *storageBackend = StorageBackend::createBackend(m_config, error);
+	if (!storageBackend) {
+		if (!error.empty()) {
+			LOG4CXX_ERROR(logger, "Can't create database connection: " << error);
+		}
+		return NULL;
+	}
+
+	if (!storageBackend->connect()) {
+		LOG4CXX_ERROR(logger, "Can't connect to database");
+		delete storageBackend;
+		return NULL;
+	}
+
+	// Connections share the settings cache of the main StorageBackend, so
+	// settings changed by one of them are not stale in the others.
+	CachingStorageBackend *cachingBackend = dynamic_cast<CachingStorageBackend *>(m_storageBackend);
+	if (cachingBackend) {
+		storageBackend = new CachingStorageBackend(storageBackend, cachingBackend->getCache());
+	}
+	return storageBackend;
+}
+
+void AsyncStorageBackend::checkConnection(Worker *worker) {
+	time_t now = time(NULL);
+	if (now - worker->lastUsed < PING_INTERVAL) {
+		worker->lastUsed = now;
+		return;
+	}
+	worker->lastUsed = now;
+
+	if (worker->storageBackend->ping()) {
+		return;
+	}
+
+	LOG4CXX_WARN(logger, "Database connection is broken, replacing it");
+	StorageBackend *storageBackend = connectBackend();
+	if (!storageBackend) {
+		// Requests are executed anyway, so their callbacks are called. Next
+		// requests try to replace the connection again.
+		worker->lastUsed = 0;
+		return;
+	}
+
+	delete worker->storageBackend;
+	worker->storageBackend = storageBackend;
+}
+
+void AsyncStorageBackend::run(Worker *worker) {
+	std::list<Job> jobs;
+
+	while (true) {
+		bool stop;
+		{
+			boost::mutex::scoped_lock lock(worker->mutex);
+			while (worker->jobs.empty() && !worker->stop) {
+				worker->cond.wait(lock);
+			}
+			stop = worker->stop;
+			jobs.swap(worker->jobs);
+		}
+
+		if (!jobs.empty()) {
+			checkConnection(worker);
+		}
+
+		// Queued writes are executed even when stopping, so for example
+		// users are marked offline on shutdown.
+		for (std::list<Job>::iterator it = jobs.begin(); it != jobs.end(); it++) {
+			(*it)(worker->storageBackend);
+		}
+		jobs.clear();
+
+		if (stop) {
+			return;
+		}
+	}
+}
+
+void AsyncStorageBackend::getUser(const std::string &barejid, UserCallback callback) {
+	queueJob(boost::hash<std::string>()(barejid), boost::bind(&AsyncStorageBackend::doGetUser, this, _1, barejid, callback));
+}
+
+void AsyncStorageBackend::setUser(const UserInfo &user, UserCallback callback) {
+	queueJob(boost::hash<std::string>()(user.jid), boost::bind(&AsyncStorageBackend::doSetUser, this, _1, user, callback));
+}
+
+void AsyncStorageBackend::setUserOnline(long id, bool online) {
+	queueJob(id, boost::bind(&StorageBackend::setUserOnline, _1, id, online));
+}
+
+void AsyncStorageBackend::setUsersOnline(const std::vector<long> &ids, bool online, StoreCallback callback) {
+	// Split the same way as requests of single user, see storeBuddies().
+	size_t count = std::max(m_workers.size(), (size_t) 1);
+	std::vector<std::vector<long> > parts(count);
+	for (std::vector<long>::const_iterator it = ids.begin(); it != ids.end(); it++) {
+		parts[(unsigned long) *it % count].push_back(*it);
+	}
+
+	StoreRequestRef request(new StoreRequest());
+	request->pending = 0;
+	request->stored = true;
+	request->callback = callback;
+	for (size_t i = 0; i < count; i++) {
+		if (!parts[i].empty()) {
+			request->pending++;
+		}
+	}
+
+	if (request->pending == 0) {
+		callback(true);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (!parts[i].empty()) {
+			queueJob(i, boost::bind(&AsyncStorageBackend::doSetUsersOnline, this, _1, parts[i], online, request));
+		}
+	}
+}
+
+void AsyncStorageBackend::getUserSetting(long userId, const std::string &variable, int type, const std::string &value, SettingCallback callback) {
+	queueJob(userId, boost::bind(&AsyncStorageBackend::doGetUserSetting, this, _1, userId, variable, type, value, callback));
+}
+
+void AsyncStorageBackend::getBuddies(long id, BuddiesCallback callback) {
+	queueJob(id, boost::bind(&AsyncStorageBackend::doGetBuddies, this, _1, id, callback));
+}
+
+void AsyncStorageBackend::storeBuddies(const std::list<std::pair<long, BuddyInfo> > &buddies, StoreBuddiesCallback callback) {
+	// Requests of single user are assigned to the connection by the user ID,
+	// so the buddies are split the same way.
+	size_t count = std::max(m_workers.size(), (size_t) 1);
+	std::vector<std::list<std::pair<long, BuddyInfo> > > parts(count);
+	std::vector<std::vector<size_t> > positions(count);
+	size_t position = 0;
+	for (std::list<std::pair<long, BuddyInfo> >::const_iterator it = buddies.begin(); it != buddies.end(); it++, position++) {
+		size_t part = (unsigned long) it->first % count;
+		parts[part].push_back(*it);
+		positions[part].push_back(position);
+	}
+
+	StoreBuddiesRequestRef request(new StoreBuddiesRequest());
+	request->buddies.assign(buddies.begin(), buddies.end());
+	request->pending = 0;
+	request->stored = true;
+	request->callback = callback;
+	for (size_t i = 0; i < count; i++) {
+		if (!parts[i].empty()) {
+			request->pending++;
+		}
+	}
+
+	if (request->pending == 0) {
+		callback(true, buddies);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (!parts[i].empty()) {
+			queueJob(i, boost::bind(&AsyncStorageBackend::doStoreBuddies, this, _1, parts[i], positions[i], request));
+		}
+	}
+}
+
+void AsyncStorageBackend::removeBuddy(long userId, long id) {
+	queueJob(userId, boost::bind(&StorageBackend::removeBuddy, _1, id));
+}
+
+void AsyncStorageBackend::doGetUser(StorageBackend *storageBackend, const std::string &barejid, UserCallback callback) {
+	UserInfo user;
+	bool registered = storageBackend->getUser(barejid, user);
+	complete(boost::bind(callback, registered, user));
+}
+
+void AsyncStorageBackend::doSetUser(StorageBackend *storageBackend, const UserInfo &user, UserCallback callback) {
+	storageBackend->setUser(user);
+	doGetUser(storageBackend, user.jid, callback);
+}
+
+void AsyncStorageBackend::doGetUserSetting(StorageBackend *storageBackend, long userId, const std::string &variable, int type, const std::string &value, SettingCallback callback) {
+	std::string v = value;
+	storageBackend->getUserSetting(userId, variable, type, v);
+	complete(boost::bind(callback, v));
+}
+
+void AsyncStorageBackend::doGetBuddies(StorageBackend *storageBackend, long id, BuddiesCallback callback) {
+	std::list<BuddyInfo> roster;
+	storageBackend->getBuddies(id, roster);
+	complete(boost::bind(callback, roster));
+}
+
+void AsyncStorageBackend::doStoreBuddies(StorageBackend *storageBackend, std::list<std::pair<long, BuddyInfo> > buddies, const std::vector<size_t> &positions, StoreBuddiesRequestRef request) {
+	bool stored = storageBackend->storeBuddies(buddies);
+	complete(boost::bind(&AsyncStorageBackend::handleBuddiesStored, this, stored, buddies, positions, request));
+}
+
+void AsyncStorageBackend::doSetUsersOnline(StorageBackend *storageBackend, const std::vector<long> &ids, bool online, StoreRequestRef request) {
+	bool stored = storageBackend->setUsersOnline(ids, online);
+	complete(boost::bind(&AsyncStorageBackend::handleStored, this, stored, request));
+}
+
+void AsyncStorageBackend::handleStored(bool stored, StoreRequestRef request) {
+	request->stored = request->stored && stored;
+	if (--request->pending == 0) {
+		request->callback(request->stored);
+	}
+}
+
+void AsyncStorageBackend::handleBuddiesStored(bool stored, const std::list<std::pair<long, BuddyInfo> > &buddies, const std::vector<size_t> &positions, StoreBuddiesRequestRef request) {
+	// Even failed store could add some buddies, so their IDs are returned too.
+	std::vector<size_t>::const_iterator position = positions.begin();
+	for (std::list<std::pair<long, BuddyInfo> >::const_iterator it = buddies.begin(); it != buddies.end(); it++, position++) {
+		request->buddies[*position].second.id = it->second.id;
+	}
+
+	request->stored = request->stored && stored;
+	if (--request->pending != 0) {
+		return;
+	}
+
+	std::list<std::pair<long, BuddyInfo> > result(request->buddies.begin(), request->buddies.end());
+	request->callback(request->stored, result);
+}
+
+}
@@ -0,0 +1,200 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "transport/BackendDecoder.h"
+#include "transport/NetworkFrameBuffer.h"
+#include "transport/Logging.h"
+#include "transport/protocol.pb.h"
+#include <boost/bind.hpp>
+
+namespace Transport {
+
+DEFINE_LOGGER(logger, "BackendDecoder");
+
+BackendDecoder::BackendDecoder(Swift::EventLoop *loop, int threads, FrameHandler handler) : m_frames(1024) {
+	m_loop = loop;
+	m_handler = handler;
+	m_nextId = 0;
+	m_owner = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner>(new Swift::EventOwner());
+
+	LOG4CXX_INFO(logger, "Starting " << threads << " backend decoder threads");
+	for (int i = 0; i < threads; i++) {
+		Worker *worker = new Worker();
+		worker->stop = false;
+		worker->thread = new boost::thread(boost::bind(&BackendDecoder::run, this, worker));
+		m_workers.push_back(worker);
+	}
+}
+
+BackendDecoder::~BackendDecoder() {
+	for (std::vector<Worker *>::iterator it = m_workers.begin(); it != m_workers.end(); it++) {
+		{
+			boost::mutex::scoped_lock lock((*it)->mutex);
+			(*it)->stop = true;
+		}
+		(*it)->cond.notify_one();
+		(*it)->thread->join();
+		delete (*it)->thread;
+		delete *it;
+	}
+
+	m_loop->removeEventsFromOwner(m_owner);
+
+	Frame *frame;
+	while (m_frames.pop(frame)) {
+		delete frame;
+	}
+}
+
+void BackendDecoder::addBackend(NetworkPluginServer::Backend *c) {
+	unsigned long id = m_nextId++;
+	m_ids[c] = id;
+	m_backends[id] = c;
+}
+
+void BackendDecoder::removeBackend(NetworkPluginServer::Backend *c) {
+	std::map<NetworkPluginServer::Backend *, unsigned long>::iterator it = m_ids.find(c);
+	if (it == m_ids.end()) {
+		return;
+	}
+
+	// Let the thread free the receive buffer of this backend.
+	Chunk chunk;
+	chunk.id = it->second;
+	chunk.remove = true;
+	queueChunk(chunk);
+
+	m_backends.erase(it->second);
+	m_ids.erase(it);
+}
+
+void BackendDecoder::decode(NetworkPluginServer::Backend *c, const Swift::SafeByteArray &data) {
+	std::map<NetworkPluginServer::Backend *, unsigned long>::iterator it = m_ids.find(c);
+	if (it == m_ids.end()) {
+		return;
+	}
+
+	Chunk chunk;
+	chunk.id = it->second;
+	chunk.data.assign((const char *) &data[0], data.size());
+	chunk.remove = false;
+	queueChunk(chunk);
+}
+
+void BackendDecoder::queueChunk(const Chunk &chunk) {
+	Worker *worker = getWorker(chunk.id);
+	{
+		boost::mutex::scoped_lock lock(worker->mutex);
+		worker->chunks.push_back(chunk);
+	}
+	worker->cond.notify_one();
+}
+
+void BackendDecoder::run(Worker *worker) {
+	// Receive buffers of backends served by this thread.
+	std::map<unsigned long, NetworkFrameBuffer> buffers;
+	pbnetwork::WrapperMessage wrapper;
+	std::list<Chunk> chunks;
+
+	while (true) {
+		{
+			boost::mutex::scoped_lock lock(worker->mutex);
+			while (worker->chunks.empty() && !worker->stop) {
+				worker->cond.wait(lock);
+			}
+			if (worker->stop) {
+				return;
+			}
+			chunks.swap(worker->chunks);
+		}
+
+		bool decoded = false;
+		for (std::list<Chunk>::iterator it = chunks.begin(); it != chunks.end(); it++) {
+			if (it->remove) {
+				buffers.erase(it->id);
+				continue;
+			}
+
+			NetworkFrameBuffer &buffer = buffers[it->id];
+			buffer.append(it->data);
+
+			const char *data;
+			unsigned int size;
+			int type;
+			while (buffer.nextFrame(data, size, type)) {
+				Frame *frame = new Frame();
+				frame->id = it->id;
+				frame->compressedSize = 0;
+				if (type == -1) {
+					if (wrapper.ParseFromArray(data, size) == false) {
+						LOG4CXX_ERROR(logger, "Parsing error, frame size " << size);
+						delete frame;
+						continue;
+					}
+					frame->type = wrapper.type();
+					frame->payload.swap(*wrapper.mutable_payload());
+				}
+				else if (type & NETWORK_FRAME_COMPRESSED) {
+					frame->type = type & ~NETWORK_FRAME_COMPRESSED;
+					frame->compressedSize = size;
+					if (!NetworkFrameBuffer::decompress(data, size, frame->payload)) {
+						LOG4CXX_ERROR(logger, "Invalid compressed frame, size " << size);
+						delete frame;
+						continue;
+					}
+				}
+				else {
+					frame->type = type;
+					frame->payload.assign(data, size);
+				}
+				m_frames.push(frame);
+				decoded = true;
+			}
+		}
+		chunks.clear();
+
+		// Single event delivers everything decoded so far, so the main loop
+		// handles the frames in batches.
+		if (decoded) {
+			m_loop->postEvent(boost::bind(&BackendDecoder::deliverFrames, this), m_owner);
+		}
+	}
+}
+
+void BackendDecoder::deliverFrames() {
+	Frame *frame;
+	while (m_frames.pop(frame)) {
+		// Backend could have been removed by one of the previous frames.
+		std::map<unsigned long, NetworkPluginServer::Backend *>::iterator it = m_backends.find(frame->id);
+		if (it != m_backends.end()) {
+			// Counters are updated here, so the backend is touched only by
+			// the main thread.
+			if (frame->compressedSize != 0) {
+				it->second->compressedBytes += frame->compressedSize;
+				it->second->uncompressedBytes += frame->payload.size();
+			}
+			m_handler(it->second, frame->type, frame->payload);
+		}
+		delete frame;
+	}
+}
+
+}
@@ -0,0 +1,131 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "transport/BackendPool.h"
+
+namespace Transport {
+
+// Uses the newest backend until it's full, which is how Spectrum always
+// placed users. Backends without users are used last, so the idle backends
+// kept by service.idle_backends are not taken while others have room.
+class FirstFitPlacement : public BackendPlacement {
+	public:
+		double getScore(const NetworkPluginServer::Backend *c) {
+			return c->users.empty() && c->incoming == 0 ? 1 : 0;
+		}
+};
+
+// Spreads users evenly across backends.
+class LeastLoadedPlacement : public BackendPlacement {
+	public:
+		double getScore(const NetworkPluginServer::Backend *c) {
+			return c->users.size() + c->incoming;
+		}
+};
+
+// Prefers the backend which is expected to use the least memory after
+// adding another user. Memory per user is estimated from the memory the
+// backend allocated since it started.
+class MemoryWeightedPlacement : public BackendPlacement {
+	public:
+		double getScore(const NetworkPluginServer::Backend *c) {
+			double perUser = 0;
+			if (!c->users.empty() && c->res > c->init_res) {
+				perUser = (double) (c->res - c->init_res) / c->users.size();
+			}
+			return c->res + perUser;
+		}
+};
+
+BackendPlacement *BackendPlacement::createPlacement(const std::string &name) {
+	if (name == "first_fit") {
+		return new FirstFitPlacement();
+	}
+	else if (name == "least_loaded") {
+		return new LeastLoadedPlacement();
+	}
+	else if (name == "memory") {
+		return new MemoryWeightedPlacement();
+	}
+	return NULL;
+}
+
+BackendPool::BackendPool(BackendPlacement *placement, unsigned long usersPerBackend) {
+	m_placement = placement;
+	m_usersPerBackend = usersPerBackend;
+	m_order = 0;
+}
+
+BackendPool::~BackendPool() {
+	delete m_placement;
+}
+
+void BackendPool::addBackend(NetworkPluginServer::Backend *c) {
+	Entry &entry = m_entries[c];
+	entry.key.backend = c;
+	entry.key.order = m_order++;
+	entry.indexed = false;
+	updateBackend(c);
+}
+
+void BackendPool::removeBackend(NetworkPluginServer::Backend *c) {
+	std::map<NetworkPluginServer::Backend *, Entry>::iterator it = m_entries.find(c);
+	if (it == m_entries.end()) {
+		return;
+	}
+
+	if (it->second.indexed) {
+		getIndex(it->second.acceptUsers, it->second.longRun).erase(it->second.key);
+	}
+	m_entries.erase(it);
+}
+
+void BackendPool::updateBackend(NetworkPluginServer::Backend *c) {
+	std::map<NetworkPluginServer::Backend *, Entry>::iterator it = m_entries.find(c);
+	if (it == m_entries.end()) {
+		return;
+	}
+
+	Entry &entry = it->second;
+	if (entry.indexed) {
+		getIndex(entry.acceptUsers, entry.longRun).erase(entry.key);
+		entry.indexed = false;
+	}
+
+	if (c->willDie || !c->connection || c->users.size() + c->incoming >= m_usersPerBackend) {
+		return;
+	}
+
+	entry.key.score = m_placement->getScore(c);
+	entry.acceptUsers = c->acceptUsers;
+	entry.longRun = c->longRun;
+	entry.indexed = true;
+	getIndex(entry.acceptUsers, entry.longRun).insert(entry.key);
+}
+
+NetworkPluginServer::Backend *BackendPool::getBackend(bool acceptUsers, bool longRun) {
+	std::set<Key> &index = getIndex(acceptUsers, longRun);
+	if (index.empty()) {
+		return NULL;
+	}
+	return index.begin()->backend;
+}
+
+}
@@ -0,0 +1,339 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "transport/CachingStorageBackend.h"
+#include <limits.h>
+
+namespace Transport {
+
+// Buddy ID of user settings.
+#define USER_SETTING -1
+
+// Type of cached buddy setting which is not in the database.
+#define NO_SETTING -1
+
+bool SettingsCache::Key::operator<(const Key &other) const {
+	if (buddyId != other.buddyId) {
+		return buddyId < other.buddyId;
+	}
+	if (userId != other.userId) {
+		return userId < other.userId;
+	}
+	return variable < other.variable;
+}
+
+SettingsCache::SettingsCache(unsigned long limit) {
+	m_limit = limit;
+	m_version = 0;
+	m_hits = 0;
+	m_misses = 0;
+	m_evicted = 0;
+}
+
+bool SettingsCache::get(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	Key key;
+	key.buddyId = buddyId;
+	key.userId = userId;
+	key.variable = variable;
+
+	SettingMap::iterator it = m_settings.find(key);
+	if (it == m_settings.end()) {
+		m_misses++;
+		return false;
+	}
+
+	m_hits++;
+	type = it->second.type;
+	value = it->second.value;
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	return true;
+}
+
+unsigned long SettingsCache::getVersion() {
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_version;
+}
+
+void SettingsCache::set(long userId, long buddyId, const std::string &variable, int type, const std::string &value, unsigned long version) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	// The value could have been changed in the database after it was read.
+	if (m_limit == 0 || version != m_version) {
+		return;
+	}
+
+	Key key;
+	key.buddyId = buddyId;
+	key.userId = userId;
+	key.variable = variable;
+
+	std::pair<SettingMap::iterator, bool> ret = m_settings.insert(std::make_pair(key, Setting()));
+	Setting &setting = ret.first->second;
+	setting.type = type;
+	setting.value = value;
+	if (!ret.second) {
+		m_lru.splice(m_lru.begin(), m_lru, setting.lru);
+		return;
+	}
+
+	m_lru.push_front(ret.first);
+	setting.lru = m_lru.begin();
+
+	if (m_settings.size() > m_limit) {
+		erase(m_lru.back());
+		m_evicted++;
+	}
+}
+
+bool SettingsCache::update(long userId, long buddyId, const std::string &variable, const std::string &value) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_version++;
+	Key key;
+	key.buddyId = buddyId;
+	key.userId = userId;
+	key.variable = variable;
+
+	SettingMap::iterator it = m_settings.find(key);
+	if (it == m_settings.end()) {
+		return false;
+	}
+
+	it->second.value = value;
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	return true;
+}
+
+void SettingsCache::remove(long userId, long buddyId, const std::string &variable) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_version++;
+	Key key;
+	key.buddyId = buddyId;
+	key.userId = userId;
+	key.variable = variable;
+
+	SettingMap::iterator it = m_settings.find(key);
+	if (it != m_settings.end()) {
+		erase(it);
+	}
+}
+
+void SettingsCache::removeBuddy(long userId, long buddyId) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_version++;
+	Key from;
+	from.buddyId = buddyId;
+	from.userId = userId == -1 ? LONG_MIN : userId;
+	Key to;
+	to.buddyId = userId == -1 ? buddyId + 1 : buddyId;
+	to.userId = userId == -1 ? LONG_MIN : userId + 1;
+	eraseRange(from, to);
+}
+
+void SettingsCache::removeUser(long userId) {
+	boost::mutex::scoped_lock lock(m_mutex);
+	m_version++;
+	// Settings are ordered by buddy ID, so settings of the user are spread
+	// over the whole cache. Users are removed rarely.
+	SettingMap::iterator it = m_settings.begin();
+	while (it != m_settings.end()) {
+		if (it->first.userId == userId) {
+			erase(it++);
+		}
+		else {
+			it++;
+		}
+	}
+}
+
+size_t SettingsCache::size() {
+	boost::mutex::scoped_lock lock(m_mutex);
+	return m_settings.size();
+}
+
+void SettingsCache::erase(SettingMap::iterator it) {
+	m_lru.erase(it->second.lru);
+	m_settings.erase(it);
+}
+
+void SettingsCache::eraseRange(const Key &from, const Key &to) {
+	SettingMap::iterator it = m_settings.lower_bound(from);
+	SettingMap::iterator end = m_settings.lower_bound(to);
+	while (it != end) {
+		erase(it++);
+	}
+}
+
+CachingStorageBackend::CachingStorageBackend(StorageBackend *storageBackend, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> cache) {
+	m_storageBackend = storageBackend;
+	m_cache = cache;
+}
+
+CachingStorageBackend::~CachingStorageBackend() {
+	delete m_storageBackend;
+}
+
+bool CachingStorageBackend::connect() {
+	return m_storageBackend->connect();
+}
+
+bool CachingStorageBackend::ping() {
+	return m_storageBackend->ping();
+}
+
+bool CachingStorageBackend::supportsConnectionPool() {
+	return m_storageBackend->supportsConnectionPool();
+}
+
+bool CachingStorageBackend::createDatabase() {
+	return m_storageBackend->createDatabase();
+}
+
+void CachingStorageBackend::setUser(const UserInfo &user) {
+	m_storageBackend->setUser(user);
+}
+
+bool CachingStorageBackend::getUser(const std::string &barejid, UserInfo &user) {
+	return m_storageBackend->getUser(barejid, user);
+}
+
+bool CachingStorageBackend::setUserOnline(long id, bool online) {
+	return m_storageBackend->setUserOnline(id, online);
+}
+
+bool CachingStorageBackend::setUsersOnline(const std::vector<long> &ids, bool online) {
+	return m_storageBackend->setUsersOnline(ids, online);
+}
+
+bool CachingStorageBackend::removeUser(long id) {
+	bool ret = m_storageBackend->removeUser(id);
+	m_cache->removeUser(id);
+	return ret;
+}
+
+bool CachingStorageBackend::getOnlineUsers(std::vector<std::string> &users) {
+	return m_storageBackend->getOnlineUsers(users);
+}
+
+bool CachingStorageBackend::getUsers(std::vector<std::string> &users) {
+	return m_storageBackend->getUsers(users);
+}
+
+bool CachingStorageBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
+	return m_storageBackend->getBuddies(id, roster);
+}
+
+long CachingStorageBackend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
+	long id = m_storageBackend->addBuddy(userId, buddyInfo);
+	// The ID could belong to removed buddy before.
+	if (id != -1) {
+		m_cache->removeBuddy(userId, id);
+	}
+	return id;
+}
+
+bool CachingStorageBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+	bool ret = m_storageBackend->updateBuddy(userId, buddyInfo);
+	// Settings passed with the buddy are merged into the stored ones.
+	if (!buddyInfo.settings.empty()) {
+		if (buddyInfo.id != -1) {
+			m_cache->removeBuddy(userId, buddyInfo.id);
+		}
+		else {
+			m_cache->removeUser(userId);
+		}
+	}
+	return ret;
+}
+
+void CachingStorageBackend::removeBuddy(long id) {
+	m_storageBackend->removeBuddy(id);
+	m_cache->removeBuddy(-1, id);
+}
+
+bool CachingStorageBackend::storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	bool ret = m_storageBackend->storeBuddies(buddies);
+	// Settings of updated buddies are merged into the stored ones and IDs
+	// of added buddies could belong to removed buddies before.
+	for (std::list<std::pair<long, BuddyInfo> >::const_iterator it = buddies.begin(); it != buddies.end(); it++) {
+		if (it->second.id != -1) {
+			m_cache->removeBuddy(it->first, it->second.id);
+		}
+	}
+	return ret;
+}
+
+bool CachingStorageBackend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+	int cachedType;
+	std::string cachedValue;
+	if (!m_cache->get(userId, buddyId, variable, cachedType, cachedValue)) {
+		unsigned long version = m_cache->getVersion();
+		cachedType = NO_SETTING;
+		if (!m_storageBackend->getBuddySetting(userId, buddyId, variable, cachedType, cachedValue)) {
+			return false;
+		}
+		m_cache->set(userId, buddyId, variable, cachedType, cachedValue, version);
+	}
+
+	// Like in the other backends, type and value are not changed when there
+	// is no such setting.
+	if (cachedType != NO_SETTING) {
+		type = cachedType;
+		value = cachedValue;
+	}
+	return true;
+}
+
+void CachingStorageBackend::updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {
+	// The setting is not stored when the buddy does not exist, so it's
+	// fetched again rather than cached.
+	m_storageBackend->updateBuddySetting(userId, buddyId, variable, type, value);
+	m_cache->remove(userId, buddyId, variable);
+}
+
+bool CachingStorageBackend::getUserSetting(long userId, const std::string &variable, int &type, std::string &value) {
+	if (m_cache->get(userId, USER_SETTING, variable, type, value)) {
+		return true;
+	}
+
+	// The setting is stored with the default value when it does not exist,
+	// so the result is what the database contains.
+	unsigned long version = m_cache->getVersion();
+	if (!m_storageBackend->getUserSetting(userId, variable, type, value)) {
+		return false;
+	}
+	m_cache->set(userId, USER_SETTING, variable, type, value, version);
+	return true;
+}
+
+void CachingStorageBackend::updateUserSetting(long userId, const std::string &variable, const std::string &value) {
+	m_storageBackend->updateUserSetting(userId, variable, value);
+	m_cache->update(userId, USER_SETTING, variable, value);
+}
+
+void CachingStorageBackend::beginTransaction() {
+	m_storageBackend->beginTransaction();
+}
+
+bool CachingStorageBackend::commitTransaction() {
+	return m_storageBackend->commitTransaction();
+}
+
+}
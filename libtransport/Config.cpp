@@ -88,13 +88,31 @@ bool Config::load(std::istream &ifs, boost::program_options::options_description
 		("service.users_per_backend", value<int>()->default_value(100), "Number of users per one legacy network backend")
 		("service.backend_host", value<std::string>()->default_value("localhost"), "Host to bind backend server to")
 		("service.backend_port", value<std::string>()->default_value("0"), "Port to bind backend server to")
+		("service.backend_socket", value<std::string>()->default_value(""), "Path to Unix socket backends connect to instead of backend_host and backend_port. Empty means TCP only.")
+		("service.backend_zygote", value<bool>()->default_value(false), "True if libpurple backends should be forked from single zygote backend instead of being executed one by one.")
+		("service.zygote_socket", value<std::string>()->default_value(""), "Internal, set by Spectrum for the zygote backend.")
+		("service.backend_output_buffer", value<int>()->default_value(65536), "Number of bytes buffered for single backend before they are written without waiting for the end of event loop iteration")
+		("service.backend_queue_high_watermark", value<int>()->default_value(4194304), "Number of bytes queued for single backend after which typing notifications are dropped")
+		("service.backend_queue_low_watermark", value<int>()->default_value(1048576), "Number of bytes queued for single backend under which dropping typing notifications stops")
+		("service.backend_decoder_threads", value<int>()->default_value(0), "Number of threads decoding data received from backends. 0 means data are decoded in the main thread.")
+		("service.backend_compression_threshold", value<int>()->default_value(0), "Frames bigger than this number of bytes are compressed when sent to or from backends. 0 disables the compression.")
+		("service.iq_route_ttl", value<int>()->default_value(120), "Number of seconds after which forwarded IQ without response is forgotten")
+		("service.iq_route_limit", value<int>()->default_value(100000), "Maximum number of forwarded IQs waiting for response")
+		("service.ft_high_watermark", value<int>()->default_value(5000000), "Number of bytes buffered for single file transfer after which backend is asked to stop sending data")
+		("service.ft_low_watermark", value<int>()->default_value(500000), "Number of bytes buffered for single file transfer under which backend is asked to send more data")
+		("service.ft_memory_limit", value<int>()->default_value(8388608), "Number of bytes buffered in memory for single file transfer, more data are stored in temporary file. Should be above service.ft_high_watermark. 0 means no limit.")
 		("service.cert", value<std::string>()->default_value(""), "PKCS#12 Certificate.")
 		("service.cert_password", value<std::string>()->default_value(""), "PKCS#12 Certificate password.")
 		("service.admin_jid", value<std::vector<std::string> >()->multitoken(), "Administrator jid.")
 		("service.admin_password", value<std::string>()->default_value(""), "Administrator password.")
 		("service.reuse_old_backends", value<bool>()->default_value(true), "True if Spectrum should use old backends which were full in the past.")
+		("service.backend_placement", value<std::string>()->default_value("first_fit"), "How users are placed to backends: first_fit, least_loaded or memory.")
+		("service.idle_backends", value<int>()->default_value(0), "Number of started backends without users kept ready for new logins.")
+		("service.max_starting_backends", value<int>()->default_value(4), "Maximum number of backends being started at the same time.")
+		("service.idle_long_running_backends", value<int>()->default_value(0), "Number of started long-running backends without users kept ready for users moved by idle_reconnect_time.")
 		("service.idle_reconnect_time", value<int>()->default_value(0), "Time in seconds after which idle users are reconnected to let their backend die.")
 		("service.memory_collector_time", value<int>()->default_value(0), "Time in seconds after which backend with most memory is set to die.")
+		("service.drain_collected_backend", value<bool>()->default_value(false), "True if users should be moved away from backend set to die by memory_collector_time when backends can resume their sessions without new login.")
 		("service.more_resources", value<bool>()->default_value(false), "Allow more resources to be connected in server mode at the same time.")
 		("service.enable_privacy_lists", value<bool>()->default_value(true), "")
 		("service.enable_xhtml", value<bool>()->default_value(true), "")
@@ -136,6 +154,12 @@ bool Config::load(std::istream &ifs, boost::program_options::options_description
 		("database.prefix", value<std::string>()->default_value(""), "Prefix of tables in database")
 		("database.encryption_key", value<std::string>()->default_value(""), "Encryption key.")
 		("database.vip_statement", value<std::string>()->default_value(""), "Encryption key.")
+		("database.pool_size", value<int>()->default_value(1), "Number of database connections executing database requests of logging in users. 0 executes them on the main thread.")
+		("database.roster_flush_interval", value<int>()->default_value(5), "Time in seconds after which changed buddies of all users are stored.")
+		("database.roster_flush_size", value<int>()->default_value(1000), "Number of changed buddies which are stored at once.")
+		("database.online_flush_interval", value<int>()->default_value(5), "Time in seconds after which changed online state of users is stored.")
+		("database.online_journal", value<std::string>()->default_value("online.journal"), "Journal of online state changes which have not been stored yet. Relative to service.working_dir. Empty disables it.")
+		("database.settings_cache_size", value<int>()->default_value(0), "Number of user and buddy settings cached in memory. 0 disables the cache.")
 		("logging.config", value<std::string>()->default_value(""), "Path to log4cxx config file which is used for Spectrum 2 instance")
 		("logging.backend_config", value<std::string>()->default_value(""), "Path to log4cxx config file which is used for backends")
 		("backend.default_avatar", value<std::string>()->default_value(""), "Full path to default avatar")
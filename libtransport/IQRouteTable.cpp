@@ -0,0 +1,103 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "transport/IQRouteTable.h"
+#include <boost/functional/hash.hpp>
+
+namespace Transport {
+
+size_t IQRouteTable::KeyHash::operator()(const Key &key) const {
+	size_t seed = 0;
+	boost::hash_combine(seed, key.user);
+	boost::hash_combine(seed, key.id);
+	return seed;
+}
+
+IQRouteTable::IQRouteTable(unsigned long ttl, unsigned long limit) {
+	m_ttl = std::max(ttl, 1UL);
+	m_limit = std::max(limit, 1UL);
+	// Route added in the current slot expires when the wheel comes back to
+	// the slot before it.
+	m_wheel.resize(m_ttl + 1);
+	m_slot = 0;
+	m_hits = 0;
+	m_misses = 0;
+	m_expired = 0;
+	m_evicted = 0;
+}
+
+void IQRouteTable::addRoute(const std::string &user, const std::string &id, const std::string &resource) {
+	Key key;
+	key.user = user;
+	key.id = id;
+
+	RouteMap::iterator it = m_routes.find(key);
+	if (it != m_routes.end()) {
+		removeRoute(it);
+	}
+
+	if (m_routes.size() >= m_limit) {
+		removeRoute(m_routes.find(m_lru.front()->first));
+		m_evicted++;
+	}
+
+	RouteMap::value_type *entry = &*m_routes.insert(std::make_pair(key, Route())).first;
+	Route &route = entry->second;
+	route.resource = resource;
+	route.lru = m_lru.insert(m_lru.end(), entry);
+	route.slot = (m_slot + m_ttl) % m_wheel.size();
+	route.timer = m_wheel[route.slot].insert(m_wheel[route.slot].end(), entry);
+}
+
+bool IQRouteTable::takeRoute(const std::string &user, const std::string &id, std::string &resource) {
+	Key key;
+	key.user = user;
+	key.id = id;
+
+	RouteMap::iterator it = m_routes.find(key);
+	if (it == m_routes.end()) {
+		m_misses++;
+		return false;
+	}
+
+	m_hits++;
+	resource = it->second.resource;
+	removeRoute(it);
+	return true;
+}
+
+void IQRouteTable::tick() {
+	m_slot = (m_slot + 1) % m_wheel.size();
+
+	RouteList &expiring = m_wheel[m_slot];
+	while (!expiring.empty()) {
+		removeRoute(m_routes.find(expiring.front()->first));
+		m_expired++;
+	}
+}
+
+void IQRouteTable::removeRoute(RouteMap::iterator it) {
+	m_lru.erase(it->second.lru);
+	m_wheel[it->second.slot].erase(it->second.timer);
+	m_routes.erase(it);
+}
+
+}
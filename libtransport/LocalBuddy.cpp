@@ -78,7 +78,7 @@ void LocalBuddy::setAlias(const std::string &alias) {
 	m_alias = alias;
 
 	if (changed) {
-		getRosterManager()->doUpdateBuddy(this);
+		getRosterManager()->updateBuddy(this);
 		getRosterManager()->storeBuddy(this);
 	}
 }
@@ -96,7 +96,7 @@ void LocalBuddy::setGroups(const std::vector<std::string> &groups) {
 
 	m_groups = groups;
 	if (changed) {
-		getRosterManager()->doUpdateBuddy(this);
+		getRosterManager()->updateBuddy(this);
 		getRosterManager()->storeBuddy(this);
 	}
 }
@@ -0,0 +1,819 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#ifndef _WIN32
+
+#include "transport/LogStorageBackend.h"
+#include "transport/Config.h"
+#include "transport/Logging.h"
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+// Magic written at the beginning of the log file.
+#define LOG_MAGIC "SP2LOG1\n"
+#define LOG_MAGIC_SIZE 8
+
+// Each record is prefixed by 4 bytes of big-endian size and 4 bytes of CRC32.
+#define RECORD_HEADER_SIZE 8
+
+// Changes done outside of a transaction are flushed to the disk at most
+// once per LOG_SYNC_INTERVAL seconds.
+#define LOG_SYNC_INTERVAL 1
+
+// The log is compacted once it contains COMPACT_RATIO times more records
+// than there are live rows, but not before it has COMPACT_MIN_RECORDS records.
+#define COMPACT_RATIO 4
+#define COMPACT_MIN_RECORDS 10000
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+namespace Transport {
+
+DEFINE_LOGGER(logger, "LogStorageBackend");
+
+enum {
+	OP_SET_USER = 1,
+	OP_SET_USER_ONLINE,
+	OP_REMOVE_USER,
+	OP_SET_USER_SETTING,
+	OP_SET_BUDDY,
+	OP_REMOVE_BUDDY
+};
+
+static void putInt(std::string &out, long long value) {
+	for (int i = 7; i >= 0; i--) {
+		out += (char) ((value >> (i * 8)) & 0xff);
+	}
+}
+
+static void putUInt32(std::string &out, unsigned int value) {
+	out += (char) ((value >> 24) & 0xff);
+	out += (char) ((value >> 16) & 0xff);
+	out += (char) ((value >> 8) & 0xff);
+	out += (char) (value & 0xff);
+}
+
+static unsigned int getUInt32(const char *data) {
+	const unsigned char *d = (const unsigned char *) data;
+	return ((unsigned int) d[0] << 24) | ((unsigned int) d[1] << 16) | ((unsigned int) d[2] << 8) | d[3];
+}
+
+static void putString(std::string &out, const std::string &value) {
+	putUInt32(out, value.size());
+	out += value;
+}
+
+static bool getInt(const std::string &in, size_t &pos, long long &value) {
+	if (in.size() - pos < 8) {
+		return false;
+	}
+	value = 0;
+	for (int i = 0; i < 8; i++) {
+		value = (value << 8) | (unsigned char) in[pos++];
+	}
+	return true;
+}
+
+static bool getString(const std::string &in, size_t &pos, std::string &value) {
+	if (in.size() - pos < 4) {
+		return false;
+	}
+	unsigned int size = getUInt32(in.data() + pos);
+	pos += 4;
+	if (in.size() - pos < size) {
+		return false;
+	}
+	value = in.substr(pos, size);
+	pos += size;
+	return true;
+}
+
+static unsigned int checksum(const char *data, size_t size) {
+	boost::crc_32_type crc;
+	crc.process_bytes(data, size);
+	return crc.checksum();
+}
+
+static void putFrame(std::string &out, const std::string &record) {
+	putUInt32(out, record.size());
+	putUInt32(out, checksum(record.data(), record.size()));
+	out += record;
+}
+
+static bool writeAll(int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t written = ::write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+LogStorageBackend::LogStorageBackend(Config *config) {
+	m_config = config;
+	m_path = CONFIG_STRING(m_config, "database.database");
+	m_fd = -1;
+	m_logSize = 0;
+	m_records = 0;
+	m_compactAt = COMPACT_MIN_RECORDS;
+	m_transaction = 0;
+	m_dirty = false;
+	m_lastSync = 0;
+	m_lastUserId = 0;
+	m_lastBuddyId = 0;
+}
+
+LogStorageBackend::~LogStorageBackend() {
+	if (m_fd == -1) {
+		return;
+	}
+
+	if (m_transaction > 0) {
+		LOG4CXX_WARN(logger, "Storing changes of unfinished transaction");
+	}
+	if (!writePending()) {
+		LOG4CXX_ERROR(logger, "Changes which could not be written are lost");
+	}
+	sync(true);
+	close(m_fd);
+}
+
+bool LogStorageBackend::connect() {
+	LOG4CXX_INFO(logger, "Opening database " << m_path);
+	m_fd = open(m_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (m_fd == -1) {
+		LOG4CXX_ERROR(logger, "Can't open " << m_path << ": " << strerror(errno));
+		return false;
+	}
+
+	if (flock(m_fd, LOCK_EX | LOCK_NB) != 0) {
+		LOG4CXX_ERROR(logger, "Can't lock " << m_path << ", it is probably used by another process: " << strerror(errno));
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+
+	std::string data;
+	char buffer[65536];
+	ssize_t size;
+	while ((size = read(m_fd, buffer, sizeof(buffer))) != 0) {
+		if (size < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG4CXX_ERROR(logger, "Can't read " << m_path << ": " << strerror(errno));
+			return false;
+		}
+		data.append(buffer, size);
+	}
+
+	if (data.empty()) {
+		if (!write(std::string(LOG_MAGIC, LOG_MAGIC_SIZE))) {
+			return false;
+		}
+		sync(true);
+		return true;
+	}
+
+	if (data.size() < LOG_MAGIC_SIZE || data.compare(0, LOG_MAGIC_SIZE, LOG_MAGIC) != 0) {
+		LOG4CXX_ERROR(logger, m_path << " is not Spectrum 2 log database");
+		return false;
+	}
+
+	unsigned long valid;
+	if (!replay(data, valid)) {
+		return false;
+	}
+
+	if (valid < data.size()) {
+		// replay() stops early only at the last record, which could be
+		// written when Spectrum 2 or the machine crashed.
+		LOG4CXX_WARN(logger, "Removing " << data.size() - valid << " bytes of incomplete or damaged record from the end of " << m_path);
+		if (ftruncate(m_fd, valid) != 0) {
+			LOG4CXX_ERROR(logger, "Can't truncate " << m_path << ": " << strerror(errno));
+			return false;
+		}
+	}
+	m_logSize = valid;
+
+	LOG4CXX_INFO(logger, "Loaded " << m_users.size() << " users and " << m_buddies.size() << " buddies from " << m_records << " records");
+	m_compactAt = std::max((unsigned long) COMPACT_MIN_RECORDS, getLiveRecords() * COMPACT_RATIO);
+	compactIfNeeded();
+	return true;
+}
+
+bool LogStorageBackend::replay(const std::string &data, unsigned long &valid) {
+	size_t pos = LOG_MAGIC_SIZE;
+	valid = pos;
+	while (data.size() - pos >= RECORD_HEADER_SIZE) {
+		unsigned int size = getUInt32(data.data() + pos);
+		unsigned int crc = getUInt32(data.data() + pos + 4);
+		if (data.size() - pos - RECORD_HEADER_SIZE < size) {
+			break;
+		}
+
+		const char *record = data.data() + pos + RECORD_HEADER_SIZE;
+		if (checksum(record, size) != crc) {
+			// Record torn by a crash is the last one. Damaged record followed
+			// by other ones can't be removed without losing them.
+			if (pos + RECORD_HEADER_SIZE + size != data.size()) {
+				LOG4CXX_ERROR(logger, "Corrupted record at offset " << pos << " of " << m_path << " is followed by "
+					<< data.size() - pos - RECORD_HEADER_SIZE - size << " bytes of other records");
+				return false;
+			}
+			break;
+		}
+
+		if (!apply(std::string(record, size))) {
+			LOG4CXX_ERROR(logger, "Unknown or malformed record at offset " << pos << " of " << m_path);
+			return false;
+		}
+
+		pos += RECORD_HEADER_SIZE + size;
+		valid = pos;
+		m_records++;
+	}
+	return true;
+}
+
+bool LogStorageBackend::apply(const std::string &record) {
+	if (record.empty()) {
+		return false;
+	}
+
+	size_t pos = 1;
+	long long id;
+	if (!getInt(record, pos, id)) {
+		return false;
+	}
+
+	switch (record[0]) {
+		case OP_SET_USER: {
+			UserInfo user;
+			long long vip;
+			user.id = id;
+			if (!getString(record, pos, user.jid) || !getString(record, pos, user.uin)
+				|| !getString(record, pos, user.password) || !getString(record, pos, user.language)
+				|| !getString(record, pos, user.encoding) || !getInt(record, pos, vip)) {
+				return false;
+			}
+			user.vip = vip != 0;
+			doSetUser(user);
+			return true;
+		}
+		case OP_SET_USER_ONLINE: {
+			long long online;
+			if (!getInt(record, pos, online)) {
+				return false;
+			}
+			UserMap::iterator it = m_users.find(id);
+			if (it != m_users.end()) {
+				it->second.online = online != 0;
+			}
+			return true;
+		}
+		case OP_REMOVE_USER:
+			doRemoveUser(id);
+			return true;
+		case OP_SET_USER_SETTING: {
+			std::string variable;
+			long long type;
+			UserSetting setting;
+			if (!getString(record, pos, variable) || !getInt(record, pos, type) || !getString(record, pos, setting.value)) {
+				return false;
+			}
+			setting.type = type;
+			UserMap::iterator it = m_users.find(id);
+			if (it != m_users.end()) {
+				it->second.settings[variable] = setting;
+			}
+			return true;
+		}
+		case OP_SET_BUDDY: {
+			BuddyInfo buddy;
+			long long userId;
+			long long flags;
+			std::string groups;
+			std::string settings;
+			buddy.id = id;
+			if (!getInt(record, pos, userId) || !getString(record, pos, buddy.legacyName)
+				|| !getString(record, pos, buddy.subscription) || !getString(record, pos, buddy.alias)
+				|| !getString(record, pos, groups) || !getInt(record, pos, flags) || !getString(record, pos, settings)) {
+				return false;
+			}
+			buddy.groups = StorageBackend::deserializeGroups(groups);
+			buddy.flags = flags;
+			if (!StorageBackend::deserializeSettings(settings, buddy.settings)) {
+				LOG4CXX_WARN(logger, "Malformed settings of buddy " << buddy.id);
+			}
+			doSetBuddy(userId, buddy);
+			return true;
+		}
+		case OP_REMOVE_BUDDY:
+			doRemoveBuddy(id);
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool LogStorageBackend::write(const std::string &data) {
+	if (!writeAll(m_fd, data.data(), data.size())) {
+		LOG4CXX_ERROR(logger, "Can't write to " << m_path << ": " << strerror(errno));
+		// Remove partially written record, so records appended later are not
+		// hidden behind it when the log is replayed.
+		if (ftruncate(m_fd, m_logSize) != 0) {
+			LOG4CXX_ERROR(logger, "Can't truncate " << m_path << ": " << strerror(errno));
+		}
+		return false;
+	}
+	m_logSize += data.size();
+	m_dirty = true;
+	return true;
+}
+
+bool LogStorageBackend::writePending() {
+	if (m_pending.empty()) {
+		return true;
+	}
+
+	// Failed records are kept, so they are not overtaken by later ones.
+	if (!write(m_pending)) {
+		return false;
+	}
+	m_pending.clear();
+	return true;
+}
+
+bool LogStorageBackend::sync(bool force) {
+	if (!m_dirty) {
+		return true;
+	}
+
+	time_t now = time(NULL);
+	if (!force && now - m_lastSync < LOG_SYNC_INTERVAL) {
+		return true;
+	}
+
+	if (fdatasync(m_fd) != 0) {
+		LOG4CXX_ERROR(logger, "Can't flush " << m_path << ": " << strerror(errno));
+		return false;
+	}
+	m_dirty = false;
+	m_lastSync = now;
+	return true;
+}
+
+bool LogStorageBackend::append(const std::string &record) {
+	m_records++;
+	putFrame(m_pending, record);
+	if (m_transaction > 0) {
+		return true;
+	}
+
+	bool ret = writePending();
+	sync(false);
+	compactIfNeeded();
+	// Compaction writes the queued records too.
+	return ret || m_pending.empty();
+}
+
+unsigned long LogStorageBackend::getLiveRecords() {
+	unsigned long records = m_buddies.size();
+	for (UserMap::const_iterator it = m_users.begin(); it != m_users.end(); it++) {
+		records += 1 + (it->second.online ? 1 : 0) + it->second.settings.size();
+	}
+	return records;
+}
+
+void LogStorageBackend::compactIfNeeded() {
+	if (m_records < m_compactAt || m_transaction > 0) {
+		return;
+	}
+
+	unsigned long live = getLiveRecords();
+	if (live * COMPACT_RATIO > m_records) {
+		// Most of the records are still live, check again once the log grows.
+		m_compactAt = live * COMPACT_RATIO;
+		return;
+	}
+
+	compact();
+}
+
+bool LogStorageBackend::compact() {
+	std::string path = m_path + ".compact";
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	if (fd == -1) {
+		LOG4CXX_ERROR(logger, "Can't open " << path << ": " << strerror(errno));
+		return false;
+	}
+
+	// The new log is locked before it replaces the old one, so no other
+	// process can open it in the meantime.
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		LOG4CXX_ERROR(logger, "Can't lock " << path << ": " << strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	std::string data(LOG_MAGIC, LOG_MAGIC_SIZE);
+	unsigned long records = 0;
+	for (UserMap::const_iterator it = m_users.begin(); it != m_users.end(); it++) {
+		putFrame(data, userRecord(it->second.info));
+		records++;
+		if (it->second.online) {
+			putFrame(data, userOnlineRecord(it->first, true));
+			records++;
+		}
+		for (std::map<std::string, UserSetting>::const_iterator s = it->second.settings.begin(); s != it->second.settings.end(); s++) {
+			putFrame(data, userSettingRecord(it->first, s->first, s->second));
+			records++;
+		}
+	}
+	for (BuddyMap::const_iterator it = m_buddies.begin(); it != m_buddies.end(); it++) {
+		putFrame(data, buddyRecord(it->second.first, it->second.second));
+		records++;
+	}
+
+	if (!writeAll(fd, data.data(), data.size()) || fdatasync(fd) != 0) {
+		LOG4CXX_ERROR(logger, "Can't write " << path << ": " << strerror(errno));
+		close(fd);
+		unlink(path.c_str());
+		return false;
+	}
+
+	// Changes written to the old log since the last sync are in the new one,
+	// so the old log does not have to be flushed.
+	if (rename(path.c_str(), m_path.c_str()) != 0) {
+		LOG4CXX_ERROR(logger, "Can't rename " << path << " to " << m_path << ": " << strerror(errno));
+		close(fd);
+		unlink(path.c_str());
+		return false;
+	}
+
+	std::string::size_type slash = m_path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : m_path.substr(0, slash + 1);
+	int dirFd = open(dir.c_str(), O_RDONLY);
+	if (dirFd != -1) {
+		fsync(dirFd);
+		close(dirFd);
+	}
+
+	LOG4CXX_INFO(logger, "Compacted " << m_path << " from " << m_logSize << " to " << data.size() << " bytes");
+	close(m_fd);
+	m_fd = fd;
+	m_logSize = data.size();
+	m_records = records;
+	m_compactAt = std::max((unsigned long) COMPACT_MIN_RECORDS, records * COMPACT_RATIO);
+	m_dirty = false;
+	// Changes of the current transaction and changes which could not be
+	// written are already in the new log.
+	m_pending.clear();
+	return true;
+}
+
+std::string LogStorageBackend::userRecord(const UserInfo &user) {
+	std::string record(1, (char) OP_SET_USER);
+	putInt(record, user.id);
+	putString(record, user.jid);
+	putString(record, user.uin);
+	putString(record, user.password);
+	putString(record, user.language);
+	putString(record, user.encoding);
+	putInt(record, user.vip);
+	return record;
+}
+
+std::string LogStorageBackend::userOnlineRecord(long id, bool online) {
+	std::string record(1, (char) OP_SET_USER_ONLINE);
+	putInt(record, id);
+	putInt(record, online);
+	return record;
+}
+
+std::string LogStorageBackend::userSettingRecord(long userId, const std::string &variable, const UserSetting &setting) {
+	std::string record(1, (char) OP_SET_USER_SETTING);
+	putInt(record, userId);
+	putString(record, variable);
+	putInt(record, setting.type);
+	putString(record, setting.value);
+	return record;
+}
+
+std::string LogStorageBackend::buddyRecord(long userId, const BuddyInfo &buddy) {
+	std::string record(1, (char) OP_SET_BUDDY);
+	putInt(record, buddy.id);
+	putInt(record, userId);
+	putString(record, buddy.legacyName);
+	putString(record, buddy.subscription);
+	putString(record, buddy.alias);
+	putString(record, StorageBackend::serializeGroups(buddy.groups));
+	putInt(record, buddy.flags);
+	putString(record, StorageBackend::serializeSettings(buddy.settings));
+	return record;
+}
+
+void LogStorageBackend::doSetUser(const UserInfo &user) {
+	UserRow &row = m_users[user.id];
+	if (!row.info.jid.empty() && row.info.jid != user.jid) {
+		m_jids.erase(row.info.jid);
+	}
+	row.info = user;
+	m_jids[user.jid] = user.id;
+	m_lastUserId = std::max(m_lastUserId, (long) user.id);
+}
+
+void LogStorageBackend::doRemoveUser(long id) {
+	UserMap::iterator it = m_users.find(id);
+	if (it != m_users.end()) {
+		m_jids.erase(it->second.info.jid);
+		m_users.erase(it);
+	}
+
+	RosterMap::iterator roster = m_rosters.find(id);
+	if (roster == m_rosters.end()) {
+		return;
+	}
+	for (std::set<long>::const_iterator b = roster->second.begin(); b != roster->second.end(); b++) {
+		BuddyMap::iterator buddy = m_buddies.find(*b);
+		if (buddy != m_buddies.end()) {
+			m_buddyIndex.erase(std::make_pair(id, buddy->second.second.legacyName));
+			m_buddies.erase(buddy);
+		}
+	}
+	m_rosters.erase(roster);
+}
+
+void LogStorageBackend::doSetBuddy(long userId, const BuddyInfo &buddy) {
+	std::pair<long, BuddyInfo> &row = m_buddies[buddy.id];
+	row.first = userId;
+	row.second = buddy;
+	m_buddyIndex[std::make_pair(userId, buddy.legacyName)] = buddy.id;
+	m_rosters[userId].insert(buddy.id);
+	m_lastBuddyId = std::max(m_lastBuddyId, buddy.id);
+}
+
+void LogStorageBackend::doRemoveBuddy(long id) {
+	BuddyMap::iterator it = m_buddies.find(id);
+	if (it == m_buddies.end()) {
+		return;
+	}
+
+	long userId = it->second.first;
+	m_buddyIndex.erase(std::make_pair(userId, it->second.second.legacyName));
+	RosterMap::iterator roster = m_rosters.find(userId);
+	if (roster != m_rosters.end()) {
+		roster->second.erase(id);
+		if (roster->second.empty()) {
+			m_rosters.erase(roster);
+		}
+	}
+	m_buddies.erase(it);
+}
+
+bool LogStorageBackend::ping() {
+	if (m_transaction == 0 && writePending()) {
+		sync(true);
+	}
+	return true;
+}
+
+bool LogStorageBackend::createDatabase() {
+	return true;
+}
+
+void LogStorageBackend::setUser(const UserInfo &user) {
+	UserInfo info = user;
+	JidIndex::const_iterator it = m_jids.find(user.jid);
+	info.id = it == m_jids.end() ? m_lastUserId + 1 : it->second;
+	doSetUser(info);
+	append(userRecord(info));
+}
+
+bool LogStorageBackend::getUser(const std::string &barejid, UserInfo &user) {
+	JidIndex::const_iterator it = m_jids.find(barejid);
+	if (it == m_jids.end()) {
+		return false;
+	}
+	user = m_users[it->second].info;
+	return true;
+}
+
+bool LogStorageBackend::setUserOnline(long id, bool online) {
+	// Like UPDATE matching no row, this is not an error.
+	UserMap::iterator it = m_users.find(id);
+	if (it == m_users.end()) {
+		return true;
+	}
+	it->second.online = online;
+	return append(userOnlineRecord(id, online));
+}
+
+bool LogStorageBackend::getOnlineUsers(std::vector<std::string> &users) {
+	for (UserMap::const_iterator it = m_users.begin(); it != m_users.end(); it++) {
+		if (it->second.online) {
+			users.push_back(it->second.info.jid);
+		}
+	}
+	return true;
+}
+
+bool LogStorageBackend::getUsers(std::vector<std::string> &users) {
+	for (UserMap::const_iterator it = m_users.begin(); it != m_users.end(); it++) {
+		users.push_back(it->second.info.jid);
+	}
+	return true;
+}
+
+bool LogStorageBackend::removeUser(long id) {
+	doRemoveUser(id);
+
+	std::string record(1, (char) OP_REMOVE_USER);
+	putInt(record, id);
+	return append(record);
+}
+
+bool LogStorageBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
+	RosterMap::const_iterator it = m_rosters.find(id);
+	if (it == m_rosters.end()) {
+		return true;
+	}
+
+	for (std::set<long>::const_iterator b = it->second.begin(); b != it->second.end(); b++) {
+		roster.push_back(m_buddies[*b].second);
+	}
+	return true;
+}
+
+long LogStorageBackend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
+	if (m_buddyIndex.find(std::make_pair(userId, buddyInfo.legacyName)) != m_buddyIndex.end()) {
+		LOG4CXX_ERROR(logger, "addBuddy: buddy " << buddyInfo.legacyName << " of user " << userId << " already exists");
+		return -1;
+	}
+
+	BuddyInfo buddy = buddyInfo;
+	buddy.id = m_lastBuddyId + 1;
+	doSetBuddy(userId, buddy);
+	if (!append(buddyRecord(userId, buddy))) {
+		return -1;
+	}
+	return buddy.id;
+}
+
+bool LogStorageBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+	// Like UPDATE matching no row, this is not an error.
+	BuddyIndex::const_iterator it = m_buddyIndex.find(std::make_pair(userId, buddyInfo.legacyName));
+	if (it == m_buddyIndex.end()) {
+		return true;
+	}
+
+	// buddyInfo.settings does not have to contain all settings, so they
+	// are merged into the stored ones.
+	BuddyInfo buddy = buddyInfo;
+	buddy.id = it->second;
+	buddy.settings = m_buddies[buddy.id].second.settings;
+	StorageBackend::mergeSettings(buddy.settings, buddyInfo.settings);
+	doSetBuddy(userId, buddy);
+	return append(buddyRecord(userId, buddy));
+}
+
+void LogStorageBackend::removeBuddy(long id) {
+	doRemoveBuddy(id);
+
+	std::string record(1, (char) OP_REMOVE_BUDDY);
+	putInt(record, id);
+	append(record);
+}
+
+bool LogStorageBackend::storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	// Changes are kept in memory even when they can't be written, so buddies
+	// added by failed call are already in the index.
+	beginTransaction();
+	for (std::list<std::pair<long, BuddyInfo> >::iterator it = buddies.begin(); it != buddies.end(); it++) {
+		BuddyIndex::const_iterator id = m_buddyIndex.find(std::make_pair(it->first, it->second.legacyName));
+		if (id != m_buddyIndex.end()) {
+			it->second.id = id->second;
+			updateBuddy(it->first, it->second);
+		}
+		else {
+			it->second.id = addBuddy(it->first, it->second);
+		}
+	}
+	return commitTransaction();
+}
+
+bool LogStorageBackend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+	BuddyMap::const_iterator it = m_buddies.find(buddyId);
+	if (it == m_buddies.end() || it->second.first != userId) {
+		return true;
+	}
+
+	std::map<std::string, SettingVariableInfo>::const_iterator s = it->second.second.settings.find(variable);
+	if (s != it->second.second.settings.end()) {
+		type = s->second.type;
+		value = s->second.type == TYPE_BOOLEAN ? (s->second.b ? "1" : "0") : s->second.s;
+	}
+	return true;
+}
+
+void LogStorageBackend::updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {
+	BuddyMap::iterator it = m_buddies.find(buddyId);
+	if (it == m_buddies.end() || it->second.first != userId) {
+		return;
+	}
+
+	SettingVariableInfo var;
+	if (!StorageBackend::parseSetting(type, value, var)) {
+		return;
+	}
+	it->second.second.settings[variable] = var;
+	append(buddyRecord(userId, it->second.second));
+}
+
+bool LogStorageBackend::getUserSetting(long userId, const std::string &variable, int &type, std::string &value) {
+	UserMap::iterator it = m_users.find(userId);
+	if (it == m_users.end()) {
+		return true;
+	}
+
+	std::map<std::string, UserSetting>::const_iterator s = it->second.settings.find(variable);
+	if (s != it->second.settings.end()) {
+		type = s->second.type;
+		value = s->second.value;
+		return true;
+	}
+
+	// Unknown setting is stored with the default value, like in other backends.
+	UserSetting &setting = it->second.settings[variable];
+	setting.type = type;
+	setting.value = value;
+	return append(userSettingRecord(userId, variable, setting));
+}
+
+void LogStorageBackend::updateUserSetting(long userId, const std::string &variable, const std::string &value) {
+	UserMap::iterator it = m_users.find(userId);
+	if (it == m_users.end()) {
+		return;
+	}
+
+	std::map<std::string, UserSetting>::iterator s = it->second.settings.find(variable);
+	if (s == it->second.settings.end()) {
+		return;
+	}
+	s->second.value = value;
+	append(userSettingRecord(userId, variable, s->second));
+}
+
+void LogStorageBackend::beginTransaction() {
+	m_transaction++;
+}
+
+bool LogStorageBackend::commitTransaction() {
+	if (m_transaction == 0 || --m_transaction > 0) {
+		return true;
+	}
+
+	bool ret = writePending() && sync(true);
+	compactIfNeeded();
+	// Compaction writes the queued records too.
+	return ret || (m_pending.empty() && !m_dirty);
+}
+
+}
+
+#endif
@@ -201,6 +201,10 @@ void initBackendLogging(Config *config) {
 	redirect_stderr();
 }
 
+void reloadBackendLogging(Config *config) {
+	initLogging(config, "logging.backend_config");
+}
+
 void initMainLogging(Config *config) {
 	initLogging(config, "logging.config");
 	initLogging(config, "logging.backend_config", true);
@@ -224,6 +228,9 @@ void shutdownLogging() {
 void initBackendLogging(Config */*config*/) {
 }
 
+void reloadBackendLogging(Config */*config*/) {
+}
+
 void initMainLogging(Config */*config*/) {
 }
 
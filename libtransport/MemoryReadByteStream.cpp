@@ -19,50 +19,143 @@
  */
 
 #include "transport/MemoryReadBytestream.h"
-#include <boost/foreach.hpp>
+#include "transport/Logging.h"
+#include <algorithm>
 
 namespace Transport {
-	
-MemoryReadBytestream::MemoryReadBytestream(unsigned long size) {
-	neededData = false;
+
+DEFINE_LOGGER(logger, "MemoryReadBytestream");
+
+// Minimal number of bytes loaded from the temporary file at once.
+#define SPILL_LOAD_SIZE 65536
+
+MemoryReadBytestream::MemoryReadBytestream(unsigned long size, unsigned long lowWatermark, unsigned long highWatermark, unsigned long memoryLimit) {
 	m_finished = false;
+	m_paused = false;
+	m_offset = 0;
+	m_buffered = 0;
+	m_memory = 0;
 	m_sent = 0;
 	m_size = size;
+	m_lowWatermark = lowWatermark;
+	m_highWatermark = highWatermark;
+	m_memoryLimit = memoryLimit;
+	m_spill = NULL;
+	m_spillRead = 0;
+	m_spillWrite = 0;
 }
 
 MemoryReadBytestream::~MemoryReadBytestream() {
-	
+	if (m_spill) {
+		fclose(m_spill);
+	}
 }
 
 unsigned long MemoryReadBytestream::appendData(const std::string &data) {
-	m_data += data;
+	if (data.empty()) {
+		return m_buffered;
+	}
+
+	// Once something is in the temporary file, everything has to go there
+	// until it's read, otherwise the data would be reordered.
+	if (!(m_spillWrite > m_spillRead || (m_memoryLimit != 0 && m_memory + data.size() > m_memoryLimit)) || !spill(data)) {
+		m_chunks.push_back(Chunk(new std::vector<unsigned char>(data.begin(), data.end())));
+		m_memory += data.size();
+	}
+	m_buffered += data.size();
+
 	onDataAvailable();
-	neededData = false;
-	return m_data.size();
+
+	if (!m_paused && m_highWatermark != 0 && m_buffered >= m_highWatermark) {
+		m_paused = true;
+		onBufferFull();
+	}
+	return m_buffered;
+}
+
+bool MemoryReadBytestream::spill(const std::string &data) {
+	if (!m_spill) {
+		m_spill = tmpfile();
+		if (!m_spill) {
+			LOG4CXX_ERROR(logger, "Cannot create temporary file, keeping file transfer data in memory");
+			m_memoryLimit = 0;
+			return false;
+		}
+	}
+
+	if (fseek(m_spill, m_spillWrite, SEEK_SET) == 0 && fwrite(data.data(), 1, data.size(), m_spill) == data.size()) {
+		m_spillWrite += data.size();
+		return true;
+	}
+
+	// Move what's already in the file to memory, so the new data can be
+	// appended there.
+	LOG4CXX_ERROR(logger, "Cannot write to temporary file, keeping file transfer data in memory");
+	while (m_spillWrite > m_spillRead) {
+		unsigned long spilled = m_spillWrite - m_spillRead;
+		loadSpilled(spilled);
+		if (m_spillWrite - m_spillRead == spilled) {
+			break;
+		}
+	}
+	fclose(m_spill);
+	m_spill = NULL;
+	m_spillRead = m_spillWrite = 0;
+	m_memoryLimit = 0;
+	return false;
+}
+
+void MemoryReadBytestream::loadSpilled(size_t size) {
+	size = std::min((unsigned long) std::max(size, (size_t) SPILL_LOAD_SIZE), m_spillWrite - m_spillRead);
+	Chunk chunk(new std::vector<unsigned char>(size));
+	if (fseek(m_spill, m_spillRead, SEEK_SET) != 0 || fread(&(*chunk)[0], 1, size, m_spill) != size) {
+		LOG4CXX_ERROR(logger, "Cannot read from temporary file");
+		return;
+	}
+
+	m_chunks.push_back(chunk);
+	m_memory += size;
+	m_spillRead += size;
+	if (m_spillRead == m_spillWrite) {
+		// Everything has been read, so the file can be reused from the start.
+		m_spillRead = m_spillWrite = 0;
+	}
 }
 
 SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> > MemoryReadBytestream::read(size_t size) {
-	if (m_data.empty()) {
-		onDataNeeded();
-		return SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> >(new std::vector<unsigned char>());
+	if (m_chunks.empty() && m_spillWrite > m_spillRead) {
+		loadSpilled(size);
 	}
 
-	if (m_data.size() < size) {
-		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> > ptr(new std::vector<unsigned char>(m_data.begin(), m_data.end()));
-		m_sent += m_data.size();
-		m_data.clear();
-		if (m_sent == m_size)
-			m_finished = true;
-		onDataNeeded();
-		return ptr;
+	if (m_chunks.empty() || size == 0) {
+		return Chunk(new std::vector<unsigned char>());
+	}
+
+	Chunk ptr;
+	Chunk &front = m_chunks.front();
+	size_t available = front->size() - m_offset;
+	if (m_offset == 0 && available <= size) {
+		ptr = front;
+		m_chunks.pop_front();
 	}
-	SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> > ptr(new std::vector<unsigned char>(m_data.begin(), m_data.begin() + size));
-	m_data.erase(m_data.begin(), m_data.begin() + size);
-	m_sent += size;
+	else {
+		size = std::min(size, available);
+		ptr = Chunk(new std::vector<unsigned char>(front->begin() + m_offset, front->begin() + m_offset + size));
+		m_offset += size;
+		if (m_offset == front->size()) {
+			m_chunks.pop_front();
+			m_offset = 0;
+		}
+	}
+
+	m_memory -= ptr->size();
+	m_buffered -= ptr->size();
+	m_sent += ptr->size();
 	if (m_sent == m_size)
 		m_finished = true;
-	if (m_data.size() < 500000 && !neededData) {
-		neededData = true;
+
+	if (m_paused && m_buffered <= m_lowWatermark) {
+		m_paused = false;
 		onDataNeeded();
 	}
 	return ptr;
@@ -24,8 +24,11 @@
 #include "transport/Util.h"
 #include "transport/Logging.h"
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
-#define MYSQL_DB_VERSION 2
+#define MYSQL_DB_VERSION 3
+// Maximum number of buddies written by single statement in storeBuddies().
+#define BULK_SIZE 500
 #define CHECK_DB_RESPONSE(stmt) \
 	if(stmt) { \
 		sqlite3_EXEC(m_db, "ROLLBACK;", NULL, NULL, NULL); \
@@ -75,7 +78,7 @@
 	{\
 	int ret = STMT->execute(); \
 	if (ret == 0) \
-		exec_ok = true; \
+		m_execOk = true; \
 	else if (ret == 2013) { \
 		LOG4CXX_INFO(logger, "MySQL connection lost. Reconnecting...");\
 		disconnect(); \
@@ -83,13 +86,12 @@
 		return METHOD; \
 	} \
 	else \
-		exec_ok = false; \
+		m_execOk = false; \
 	}
 
 namespace Transport {
 
 DEFINE_LOGGER(logger, "MySQLBackend");
-static bool exec_ok;
 
 MySQLBackend::Statement::Statement(MYSQL *conn, const std::string &format, const std::string &statement) {
 	m_resultOffset = -1;
@@ -269,9 +271,8 @@ MySQLBackend::Statement& MySQLBackend::Statement::operator >> (std::string& t) {
 MySQLBackend::MySQLBackend(Config *config) {
 	m_config = config;
 	m_prefix = CONFIG_STRING(m_config, "database.prefix");
-	mysql_init(&m_conn);
-	my_bool my_true = 1;
-	mysql_options(&m_conn, MYSQL_OPT_RECONNECT, &my_true);
+	m_connected = false;
+	m_execOk = false;
 }
 
 MySQLBackend::~MySQLBackend(){
@@ -279,19 +280,20 @@ MySQLBackend::~MySQLBackend(){
 }
 
 void MySQLBackend::disconnect() {
+	if (!m_connected) {
+		return;
+	}
+
 	LOG4CXX_INFO(logger, "Disconnecting");
 	delete m_setUser;
 	delete m_getUser;
 	delete m_removeUser;
 	delete m_removeUserBuddies;
 	delete m_removeUserSettings;
-	delete m_removeUserBuddiesSettings;
 	delete m_addBuddy;
 	delete m_removeBuddy;
-	delete m_removeBuddySettings;
 	delete m_updateBuddy;
 	delete m_getBuddies;
-	delete m_getBuddiesSettings;
 	delete m_getUserSetting;
 	delete m_setUserSetting;
 	delete m_updateUserSetting;
@@ -301,6 +303,21 @@ void MySQLBackend::disconnect() {
 	delete m_getOnlineUsers;
 	delete m_getUsers;
 	mysql_close(&m_conn);
+	m_connected = false;
+}
+
+bool MySQLBackend::ping() {
+	if (!m_connected) {
+		return false;
+	}
+
+	// MYSQL_OPT_RECONNECT reconnects silently, but the prepared statements
+	// are lost together with the old connection.
+	unsigned long id = mysql_thread_id(&m_conn);
+	if (mysql_ping(&m_conn)) {
+		return false;
+	}
+	return mysql_thread_id(&m_conn) == id;
 }
 
 bool MySQLBackend::connect() {
@@ -309,14 +326,22 @@ bool MySQLBackend::connect() {
 		", port " << CONFIG_INT(m_config, "database.port")
 	);
 
+	// The handle is initialized here, so the connection can be established
+	// again after disconnect().
+	mysql_init(&m_conn);
+	my_bool my_true = 1;
+	mysql_options(&m_conn, MYSQL_OPT_RECONNECT, &my_true);
+
 	if (!mysql_real_connect(&m_conn, CONFIG_STRING(m_config, "database.server").c_str(),
 					   CONFIG_STRING(m_config, "database.user").c_str(),
 					   CONFIG_STRING(m_config, "database.password").c_str(),
 					   CONFIG_STRING(m_config, "database.database").c_str(),
 					   CONFIG_INT(m_config, "database.port"), NULL, 0)) {
 		LOG4CXX_ERROR(logger, "Can't connect database: " << mysql_error(&m_conn));
+		mysql_close(&m_conn);
 		return false;
 	}
+	m_connected = true;
 
 	if (!mysql_set_character_set(&m_conn, "utf8")) {
 		LOG4CXX_INFO(logger, "New client character set: " << mysql_character_set_name(&m_conn));
@@ -330,16 +355,13 @@ bool MySQLBackend::connect() {
 	m_removeUser = new Statement(&m_conn, "i", "DELETE FROM " + m_prefix + "users WHERE id=?");
 	m_removeUserBuddies = new Statement(&m_conn, "i", "DELETE FROM " + m_prefix + "buddies WHERE user_id=?");
 	m_removeUserSettings = new Statement(&m_conn, "i", "DELETE FROM " + m_prefix + "users_settings WHERE user_id=?");
-	m_removeUserBuddiesSettings = new Statement(&m_conn, "i", "DELETE FROM " + m_prefix + "buddies_settings WHERE user_id=?");
 
-	m_addBuddy = new Statement(&m_conn, "issssi", "INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags) VALUES (?, ?, ?, ?, ?, ?)");
+	m_addBuddy = new Statement(&m_conn, "issssis", "INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES (?, ?, ?, ?, ?, ?, ?)");
 	m_removeBuddy = new Statement(&m_conn, "i", "DELETE FROM " + m_prefix + "buddies WHERE id=?");
-	m_removeBuddySettings = new Statement(&m_conn, "i", "DELETE FROM " + m_prefix + "buddies_settings WHERE buddy_id=?");
 	m_updateBuddy = new Statement(&m_conn, "ssisis", "UPDATE " + m_prefix + "buddies SET groups=?, nickname=?, flags=?, subscription=? WHERE user_id=? AND uin=?");
-	m_getBuddies = new Statement(&m_conn, "i|issssi", "SELECT id, uin, subscription, nickname, groups, flags FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC");
-	m_getBuddiesSettings = new Statement(&m_conn, "i|iiss", "SELECT buddy_id, type, var, value FROM " + m_prefix + "buddies_settings WHERE user_id=? ORDER BY buddy_id ASC");
-	m_updateBuddySetting = new Statement(&m_conn, "iisiss", "INSERT INTO " + m_prefix + "buddies_settings (user_id, buddy_id, var, type, value) VALUES (?, ?, ?, ?, ?) ON DUPLICATE KEY UPDATE value=?");
-	m_getBuddySetting = new Statement(&m_conn, "is|is", "SELECT type, value FROM " + m_prefix + "buddies_settings WHERE user_id=? AND buddy_id=? AND var=?");
+	m_getBuddies = new Statement(&m_conn, "i|issssis", "SELECT id, uin, subscription, nickname, groups, flags, settings FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC");
+	m_updateBuddySetting = new Statement(&m_conn, "sii", "UPDATE " + m_prefix + "buddies SET settings=? WHERE user_id=? AND id=?");
+	m_getBuddySetting = new Statement(&m_conn, "ii|s", "SELECT settings FROM " + m_prefix + "buddies WHERE user_id=? AND id=?");
 	
 	m_getUserSetting = new Statement(&m_conn, "is|is", "SELECT type, value FROM " + m_prefix + "users_settings WHERE user_id=? AND var=?");
 	m_setUserSetting = new Statement(&m_conn, "isis", "INSERT INTO " + m_prefix + "users_settings (user_id, var, type, value) VALUES (?,?,?,?)");
@@ -361,21 +383,12 @@ bool MySQLBackend::createDatabase() {
 							"`nickname` varchar(255) collate utf8_bin NOT NULL,"
 							"`groups` varchar(255) collate utf8_bin NOT NULL,"
 							"`flags` smallint(4) NOT NULL DEFAULT '0',"
+							"`settings` varchar(4095) collate utf8_bin NOT NULL DEFAULT '',"
 							"PRIMARY KEY (`id`),"
 							"UNIQUE KEY `user_id` (`user_id`,`uin`)"
 						") ENGINE=InnoDB DEFAULT CHARSET=utf8 COLLATE=utf8_bin;");
 
 	if (not_exist) {
-		exec("CREATE TABLE IF NOT EXISTS `" + m_prefix + "buddies_settings` ("
-				"`user_id` int(10) unsigned NOT NULL,"
-				"`buddy_id` int(10) unsigned NOT NULL,"
-				"`var` varchar(50) collate utf8_bin NOT NULL,"
-				"`type` smallint(4) unsigned NOT NULL,"
-				"`value` varchar(255) collate utf8_bin NOT NULL,"
-				"PRIMARY KEY (`buddy_id`,`var`),"
-				"KEY `user_id` (`user_id`)"
-			") ENGINE=InnoDB DEFAULT CHARSET=utf8 COLLATE=utf8_bin;");
- 
 		exec("CREATE TABLE IF NOT EXISTS `" + m_prefix + "users` ("
 				"`id` int(10) unsigned NOT NULL auto_increment,"
 				"`jid` varchar(255) collate utf8_bin NOT NULL,"
@@ -399,14 +412,85 @@ bool MySQLBackend::createDatabase() {
 				"KEY `user_id` (`user_id`)"
 			") ENGINE=InnoDB DEFAULT CHARSET=utf8 COLLATE=utf8_bin;");
 
-		exec("CREATE TABLE IF NOT EXISTS `" + m_prefix + "db_version` ("
-				"`ver` int(10) unsigned NOT NULL default '1',"
-				"UNIQUE KEY `ver` (`ver`)"
-			") ENGINE=InnoDB DEFAULT CHARSET=utf8 COLLATE=utf8_bin;");
+	}
 
-		exec("INSERT IGNORE INTO `" + m_prefix + "db_version` (ver) VALUES ('2');");
+	// Databases created by old versions do not have to have it.
+	exec("CREATE TABLE IF NOT EXISTS `" + m_prefix + "db_version` ("
+			"`ver` int(10) unsigned NOT NULL default '1',"
+			"UNIQUE KEY `ver` (`ver`)"
+		") ENGINE=InnoDB DEFAULT CHARSET=utf8 COLLATE=utf8_bin;");
+
+	// The buddies table is not created when it already exists, so the
+	// databases created by older versions are upgraded here.
+	return upgradeDatabase();
+}
+
+bool MySQLBackend::hasRows(const std::string &query) {
+	if (!exec(query)) {
+		return false;
+	}
+	MYSQL_RES *result = mysql_store_result(&m_conn);
+	bool ret = result && mysql_num_rows(result) > 0;
+	if (result) {
+		mysql_free_result(result);
+	}
+	return ret;
+}
+
+bool MySQLBackend::upgradeDatabase() {
+	// Version 3 moves buddies_settings rows to the settings column of buddies
+	// table, so the roster is loaded by single query. The buddies_settings
+	// table is kept, but it is not used anymore.
+	std::string version = boost::lexical_cast<std::string>(MYSQL_DB_VERSION);
+	if (hasRows("SELECT ver FROM `" + m_prefix + "db_version` WHERE ver >= " + version)) {
+		return true;
 	}
 
+	LOG4CXX_INFO(logger, "Upgrading database to version " << MYSQL_DB_VERSION);
+	// ALTER TABLE is committed immediately, so the column can exist already
+	// when the previous upgrade failed later.
+	if (!hasRows("SHOW COLUMNS FROM `" + m_prefix + "buddies` LIKE 'settings'")
+		&& !exec("ALTER TABLE `" + m_prefix + "buddies` ADD `settings` varchar(4095) collate utf8_bin NOT NULL DEFAULT ''")) {
+		return false;
+	}
+
+	std::map<long, std::map<std::string, SettingVariableInfo> > settings;
+	// New databases do not have the buddies_settings table.
+	if (hasRows("SHOW TABLES LIKE '" + m_prefix + "buddies_settings'")) {
+		if (!exec("SELECT buddy_id, type, var, value FROM `" + m_prefix + "buddies_settings`")) {
+			return false;
+		}
+		MYSQL_RES *result = mysql_store_result(&m_conn);
+		MYSQL_ROW row;
+		while (result && (row = mysql_fetch_row(result))) {
+			SettingVariableInfo var;
+			if (StorageBackend::parseSetting(atoi(row[1]), row[3] ? row[3] : "", var)) {
+				settings[atol(row[0])][row[2]] = var;
+			}
+		}
+		if (result) {
+			mysql_free_result(result);
+		}
+	}
+
+	Statement setSettings(&m_conn, "si", "UPDATE " + m_prefix + "buddies SET settings=? WHERE id=?");
+	beginTransaction();
+	for (std::map<long, std::map<std::string, SettingVariableInfo> >::const_iterator it = settings.begin(); it != settings.end(); it++) {
+		setSettings << StorageBackend::serializeSettings(it->second) << (int) it->first;
+		if (setSettings.execute() != 0) {
+			exec("ROLLBACK;");
+			return false;
+		}
+	}
+	// The version is bumped only together with the converted settings.
+	if (!exec("INSERT IGNORE INTO `" + m_prefix + "db_version` (ver) VALUES ('" + version + "');")) {
+		exec("ROLLBACK;");
+		return false;
+	}
+	if (!commitTransaction()) {
+		exec("ROLLBACK;");
+		return false;
+	}
 	return true;
 }
 
@@ -430,7 +514,7 @@ void MySQLBackend::setUser(const UserInfo &user) {
 bool MySQLBackend::getUser(const std::string &barejid, UserInfo &user) {
 	*m_getUser << barejid;
 	EXEC(m_getUser, getUser(barejid, user));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	int ret = false;
@@ -463,14 +547,22 @@ bool MySQLBackend::getUser(const std::string &barejid, UserInfo &user) {
 	return ret;
 }
 
-void MySQLBackend::setUserOnline(long id, bool online) {
+bool MySQLBackend::setUserOnline(long id, bool online) {
 	*m_setUserOnline << online << id;
 	EXEC(m_setUserOnline, setUserOnline(id, online));
+	return m_execOk;
+}
+
+bool MySQLBackend::setUsersOnline(const std::vector<long> &ids, bool online) {
+	if (ids.empty()) {
+		return true;
+	}
+	return exec("UPDATE " + m_prefix + "users SET online=" + (online ? "1" : "0") + ", last_login=NOW() WHERE id IN (" + StorageBackend::serializeIds(ids) + ")");
 }
 
 bool MySQLBackend::getOnlineUsers(std::vector<std::string> &users) {
 	EXEC(m_getOnlineUsers, getOnlineUsers(users));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	std::string jid;
@@ -484,7 +576,7 @@ bool MySQLBackend::getOnlineUsers(std::vector<std::string> &users) {
 
 bool MySQLBackend::getUsers(std::vector<std::string> &users) {
 	EXEC(m_getUsers, getUsers(users));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	std::string jid;
@@ -497,56 +589,75 @@ bool MySQLBackend::getUsers(std::vector<std::string> &users) {
 }
 
 long MySQLBackend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
-// 	"INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags) VALUES (?, ?, ?, ?, ?, ?)"
+// 	"INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES (?, ?, ?, ?, ?, ?, ?)"
 	std::string groups = StorageBackend::serializeGroups(buddyInfo.groups);
 	*m_addBuddy << userId << buddyInfo.legacyName << buddyInfo.subscription;
 	*m_addBuddy << groups;
-	*m_addBuddy << buddyInfo.alias << buddyInfo.flags;
+	*m_addBuddy << buddyInfo.alias << buddyInfo.flags << StorageBackend::serializeSettings(buddyInfo.settings);
 
 	EXEC(m_addBuddy, addBuddy(userId, buddyInfo));
+	if (!m_execOk)
+		return -1;
 
-	long id = (long) mysql_insert_id(&m_conn);
+	return (long) mysql_insert_id(&m_conn);
+}
+
+bool MySQLBackend::getBuddySettings(long userId, long buddyId, std::map<std::string, SettingVariableInfo> &settings) {
+// 	"SELECT settings FROM " + m_prefix + "buddies WHERE user_id=? AND id=?"
+	*m_getBuddySetting << userId << buddyId;
+	EXEC(m_getBuddySetting, getBuddySettings(userId, buddyId, settings));
+	if (!m_execOk)
+		return false;
 
-// 	INSERT OR REPLACE INTO " + m_prefix + "buddies_settings (user_id, buddy_id, var, type, value) VALUES (?, ?, ?, ?, ?)
-	if (buddyInfo.settings.find("icon_hash") != buddyInfo.settings.end() && !buddyInfo.settings.find("icon_hash")->second.s.empty()) {
-		*m_updateBuddySetting << userId << id << buddyInfo.settings.find("icon_hash")->first << (int) TYPE_STRING << buddyInfo.settings.find("icon_hash")->second.s << buddyInfo.settings.find("icon_hash")->second.s;
-		EXEC(m_updateBuddySetting, addBuddy(userId, buddyInfo));
+	bool ret = false;
+	std::string data;
+	if (m_getBuddySetting->fetch() == 0) {
+		*m_getBuddySetting >> data;
+		StorageBackend::deserializeSettings(data, settings);
+		ret = true;
 	}
 
-	return id;
+	while (m_getBuddySetting->fetch() == 0) {
+
+	}
+	return ret;
 }
 
 void MySQLBackend::updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {
-	*m_updateBuddySetting << userId << buddyId << variable << type << value << value;
+	std::map<std::string, SettingVariableInfo> settings;
+	if (!getBuddySettings(userId, buddyId, settings)) {
+		return;
+	}
+
+	if (!StorageBackend::parseSetting(type, value, settings[variable])) {
+		return;
+	}
+
+	*m_updateBuddySetting << StorageBackend::serializeSettings(settings) << userId << buddyId;
 	EXEC(m_updateBuddySetting, updateBuddySetting(userId, buddyId, variable, type, value));
 }
 
-void MySQLBackend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
-// 	"SELECT type, value FROM " + m_prefix + "users_settings WHERE user_id=? AND var=?"
-	*m_getBuddySetting << userId << buddyId << variable;
-	EXEC(m_getBuddySetting, getBuddySetting(userId, buddyId, variable, type, value));
-	if (m_getBuddySetting->fetch() == 0) {
-		*m_getBuddySetting >> type >> value;
+bool MySQLBackend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+	std::map<std::string, SettingVariableInfo> settings;
+	// getBuddySettings() returns false also when the buddy does not exist.
+	if (!getBuddySettings(userId, buddyId, settings) && !m_execOk) {
+		return false;
 	}
 
-	while (m_getBuddySetting->fetch() == 0) {
-
+	std::map<std::string, SettingVariableInfo>::const_iterator it = settings.find(variable);
+	if (it != settings.end()) {
+		type = it->second.type;
+		value = it->second.type == TYPE_BOOLEAN ? (it->second.b ? "1" : "0") : it->second.s;
 	}
+	return true;
 }
 
 void MySQLBackend::removeBuddy(long id) {
 	*m_removeBuddy << (int) id;
 	EXEC(m_removeBuddy, removeBuddy(id));
-	if (!exec_ok)
-		return;
-
-	*m_removeBuddySettings << (int) id;
-	EXEC(m_removeBuddySettings, removeBuddy(id));
-	if (!exec_ok)
-		return;
 }
 
-void MySQLBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+bool MySQLBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
 // 	"UPDATE " + m_prefix + "buddies SET groups=?, nickname=?, flags=?, subscription=? WHERE user_id=? AND uin=?"
 	std::string groups = StorageBackend::serializeGroups(buddyInfo.groups);
 	*m_updateBuddy << groups;
@@ -554,121 +665,197 @@ void MySQLBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
 	*m_updateBuddy << userId << buddyInfo.legacyName;
 
 	EXEC(m_updateBuddy, updateBuddy(userId, buddyInfo));
+	if (!m_execOk)
+		return false;
+
+	// buddyInfo.settings does not have to contain all settings, so they
+	// are merged into the stored ones.
+	if (buddyInfo.settings.empty() || buddyInfo.id == -1)
+		return true;
+
+	std::map<std::string, SettingVariableInfo> settings;
+	if (!getBuddySettings(userId, buddyInfo.id, settings))
+		return m_execOk;
+	if (!StorageBackend::mergeSettings(settings, buddyInfo.settings))
+		return true;
+
+// 	"UPDATE " + m_prefix + "buddies SET settings=? WHERE user_id=? AND id=?"
+	*m_updateBuddySetting << StorageBackend::serializeSettings(settings) << userId << buddyInfo.id;
+	EXEC(m_updateBuddySetting, updateBuddy(userId, buddyInfo));
+	return m_execOk;
 }
 
-bool MySQLBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
-//	SELECT id, uin, subscription, nickname, groups, flags FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC
-	*m_getBuddies << id;
+bool MySQLBackend::storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	// Buddies of all users are upserted by multi-row statements, so storing
+	// them costs few round trips instead of one or two per buddy.
+	if (!exec("START TRANSACTION;")) {
+		return false;
+	}
+
+	// IDs are set only once the transaction is committed.
+	std::vector<std::pair<BuddyInfo *, long> > ids;
+	std::list<std::pair<long, BuddyInfo> >::iterator it = buddies.begin();
+	while (it != buddies.end()) {
+		BuddyChunk chunk;
+		for (int i = 0; it != buddies.end() && i < BULK_SIZE; it++, i++) {
+			chunk[std::make_pair(it->first, it->second.legacyName)] = &it->second;
+		}
+
+		// buddyInfo.settings does not have to contain all settings, so
+		// they are merged into the stored ones, which stay locked until
+		// the commit. mysql_insert_id() returns only the first ID, so new
+		// buddies are fetched again to find out their IDs.
+		std::map<std::pair<long, std::string>, std::pair<long, std::string> > stored;
+		if (!getStoredBuddies(chunk, stored) || !upsertBuddies(chunk, stored) || !getStoredBuddies(chunk, stored)) {
+			exec("ROLLBACK;");
+			return false;
+		}
+
+		for (BuddyChunk::const_iterator buddy = chunk.begin(); buddy != chunk.end(); buddy++) {
+			std::map<std::pair<long, std::string>, std::pair<long, std::string> >::const_iterator s = stored.find(buddy->first);
+			if (buddy->second->id == -1 && s != stored.end()) {
+				ids.push_back(std::make_pair(buddy->second, s->second.first));
+			}
+		}
+	}
+
+	if (!commitTransaction()) {
+		exec("ROLLBACK;");
+		return false;
+	}
+
+	for (std::vector<std::pair<BuddyInfo *, long> >::iterator id = ids.begin(); id != ids.end(); id++) {
+		id->first->id = id->second;
+	}
+	return true;
+}
+
+std::string MySQLBackend::quote(const std::string &str) {
+	std::vector<char> escaped(str.size() * 2 + 1);
+	unsigned long length = mysql_real_escape_string(&m_conn, &escaped[0], str.c_str(), str.size());
+	return "'" + std::string(&escaped[0], length) + "'";
+}
+
+bool MySQLBackend::getStoredBuddies(const BuddyChunk &chunk, std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored) {
+	std::string keys;
+	for (BuddyChunk::const_iterator it = chunk.begin(); it != chunk.end(); it++) {
+		keys += std::string(keys.empty() ? "(" : ",(") + boost::lexical_cast<std::string>(it->first.first) + "," + quote(it->first.second) + ")";
+	}
+
+	if (!exec("SELECT id, user_id, uin, settings FROM " + m_prefix + "buddies WHERE (user_id, uin) IN (" + keys + ") FOR UPDATE")) {
+		return false;
+	}
 
-// 	"SELECT buddy_id, type, var, value FROM " + m_prefix + "buddies_settings WHERE user_id=? ORDER BY buddy_id ASC"
-	*m_getBuddiesSettings << id;
+	MYSQL_RES *result = mysql_store_result(&m_conn);
+	if (!result) {
+		LOG4CXX_ERROR(logger, "getStoredBuddies " << mysql_error(&m_conn));
+		return false;
+	}
 
-	SettingVariableInfo var;
-	long buddy_id = -1;
-	std::string key;
+	MYSQL_ROW row;
+	while ((row = mysql_fetch_row(result))) {
+		unsigned long *lengths = mysql_fetch_lengths(result);
+		std::pair<long, std::string> key(atol(row[1]), std::string(row[2], lengths[2]));
+		stored[key] = std::make_pair(atol(row[0]), std::string(row[3], lengths[3]));
+	}
+	mysql_free_result(result);
+	return true;
+}
+
+bool MySQLBackend::upsertBuddies(const BuddyChunk &chunk, const std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored) {
+	std::string values;
+	for (BuddyChunk::const_iterator it = chunk.begin(); it != chunk.end(); it++) {
+		const BuddyInfo &buddyInfo = *it->second;
+		std::map<std::string, SettingVariableInfo> settings;
+		std::map<std::pair<long, std::string>, std::pair<long, std::string> >::const_iterator s = stored.find(it->first);
+		if (s != stored.end()) {
+			StorageBackend::deserializeSettings(s->second.second, settings);
+		}
+		StorageBackend::mergeSettings(settings, buddyInfo.settings);
+
+		values += std::string(values.empty() ? "(" : ",(") + boost::lexical_cast<std::string>(it->first.first) + ","
+			+ quote(buddyInfo.legacyName) + ","
+			+ quote(buddyInfo.subscription) + ","
+			+ quote(StorageBackend::serializeGroups(buddyInfo.groups)) + ","
+			+ quote(buddyInfo.alias) + ","
+			+ boost::lexical_cast<std::string>(buddyInfo.flags) + ","
+			+ quote(StorageBackend::serializeSettings(settings)) + ")";
+	}
+
+	// groups is reserved word since MySQL 8.0.
+	return exec("INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, `groups`, nickname, flags, settings) VALUES " + values
+		+ " ON DUPLICATE KEY UPDATE subscription=VALUES(subscription), `groups`=VALUES(`groups`), nickname=VALUES(nickname),"
+		" flags=VALUES(flags), settings=VALUES(settings)");
+}
+
+bool MySQLBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
+//	SELECT id, uin, subscription, nickname, groups, flags, settings FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC
+	*m_getBuddies << id;
 
 	EXEC(m_getBuddies, getBuddies(id, roster));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	while (m_getBuddies->fetch() == 0) {
 		BuddyInfo b;
 
 		std::string group;
-		*m_getBuddies >> b.id >> b.legacyName >> b.subscription >> b.alias >> group >> b.flags;
+		std::string settings;
+		*m_getBuddies >> b.id >> b.legacyName >> b.subscription >> b.alias >> group >> b.flags >> settings;
 
 		if (!group.empty()) {
 			b.groups = StorageBackend::deserializeGroups(group);
 		}
 
-		roster.push_back(b);
-	}
-
-	EXEC(m_getBuddiesSettings, getBuddies(id, roster));
-	if (!exec_ok)
-		return false;
-
-	BOOST_FOREACH(BuddyInfo &b, roster) {
-		if (buddy_id == b.id) {
-// 			std::cout << "Adding buddy info setting " << key << "\n";
-			b.settings[key] = var;
-			buddy_id = -1;
+		if (!StorageBackend::deserializeSettings(settings, b.settings)) {
+			LOG4CXX_WARN(logger, "Malformed settings of buddy " << b.id);
 		}
 
-		while(buddy_id == -1 && m_getBuddiesSettings->fetch() == 0) {
-			std::string val;
-			*m_getBuddiesSettings >> buddy_id >> var.type >> key >> val;
-
-			switch (var.type) {
-				case TYPE_BOOLEAN:
-					var.b = atoi(val.c_str());
-					break;
-				case TYPE_STRING:
-					var.s = val;
-					break;
-				default:
-					if (buddy_id == b.id) {
-						buddy_id = -1;
-					}
-					continue;
-					break;
-			}
-			if (buddy_id == b.id) {
-// 				std::cout << "Adding buddy info setting " << key << "=" << val << "\n";
-				b.settings[key] = var;
-				buddy_id = -1;
-			}
-		}
+		roster.push_back(b);
 	}
 
-	while(m_getBuddiesSettings->fetch() == 0) {
-		// TODO: probably remove those settings, because there's no buddy for them.
-		// It should not happend, but one never know...
-	}
-	
 	return true;
 }
 
 bool MySQLBackend::removeUser(long id) {
 	*m_removeUser << (int) id;
 	EXEC(m_removeUser, removeUser(id));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	*m_removeUserSettings << (int) id;
 	EXEC(m_removeUserSettings, removeUser(id));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	*m_removeUserBuddies << (int) id;
 	EXEC(m_removeUserBuddies, removeUser(id));
-	if (!exec_ok)
-		return false;
-
-	*m_removeUserBuddiesSettings << (int) id;
-	EXEC(m_removeUserBuddiesSettings, removeUser(id));
-	if (!exec_ok)
+	if (!m_execOk)
 		return false;
 
 	return true;
 }
 
-void MySQLBackend::getUserSetting(long id, const std::string &variable, int &type, std::string &value) {
+bool MySQLBackend::getUserSetting(long id, const std::string &variable, int &type, std::string &value) {
 // 	"SELECT type, value FROM " + m_prefix + "users_settings WHERE user_id=? AND var=?"
 	*m_getUserSetting << id << variable;
 	EXEC(m_getUserSetting, getUserSetting(id, variable, type, value));
+	if (!m_execOk)
+		return false;
+
 	if (m_getUserSetting->fetch() != 0) {
 // 		"INSERT INTO " + m_prefix + "users_settings (user_id, var, type, value) VALUES (?,?,?,?)"
 		*m_setUserSetting << id << variable << type << value;
 		EXEC(m_setUserSetting, getUserSetting(id, variable, type, value));
-	}
-	else {
-		*m_getUserSetting >> type >> value;
+		return m_execOk;
 	}
 
+	*m_getUserSetting >> type >> value;
+
 	while (m_getUserSetting->fetch() == 0) {
 
 	}
+	return true;
 }
 
 void MySQLBackend::updateUserSetting(long id, const std::string &variable, const std::string &value) {
@@ -681,8 +868,8 @@ void MySQLBackend::beginTransaction() {
 	exec("START TRANSACTION;");
 }
 
-void MySQLBackend::commitTransaction() {
-	exec("COMMIT;");
+bool MySQLBackend::commitTransaction() {
+	return exec("COMMIT;");
 }
 
 }
@@ -0,0 +1,308 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include "transport/NetworkFrameBuffer.h"
+
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+#include <stdint.h>
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include <google/protobuf/message_lite.h>
+
+namespace Transport {
+
+#ifdef WITH_ZLIB
+// Preset dictionary for compressed frames, built from the strings which are
+// common in big payloads (vCards, room lists and rosters). Both sides have to
+// use the same dictionary, so it must never be changed. Deflate prefers
+// the matches at the end of the dictionary, so the most common strings are
+// the last ones.
+static const char frameDictionary[] =
+	"image/gifimage/jpegimage/png"
+	"http://https://www."
+	".org.net.com"
+	"General"
+	"Buddies"
+	"@gmail.com@chat.facebook.com@conference."
+	"#";
+#endif
+
+// Frames can carry passwords, so the memory is cleared before it's freed,
+// the same way SafeByteArray does it. Volatile keeps the compiler from
+// dropping the writes.
+static void wipe(std::vector<char> &buffer) {
+	volatile char *data = buffer.empty() ? NULL : &buffer[0];
+	for (size_t i = 0; i < buffer.size(); i++) {
+		data[i] = 0;
+	}
+}
+
+static void appendHeader(std::string &out, uint32_t size) {
+	size = htonl(size);
+	out.append((const char *) &size, 4);
+}
+
+static void appendType(std::string &out, int type) {
+	uint16_t t = htons((uint16_t) type);
+	out.append((const char *) &t, 2);
+}
+
+void NetworkFrameBuffer::appendFrame(std::string &out, const std::string &wrapper) {
+	appendHeader(out, wrapper.size());
+	out.append(wrapper);
+}
+
+void NetworkFrameBuffer::appendFrame(std::string &out, int type, const std::string &payload) {
+	appendHeader(out, (payload.size() + 2) | NETWORK_FRAME_V2);
+	appendType(out, type);
+	out.append(payload);
+}
+
+void NetworkFrameBuffer::appendFrame(std::string &out, int type, const google::protobuf::MessageLite &payload) {
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+	size_t size = payload.ByteSizeLong();
+#else
+	size_t size = payload.ByteSize();
+#endif
+	appendHeader(out, (size + 2) | NETWORK_FRAME_V2);
+	appendType(out, type);
+
+	// ByteSize() cached the sizes, so serialize directly after the header.
+	size_t offset = out.size();
+	out.resize(offset + size);
+	if (size != 0) {
+		payload.SerializeWithCachedSizesToArray((uint8_t *) &out[offset]);
+	}
+}
+
+bool NetworkFrameBuffer::appendCompressedFrame(std::string &out, int type, const std::string &payload) {
+#ifdef WITH_ZLIB
+	if (payload.size() < 2 || payload.size() > NETWORK_FRAME_MAX_DECOMPRESSED_SIZE) {
+		return false;
+	}
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+	deflateSetDictionary(&stream, (const Bytef *) frameDictionary, sizeof(frameDictionary) - 1);
+
+	// Compressed payload has to be smaller than the original one, otherwise
+	// there is no point in sending it. It's compressed directly after the
+	// place for the header.
+	size_t offset = out.size();
+	size_t limit = payload.size() - 1;
+	out.resize(offset + 6 + limit);
+	stream.next_in = (Bytef *) payload.data();
+	stream.avail_in = payload.size();
+	stream.next_out = (Bytef *) &out[offset + 6];
+	stream.avail_out = limit;
+	int ret = deflate(&stream, Z_FINISH);
+	size_t size = limit - stream.avail_out;
+	deflateEnd(&stream);
+
+	if (ret != Z_STREAM_END) {
+		out.resize(offset);
+		return false;
+	}
+
+	uint32_t header = htonl((size + 2) | NETWORK_FRAME_V2);
+	uint16_t t = htons((uint16_t) (type | NETWORK_FRAME_COMPRESSED));
+	memcpy(&out[offset], &header, 4);
+	memcpy(&out[offset + 4], &t, 2);
+	out.resize(offset + 6 + size);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool NetworkFrameBuffer::decompress(const char *data, size_t size, std::string &out) {
+#ifdef WITH_ZLIB
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+		return false;
+	}
+	inflateSetDictionary(&stream, (const Bytef *) frameDictionary, sizeof(frameDictionary) - 1);
+
+	stream.next_in = (Bytef *) data;
+	stream.avail_in = size;
+	out.clear();
+	int ret = Z_OK;
+	while (ret == Z_OK) {
+		// Small frame can decompress to gigabytes, so stop once the output
+		// exceeds the limit. The sender never compresses that much.
+		size_t offset = out.size();
+		if (offset > NETWORK_FRAME_MAX_DECOMPRESSED_SIZE) {
+			break;
+		}
+		out.resize(offset + std::min(std::max(size * 2, (size_t) 4096), NETWORK_FRAME_MAX_DECOMPRESSED_SIZE + 1 - offset));
+		stream.next_out = (Bytef *) &out[offset];
+		stream.avail_out = out.size() - offset;
+		ret = inflate(&stream, Z_NO_FLUSH);
+		out.resize(out.size() - stream.avail_out);
+	}
+	inflateEnd(&stream);
+	if (ret != Z_STREAM_END || out.size() > NETWORK_FRAME_MAX_DECOMPRESSED_SIZE) {
+		std::string().swap(out);
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool NetworkFrameBuffer::isCompressionSupported() {
+#ifdef WITH_ZLIB
+	return true;
+#else
+	return false;
+#endif
+}
+
+NetworkFrameBuffer::NetworkFrameBuffer() : m_start(0), m_end(0) {
+}
+
+NetworkFrameBuffer::~NetworkFrameBuffer() {
+	wipe(m_buffer);
+}
+
+void NetworkFrameBuffer::reallocate(size_t size) {
+	// std::vector::resize() would free the old memory without clearing it.
+	std::vector<char> buffer(size);
+	size_t pending = m_end - m_start;
+	if (pending != 0) {
+		memcpy(&buffer[0], &m_buffer[m_start], pending);
+	}
+	wipe(m_buffer);
+	m_buffer.swap(buffer);
+	m_start = 0;
+	m_end = pending;
+}
+
+void NetworkFrameBuffer::reserve(size_t size) {
+	// There is enough space after the write cursor.
+	if (m_buffer.size() - m_end >= size) {
+		return;
+	}
+
+	// Move unconsumed data to the beginning of the buffer. This is the only
+	// place where we copy already buffered data, so it happens at most once
+	// per buffer-full of frames instead of once per frame.
+	size_t pending = m_end - m_start;
+	if (m_start != 0) {
+		if (pending != 0) {
+			memmove(&m_buffer[0], &m_buffer[m_start], pending);
+		}
+		m_start = 0;
+		m_end = pending;
+	}
+
+	if (m_buffer.size() - m_end < size) {
+		size_t newSize = m_buffer.empty() ? 4096 : m_buffer.size();
+		while (newSize - m_end < size) {
+			newSize *= 2;
+		}
+		reallocate(newSize);
+	}
+}
+
+void NetworkFrameBuffer::append(const char *data, size_t size) {
+	if (size == 0) {
+		return;
+	}
+
+	// Everything has been consumed, so we can start from the beginning
+	// without moving anything.
+	if (m_start == m_end) {
+		m_start = m_end = 0;
+	}
+
+	// Memory allocated for big frame is released once the frame has been
+	// consumed, so single file transfer chunk or roster does not keep it
+	// allocated for the life of the connection.
+	size_t needed = m_end - m_start + size;
+	if (m_buffer.size() > REUSED_BUFFER_LIMIT && needed <= REUSED_BUFFER_LIMIT) {
+		size_t newSize = 4096;
+		while (newSize < needed) {
+			newSize *= 2;
+		}
+		reallocate(newSize);
+	}
+
+	reserve(size);
+	memcpy(&m_buffer[m_end], data, size);
+	m_end += size;
+}
+
+bool NetworkFrameBuffer::nextFrame(const char *&frame, unsigned int &size, int &type) {
+	// We need whole header to read the expected size of wrapper message.
+	if (m_end - m_start < 4) {
+		return false;
+	}
+
+	uint32_t expected_size;
+	memcpy(&expected_size, &m_buffer[m_start], 4);
+	expected_size = ntohl(expected_size);
+	bool v2 = expected_size & NETWORK_FRAME_V2;
+	expected_size &= ~NETWORK_FRAME_V2;
+
+	// If we don't have whole wrapper message, wait for more data.
+	if (m_end - m_start - 4 < expected_size) {
+		return false;
+	}
+
+	frame = &m_buffer[0] + m_start + 4;
+	size = expected_size;
+	type = -1;
+	m_start += 4 + expected_size;
+
+	if (v2) {
+		// Frame is too short to contain the type, treat it as invalid v1 frame.
+		if (size < 2) {
+			return true;
+		}
+		uint16_t t;
+		memcpy(&t, frame, 2);
+		type = ntohs(t);
+		frame += 2;
+		size -= 2;
+	}
+	return true;
+}
+
+void NetworkFrameBuffer::clear() {
+	m_start = m_end = 0;
+	wipe(m_buffer);
+	std::vector<char>().swap(m_buffer);
+}
+
+}
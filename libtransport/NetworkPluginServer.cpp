@@ -19,6 +19,9 @@
  */
 
 #include "transport/NetworkPluginServer.h"
+#include "transport/BackendPool.h"
+#include "transport/BackendDecoder.h"
+#include "transport/IQRouteTable.h"
 #include "transport/User.h"
 #include "transport/Transport.h"
 #include "transport/RosterManager.h"
@@ -39,6 +42,7 @@
 #include "Swiften/Elements/StreamError.h"
 #include "Swiften/Network/BoostConnectionServer.h"
 #include "Swiften/Network/ConnectionServerFactory.h"
+#include "Swiften/Network/BoostNetworkFactories.h"
 #include "Swiften/Elements/AttentionPayload.h"
 #include "Swiften/Elements/XHTMLIMPayload.h"
 #include "Swiften/Elements/Delay.h"
@@ -46,9 +50,11 @@
 #include "Swiften/Elements/DeliveryReceiptRequest.h"
 #include "Swiften/Elements/InvisiblePayload.h"
 #include "Swiften/Elements/SpectrumErrorPayload.h"
+#include "Swiften/EventLoop/EventLoop.h"
 
 #include "boost/date_time/posix_time/posix_time.hpp"
 #include "boost/signal.hpp"
+#include <algorithm>
 
 #include "transport/utf8.h"
 
@@ -63,6 +69,10 @@
 #include "sys/signal.h"
 #include <sys/types.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "popt.h"
 #endif
 
@@ -77,6 +87,22 @@ DEFINE_LOGGER(logger, "NetworkPluginServer");
 
 static NetworkPluginServer *_server;
 
+// Messages parsed on the hot path are reused for every frame instead of being
+// constructed for each of them. Protobuf keeps the memory allocated for string
+// fields when the message is cleared, so parsing them does not hit the allocator
+// once they are warmed up.
+struct NetworkPluginServer::ReusedMessages {
+	pbnetwork::WrapperMessage wrapper;
+	std::string payload;
+	pbnetwork::Buddy buddy;
+	pbnetwork::ConversationMessage conversationMessage;
+	pbnetwork::Participant participant;
+};
+
+// Placeholder in m_pids for backends requested from the zygote until the
+// zygote replies with their pid.
+#define ZYGOTE_PENDING_PID ((unsigned long) -1)
+
 class NetworkConversation : public Conversation {
 	public:
 		NetworkConversation(ConversationManager *conversationManager, const std::string &legacyName, bool muc = false) : Conversation(conversationManager, legacyName, muc) {
@@ -134,7 +160,7 @@ class NetworkFactory : public Factory {
 	wrap.SerializeToString(&MESSAGE);
 
 // Executes new backend
-static unsigned long exec_(const std::string& exePath, const char *host, const char *port, const char *log_id, const char *cmdlineArgs) {
+static unsigned long exec_(const std::string& exePath, const char *host, const char *port, const char *log_id, const char *cmdlineArgs, const std::string &socketPath = "") {
 	// BACKEND_ID is replaced with unique ID. The ID is increasing for every backend.
 	std::string finalExePath = boost::replace_all_copy(exePath, "BACKEND_ID", boost::lexical_cast<std::string>(backend_id++));	
 
@@ -177,7 +203,13 @@ static unsigned long exec_(const std::string& exePath, const char *host, const c
 	return 0;
 #else
 	// Add host and port.
-	finalExePath += std::string(" --host ") + host + " --port " + port + " --service.backend_id=" + log_id + " " + cmdlineArgs;
+	finalExePath += std::string(" --host ") + host + " --port " + port + " --service.backend_id=" + log_id;
+	// Backend tries the Unix socket first and falls back to host and port
+	// if it can't use it.
+	if (!socketPath.empty()) {
+		finalExePath += " --service.backend_socket=" + socketPath;
+	}
+	finalExePath += std::string(" ") + cmdlineArgs;
 	LOG4CXX_INFO(logger, "Starting new backend " << finalExePath);
 
 	// Create array of char * from string using -lpopt library
@@ -232,8 +264,107 @@ static void SigCatcher(int n) {
 		}
 	}
 }
+
+static int sig_block_count = 0;
+static sigset_t block_mask;
+
+static void __block_signals ( void )
+{
+  static int init_done = 0;
+
+  if ( (sig_block_count++) != 1 ) return;
+
+  if ( init_done == 0 ) {
+    sigemptyset ( &block_mask );
+    sigaddset ( &block_mask, SIGPIPE );
+    sigaddset ( &block_mask, SIGHUP );
+    sigaddset ( &block_mask, SIGINT );
+    sigaddset ( &block_mask, SIGQUIT );
+    sigaddset ( &block_mask, SIGTERM );
+    sigaddset ( &block_mask, SIGABRT );
+    sigaddset ( &block_mask, SIGCHLD );
+    init_done = 1;
+  }
+
+  sigprocmask ( SIG_BLOCK, &block_mask, NULL );
+  return;
+}
+
+static void __unblock_signals ( void )
+{
+  sigset_t sigset;
+
+  if ( (sig_block_count--) != 0 ) return;
+  sigprocmask ( SIG_UNBLOCK, &block_mask, NULL );
+
+  if ( sigpending ( &sigset ) == 0 ) {
+    if ( sigismember ( &sigset, SIGCHLD ) ) {
+      raise ( SIGCHLD );
+    }
+  }
+}
 #endif
 
+static NetworkPluginServer::Priority getPriority(int type) {
+	switch (type) {
+		case pbnetwork::WrapperMessage_Type_TYPE_PING:
+		case pbnetwork::WrapperMessage_Type_TYPE_API_VERSION:
+		case pbnetwork::WrapperMessage_Type_TYPE_EXIT:
+			return NetworkPluginServer::PRIORITY_CONTROL;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING:
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED:
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING:
+			return NetworkPluginServer::PRIORITY_TYPING;
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_START:
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_DATA:
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH:
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_PAUSE:
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_CONTINUE:
+			return NetworkPluginServer::PRIORITY_FT;
+		// Session lifecycle (LOGIN, LOGOUT, EXPORT_SESSION, IMPORT_SESSION,
+		// BUDDIES, JOIN_ROOM, LEAVE_ROOM), status and buddy changes stay in
+		// the same class as messages. Frames of one class are never reordered,
+		// so re-login can't overtake the LOGOUT and user's last messages are
+		// not overtaken by it.
+		default:
+			return NetworkPluginServer::PRIORITY_MESSAGE;
+	}
+}
+
+// Frames which can be dropped when the backend is congested. Losing them
+// only leaves typing state stale until the next change. User's status is
+// not sent again until it changes, so it's never dropped.
+static bool isSheddable(int type) {
+	switch (type) {
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING:
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED:
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static void addRosterSnapshot(User *user, google::protobuf::RepeatedPtrField<pbnetwork::Buddy> *buddies) {
+	const RosterManager::BuddiesMap &roster = user->getRosterManager()->getBuddies();
+	for(RosterManager::BuddiesMap::const_iterator bt = roster.begin(); bt != roster.end(); bt++) {
+		Buddy *b = (*bt).second;
+		if (!b) {
+			continue;
+		}
+
+		pbnetwork::Buddy *buddy = buddies->Add();
+		buddy->set_username(user->getJID().toBare());
+		buddy->set_buddyname(b->getName());
+		buddy->set_alias(b->getAlias());
+		buddy->set_iconhash(b->getIconHash());
+		BOOST_FOREACH(const std::string &g, b->getGroups()) {
+			buddy->add_group(g);
+		}
+		buddy->set_status(pbnetwork::STATUS_NONE);
+	}
+}
+
 static void handleBuddyPayload(LocalBuddy *buddy, const pbnetwork::Buddy &payload) {
 	// Set alias only if it's not empty. Backends are allowed to send empty alias if it has
 	// not changed.
@@ -263,11 +394,50 @@ NetworkPluginServer::NetworkPluginServer(Component *component, Config *config, U
 	m_userManager = userManager;
 	m_config = config;
 	m_component = component;
-	m_isNextLongRun = false;
 	m_adminInterface = NULL;
-	m_startingBackend = false;
 	m_lastLogin = 0;
 	m_firstPong = true;
+	m_flushScheduled = false;
+	m_flushOwner = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner>(new Swift::EventOwner());
+	m_outputBufferSize = CONFIG_INT(m_config, "service.backend_output_buffer");
+	m_queueHighWatermark = CONFIG_INT(m_config, "service.backend_queue_high_watermark");
+	m_queueLowWatermark = std::min(m_queueHighWatermark, (unsigned long) CONFIG_INT(m_config, "service.backend_queue_low_watermark"));
+	m_compressionThreshold = CONFIG_INT(m_config, "service.backend_compression_threshold");
+	if (m_compressionThreshold != 0 && !NetworkFrameBuffer::isCompressionSupported()) {
+		LOG4CXX_WARN(logger, "service.backend_compression_threshold is set, but Spectrum2 has been built without zlib");
+		m_compressionThreshold = 0;
+	}
+	m_messages = new ReusedMessages();
+	m_decoder = NULL;
+	if (CONFIG_INT(m_config, "service.backend_decoder_threads") > 0) {
+		m_decoder = new BackendDecoder(m_component->m_loop, CONFIG_INT(m_config, "service.backend_decoder_threads"),
+			boost::bind(&NetworkPluginServer::handleFrame, this, _1, _2, _3));
+	}
+
+	BackendPlacement *placement = BackendPlacement::createPlacement(CONFIG_STRING(m_config, "service.backend_placement"));
+	if (!placement) {
+		LOG4CXX_ERROR(logger, "Unknown service.backend_placement " << CONFIG_STRING(m_config, "service.backend_placement") << ", using first_fit");
+		placement = BackendPlacement::createPlacement("first_fit");
+	}
+	m_pool = new BackendPool(placement, CONFIG_INT(m_config, "service.users_per_backend"));
+	m_idleBackends = CONFIG_INT(m_config, "service.idle_backends");
+	m_idleLongRunBackends = CONFIG_INT(m_config, "service.idle_long_running_backends");
+	m_maxStartingBackends = std::max(1, CONFIG_INT(m_config, "service.max_starting_backends"));
+	m_zygotePid = 0;
+#ifndef _WIN32
+	if (CONFIG_BOOL(m_config, "service.backend_zygote")) {
+		// Other backends do not know service.zygote_socket, so they would
+		// just connect as one more backend.
+		std::string backend = CONFIG_STRING(m_config, "service.backend");
+		if (backend.substr(backend.find_last_of('/') + 1).find("libpurple_backend") != std::string::npos) {
+			m_zygotePath = CONFIG_STRING(m_config, "service.working_dir") + "/backend_zygote.sock";
+		}
+		else {
+			LOG4CXX_WARN(logger, "backend_zygote is supported only by libpurple backend, starting backends directly");
+		}
+	}
+#endif
+
 	m_xmppParser = new Swift::XMPPParser(this, &m_collection, component->getNetworkFactories()->getXMLParserFactory());
 	m_xmppParser->parse("<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' to='localhost' version='1.0'>");
 #if HAVE_SWIFTEN_3
@@ -285,6 +455,12 @@ NetworkPluginServer::NetworkPluginServer(Component *component, Config *config, U
 	m_pingTimer->onTick.connect(boost::bind(&NetworkPluginServer::pingTimeout, this));
 	m_pingTimer->start();
 
+	// Negative values would wrap around to huge unsigned ones.
+	m_iqRoutes = new IQRouteTable(std::max(1, CONFIG_INT(m_config, "service.iq_route_ttl")), std::max(1, CONFIG_INT(m_config, "service.iq_route_limit")));
+	m_iqRouteTimer = component->getNetworkFactories()->getTimerFactory()->createTimer(1000);
+	m_iqRouteTimer->onTick.connect(boost::bind(&NetworkPluginServer::iqRouteTimeout, this));
+	m_iqRouteTimer->start();
+
 	m_loginTimer = component->getNetworkFactories()->getTimerFactory()->createTimer(CONFIG_INT(config, "service.login_delay") * 1000);
 	m_loginTimer->onTick.connect(boost::bind(&NetworkPluginServer::loginDelayFinished, this));
 	m_loginTimer->start();
@@ -311,6 +487,18 @@ NetworkPluginServer::NetworkPluginServer(Component *component, Config *config, U
 	}
 	m_server = component->getNetworkFactories()->getConnectionServerFactory()->createConnectionServer(*hostAddress, boost::lexical_cast<int>(CONFIG_STRING(m_config, "service.backend_port")));
 	m_server->onNewConnection.connect(boost::bind(&NetworkPluginServer::handleNewClientConnection, this, _1));
+
+#ifndef _WIN32
+	// Backends are always running on the same machine, so let them connect
+	// over Unix socket if it's configured. TCP server is still there for
+	// backends which do not support it.
+	std::string socketPath = CONFIG_STRING(m_config, "service.backend_socket");
+	Swift::BoostNetworkFactories *boostFactories = dynamic_cast<Swift::BoostNetworkFactories *>(component->getNetworkFactories());
+	if (!socketPath.empty() && boostFactories) {
+		m_unixServer = Swift::UnixConnectionServer::create(socketPath, boostFactories->getIOServiceThread()->getIOService(), m_component->m_loop);
+		m_unixServer->onNewConnection.connect(boost::bind(&NetworkPluginServer::handleNewClientConnection, this, _1));
+	}
+#endif
 }
 
 NetworkPluginServer::~NetworkPluginServer() {
@@ -320,20 +508,40 @@ NetworkPluginServer::~NetworkPluginServer() {
 
 	for (std::list<Backend *>::const_iterator it = m_clients.begin(); it != m_clients.end(); it++) {
 		LOG4CXX_INFO(logger, "Stopping backend " << *it);
-		std::string message;
-		pbnetwork::WrapperMessage wrap;
-		wrap.set_type(pbnetwork::WrapperMessage_Type_TYPE_EXIT);
-		wrap.SerializeToString(&message);
-
 		Backend *c = (Backend *) *it;
-		send(c->connection, message);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_EXIT);
+		flush(c, true);
+	}
+
+#ifndef _WIN32
+	// Zygote exits when we disconnect, but it may still wait for us to connect.
+	if (m_zygote) {
+		m_zygote->onDataRead.disconnect_all_slots();
+		m_zygote->onDisconnected.disconnect_all_slots();
+		m_zygote->disconnect();
 	}
+	if (m_zygotePid) {
+		kill(m_zygotePid, SIGTERM);
+	}
+#endif
 
+	delete m_decoder;
+	m_component->m_loop->removeEventsFromOwner(m_flushOwner);
 	m_pingTimer->stop();
+	m_iqRouteTimer->stop();
+	delete m_iqRoutes;
 	m_server->stop();
 	m_server.reset();
+#ifndef _WIN32
+	if (m_unixServer) {
+		m_unixServer->stop();
+		m_unixServer.reset();
+	}
+#endif
 	delete m_component->m_factory;
 	delete m_xmppParser;
+	delete m_messages;
+	delete m_pool;
 // 	delete m_vcardResponder;
 // 	delete m_rosterResponder;
 // 	delete m_blockResponder;
@@ -344,8 +552,20 @@ void NetworkPluginServer::start() {
 
 	LOG4CXX_INFO(logger, "Listening on host " << CONFIG_STRING(m_config, "service.backend_host") << " port " << CONFIG_STRING(m_config, "service.backend_port"));
 
+#ifndef _WIN32
+	if (m_unixServer) {
+		if (m_unixServer->start()) {
+			LOG4CXX_INFO(logger, "Listening on Unix socket " << m_unixServer->getPath());
+		}
+		else {
+			LOG4CXX_ERROR(logger, "Can't listen on Unix socket " << m_unixServer->getPath() << ", backends will use TCP");
+			m_unixServer.reset();
+		}
+	}
+#endif
+
 	while (true) {
-		unsigned long pid = exec_(CONFIG_STRING(m_config, "service.backend"), CONFIG_STRING(m_config, "service.backend_host").c_str(), CONFIG_STRING(m_config, "service.backend_port").c_str(), "1", m_config->getCommandLineArgs().c_str());
+		unsigned long pid = exec_(CONFIG_STRING(m_config, "service.backend"), CONFIG_STRING(m_config, "service.backend_host").c_str(), CONFIG_STRING(m_config, "service.backend_port").c_str(), "1", m_config->getCommandLineArgs().c_str(), getBackendSocket());
 		LOG4CXX_INFO(logger, "Tried to spawn first backend with pid " << pid);
 		LOG4CXX_INFO(logger, "Backend should now connect to Spectrum2 instance. Spectrum2 won't accept any connection before backend connects");
 
@@ -385,6 +605,117 @@ void NetworkPluginServer::start() {
 		// quit the while loop
 		break;
 	}
+
+	if (!m_zygotePath.empty()) {
+		startZygote();
+	}
+}
+
+void NetworkPluginServer::startZygote() {
+#ifndef _WIN32
+	// Zygote is normal backend which initializes itself and then just forks
+	// the new backends when we ask it to do so over m_zygotePath socket.
+	std::string args = m_config->getCommandLineArgs() + " --service.zygote_socket=" + m_zygotePath;
+	m_zygotePid = exec_(CONFIG_STRING(m_config, "service.backend"), CONFIG_STRING(m_config, "service.backend_host").c_str(), CONFIG_STRING(m_config, "service.backend_port").c_str(), "zygote", args.c_str(), getBackendSocket());
+	LOG4CXX_INFO(logger, "Started backend zygote with pid " << m_zygotePid);
+#endif
+}
+
+bool NetworkPluginServer::requestFromZygote(const std::string &log_id) {
+#ifndef _WIN32
+	// Connect the zygote lazily, it's not listening before it's initialized.
+	// Connecting Unix socket does not wait for the other side to accept it.
+	if (!m_zygote) {
+		Swift::BoostNetworkFactories *boostFactories = dynamic_cast<Swift::BoostNetworkFactories *>(m_component->getNetworkFactories());
+		if (!boostFactories) {
+			return false;
+		}
+
+		Swift::UnixConnection::ref zygote = Swift::UnixConnection::create(boostFactories->getIOServiceThread()->getIOService(), m_component->m_loop);
+		if (!zygote->connect(m_zygotePath)) {
+			LOG4CXX_INFO(logger, "Backend zygote is not ready yet, starting backend directly");
+			return false;
+		}
+		zygote->onDataRead.connect(boost::bind(&NetworkPluginServer::handleZygoteDataRead, this, _1));
+		zygote->onDisconnected.connect(boost::bind(&NetworkPluginServer::handleZygoteDisconnected, this));
+		m_zygote = zygote;
+	}
+
+	// Request is the backend ID, reply is the pid of the forked backend.
+	// Zygote answers the requests in order, so we don't wait for the reply
+	// here and pair them in handleZygoteDataRead.
+	m_zygote->write(Swift::createSafeByteArray(log_id + "\n"));
+	return true;
+#else
+	return false;
+#endif
+}
+
+void NetworkPluginServer::handleZygoteDataRead(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray> data) {
+#ifndef _WIN32
+	if (data->empty()) {
+		return;
+	}
+	m_zygoteReply.append((const char *) &(*data)[0], data->size());
+
+	size_t end;
+	while ((end = m_zygoteReply.find('\n')) != std::string::npos) {
+		unsigned long pid = strtoul(m_zygoteReply.substr(0, end).c_str(), NULL, 10);
+		m_zygoteReply.erase(0, end + 1);
+		if (m_zygoteRequests.empty()) {
+			LOG4CXX_ERROR(logger, "Backend zygote sent unexpected reply");
+			continue;
+		}
+
+		size_t index = m_zygoteRequests.front();
+		m_zygoteRequests.pop_front();
+		if (pid == 0) {
+			LOG4CXX_ERROR(logger, "Backend zygote failed to fork new backend, starting backend directly");
+		}
+		else {
+			LOG4CXX_INFO(logger, "Backend zygote forked backend with pid " << pid);
+		}
+		setZygoteBackendPid(index, pid);
+	}
+#endif
+}
+
+void NetworkPluginServer::handleZygoteDisconnected() {
+#ifndef _WIN32
+	LOG4CXX_ERROR(logger, "Backend zygote disconnected, starting backends directly");
+	m_zygote->onDataRead.disconnect_all_slots();
+	m_zygote->onDisconnected.disconnect_all_slots();
+	m_zygote.reset();
+	m_zygoteReply.clear();
+
+	// Requests which have not been answered are lost, start the backends
+	// ourselves.
+	std::list<size_t> requests;
+	requests.swap(m_zygoteRequests);
+	for (std::list<size_t>::const_iterator it = requests.begin(); it != requests.end(); it++) {
+		setZygoteBackendPid(*it, 0);
+	}
+#endif
+}
+
+void NetworkPluginServer::setZygoteBackendPid(size_t index, unsigned long pid) {
+#ifndef _WIN32
+	if (pid == 0) {
+		std::string log_id = boost::lexical_cast<std::string>(index + 1);
+		pid = exec_(CONFIG_STRING(m_config, "service.backend"), CONFIG_STRING(m_config, "service.backend_host").c_str(), CONFIG_STRING(m_config, "service.backend_port").c_str(), log_id.c_str(), m_config->getCommandLineArgs().c_str(), getBackendSocket());
+	}
+
+	__block_signals();
+	if (m_pids[index] == ZYGOTE_PENDING_PID) {
+		m_pids[index] = pid;
+	}
+	for (std::list<StartingBackend>::iterator it = m_startingBackends.begin(); it != m_startingBackends.end(); it++) {
+		if (it->index == index && it->pid == ZYGOTE_PENDING_PID) {
+			it->pid = pid;
+		}
+	}
+	__unblock_signals();
+#endif
 }
 
 void NetworkPluginServer::loginDelayFinished() {
@@ -402,20 +733,37 @@ void NetworkPluginServer::handleNewClientConnection(SWIFTEN_SHRPTR_NAMESPACE::sh
 	client->shared = 0;
 	// Until we receive first PONG from backend, backend is in willDie state.
 	client->willDie = true;
-	// Backend does not accept new clients automatically if it's long-running
-	client->acceptUsers = !m_isNextLongRun;
-	client->longRun = m_isNextLongRun;
+	// We don't know which of the spawned processes connected, but they are
+	// all the same, so just take the role of the oldest one. Processes
+	// which died before connecting don't count.
+	expireStartingBackends(false);
+	bool longRun = false;
+	if (!m_startingBackends.empty()) {
+		longRun = m_startingBackends.front().longRun;
+		m_startingBackends.pop_front();
+	}
 
-	m_startingBackend = false;
+	// Backend does not accept new clients automatically if it's long-running
+	client->acceptUsers = !longRun;
+	client->longRun = longRun;
 
 	LOG4CXX_INFO(logger, "New" + (client->longRun ? std::string(" long-running") : "") +  " backend " << client << " connected. Current backend count=" << (m_clients.size() + 1));
 
 	m_clients.push_front(client);
+	m_pool->addBackend(client);
 
 	c->onDisconnected.connect(boost::bind(&NetworkPluginServer::handleSessionFinished, this, client));
+	if (m_decoder) {
+		m_decoder->addBackend(client);
+	}
 	c->onDataRead.connect(boost::bind(&NetworkPluginServer::handleDataRead, this, client, _1));
+	c->onDataWritten.connect(boost::bind(&NetworkPluginServer::handleDataWritten, this, client));
 	sendPing(client);
 
+	// Announce our API version. Backends supporting protocol v2 framing reply
+	// with their version, the others ignore it and we keep using v1 frames.
+	sendAPIVersion(client);
+
 	// sendPing sets pongReceived to 0, but we want to have it -1 to ignore this backend
 	// in first ::pingTimeout call, because it can be called right after this function
 	// and backend wouldn't have any time to response to ping.
@@ -427,6 +775,26 @@ void NetworkPluginServer::handleSessionFinished(Backend *c) {
 
 	// This backend will do, so we can't reconnect users to it in User::handleDisconnected call
 	c->willDie = true;
+	m_pool->removeBackend(c);
+	if (m_decoder) {
+		m_decoder->removeBackend(c);
+	}
+
+	// Users being moved away from this backend lost their session, so they are
+	// disconnected below. Users being moved to this backend go back to their
+	// old backend once it exports the session.
+	for (std::map<std::string, Backend *>::iterator it = m_migrations.begin(); it != m_migrations.end(); ) {
+		User *user = m_userManager->getUser(it->first);
+		if (user && user->getData() == c) {
+			user->setIgnoreDisconnect(false);
+			eraseMigration(it++);
+			continue;
+		}
+		if (it->second == c) {
+			it->second = NULL;
+		}
+		it++;
+	}
 
 	// If there are users associated with this backend, it must have crashed, so print error output
 	// and disconnect users
@@ -440,15 +808,13 @@ void NetworkPluginServer::handleSessionFinished(Backend *c) {
 		(*it)->handleDisconnected("Internal Server Error, please reconnect.");
 	}
 
-	std::string message;
-	pbnetwork::WrapperMessage wrap;
-	wrap.set_type(pbnetwork::WrapperMessage_Type_TYPE_EXIT);
-	wrap.SerializeToString(&message);
-
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_EXIT);
+	flush(c, true);
+	m_pendingFlush.remove(c);
 
 	c->connection->onDisconnected.disconnect_all_slots();
 	c->connection->onDataRead.disconnect_all_slots();
+	c->connection->onDataWritten.disconnect_all_slots();
 	c->connection->disconnect();
 	c->connection.reset();
 
@@ -513,14 +879,32 @@ void NetworkPluginServer::handleVCardPayload(const std::string &data) {
 	m_userManager->sendVCard(payload.id(), vcard);
 }
 
+User *NetworkPluginServer::getUser(unsigned int sessionId, const std::string &name) {
+	// Session ID is echoed only by backends which know it, the others are
+	// still served by looking up the JID.
+	if (sessionId) {
+		User *user = m_userManager->getUserBySessionId(sessionId);
+		if (user) {
+			// The generation part of session ID wraps, so stale ID can
+			// belong to another user now.
+			if (user->getJID().toBare().toString() != name) {
+				LOG4CXX_WARN(logger, "Session ID " << sessionId << " of " << name << " belongs to " << user->getJID().toBare().toString() << ", ignoring the message");
+				return NULL;
+			}
+			return user;
+		}
+	}
+	return m_userManager->getUser(name);
+}
+
 void NetworkPluginServer::handleAuthorizationPayload(const std::string &data) {
-	pbnetwork::Buddy payload;
+	pbnetwork::Buddy &payload = m_messages->buddy;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user)
 		return;
 
@@ -544,13 +928,13 @@ void NetworkPluginServer::handleAuthorizationPayload(const std::string &data) {
 }
 
 void NetworkPluginServer::handleChatStatePayload(const std::string &data, Swift::ChatState::ChatStateType type) {
-	pbnetwork::Buddy payload;
+	pbnetwork::Buddy &payload = m_messages->buddy;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user)
 		return;
 
@@ -568,17 +952,7 @@ void NetworkPluginServer::handleChatStatePayload(const std::string &data, Swift:
 	conv->handleMessage(msg);
 }
 
-void NetworkPluginServer::handleBuddyChangedPayload(const std::string &data) {
-	pbnetwork::Buddy payload;
-	if (payload.ParseFromString(data) == false) {
-		// TODO: ERROR
-		return;
-	}
-
-	User *user = m_userManager->getUser(payload.username());
-	if (!user)
-		return;
-
+static void handleBuddyChanged(Config *config, User *user, const pbnetwork::Buddy &payload) {
 	LocalBuddy *buddy = (LocalBuddy *) user->getRosterManager()->getBuddy(payload.buddyname());
 	if (buddy) {
 		handleBuddyPayload(buddy, payload);
@@ -592,7 +966,7 @@ void NetworkPluginServer::handleBuddyChangedPayload(const std::string &data) {
 		for (int i = 0; i < payload.group_size(); i++) {
 			groups.push_back(payload.group(i));
 		}
-		if (CONFIG_BOOL_DEFAULTED(m_config, "service.jid_escaping", true)) {
+		if (CONFIG_BOOL_DEFAULTED(config, "service.jid_escaping", true)) {
 			buddy = new LocalBuddy(user->getRosterManager(), -1, payload.buddyname(), payload.alias(), groups, BUDDY_JID_ESCAPING);
 		}
 		else {
@@ -610,14 +984,56 @@ void NetworkPluginServer::handleBuddyChangedPayload(const std::string &data) {
 	}
 }
 
+void NetworkPluginServer::handleBuddyChangedPayload(const std::string &data) {
+	pbnetwork::Buddy &payload = m_messages->buddy;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	User *user = getUser(payload.sessionid(), payload.username());
+	if (!user)
+		return;
+
+	handleBuddyChanged(m_config, user, payload);
+}
+
+void NetworkPluginServer::handleBuddiesChangedPayload(const std::string &data) {
+	pbnetwork::Buddies payload;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	// Roster changes of every user are applied in one batch, so they end up
+	// in single roster push and single storage transaction.
+	std::vector<RosterManager *> batches;
+	for (int i = 0; i < payload.buddy_size(); i++) {
+		User *user = getUser(payload.buddy(i).sessionid(), payload.buddy(i).username());
+		if (!user)
+			continue;
+
+		RosterManager *roster = user->getRosterManager();
+		if (std::find(batches.begin(), batches.end(), roster) == batches.end()) {
+			roster->beginBatch();
+			batches.push_back(roster);
+		}
+		handleBuddyChanged(m_config, user, payload.buddy(i));
+	}
+
+	BOOST_FOREACH(RosterManager *roster, batches) {
+		roster->endBatch();
+	}
+}
+
 void NetworkPluginServer::handleBuddyRemovedPayload(const std::string &data) {
-	pbnetwork::Buddy payload;
+	pbnetwork::Buddy &payload = m_messages->buddy;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user)
 		return;
 
@@ -625,13 +1041,13 @@ void NetworkPluginServer::handleBuddyRemovedPayload(const std::string &data) {
 }
 
 void NetworkPluginServer::handleParticipantChangedPayload(const std::string &data) {
-	pbnetwork::Participant payload;
+	pbnetwork::Participant &payload = m_messages->participant;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user)
 		return;
 
@@ -665,14 +1081,14 @@ void NetworkPluginServer::handleRoomChangedPayload(const std::string &data) {
 }
 
 void NetworkPluginServer::handleConvMessagePayload(const std::string &data, bool subject) {
-	pbnetwork::ConversationMessage payload;
+	pbnetwork::ConversationMessage &payload = m_messages->conversationMessage;
 
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user) {
 		LOG4CXX_ERROR(logger, "handleConvMessagePayload: unknown username " << payload.username());
 		return;
@@ -741,14 +1157,14 @@ void NetworkPluginServer::handleConvMessagePayload(const std::string &data, bool
 }
 
 void NetworkPluginServer::handleConvMessageAckPayload(const std::string &data) {
-	pbnetwork::ConversationMessage payload;
+	pbnetwork::ConversationMessage &payload = m_messages->conversationMessage;
 
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user)
 		return;
 
@@ -772,13 +1188,13 @@ void NetworkPluginServer::handleConvMessageAckPayload(const std::string &data) {
 }
 
 void NetworkPluginServer::handleAttentionPayload(const std::string &data) {
-	pbnetwork::ConversationMessage payload;
+	pbnetwork::ConversationMessage &payload = m_messages->conversationMessage;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
 	}
 
-	User *user = m_userManager->getUser(payload.username());
+	User *user = getUser(payload.sessionid(), payload.username());
 	if (!user)
 		return;
 
@@ -808,6 +1224,29 @@ void NetworkPluginServer::handleStatsPayload(Backend *c, const std::string &data
 	c->init_res = payload.init_res();
 	c->shared = payload.shared();
 	c->id = payload.id();
+	m_pool->updateBackend(c);
+}
+
+void NetworkPluginServer::handleAPIVersionPayload(Backend *c, const std::string &data) {
+	pbnetwork::APIVersion payload;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	// Use the highest version both sides understand.
+	c->apiVersion = std::min((int) payload.version(), NETWORK_PLUGIN_API_VERSION);
+	LOG4CXX_INFO(logger, "Backend " << c << " (ID=" << c->id << ") uses API version " << c->apiVersion);
+
+	c->sessionResume = c->apiVersion >= 3 && payload.sessionresume();
+	if (c->sessionResume) {
+		LOG4CXX_INFO(logger, "Backend " << c << " (ID=" << c->id << ") supports session resume");
+	}
+
+	if (m_compressionThreshold != 0 && payload.compressionthreshold() != 0) {
+		c->compressionThreshold = m_compressionThreshold;
+		LOG4CXX_INFO(logger, "Backend " << c << " (ID=" << c->id << ") accepted compression of frames bigger than " << c->compressionThreshold << " bytes");
+	}
 }
 
 void NetworkPluginServer::handleFTStartPayload(const std::string &data) {
@@ -834,8 +1273,10 @@ void NetworkPluginServer::handleFTStartPayload(const std::string &data) {
 	fileInfo.setName(payload.filename());
 
 	Backend *c = (Backend *) user->getData();
-	SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<MemoryReadBytestream> bytestream(new MemoryReadBytestream(payload.size()));
+	SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<MemoryReadBytestream> bytestream(new MemoryReadBytestream(payload.size(),
+		CONFIG_INT(m_config, "service.ft_low_watermark"), CONFIG_INT(m_config, "service.ft_high_watermark"), CONFIG_INT(m_config, "service.ft_memory_limit")));
 	bytestream->onDataNeeded.connect(boost::bind(&NetworkPluginServer::handleFTDataNeeded, this, c, bytestream_id + 1));
+	bytestream->onBufferFull.connect(boost::bind(&NetworkPluginServer::handleFTBufferFull, this, c, bytestream_id + 1));
 
 	LOG4CXX_INFO(logger, "jid=" << buddy->getJID());
 
@@ -890,18 +1331,15 @@ void NetworkPluginServer::handleFTDataPayload(Backend *b, const std::string &dat
 	FileTransferManager::Transfer &transfer = m_filetransfers[payload.ftid()];
 	MemoryReadBytestream *bytestream = (MemoryReadBytestream *) transfer.readByteStream.get();
 
-	if (bytestream->appendData(payload.data()) > 5000000) {
-		pbnetwork::FileTransferData f;
-		f.set_ftid(payload.ftid());
-		f.set_data("");
-
-		std::string message;
-		f.SerializeToString(&message);
+	bytestream->appendData(payload.data());
+}
 
-		WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_PAUSE);
+void NetworkPluginServer::handleFTBufferFull(Backend *b, unsigned long ftid) {
+	pbnetwork::FileTransferData f;
+	f.set_ftid(ftid);
+	f.set_data("");
 
-		send(b->connection, message);
-	}
+	send(b, pbnetwork::WrapperMessage_Type_TYPE_FT_PAUSE, f);
 }
 
 void NetworkPluginServer::handleFTDataNeeded(Backend *b, unsigned long ftid) {
@@ -909,12 +1347,7 @@ void NetworkPluginServer::handleFTDataNeeded(Backend *b, unsigned long ftid) {
 	f.set_ftid(ftid);
 	f.set_data("");
 
-	std::string message;
-	f.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_CONTINUE);
-
-	send(b->connection, message);
+	send(b, pbnetwork::WrapperMessage_Type_TYPE_FT_CONTINUE, f);
 }
 
 void NetworkPluginServer::connectWaitingUsers() {
@@ -945,6 +1378,7 @@ void NetworkPluginServer::handlePongReceived(Backend *c) {
 	if (c->pongReceived == -1) {
 		// Backend is fully ready to handle requests
 		c->willDie = false;
+		m_pool->updateBackend(c);
 
 		if (m_firstPong) {
 			// first backend connected, start the server, we're ready.
@@ -953,6 +1387,7 @@ void NetworkPluginServer::handlePongReceived(Backend *c) {
 		}
 
 		connectWaitingUsers();
+		spawnIdleBackends();
 	}
 
 	c->pongReceived = true;
@@ -980,12 +1415,7 @@ void NetworkPluginServer::handleQueryPayload(Backend *b, const std::string &data
 	response.set_config(msg->getBody());
 #endif
 
-	std::string message;
-	response.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_QUERY);
-
-	send(b->connection, message);
+	send(b, pbnetwork::WrapperMessage_Type_TYPE_QUERY, response);
 }
 
 void NetworkPluginServer::handleBackendConfigPayload(const std::string &data) {
@@ -1105,12 +1535,11 @@ void NetworkPluginServer::handleElement(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swi
 		return;
 	}
 
-	// TODO: Move m_id2resource in User and clean it up
 	SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::IQ> iq = SWIFTEN_SHRPTR_NAMESPACE::dynamic_pointer_cast<Swift::IQ>(stanza);
 	if (iq) {
-		if (m_id2resource.find(stanza->getTo().toBare().toString() + stanza->getID()) != m_id2resource.end()) {
-			iq->setTo(Swift::JID(iq->getTo().getNode(), iq->getTo().getDomain(), m_id2resource[stanza->getTo().toBare().toString() + stanza->getID()]));
-			m_id2resource.erase(stanza->getTo().toBare().toString() + stanza->getID());
+		std::string resource;
+		if (m_iqRoutes->takeRoute(stanza->getTo().toBare().toString(), stanza->getID(), resource)) {
+			iq->setTo(Swift::JID(iq->getTo().getNode(), iq->getTo().getDomain(), resource));
 		}
 		else {
 			Swift::Presence::ref highest = m_component->getPresenceOracle()->getHighestPriorityPresence(user->getJID());
@@ -1152,8 +1581,7 @@ void NetworkPluginServer::handleRawPresenceReceived(SWIFTEN_SHRPTR_NAMESPACE::sh
 	}
 
 	std::string xml = safeByteArrayToString(m_serializer->serializeElement(presence));
-	WRAP(xml, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML);
-	send(c->connection, xml);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, xml);
 }
 
 void NetworkPluginServer::handleRawIQReceived(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::IQ> iq) {
@@ -1167,7 +1595,7 @@ void NetworkPluginServer::handleRawIQReceived(SWIFTEN_SHRPTR_NAMESPACE::shared_p
 	}
 
 	if (iq->getType() == Swift::IQ::Get) {
-		m_id2resource[iq->getFrom().toBare().toString() + iq->getID()] = iq->getFrom().getResource();
+		m_iqRoutes->addRoute(iq->getFrom().toBare().toString(), iq->getID(), iq->getFrom().getResource());
 	}
 
 	Swift::JID legacyname = Swift::JID(Buddy::JIDToLegacyName(iq->getTo()));
@@ -1179,143 +1607,336 @@ void NetworkPluginServer::handleRawIQReceived(SWIFTEN_SHRPTR_NAMESPACE::shared_p
 	}
 
 	std::string xml = safeByteArrayToString(m_serializer->serializeElement(iq));
-	WRAP(xml, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML);
-	send(c->connection, xml);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, xml);
 }
 
 void NetworkPluginServer::handleDataRead(Backend *c, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray> data) {
+	if (data->empty()) {
+		return;
+	}
+
+	// Frames are split and decoded by BackendDecoder threads, which pass them
+	// back to handleFrame().
+	if (m_decoder) {
+		m_decoder->decode(c, *data);
+		return;
+	}
+
 	// Append data to buffer
-	c->data.insert(c->data.end(), data->begin(), data->end());
-
-	// Parse data while there are some
-	while (c->data.size() != 0) {
-		// expected_size of wrapper message
-		unsigned int expected_size;
-
-		// if data is >= 4, we have whole header and we can
-		// read expected_size.
-		if (c->data.size() >= 4) {
-			expected_size = *((unsigned int*) &c->data[0]);
-			expected_size = ntohl(expected_size);
-			// If we don't have whole wrapper message, wait for next
-			// handleDataRead call.
-			if (c->data.size() - 4 < expected_size)
-				return;
-		}
-		else {
-			return;
+	c->data.append((const char *) &(*data)[0], data->size());
+
+	// Parse data while there are some complete frames. Frames are parsed
+	// directly from the receive buffer, so nothing is copied or erased
+	// per frame.
+	const char *frame;
+	unsigned int expected_size;
+	int type;
+	pbnetwork::WrapperMessage &wrapper = m_messages->wrapper;
+	std::string &payload = m_messages->payload;
+	if (payload.capacity() > REUSED_BUFFER_LIMIT) {
+		std::string().swap(payload);
+	}
+	if (wrapper.payload().capacity() > REUSED_BUFFER_LIMIT) {
+		std::string().swap(*wrapper.mutable_payload());
+	}
+	while (c->data.nextFrame(frame, expected_size, type)) {
+		if (type == -1) {
+			// Parse wrapper message
+			if (wrapper.ParseFromArray(frame, expected_size) == false) {
+				std::cout << "PARSING ERROR " << expected_size << "\n";
+				continue;
+			}
+			type = wrapper.type();
+			payload.swap(*wrapper.mutable_payload());
 		}
-
-		// Parse wrapper message and erase it from buffer.
-		pbnetwork::WrapperMessage wrapper;
-		if (wrapper.ParseFromArray(&c->data[4], expected_size) == false) {
-			std::cout << "PARSING ERROR " << expected_size << "\n";
-			c->data.erase(c->data.begin(), c->data.begin() + 4 + expected_size);
-			continue;
+		else if (type & NETWORK_FRAME_COMPRESSED) {
+			type &= ~NETWORK_FRAME_COMPRESSED;
+			if (!NetworkFrameBuffer::decompress(frame, expected_size, payload)) {
+				LOG4CXX_ERROR(logger, "Backend " << c << " (ID=" << c->id << ") sent invalid compressed frame");
+				continue;
+			}
+			c->compressedBytes += expected_size;
+			c->uncompressedBytes += payload.size();
 		}
-		c->data.erase(c->data.begin(), c->data.begin() + 4 + expected_size);
-
-		// If backend is slow and it is sending us lot of message, there is possibility
-		// that we don't receive PONG response before timeout. However, if we received
-		// at least some data, it means backend is not dead and we can treat it as
-		// PONG received event.
-		if (c->pongReceived == false) {
-			c->pongReceived = true;
+		else {
+			// v2 frame contains just the payload
+			payload.assign(frame, expected_size);
 		}
 
-		// Handle payload in wrapper message
-		switch(wrapper.type()) {
-			case pbnetwork::WrapperMessage_Type_TYPE_CONNECTED:
-				handleConnectedPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_DISCONNECTED:
-				handleDisconnectedPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED:
-				handleBuddyChangedPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE:
-				handleConvMessagePayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED:
-				handleConvMessagePayload(wrapper.payload(), true);
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_PONG:
-				handlePongReceived(c);
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_PARTICIPANT_CHANGED:
-				handleParticipantChangedPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_ROOM_NICKNAME_CHANGED:
-				handleRoomChangedPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_VCARD:
-				handleVCardPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING:
-				handleChatStatePayload(wrapper.payload(), Swift::ChatState::Composing);
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED:
-				handleChatStatePayload(wrapper.payload(), Swift::ChatState::Paused);
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING:
-				handleChatStatePayload(wrapper.payload(), Swift::ChatState::Active);
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_AUTH_REQUEST:
-				handleAuthorizationPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_ATTENTION:
-				handleAttentionPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_STATS:
-				handleStatsPayload(c, wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_FT_START:
-				handleFTStartPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH:
-				handleFTFinishPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_FT_DATA:
-				handleFTDataPayload(c, wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED:
-				handleBuddyRemovedPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_QUERY:
-				handleQueryPayload(c, wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_BACKEND_CONFIG:
-				handleBackendConfigPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_ROOM_LIST:
-				handleRoomListPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE_ACK:
-				handleConvMessageAckPayload(wrapper.payload());
-				break;
-			case pbnetwork::WrapperMessage_Type_TYPE_RAW_XML:
-				handleRawXML(wrapper.payload());
-				break;
-			default:
-				return;
-		}
+		handleFrame(c, type, payload);
 	}
 }
 
-void NetworkPluginServer::send(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Connection> &c, const std::string &data) {
-	// generate header - size of wrapper message
-	uint32_t size = htonl(data.size());
-	char *header = (char *) &size;
-
-	// send header together with wrapper message
-	c->write(Swift::createSafeByteArray(std::string(header, 4) + data));
-}
-
-void NetworkPluginServer::pingTimeout() {
-	LOG4CXX_INFO(logger, "Sending PING to backends");
-	// TODO: move to separate timer, those 2 loops could be expensive
-	// Some users are connected for weeks and they are blocking backend to be destroyed and its memory
+void NetworkPluginServer::handleFrame(Backend *c, int type, const std::string &payload) {
+	// If backend is slow and it is sending us lot of message, there is possibility
+	// that we don't receive PONG response before timeout. However, if we received
+	// at least some data, it means backend is not dead and we can treat it as
+	// PONG received event.
+	if (c->pongReceived == false) {
+		c->pongReceived = true;
+	}
+	// Handle payload in wrapper message
+	switch(type) {
+		case pbnetwork::WrapperMessage_Type_TYPE_CONNECTED:
+			handleConnectedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_DISCONNECTED:
+			handleDisconnectedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED:
+			handleBuddyChangedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDIES_CHANGED:
+			handleBuddiesChangedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE:
+			handleConvMessagePayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED:
+			handleConvMessagePayload(payload, true);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_PONG:
+			handlePongReceived(c);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_PARTICIPANT_CHANGED:
+			handleParticipantChangedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_ROOM_NICKNAME_CHANGED:
+			handleRoomChangedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_VCARD:
+			handleVCardPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING:
+			handleChatStatePayload(payload, Swift::ChatState::Composing);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED:
+			handleChatStatePayload(payload, Swift::ChatState::Paused);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING:
+			handleChatStatePayload(payload, Swift::ChatState::Active);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_AUTH_REQUEST:
+			handleAuthorizationPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_ATTENTION:
+			handleAttentionPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_STATS:
+			handleStatsPayload(c, payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_START:
+			handleFTStartPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH:
+			handleFTFinishPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_FT_DATA:
+			handleFTDataPayload(c, payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED:
+			handleBuddyRemovedPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_QUERY:
+			handleQueryPayload(c, payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_BACKEND_CONFIG:
+			handleBackendConfigPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_ROOM_LIST:
+			handleRoomListPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE_ACK:
+			handleConvMessageAckPayload(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_RAW_XML:
+			handleRawXML(payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_API_VERSION:
+			handleAPIVersionPayload(c, payload);
+			break;
+		case pbnetwork::WrapperMessage_Type_TYPE_SESSION_EXPORTED:
+			handleSessionExportedPayload(c, payload);
+			break;
+		default:
+			return;
+	}
+}
+
+void NetworkPluginServer::send(Backend *c, int type, const google::protobuf::MessageLite &payload) {
+	if (c->congested && isSheddable(type)) {
+		c->shed++;
+		return;
+	}
+
+	std::string &output = c->output[getPriority(type)];
+	size_t size = output.size();
+	bool pending = c->queued != 0;
+
+	// Backends supporting v2 frames get the payload serialized directly into
+	// the output buffer. Big payloads have to be serialized first to be
+	// compressed.
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+	if (c->compressionThreshold != 0 && payload.ByteSizeLong() > c->compressionThreshold) {
+#else
+	if (c->compressionThreshold != 0 && (unsigned long) payload.ByteSize() > c->compressionThreshold) {
+#endif
+		std::string message;
+		payload.SerializeToString(&message);
+		appendCompressedFrame(c, output, type, message);
+	}
+	else if (c->apiVersion >= 2) {
+		NetworkFrameBuffer::appendFrame(output, type, payload);
+	}
+	else {
+		std::string message;
+		payload.SerializeToString(&message);
+		WRAP(message, (pbnetwork::WrapperMessage_Type) type);
+		NetworkFrameBuffer::appendFrame(output, message);
+	}
+
+	handleFrameQueued(c, pending, output.size() - size);
+}
+
+void NetworkPluginServer::send(Backend *c, int type, const std::string &payload) {
+	if (c->congested && isSheddable(type)) {
+		c->shed++;
+		return;
+	}
+
+	std::string &output = c->output[getPriority(type)];
+	size_t size = output.size();
+	bool pending = c->queued != 0;
+
+	if (c->compressionThreshold != 0 && payload.size() > c->compressionThreshold) {
+		appendCompressedFrame(c, output, type, payload);
+	}
+	else if (c->apiVersion >= 2) {
+		NetworkFrameBuffer::appendFrame(output, type, payload);
+	}
+	else {
+		std::string message = payload;
+		WRAP(message, (pbnetwork::WrapperMessage_Type) type);
+		NetworkFrameBuffer::appendFrame(output, message);
+	}
+
+	handleFrameQueued(c, pending, output.size() - size);
+}
+
+void NetworkPluginServer::appendCompressedFrame(Backend *c, std::string &output, int type, const std::string &payload) {
+	size_t size = output.size();
+	if (NetworkFrameBuffer::appendCompressedFrame(output, type, payload)) {
+		c->compressedBytes += output.size() - size - 6;
+		c->uncompressedBytes += payload.size();
+	}
+	else {
+		NetworkFrameBuffer::appendFrame(output, type, payload);
+	}
+}
+
+void NetworkPluginServer::handleFrameQueued(Backend *c, bool pending, size_t size) {
+	// Frames produced during single event loop turn are written to the
+	// backend together in flushBackends().
+	if (!pending) {
+		m_pendingFlush.push_back(c);
+	}
+	c->outputFrames++;
+	c->queued += size;
+
+	if (!c->congested && c->queued >= m_queueHighWatermark) {
+		LOG4CXX_WARN(logger, "Backend " << c << " (ID=" << c->id << ") does not read fast enough, " << c->queued << " bytes queued. Dropping presences and typing notifications.");
+		c->congested = true;
+	}
+
+	// Do not let the buffer grow without limit during big fan-outs.
+	if (c->queued >= m_outputBufferSize) {
+		flush(c);
+		if (c->queued == 0) {
+			m_pendingFlush.remove(c);
+		}
+		return;
+	}
+
+	if (!m_flushScheduled) {
+		m_flushScheduled = true;
+		m_component->m_loop->postEvent(boost::bind(&NetworkPluginServer::flushBackends, this), m_flushOwner);
+	}
+}
+
+std::string NetworkPluginServer::getBackendSocket() {
+#ifndef _WIN32
+	if (m_unixServer) {
+		return m_unixServer->getPath();
+	}
+#endif
+	return "";
+}
+
+void NetworkPluginServer::flush(Backend *c, bool all) {
+	if (c->queued == 0 || !c->connection) {
+		return;
+	}
+
+	// While the backend has not read the previous write, frames stay in our
+	// queue where they can still be reordered by priority and shed.
+	if (c->writing && !all) {
+		return;
+	}
+
+	// Take whole priority classes starting with the most important one, so
+	// single write does not get much bigger than the output buffer.
+	std::string data;
+	for (int i = 0; i < PRIORITY_COUNT; i++) {
+		if (c->output[i].empty()) {
+			continue;
+		}
+		if (!all && !data.empty() && data.size() + c->output[i].size() > m_outputBufferSize) {
+			break;
+		}
+		data.append(c->output[i]);
+		c->output[i].clear();
+	}
+	c->queued -= data.size();
+
+	c->flushes++;
+	if (c->queued == 0) {
+		c->flushedFrames += c->outputFrames;
+		c->outputFrames = 0;
+	}
+
+	if (c->congested && c->queued <= m_queueLowWatermark) {
+		LOG4CXX_INFO(logger, "Backend " << c << " (ID=" << c->id << ") is not congested anymore, " << c->shed << " frames dropped so far.");
+		c->congested = false;
+	}
+
+	c->writing = true;
+	c->connection->write(Swift::SafeByteArray(data.begin(), data.end()));
+}
+
+void NetworkPluginServer::handleDataWritten(Backend *c) {
+	c->writing = false;
+	flush(c);
+}
+
+void NetworkPluginServer::flushBackends() {
+	m_flushScheduled = false;
+
+	std::list<Backend *> backends;
+	backends.swap(m_pendingFlush);
+	for (std::list<Backend *>::const_iterator it = backends.begin(); it != backends.end(); it++) {
+		flush(*it);
+	}
+}
+
+void NetworkPluginServer::iqRouteTimeout() {
+	m_iqRoutes->tick();
+	m_iqRouteTimer->start();
+}
+
+void NetworkPluginServer::pingTimeout() {
+	LOG4CXX_INFO(logger, "Sending PING to backends");
+	// TODO: move to separate timer, those 2 loops could be expensive
+	// Some users are connected for weeks and they are blocking backend to be destroyed and its memory
 	// to be freed. We are finding users who are inactive for more than "idle_reconnect_time" seconds and
 	// reconnect them to long-running backend, where they can idle hapilly till the end of ages.
 	time_t now = time(NULL);
@@ -1344,13 +1965,28 @@ void NetworkPluginServer::pingTimeout() {
 		}
 	}
 
-	// We have to remove startingBackend flag otherwise 1 broken backend start could
-	// block the backend.
-	m_startingBackend = false;
+#ifndef _WIN32
+	// Backends forked by zygote are not our children, so SigCatcher does not
+	// see them exit. Free their log IDs here.
+	if (!m_zygotePath.empty()) {
+		for (std::vector<unsigned long>::iterator it = m_pids.begin(); it != m_pids.end(); it++) {
+			if (*it != 0 && *it != ZYGOTE_PENDING_PID && kill(*it, 0) == -1 && errno == ESRCH) {
+				*it = 0;
+			}
+		}
+	}
+#endif
+
+	// We have to forget backends which did not connect in time otherwise 1 broken
+	// backend start could block spawning new backends.
+	expireStartingBackends(true);
 
 	// check ping responses
 	std::vector<Backend *> toRemove;
+	unsigned long keptIdle = 0;
+	unsigned long keptIdleLongRun = 0;
 	for (std::list<Backend *>::const_iterator it = m_clients.begin(); it != m_clients.end(); it++) {
+		bool dead = false;
 		// pong has been received OR backend just connected and did not have time to answer the ping
 		// request.
 		if ((*it)->pongReceived || (*it)->pongReceived == -1) {
@@ -1366,6 +2002,7 @@ void NetworkPluginServer::pingTimeout() {
 		else {
 			LOG4CXX_INFO(logger, "Disconnecting backend " << (*it) << " (ID=" << (*it)->id << "). PING response not received.");
 			toRemove.push_back(*it);
+			dead = true;
 
 #ifndef WIN32
 			// generate coredump for this backend to find out why it wasn't able to respond to PING
@@ -1379,7 +2016,15 @@ void NetworkPluginServer::pingTimeout() {
 #endif
 		}
 
-		if ((*it)->users.size() == 0) {
+		if (!dead && (*it)->users.size() == 0) {
+			// Keep configured number of idle backends for the next logins.
+			if (isIdleBackend(*it)) {
+				unsigned long &kept = (*it)->longRun ? keptIdleLongRun : keptIdle;
+				if (kept < ((*it)->longRun ? m_idleLongRunBackends : m_idleBackends)) {
+					kept++;
+					continue;
+				}
+			}
 			LOG4CXX_INFO(logger, "Disconnecting backend " << (*it) << " (ID=" << (*it)->id << "). There are no users.");
 			toRemove.push_back(*it);
 		}
@@ -1389,6 +2034,8 @@ void NetworkPluginServer::pingTimeout() {
 		handleSessionFinished(b);
 	}
 
+	spawnIdleBackends();
+
 	m_pingTimer->start();
 }
 
@@ -1410,7 +2057,28 @@ void NetworkPluginServer::collectBackend() {
 			m_collectTimer->start();
 		}
 		LOG4CXX_INFO(logger, "Backend " << backend << " (ID=" << backend->id << ") is set to die");
+		// Long-running backends don't accept users on their own anyway, so
+		// they are taken out of the pool by willDie. Otherwise inactive users
+		// would still be moved to them and they would be picked as the target
+		// of their own users below.
 		backend->acceptUsers = false;
+		backend->willDie = true;
+		m_pool->updateBackend(backend);
+
+		// Move users away if it can be done without logging them in again, so
+		// the backend can be collected sooner. Every started migration
+		// reserves its place on the target, so the pool stops offering
+		// the target once it's full.
+		if (CONFIG_BOOL(m_config, "service.drain_collected_backend")) {
+			std::list<User *> users = backend->users;
+			BOOST_FOREACH(User *user, users) {
+				Backend *target = getFreeClient(!backend->longRun, backend->longRun, true);
+				if (!target) {
+					break;
+				}
+				migrateUser(user, target, false);
+			}
+		}
 	}
 }
 
@@ -1436,22 +2104,121 @@ bool NetworkPluginServer::moveToLongRunBackend(User *user) {
 		return false;
 	}
 
-	// old backend will trigger disconnection which has to be ignored to keep user online
-	user->setIgnoreDisconnect(true);
+	migrateUser(user, backend, true);
+	return true;
+}
+
+bool NetworkPluginServer::migrateUser(User *user, Backend *target, bool relogin) {
+	Backend *old = (Backend *) user->getData();
+	std::string name = user->getJID().toBare();
+	if (!old || old == target || m_migrations.find(name) != m_migrations.end()) {
+		return false;
+	}
+
+	// Export and import without resume support would log the user out and
+	// in again anyway.
+	if (!old->sessionResume || !target->sessionResume) {
+		if (!relogin) {
+			return false;
+		}
+
+		// old backend will trigger disconnection which has to be ignored to keep user online
+		user->setIgnoreDisconnect(true);
 
-	// remove user from the old backend
-	// If backend is empty, it will be collected by pingTimeout
-	old->users.remove(user);
+		// remove user from the old backend
+		// If backend is empty, it will be collected by pingTimeout
+		old->users.remove(user);
+		m_pool->updateBackend(old);
 
-	// switch to new backend and connect
-	user->setData(backend);
-	backend->users.push_back(user);
+		// switch to new backend and connect
+		user->setData(target);
+		target->users.push_back(user);
+		m_pool->updateBackend(target);
 
-	// connect him
-	handleUserReadyToConnect(user);
+		// connect him
+		handleUserReadyToConnect(user);
+		return true;
+	}
+
+	// Ask the old backend for the session. User stays there until it replies,
+	// so everything sent to him before is still handled by the old backend.
+	LOG4CXX_INFO(logger, "Moving session of user " << name << " from backend " << old->id << " to backend " << target->id);
+	user->setIgnoreDisconnect(true);
+	m_migrations[name] = target;
+	target->incoming++;
+	m_pool->updateBackend(target);
+
+	pbnetwork::SessionState state;
+	state.set_username(name);
+	state.set_legacyname(user->getUserInfo().uin);
+	send(old, pbnetwork::WrapperMessage_Type_TYPE_EXPORT_SESSION, state);
 	return true;
 }
 
+void NetworkPluginServer::eraseMigration(std::map<std::string, Backend *>::iterator it) {
+	Backend *target = it->second;
+	m_migrations.erase(it);
+	if (target) {
+		target->incoming--;
+		m_pool->updateBackend(target);
+	}
+}
+
+void NetworkPluginServer::handleSessionExportedPayload(Backend *c, const std::string &data) {
+	pbnetwork::SessionState payload;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	std::map<std::string, Backend *>::iterator it = m_migrations.find(payload.username());
+	if (it == m_migrations.end()) {
+		LOG4CXX_WARN(logger, "Session exported for user " << payload.username() << " who is not being moved");
+		return;
+	}
+
+	User *user = m_userManager->getUser(payload.username());
+	if (!user || user->getData() != c) {
+		eraseMigration(it);
+		return;
+	}
+
+	// Target backend disconnected in the meantime, so resume the session where
+	// it was before.
+	Backend *target = it->second ? it->second : c;
+	eraseMigration(it);
+
+	// Backend knows only its own part of the session, the rest comes from us.
+	UserInfo userInfo = user->getUserInfo();
+	payload.set_legacyname(userInfo.uin);
+	payload.set_password(userInfo.password);
+	payload.set_sessionid(user->getSessionId());
+	addRosterSnapshot(user, payload.mutable_buddy());
+
+	std::map<std::string, Conversation *> &conversations = user->getConversationManager()->getConversations();
+	for (std::map<std::string, Conversation *>::const_iterator ct = conversations.begin(); ct != conversations.end(); ct++) {
+		Conversation *conv = ct->second;
+		if (!conv->isMUC()) {
+			continue;
+		}
+
+		pbnetwork::Room *room = payload.add_room();
+		room->set_username(user->getJID().toBare());
+		room->set_nickname(conv->getNickname());
+		room->set_room(conv->getLegacyName());
+	}
+
+	c->users.remove(user);
+	m_pool->updateBackend(c);
+
+	user->setData(target);
+	target->users.push_back(user);
+	m_pool->updateBackend(target);
+
+	LOG4CXX_INFO(logger, "Session of user " << payload.username() << " exported, importing it to backend " << target->id);
+	send(target, pbnetwork::WrapperMessage_Type_TYPE_IMPORT_SESSION, payload);
+}
+
 void NetworkPluginServer::handleUserCreated(User *user) {
 	// Get free backend to handle this user or spawn new one if there's no free one.
 	Backend *c = getFreeClient();
@@ -1466,6 +2233,10 @@ void NetworkPluginServer::handleUserCreated(User *user) {
 	// Associate users with backend
 	user->setData(c);
 	c->users.push_back(user);
+	m_pool->updateBackend(c);
+
+	// Replace the idle backend this user might have just taken.
+	spawnIdleBackends();
 
 	// Don't forget to disconnect these in handleUserDestroyed!!!
 	user->onReadyToConnect.connect(boost::bind(&NetworkPluginServer::handleUserReadyToConnect, this, user));
@@ -1485,45 +2256,20 @@ void NetworkPluginServer::handleUserReadyToConnect(User *user) {
 	login.set_user(user->getJID().toBare());
 	login.set_legacyname(userInfo.uin);
 	login.set_password(userInfo.password);
+	login.set_sessionid(user->getSessionId());
 
-	std::string message;
-	login.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_LOGIN);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_LOGIN, login);
 
 	// Send buddies
 	if (CONFIG_BOOL_DEFAULTED(m_config, "features.send_buddies_on_login", false)) {
 		pbnetwork::Buddies buddies;
-
-		const RosterManager::BuddiesMap &roster = user->getRosterManager()->getBuddies();
-		for(RosterManager::BuddiesMap::const_iterator bt = roster.begin(); bt != roster.end(); bt++) {
-			Buddy *b = (*bt).second;
-			if (!b) {
-				continue;
-			}
-
-			pbnetwork::Buddy *buddy = buddies.add_buddy();
-			buddy->set_username(user->getJID().toBare());
-			buddy->set_buddyname(b->getName());
-			buddy->set_alias(b->getAlias());
-			buddy->set_iconhash(b->getIconHash());
-			BOOST_FOREACH(const std::string &g, b->getGroups()) {
-				buddy->add_group(g);
-			}
-			buddy->set_status(pbnetwork::STATUS_NONE);
-		}
-
-		std::string msg;
-		buddies.SerializeToString(&msg);
-
-		WRAP(msg, pbnetwork::WrapperMessage_Type_TYPE_BUDDIES);
-		send(c->connection, msg);
+		addRosterSnapshot(user, buddies.mutable_buddy());
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_BUDDIES, buddies);
 	}
 }
 
@@ -1549,16 +2295,12 @@ void NetworkPluginServer::handleUserPresenceChanged(User *user, Swift::Presence:
 
 	status.set_statusmessage(presence->getStatus());
 
-	std::string message;
-	status.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_STATUS_CHANGED);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_STATUS_CHANGED, status);
 }
 
 void NetworkPluginServer::handleRoomJoined(User *user, const Swift::JID &who, const std::string &r, const std::string &nickname, const std::string &password) {
@@ -1570,16 +2312,12 @@ void NetworkPluginServer::handleRoomJoined(User *user, const Swift::JID &who, co
 	room.set_room(r);
 	room.set_password(password);
 
-	std::string message;
-	room.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_JOIN_ROOM);
  
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_JOIN_ROOM, room);
 }
 
 void NetworkPluginServer::handleRoomLeft(User *user, const std::string &r) {
@@ -1591,20 +2329,20 @@ void NetworkPluginServer::handleRoomLeft(User *user, const std::string &r) {
 	room.set_room(r);
 	room.set_password("");
 
-	std::string message;
-	room.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_LEAVE_ROOM);
  
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_LEAVE_ROOM, room);
 }
 
 void NetworkPluginServer::handleUserDestroyed(User *user) {
 	m_waitingUsers.remove(user);
+	std::map<std::string, Backend *>::iterator migration = m_migrations.find(user->getJID().toBare());
+	if (migration != m_migrations.end()) {
+		eraseMigration(migration);
+	}
 	UserInfo userInfo = user->getUserInfo();
 
 	user->onReadyToConnect.disconnect(boost::bind(&NetworkPluginServer::handleUserReadyToConnect, this, user));
@@ -1620,16 +2358,12 @@ void NetworkPluginServer::handleUserDestroyed(User *user) {
 	logout.set_user(user->getJID().toBare());
 	logout.set_legacyname(userInfo.uin);
 
-	std::string message;
-	logout.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_LOGOUT);
  
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_LOGOUT, logout);
 	c->users.remove(user);
 
 	// If backend should handle only one user, it must not accept another one before 
@@ -1638,6 +2372,7 @@ void NetworkPluginServer::handleUserDestroyed(User *user) {
 		LOG4CXX_INFO(logger, "Backend " << c->id << " will die, because the last user disconnected");
 		c->willDie = true;
 	}
+	m_pool->updateBackend(c);
 }
 
 void NetworkPluginServer::handleMessageReceived(NetworkConversation *conv, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Message> &msg) {
@@ -1656,8 +2391,7 @@ void NetworkPluginServer::handleMessageReceived(NetworkConversation *conv, SWIFT
 			msg->setTo(Swift::JID(legacyname.getNode(), legacyname.getDomain()));
 		}
 		std::string xml = safeByteArrayToString(m_serializer->serializeElement(msg));
-		WRAP(xml, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML);
-		send(c->connection, xml);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, xml);
 		return;
 	}
 
@@ -1682,16 +2416,12 @@ void NetworkPluginServer::handleMessageReceived(NetworkConversation *conv, SWIFT
 			buddy.set_username(conv->getConversationManager()->getUser()->getJID().toBare());
 			buddy.set_buddyname(conv->getLegacyName());
 
-			std::string message;
-			buddy.SerializeToString(&message);
-
-			WRAP(message, type);
 
 			Backend *c = (Backend *) conv->getConversationManager()->getUser()->getData();
 			if (!c) {
 				return;
 			}
-			send(c->connection, message);
+			send(c, type, buddy);
 		}
 	}
 
@@ -1706,13 +2436,9 @@ void NetworkPluginServer::handleMessageReceived(NetworkConversation *conv, SWIFT
 		m.set_message(msg->getBody());
 #endif
 
-		std::string message;
-		m.SerializeToString(&message);
-
-		WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_ATTENTION);
 
 		Backend *c = (Backend *) conv->getConversationManager()->getUser()->getData();
-		send(c->connection, message);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_ATTENTION, m);
 		return;
 	}
 
@@ -1722,13 +2448,9 @@ void NetworkPluginServer::handleMessageReceived(NetworkConversation *conv, SWIFT
 		m.set_buddyname(conv->getLegacyName());
 		m.set_message(msg->getSubject());
 
-		std::string message;
-		m.SerializeToString(&message);
-
-		WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED);
 
 		Backend *c = (Backend *) conv->getConversationManager()->getUser()->getData();
-		send(c->connection, message);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED, m);
 		return;
 	}
 	
@@ -1756,16 +2478,12 @@ void NetworkPluginServer::handleMessageReceived(NetworkConversation *conv, SWIFT
 			m.set_id(msg->getID());
 		}
 
-		std::string message;
-		m.SerializeToString(&message);
-
-		WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE);
 
 		Backend *c = (Backend *) conv->getConversationManager()->getUser()->getData();
 		if (!c) {
 			return;
 		}
-		send(c->connection, message);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE, m);
 	}
 }
 
@@ -1781,16 +2499,12 @@ void NetworkPluginServer::handleBuddyRemoved(Buddy *b) {
 	}
 	buddy.set_status(pbnetwork::STATUS_NONE);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED, buddy);
 }
 
 void NetworkPluginServer::handleBuddyUpdated(Buddy *b, const Swift::RosterItemPayload &item) {
@@ -1808,16 +2522,12 @@ void NetworkPluginServer::handleBuddyUpdated(Buddy *b, const Swift::RosterItemPa
 	}
 	buddy.set_status(pbnetwork::STATUS_NONE);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED, buddy);
 }
 
 void NetworkPluginServer::handleBuddyAdded(Buddy *buddy, const Swift::RosterItemPayload &item) {
@@ -1834,16 +2544,12 @@ void NetworkPluginServer::handleUserBuddyAdded(User *user, Buddy *b) {
 	}
 	buddy.set_status(pbnetwork::STATUS_NONE);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED, buddy);
 }
 
 void NetworkPluginServer::handleUserBuddyRemoved(User *user, Buddy *b) {
@@ -1863,16 +2569,12 @@ void NetworkPluginServer::handleBlockToggled(Buddy *b) {
 	buddy.set_status(pbnetwork::STATUS_NONE);
 	buddy.set_blocked(!b->isBlocked());
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED, buddy);
 }
 
 
@@ -1889,16 +2591,12 @@ void NetworkPluginServer::handleVCardUpdated(User *user, SWIFTEN_SHRPTR_NAMESPAC
 	vcard.set_photo(&v->getPhoto()[0], v->getPhoto().size());
 	vcard.set_nickname(v->getNickname());
 
-	std::string message;
-	vcard.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_VCARD);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_VCARD, vcard);
 }
 
 void NetworkPluginServer::handleVCardRequired(User *user, const std::string &name, unsigned int id) {
@@ -1907,16 +2605,12 @@ void NetworkPluginServer::handleVCardRequired(User *user, const std::string &nam
 	vcard.set_buddyname(name);
 	vcard.set_id(id);
 
-	std::string message;
-	vcard.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_VCARD);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_VCARD, vcard);
 }
 
 void NetworkPluginServer::handleFTAccepted(User *user, const std::string &buddyName, const std::string &fileName, unsigned long size, unsigned long ftID) {
@@ -1927,16 +2621,12 @@ void NetworkPluginServer::handleFTAccepted(User *user, const std::string &buddyN
 	f.set_size(size);
 	f.set_ftid(ftID);
 
-	std::string message;
-	f.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_START);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_FT_START, f);
 }
 
 void NetworkPluginServer::handleFTRejected(User *user, const std::string &buddyName, const std::string &fileName, unsigned long size) {
@@ -1947,16 +2637,12 @@ void NetworkPluginServer::handleFTRejected(User *user, const std::string &buddyN
 	f.set_size(size);
 	f.set_ftid(0);
 
-	std::string message;
-	f.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH);
 
 	Backend *c = (Backend *) user->getData();
 	if (!c) {
 		return;
 	}
-	send(c->connection, message);
+	send(c, pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH, f);
 }
 
 void NetworkPluginServer::handleFTStateChanged(Swift::FileTransfer::State state, const std::string &userName, const std::string &buddyName, const std::string &fileName, unsigned long size, unsigned long id) {
@@ -1976,15 +2662,9 @@ void NetworkPluginServer::handleFTStateChanged(Swift::FileTransfer::State state,
 }
 
 void NetworkPluginServer::sendPing(Backend *c) {
-
-	std::string message;
-	pbnetwork::WrapperMessage wrap;
-	wrap.set_type(pbnetwork::WrapperMessage_Type_TYPE_PING);
-	wrap.SerializeToString(&message);
-
 	if (c->connection) {
 		LOG4CXX_INFO(logger, "PING to " << c << " (ID=" << c->id << ")");
-		send(c->connection, message);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_PING);
 		c->pongReceived = false;
 	}
 	else {
@@ -1997,15 +2677,14 @@ void NetworkPluginServer::sendAPIVersion(Backend *c) {
 
 	pbnetwork::APIVersion apiver;
 	apiver.set_version(NETWORK_PLUGIN_API_VERSION);
+	if (m_compressionThreshold != 0) {
+		apiver.set_compressionthreshold(m_compressionThreshold);
+	}
 
-	std::string message;
-	apiver.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_API_VERSION);
 
 	if (c->connection) {
 		LOG4CXX_INFO(logger, "API Version to " << c << " (ID=" << c->id << ")");
-		send(c->connection, message);
+		send(c, pbnetwork::WrapperMessage_Type_TYPE_API_VERSION, apiver);
 	}
 }
 
@@ -2017,49 +2696,6 @@ void NetworkPluginServer::handlePIDTerminated(unsigned long pid) {
 	}
 }
 
-#ifndef _WIN32
-
-static int sig_block_count = 0;
-static sigset_t block_mask;
-
-static void __block_signals ( void )
-{
-  static int init_done = 0;
-
-  if ( (sig_block_count++) != 1 ) return;
-
-  if ( init_done == 0 ) {
-    sigemptyset ( &block_mask );
-    sigaddset ( &block_mask, SIGPIPE );
-    sigaddset ( &block_mask, SIGHUP );
-    sigaddset ( &block_mask, SIGINT );
-    sigaddset ( &block_mask, SIGQUIT );
-    sigaddset ( &block_mask, SIGTERM );
-    sigaddset ( &block_mask, SIGABRT );
-    sigaddset ( &block_mask, SIGCHLD );
-    init_done = 1;
-  }
-
-  sigprocmask ( SIG_BLOCK, &block_mask, NULL );
-  return;
-}
-
-static void __unblock_signals ( void )
-{
-  sigset_t sigset;
-
-  if ( (sig_block_count--) != 0 ) return;
-  sigprocmask ( SIG_UNBLOCK, &block_mask, NULL );
-
-  if ( sigpending ( &sigset ) == 0 ) {
-    if ( sigismember ( &sigset, SIGCHLD ) ) {
-      raise ( SIGCHLD );
-    }
-  }
-}
-
-#endif
-
 NetworkPluginServer::Backend *NetworkPluginServer::getFreeClient(bool acceptUsers, bool longRun, bool check) {
 	NetworkPluginServer::Backend *c = NULL;
 
@@ -2078,50 +2714,156 @@ NetworkPluginServer::Backend *NetworkPluginServer::getFreeClient(bool acceptUser
 		m_lastLogin = time(NULL);
 	}
 
-	// Check all backends and find free one
-	for (std::list<Backend *>::const_iterator it = m_clients.begin(); it != m_clients.end(); it++) {
-		if ((*it)->willDie == false && (*it)->acceptUsers == acceptUsers && (*it)->users.size() < CONFIG_INT(m_config, "service.users_per_backend") && (*it)->connection && (*it)->longRun == longRun) {
-			c = *it;
-			// if we're not reusing all backends and backend is full, stop accepting new users on this backend
-			if (!CONFIG_BOOL(m_config, "service.reuse_old_backends")) {
-				if (!check && c->users.size() + 1 >= CONFIG_INT(m_config, "service.users_per_backend")) {
-					c->acceptUsers = false;
-				}
+	// Find free backend according to service.backend_placement
+	c = m_pool->getBackend(acceptUsers, longRun);
+	if (c) {
+		// if we're not reusing all backends and backend is full, stop accepting new users on this backend
+		if (!CONFIG_BOOL(m_config, "service.reuse_old_backends")) {
+			if (!check && c->users.size() + c->incoming + 1 >= CONFIG_INT(m_config, "service.users_per_backend")) {
+				c->acceptUsers = false;
+				m_pool->updateBackend(c);
 			}
-			break;
 		}
 	}
 
-	// there's no free backend, so spawn one.
-	if (c == NULL && !m_startingBackend) {
-		m_isNextLongRun = longRun;
-		m_startingBackend = true;
+	// there's no free backend, so spawn new ones.
+	if (c == NULL) {
+		spawnBackends(longRun);
+	}
 
-#ifndef _WIN32
-		__block_signals();
-#endif
-		std::vector<unsigned long>::iterator log_id_it;
-		log_id_it = std::find(m_pids.begin(), m_pids.end(), 0);
-		std::string log_id = "";
-		if (log_id_it == m_pids.end()) {
-			log_id = boost::lexical_cast<std::string>(m_pids.size() + 1);
-		}
-		else {
-			log_id = boost::lexical_cast<std::string>(log_id_it - m_pids.begin() + 1);
+	return c;
+}
+
+void NetworkPluginServer::spawnBackends(bool longRun) {
+	unsigned long needed = 1;
+	if (!longRun) {
+		// Spawn enough backends for all the waiting users including the one
+		// we are looking for backend for now.
+		unsigned long usersPerBackend = std::max(1, CONFIG_INT(m_config, "service.users_per_backend"));
+		needed = (m_waitingUsers.size() + usersPerBackend) / usersPerBackend;
+	}
+
+	unsigned long starting = getStartingBackendsCount(longRun);
+	while (starting < needed && m_startingBackends.size() < m_maxStartingBackends) {
+		spawnBackend(longRun);
+		starting++;
+	}
+}
+
+unsigned long NetworkPluginServer::getStartingBackendsCount(bool longRun) {
+	unsigned long count = 0;
+	for (std::list<StartingBackend>::const_iterator it = m_startingBackends.begin(); it != m_startingBackends.end(); it++) {
+		if (it->longRun == longRun) {
+			count++;
 		}
-		unsigned long pid = exec_(CONFIG_STRING(m_config, "service.backend"), CONFIG_STRING(m_config, "service.backend_host").c_str(), CONFIG_STRING(m_config, "service.backend_port").c_str(), log_id.c_str(), m_config->getCommandLineArgs().c_str());
-		if (log_id_it == m_pids.end()) {
-			m_pids.push_back(pid);
+	}
+	return count;
+}
+
+void NetworkPluginServer::expireStartingBackends(bool all) {
+	// SigCatcher resets the pid in m_pids once the process exits. Optionally
+	// forget also the processes which did not connect within one ping period.
+	time_t now = time(NULL);
+	std::list<StartingBackend>::iterator it = m_startingBackends.begin();
+	while (it != m_startingBackends.end()) {
+		if (m_pids[it->index] != it->pid || (all && now - it->started >= 20)) {
+			LOG4CXX_WARN(logger, "Backend with pid " << it->pid << " did not connect");
+			it = m_startingBackends.erase(it);
 		}
 		else {
-			*log_id_it = pid;
+			it++;
 		}
+	}
+}
+
+void NetworkPluginServer::spawnBackend(bool longRun) {
 #ifndef _WIN32
-		__unblock_signals();
+	__block_signals();
 #endif
+	std::vector<unsigned long>::iterator log_id_it;
+	log_id_it = std::find(m_pids.begin(), m_pids.end(), 0);
+	std::string log_id = "";
+	if (log_id_it == m_pids.end()) {
+		log_id = boost::lexical_cast<std::string>(m_pids.size() + 1);
+	}
+	else {
+		log_id = boost::lexical_cast<std::string>(log_id_it - m_pids.begin() + 1);
+	}
+	unsigned long pid = 0;
+	if (!m_zygotePath.empty() && requestFromZygote(log_id)) {
+		pid = ZYGOTE_PENDING_PID;
+	}
+	if (pid == 0) {
+		pid = exec_(CONFIG_STRING(m_config, "service.backend"), CONFIG_STRING(m_config, "service.backend_host").c_str(), CONFIG_STRING(m_config, "service.backend_port").c_str(), log_id.c_str(), m_config->getCommandLineArgs().c_str(), getBackendSocket());
+	}
+	StartingBackend starting;
+	if (log_id_it == m_pids.end()) {
+		starting.index = m_pids.size();
+		m_pids.push_back(pid);
+	}
+	else {
+		starting.index = log_id_it - m_pids.begin();
+		*log_id_it = pid;
 	}
+#ifndef _WIN32
+	__unblock_signals();
+#endif
 
-	return c;
+	if (pid == ZYGOTE_PENDING_PID) {
+		LOG4CXX_INFO(logger, "Requested" << (longRun ? " long-running" : "") << " backend from zygote, " << (m_startingBackends.size() + 1) << " backends are starting now");
+	}
+	else {
+		LOG4CXX_INFO(logger, "Spawned" << (longRun ? " long-running" : "") << " backend with pid " << pid << ", " << (m_startingBackends.size() + 1) << " backends are starting now");
+	}
+	starting.pid = pid;
+	starting.longRun = longRun;
+	starting.started = time(NULL);
+	m_startingBackends.push_back(starting);
+#ifndef _WIN32
+	if (pid == ZYGOTE_PENDING_PID) {
+		m_zygoteRequests.push_back(starting.index);
+	}
+#endif
+}
+
+bool NetworkPluginServer::isIdleBackend(Backend *c) {
+	// Long-running backends never accept users on their own, normal backends
+	// do until they are set to die. Backends which did not answer the first
+	// PING yet are idle too, they are just warming up.
+	return c->users.empty() && c->connection && c->acceptUsers == !c->longRun &&
+		(!c->willDie || c->pongReceived == -1);
+}
+
+void NetworkPluginServer::spawnIdleBackends() {
+	if (m_idleBackends == 0 && m_idleLongRunBackends == 0) {
+		return;
+	}
+
+	// Backends which are still starting will be idle too.
+	unsigned long idle = getStartingBackendsCount(false);
+	unsigned long idleLongRun = getStartingBackendsCount(true);
+	for (std::list<Backend *>::const_iterator it = m_clients.begin(); it != m_clients.end(); it++) {
+		if (isIdleBackend(*it)) {
+			if ((*it)->longRun) {
+				idleLongRun++;
+			}
+			else {
+				idle++;
+			}
+		}
+	}
+
+	while (idle < m_idleBackends && m_startingBackends.size() < m_maxStartingBackends) {
+		LOG4CXX_INFO(logger, "Spawning idle backend, there are " << idle << " idle backends now");
+		spawnBackend(false);
+		idle++;
+	}
+
+	while (idleLongRun < m_idleLongRunBackends && m_startingBackends.size() < m_maxStartingBackends) {
+		LOG4CXX_INFO(logger, "Spawning idle long-running backend, there are " << idleLongRun << " idle long-running backends now");
+		spawnBackend(true);
+		idleLongRun++;
+	}
 }
 
 }
@@ -0,0 +1,202 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "transport/OnlineUsersFlusher.h"
+#include "transport/AsyncStorageBackend.h"
+#include "transport/Transport.h"
+#include "transport/Logging.h"
+
+#include "Swiften/Network/NetworkFactories.h"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+
+namespace Transport {
+
+DEFINE_LOGGER(logger, "OnlineUsersFlusher");
+
+// Retries of failed flush are delayed up to 2^MAX_BACKOFF intervals.
+#define MAX_BACKOFF 4
+
+// Maximum number of users changed by single statement.
+#define BATCH_SIZE 1000
+
+OnlineUsersFlusher::OnlineUsersFlusher(Component *component, AsyncStorageBackend *storage, int interval, const std::string &journal) {
+	m_component = component;
+	m_storage = storage;
+	m_interval = interval;
+	m_journalPath = journal;
+	m_failures = 0;
+	m_lastBatch = 0;
+
+	if (m_journalPath.empty()) {
+		return;
+	}
+
+	loadJournal();
+	m_journal.open(m_journalPath.c_str(), std::ios::out | std::ios::app);
+	if (!m_journal.is_open()) {
+		LOG4CXX_ERROR(logger, "Can't open " << m_journalPath << ", online state of users won't survive crash");
+	}
+
+	if (!m_pending.empty()) {
+		LOG4CXX_INFO(logger, "Storing online state of " << m_pending.size() << " users left in " << m_journalPath);
+		flush();
+	}
+}
+
+OnlineUsersFlusher::~OnlineUsersFlusher() {
+	flush();
+
+	// Failed flush without the pool schedules the retry.
+	if (m_timer) {
+		m_timer->stop();
+		m_timer->onTick.disconnect(boost::bind(&OnlineUsersFlusher::scheduledFlush, this));
+	}
+}
+
+void OnlineUsersFlusher::loadJournal() {
+	std::ifstream journal(m_journalPath.c_str());
+	long id;
+	int online;
+	// Line which has not been written completely before the crash ends
+	// the loop.
+	while (journal >> id >> online) {
+		m_pending[id] = online != 0;
+	}
+}
+
+void OnlineUsersFlusher::rewriteJournal() {
+	if (!m_journal.is_open()) {
+		return;
+	}
+
+	m_journal.close();
+	m_journal.open(m_journalPath.c_str(), std::ios::out | std::ios::trunc);
+	for (std::map<long, bool>::const_iterator it = m_pending.begin(); it != m_pending.end(); it++) {
+		m_journal << it->first << " " << it->second << "\n";
+	}
+	m_journal.flush();
+}
+
+void OnlineUsersFlusher::setUserOnline(long id, bool online) {
+	m_pending[id] = online;
+
+	if (m_journal.is_open()) {
+		m_journal << id << " " << online << "\n";
+		m_journal.flush();
+	}
+
+	schedule();
+}
+
+void OnlineUsersFlusher::schedule() {
+	if (m_timer || m_pending.empty()) {
+		return;
+	}
+
+	int delay = m_interval * (1 << std::min(m_failures, MAX_BACKOFF));
+	m_timer = m_component->getNetworkFactories()->getTimerFactory()->createTimer(delay * 1000);
+	m_timer->onTick.connect(boost::bind(&OnlineUsersFlusher::scheduledFlush, this));
+	m_timer->start();
+}
+
+void OnlineUsersFlusher::scheduledFlush() {
+	if (m_timer) {
+		m_timer->stop();
+		m_timer->onTick.disconnect(boost::bind(&OnlineUsersFlusher::scheduledFlush, this));
+		m_timer.reset();
+	}
+
+	flush();
+}
+
+void OnlineUsersFlusher::flush() {
+	if (m_pending.empty()) {
+		return;
+	}
+
+	BatchRef batch(new Batch());
+	batch->id = ++m_lastBatch;
+	batch->states.swap(m_pending);
+	batch->pending = 0;
+	batch->stored = true;
+
+	std::vector<long> online;
+	std::vector<long> offline;
+	for (std::map<long, bool>::const_iterator it = batch->states.begin(); it != batch->states.end(); it++) {
+		(it->second ? online : offline).push_back(it->first);
+		Sent &sent = m_sent[it->first];
+		sent.batch = batch->id;
+		sent.pending++;
+	}
+
+	// All requests are counted before the first one is sent, because
+	// without the pool they finish immediately.
+	batch->pending = (offline.size() + BATCH_SIZE - 1) / BATCH_SIZE + (online.size() + BATCH_SIZE - 1) / BATCH_SIZE;
+	m_batches.push_back(batch);
+	store(batch, offline, false);
+	store(batch, online, true);
+}
+
+void OnlineUsersFlusher::store(BatchRef batch, const std::vector<long> &ids, bool online) {
+	for (std::vector<long>::const_iterator it = ids.begin(); it != ids.end();) {
+		std::vector<long>::const_iterator end = ids.end() - it > BATCH_SIZE ? it + BATCH_SIZE : ids.end();
+		m_storage->setUsersOnline(std::vector<long>(it, end), online, boost::bind(&OnlineUsersFlusher::handleStored, this, batch, _1));
+		it = end;
+	}
+}
+
+void OnlineUsersFlusher::handleStored(BatchRef batch, bool stored) {
+	batch->stored = batch->stored && stored;
+	if (--batch->pending != 0) {
+		return;
+	}
+	m_batches.remove(batch);
+
+	if (batch->stored) {
+		LOG4CXX_INFO(logger, "Stored online state of " << batch->states.size() << " users");
+		m_failures = 0;
+	}
+	else {
+		LOG4CXX_ERROR(logger, "Storing online state of " << batch->states.size() << " users failed, will retry later");
+		m_failures++;
+	}
+
+	for (std::map<long, bool>::const_iterator it = batch->states.begin(); it != batch->states.end(); it++) {
+		std::map<long, Sent>::iterator sent = m_sent.find(it->first);
+		// States changed in the meantime or sent by later batch are newer,
+		// even when that batch has finished before this one.
+		if (!batch->stored && sent->second.batch == batch->id) {
+			m_pending.insert(*it);
+		}
+		if (--sent->second.pending == 0) {
+			m_sent.erase(sent);
+		}
+	}
+
+	if (m_batches.empty()) {
+		rewriteJournal();
+	}
+	schedule();
+}
+
+}
@@ -31,9 +31,17 @@ namespace Transport {
 
 static LoggerPtr logger = Logger::getLogger("PQXXBackend");
 
+#define PQXX_DB_VERSION 2
+
+// Statements taking longer than this (in microseconds) are logged.
+#define SLOW_STATEMENT 100000
+// Maximum number of buddies written by single statement in storeBuddies().
+#define BULK_SIZE 500
+
 PQXXBackend::PQXXBackend(Config *config) {
 	m_config = config;
 	m_prefix = CONFIG_STRING(m_config, "database.prefix");
+	m_conn = NULL;
 }
 
 PQXXBackend::~PQXXBackend(){
@@ -42,8 +50,26 @@ PQXXBackend::~PQXXBackend(){
 
 void PQXXBackend::disconnect() {
 	LOG4CXX_INFO(logger, "Disconnecting");
+	logTimings();
 
 	delete m_conn;
+	m_conn = NULL;
+}
+
+bool PQXXBackend::ping() {
+	if (!m_conn || !m_conn->is_open()) {
+		return false;
+	}
+
+	try {
+		pqxx::nontransaction txn(*m_conn);
+		txn.exec("SELECT 1");
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+		return false;
+	}
+	return true;
 }
 
 bool PQXXBackend::connect() {
@@ -82,24 +108,16 @@ bool PQXXBackend::connect() {
 	}
 
 	createDatabase();
+	prepareStatements();
 
 	return true;
 }
 
 bool PQXXBackend::createDatabase() {
 	
-	int exist = exec("SELECT * FROM " + m_prefix + "buddies_settings LIMIT 1;", false);
+	int exist = exec("SELECT * FROM " + m_prefix + "buddies LIMIT 1;", false);
 
 	if (!exist) {
-		exec("CREATE TABLE " + m_prefix + "buddies_settings ("
-				"user_id integer NOT NULL,"
-				"buddy_id integer NOT NULL,"
-				"var varchar(50) NOT NULL,"
-				"type smallint NOT NULL,"
-				"value varchar(255) NOT NULL,"
-				"PRIMARY KEY (buddy_id,var)"
-			");");
-		
 		exec("CREATE TYPE Subscription AS ENUM ('to','from','both','ask','none');");
 		exec("CREATE TABLE " + m_prefix + "buddies ("
 							"id SERIAL,"
@@ -109,6 +127,7 @@ bool PQXXBackend::createDatabase() {
 							"nickname varchar(255) NOT NULL,"
 							"groups varchar(255) NOT NULL,"
 							"flags smallint NOT NULL DEFAULT '0',"
+							"settings text NOT NULL DEFAULT '',"
 							"PRIMARY KEY (id),"
 							"UNIQUE (user_id,uin)"
 						");");
@@ -140,14 +159,90 @@ bool PQXXBackend::createDatabase() {
 				"UNIQUE (ver)"
 			");");
 
- 		exec("INSERT INTO " + m_prefix + "db_version (ver) VALUES ('1');");
+ 		exec("INSERT INTO " + m_prefix + "db_version (ver) VALUES ('" + pqxx::to_string(PQXX_DB_VERSION) + "');");
+		return true;
 	}
 
+	return upgradeDatabase();
+}
+
+bool PQXXBackend::upgradeDatabase() {
+	if (exec("SELECT settings FROM " + m_prefix + "buddies LIMIT 1;", false)) {
+		return true;
+	}
+
+	// Version 2 moves buddies_settings rows to the settings column of buddies
+	// table, so the roster is loaded by single query. The settings are
+	// serialized the same way as StorageBackend::serializeSettings() does.
+	// The buddies_settings table is kept, but it is not used anymore.
+	LOG4CXX_INFO(logger, "Upgrading database to version " << PQXX_DB_VERSION);
+	try {
+		pqxx::work txn(*m_conn);
+		txn.exec("ALTER TABLE " + m_prefix + "buddies ADD COLUMN settings text NOT NULL DEFAULT ''");
+		txn.exec("UPDATE " + m_prefix + "buddies AS b SET settings=s.data FROM ("
+				"SELECT buddy_id, string_agg(type || ':' || octet_length(var) || ':' || var || octet_length(value) || ':' || value, '' ORDER BY var) AS data "
+				"FROM " + m_prefix + "buddies_settings WHERE type IN (" + pqxx::to_string((int) TYPE_BOOLEAN) + "," + pqxx::to_string((int) TYPE_STRING) + ") "
+				"GROUP BY buddy_id) AS s "
+			"WHERE b.id=s.buddy_id");
+		txn.exec("UPDATE " + m_prefix + "db_version SET ver=" + pqxx::to_string(PQXX_DB_VERSION));
+		txn.commit();
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+		return false;
+	}
 	return true;
 }
 
+void PQXXBackend::prepareStatements() {
+	m_conn->prepare("set_user", "INSERT INTO " + m_prefix + "users (jid, uin, password, language, encoding, last_login, vip) VALUES ($1, $2, $3, $4, $5, NOW(), $6)");
+	m_conn->prepare("get_user", "SELECT id, jid, uin, password, encoding, language, vip FROM " + m_prefix + "users WHERE jid=$1");
+	m_conn->prepare("set_user_online", "UPDATE " + m_prefix + "users SET online=$1, last_login=NOW() WHERE id=$2");
+	m_conn->prepare("get_online_users", "SELECT jid FROM " + m_prefix + "users WHERE online='true'");
+	m_conn->prepare("get_users", "SELECT jid FROM " + m_prefix + "users");
+
+	m_conn->prepare("remove_user", "DELETE FROM " + m_prefix + "users WHERE id=$1");
+	m_conn->prepare("remove_user_buddies", "DELETE FROM " + m_prefix + "buddies WHERE user_id=$1");
+	m_conn->prepare("remove_user_settings", "DELETE FROM " + m_prefix + "users_settings WHERE user_id=$1");
+
+	m_conn->prepare("add_buddy", "INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES ($1, $2, $3, $4, $5, $6, $7) RETURNING id");
+	m_conn->prepare("update_buddy", "UPDATE " + m_prefix + "buddies SET groups=$1, nickname=$2, flags=$3, subscription=$4 WHERE user_id=$5 AND uin=$6");
+	m_conn->prepare("remove_buddy", "DELETE FROM " + m_prefix + "buddies WHERE id=$1");
+	m_conn->prepare("get_buddies", "SELECT id, uin, subscription, nickname, groups, flags, settings FROM " + m_prefix + "buddies WHERE user_id=$1 ORDER BY id ASC");
+
+	m_conn->prepare("get_buddy_settings", "SELECT settings FROM " + m_prefix + "buddies WHERE user_id=$1 AND id=$2");
+	m_conn->prepare("lock_buddy_settings", "SELECT settings FROM " + m_prefix + "buddies WHERE user_id=$1 AND id=$2 FOR UPDATE");
+	m_conn->prepare("update_buddy_settings", "UPDATE " + m_prefix + "buddies SET settings=$3 WHERE user_id=$1 AND id=$2");
+
+	m_conn->prepare("get_user_setting", "SELECT type, value FROM " + m_prefix + "users_settings WHERE user_id=$1 AND var=$2");
+	m_conn->prepare("set_user_setting", "INSERT INTO " + m_prefix + "users_settings (user_id, var, type, value) VALUES ($1, $2, $3, $4)");
+	m_conn->prepare("update_user_setting", "UPDATE " + m_prefix + "users_settings SET value=$1 WHERE user_id=$2 AND var=$3");
+}
+
+void PQXXBackend::recordTiming(const std::string &statement, const boost::posix_time::ptime &start) {
+	long duration = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+	StatementTiming &timing = m_timings[statement];
+	timing.count++;
+	timing.total += duration;
+	if (duration > timing.max) {
+		timing.max = duration;
+	}
+
+	if (duration >= SLOW_STATEMENT) {
+		LOG4CXX_WARN(logger, "Statement " << statement << " took " << duration / 1000 << " ms");
+	}
+}
+
+void PQXXBackend::logTimings() {
+	for (std::map<std::string, StatementTiming>::const_iterator it = m_timings.begin(); it != m_timings.end(); it++) {
+		LOG4CXX_INFO(logger, "Statement " << it->first << ": executed " << it->second.count << " times, average "
+			<< it->second.total / it->second.count << " us, max " << it->second.max << " us");
+	}
+}
+
 template<typename T>
-std::string PQXXBackend::quote(pqxx::nontransaction &txn, const T &t) {
+std::string PQXXBackend::quote(pqxx::transaction_base &txn, const T &t) {
 	return "'" + txn.esc(pqxx::to_string(t)) + "'";
 }
 
@@ -176,14 +271,9 @@ void PQXXBackend::setUser(const UserInfo &user) {
 	}
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		txn.exec("INSERT INTO " + m_prefix + "users (jid, uin, password, language, encoding, last_login, vip) VALUES "
-			+ "(" + quote(txn, user.jid) + ","
-			+ quote(txn, user.uin) + ","
-			+ quote(txn, encrypted) + ","
-			+ quote(txn, user.language) + ","
-			+ quote(txn, user.encoding) + ","
-			+ "NOW(),"
-			+ (user.vip ? "'true'" : "'false'") +")");
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("set_user", user.jid, user.uin, encrypted, user.language, user.encoding, user.vip);
+		recordTiming("set_user", start);
 	}
 	catch (std::exception& e) {
 		LOG4CXX_ERROR(logger, e.what());
@@ -194,8 +284,9 @@ bool PQXXBackend::getUser(const std::string &barejid, UserInfo &user) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
 
-		pqxx::result r = txn.exec("SELECT id, jid, uin, password, encoding, language, vip FROM " + m_prefix + "users WHERE jid="
-			+ quote(txn, barejid));
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		pqxx::result r = txn.exec_prepared("get_user", barejid);
+		recordTiming("get_user", start);
 
 		if (r.size() == 0) {
 			return false;
@@ -217,20 +308,44 @@ bool PQXXBackend::getUser(const std::string &barejid, UserInfo &user) {
 	return true;
 }
 
-void PQXXBackend::setUserOnline(long id, bool online) {
+bool PQXXBackend::setUserOnline(long id, bool online) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		txn.exec("UPDATE " + m_prefix + "users SET online=" + (online ? "'true'" : "'false'") + ", last_login=NOW() WHERE id=" + pqxx::to_string(id));
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("set_user_online", online, id);
+		recordTiming("set_user_online", start);
 	}
 	catch (std::exception& e) {
 		LOG4CXX_ERROR(logger, e.what());
+		return false;
 	}
+	return true;
+}
+
+bool PQXXBackend::setUsersOnline(const std::vector<long> &ids, bool online) {
+	if (ids.empty()) {
+		return true;
+	}
+
+	try {
+		pqxx::nontransaction txn(*m_conn);
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec("UPDATE " + m_prefix + "users SET online=" + (online ? "'true'" : "'false'") + ", last_login=NOW() WHERE id IN (" + StorageBackend::serializeIds(ids) + ")");
+		recordTiming("set_users_online", start);
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+		return false;
+	}
+	return true;
 }
 
 bool PQXXBackend::getOnlineUsers(std::vector<std::string> &users) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		pqxx::result r = txn.exec("SELECT jid FROM " + m_prefix + "users WHERE online='true'");
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		pqxx::result r = txn.exec_prepared("get_online_users");
+		recordTiming("get_online_users", start);
 
 		for (pqxx::result::const_iterator it = r.begin(); it != r.end(); it++)  {
 			users.push_back((*it)[0].as<std::string>());
@@ -247,7 +362,9 @@ bool PQXXBackend::getOnlineUsers(std::vector<std::string> &users) {
 bool PQXXBackend::getUsers(std::vector<std::string> &users) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		pqxx::result r = txn.exec("SELECT jid FROM " + m_prefix + "users");
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		pqxx::result r = txn.exec_prepared("get_users");
+		recordTiming("get_users", start);
 
 		for (pqxx::result::const_iterator it = r.begin(); it != r.end(); it++)  {
 			users.push_back((*it)[0].as<std::string>());
@@ -264,27 +381,13 @@ bool PQXXBackend::getUsers(std::vector<std::string> &users) {
 long PQXXBackend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		pqxx::result r = txn.exec("INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags) VALUES "
-			+ "(" + pqxx::to_string(userId) + ","
-			+ quote(txn, buddyInfo.legacyName) + ","
-			+ quote(txn, buddyInfo.subscription) + ","
-			+ quote(txn, StorageBackend::serializeGroups(buddyInfo.groups)) + ","
-			+ quote(txn, buddyInfo.alias) + ","
-			+ pqxx::to_string(buddyInfo.flags) + ") RETURNING id");
-
-		long id = r[0][0].as<long>();
-
-		r = txn.exec("UPDATE " + m_prefix + "buddies_settings SET var = " + quote(txn, buddyInfo.settings.find("icon_hash")->first) + ", type = " + pqxx::to_string((int)TYPE_STRING) + ", value = " + quote(txn, buddyInfo.settings.find("icon_hash")->second.s) + " WHERE user_id = " + pqxx::to_string(userId) + " AND buddy_id = " + pqxx::to_string(id));
-		if (r.affected_rows() == 0) {
-			txn.exec("INSERT INTO " + m_prefix + "buddies_settings (user_id, buddy_id, var, type, value) VALUES "
-				+ "(" + pqxx::to_string(userId) + ","
-				+ pqxx::to_string(id) + ","
-				+ quote(txn, buddyInfo.settings.find("icon_hash")->first) + ","
-				+ pqxx::to_string((int)TYPE_STRING) + ","
-				+ quote(txn,  buddyInfo.settings.find("icon_hash")->second.s) + ")");
-		}
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		pqxx::result r = txn.exec_prepared("add_buddy", userId, buddyInfo.legacyName, buddyInfo.subscription,
+			StorageBackend::serializeGroups(buddyInfo.groups), buddyInfo.alias, buddyInfo.flags,
+			StorageBackend::serializeSettings(buddyInfo.settings));
+		recordTiming("add_buddy", start);
 
-		return id;
+		return r[0][0].as<long>();
 	}
 	catch (std::exception& e) {
 		LOG4CXX_ERROR(logger, e.what());
@@ -292,10 +395,172 @@ long PQXXBackend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
 	}
 }
 
-void PQXXBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+bool PQXXBackend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+	try {
+		pqxx::work txn(*m_conn);
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("update_buddy", StorageBackend::serializeGroups(buddyInfo.groups), buddyInfo.alias, buddyInfo.flags,
+			buddyInfo.subscription, userId, buddyInfo.legacyName);
+		recordTiming("update_buddy", start);
+
+		// buddyInfo.settings does not have to contain all settings, so they
+		// are merged into the stored ones.
+		std::map<std::string, SettingVariableInfo> settings;
+		if (!buddyInfo.settings.empty() && buddyInfo.id != -1 && getBuddySettings(txn, userId, buddyInfo.id, settings, true)
+			&& StorageBackend::mergeSettings(settings, buddyInfo.settings)) {
+			start = boost::posix_time::microsec_clock::universal_time();
+			txn.exec_prepared("update_buddy_settings", userId, buddyInfo.id, StorageBackend::serializeSettings(settings));
+			recordTiming("update_buddy_settings", start);
+		}
+		txn.commit();
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+		return false;
+	}
+	return true;
+}
+
+bool PQXXBackend::storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	// Buddies of all users are upserted by multi-row statements, so storing
+	// them costs few round trips instead of one or two per buddy.
+	try {
+		pqxx::work txn(*m_conn);
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+		// IDs are set only once the transaction is committed.
+		std::vector<std::pair<BuddyInfo *, long> > ids;
+		std::list<std::pair<long, BuddyInfo> >::iterator it = buddies.begin();
+		while (it != buddies.end()) {
+			std::string keys;
+			std::map<std::pair<long, std::string>, BuddyInfo *> chunk;
+			for (int i = 0; it != buddies.end() && i < BULK_SIZE; it++, i++) {
+				keys += std::string(keys.empty() ? "(" : ",(") + pqxx::to_string(it->first) + "," + quote(txn, it->second.legacyName) + ")";
+				chunk[std::make_pair(it->first, it->second.legacyName)] = &it->second;
+			}
+
+			// buddyInfo.settings does not have to contain all settings, so
+			// they are merged into the stored ones, which stay locked until
+			// the commit.
+			std::map<std::pair<long, std::string>, std::map<std::string, SettingVariableInfo> > stored;
+			pqxx::result r = txn.exec("SELECT user_id, uin, settings FROM " + m_prefix + "buddies WHERE (user_id, uin) IN (VALUES " + keys + ") FOR UPDATE");
+			for (pqxx::result::const_iterator row = r.begin(); row != r.end(); row++) {
+				std::pair<long, std::string> key((*row)[0].as<long>(), (*row)[1].as<std::string>());
+				StorageBackend::deserializeSettings((*row)[2].as<std::string>(), stored[key]);
+			}
+
+			std::string values;
+			for (std::map<std::pair<long, std::string>, BuddyInfo *>::const_iterator buddy = chunk.begin(); buddy != chunk.end(); buddy++) {
+				const BuddyInfo &buddyInfo = *buddy->second;
+				std::map<std::string, SettingVariableInfo> settings = buddyInfo.settings;
+				std::map<std::pair<long, std::string>, std::map<std::string, SettingVariableInfo> >::iterator s = stored.find(buddy->first);
+				if (s != stored.end()) {
+					StorageBackend::mergeSettings(s->second, buddyInfo.settings);
+					settings.swap(s->second);
+				}
+
+				values += std::string(values.empty() ? "(" : ",(") + pqxx::to_string(buddy->first.first) + ","
+					+ quote(txn, buddyInfo.legacyName) + ","
+					+ quote(txn, buddyInfo.subscription) + "::Subscription,"
+					+ quote(txn, StorageBackend::serializeGroups(buddyInfo.groups)) + ","
+					+ quote(txn, buddyInfo.alias) + ","
+					+ pqxx::to_string(buddyInfo.flags) + ","
+					+ quote(txn, StorageBackend::serializeSettings(settings)) + ")";
+			}
+
+			r = txn.exec("INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES " + values
+				+ " ON CONFLICT (user_id, uin) DO UPDATE SET subscription=EXCLUDED.subscription, groups=EXCLUDED.groups, nickname=EXCLUDED.nickname, flags=EXCLUDED.flags, settings=EXCLUDED.settings"
+				+ " RETURNING id, user_id, uin");
+
+			// Rows are not guaranteed to be returned in the order of VALUES.
+			for (pqxx::result::const_iterator row = r.begin(); row != r.end(); row++) {
+				long id = (*row)[0].as<long>();
+				long userId = (*row)[1].as<long>();
+				std::map<std::pair<long, std::string>, BuddyInfo *>::const_iterator buddy = chunk.find(std::make_pair(userId, (*row)[2].as<std::string>()));
+				if (buddy == chunk.end()) {
+					continue;
+				}
+
+				if (buddy->second->id == -1) {
+					ids.push_back(std::make_pair(buddy->second, id));
+				}
+			}
+		}
+
+		txn.commit();
+		recordTiming("store_buddies", start);
+
+		for (std::vector<std::pair<BuddyInfo *, long> >::iterator id = ids.begin(); id != ids.end(); id++) {
+			id->first->id = id->second;
+		}
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+		return false;
+	}
+	return true;
+}
+
+void PQXXBackend::removeBuddy(long id) {
+	try {
+		pqxx::nontransaction txn(*m_conn);
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("remove_buddy", id);
+		recordTiming("remove_buddy", start);
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+	}
+}
+
+bool PQXXBackend::getBuddySettings(pqxx::transaction_base &txn, long userId, long buddyId, std::map<std::string, SettingVariableInfo> &settings, bool lock) {
+	const char *statement = lock ? "lock_buddy_settings" : "get_buddy_settings";
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	pqxx::result r = txn.exec_prepared(statement, userId, buddyId);
+	recordTiming(statement, start);
+	if (r.size() == 0) {
+		return false;
+	}
+
+	StorageBackend::deserializeSettings(r[0][0].as<std::string>(), settings);
+	return true;
+}
+
+bool PQXXBackend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		txn.exec("UPDATE " + m_prefix + "buddies SET groups=" + quote(txn, StorageBackend::serializeGroups(buddyInfo.groups)) + ", nickname=" + quote(txn, buddyInfo.alias) + ", flags=" + pqxx::to_string(buddyInfo.flags) + ", subscription=" + quote(txn, buddyInfo.subscription) + " WHERE user_id=" + pqxx::to_string(userId) + " AND uin=" + quote(txn, buddyInfo.legacyName));
+		std::map<std::string, SettingVariableInfo> settings;
+		getBuddySettings(txn, userId, buddyId, settings);
+
+		std::map<std::string, SettingVariableInfo>::const_iterator it = settings.find(variable);
+		if (it != settings.end()) {
+			type = it->second.type;
+			value = it->second.type == TYPE_BOOLEAN ? (it->second.b ? "1" : "0") : it->second.s;
+		}
+		return true;
+	}
+	catch (std::exception& e) {
+		LOG4CXX_ERROR(logger, e.what());
+	}
+	return false;
+}
+
+void PQXXBackend::updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {
+	try {
+		pqxx::work txn(*m_conn);
+		std::map<std::string, SettingVariableInfo> settings;
+		if (!getBuddySettings(txn, userId, buddyId, settings, true)) {
+			return;
+		}
+
+		if (!StorageBackend::parseSetting(type, value, settings[variable])) {
+			return;
+		}
+
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("update_buddy_settings", userId, buddyId, StorageBackend::serializeSettings(settings));
+		recordTiming("update_buddy_settings", start);
+		txn.commit();
 	}
 	catch (std::exception& e) {
 		LOG4CXX_ERROR(logger, e.what());
@@ -306,7 +571,9 @@ bool PQXXBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
 
-		pqxx::result r = txn.exec("SELECT id, uin, subscription, nickname, groups, flags FROM " + m_prefix + "buddies WHERE user_id=" + pqxx::to_string(id) + " ORDER BY id ASC");
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		pqxx::result r = txn.exec_prepared("get_buddies", id);
+		recordTiming("get_buddies", start);
 		for (pqxx::result::const_iterator it = r.begin(); it != r.end(); it++)  {
 			BuddyInfo b;
 			std::string group;
@@ -322,39 +589,11 @@ bool PQXXBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
 				b.groups = StorageBackend::deserializeGroups(group);
 			}
 
-			roster.push_back(b);
-		}
-
-
-		r = txn.exec("SELECT buddy_id, type, var, value FROM " + m_prefix + "buddies_settings WHERE user_id=" + pqxx::to_string(id) + " ORDER BY buddy_id ASC");
-		for (pqxx::result::const_iterator it = r.begin(); it != r.end(); it++)  {
-			SettingVariableInfo var;
-			long buddy_id = -1;
-			std::string key;
-			std::string val;
-
-			buddy_id = (*it)[0].as<long>();
-			var.type = (*it)[1].as<long>();
-			key = (*it)[2].as<std::string>();
-			val = (*it)[3].as<std::string>();
-			switch (var.type) {
-				case TYPE_BOOLEAN:
-					var.b = atoi(val.c_str());
-					break;
-				case TYPE_STRING:
-					var.s = val;
-					break;
-				default:
-					continue;
-					break;
+			if (!StorageBackend::deserializeSettings((*it)[6].as<std::string>(), b.settings)) {
+				LOG4CXX_WARN(logger, "Malformed settings of buddy " << b.id);
 			}
 
-			BOOST_FOREACH(BuddyInfo &b, roster) {
-				if (buddy_id == b.id) {
-					b.settings[key] = var;
-					break;
-				}
-			}
+			roster.push_back(b);
 		}
 
 		return true;
@@ -369,10 +608,11 @@ bool PQXXBackend::getBuddies(long id, std::list<BuddyInfo> &roster) {
 bool PQXXBackend::removeUser(long id) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		txn.exec("DELETE FROM " + m_prefix + "users WHERE id=" + pqxx::to_string(id));
-		txn.exec("DELETE FROM " + m_prefix + "buddies WHERE user_id=" + pqxx::to_string(id));
-		txn.exec("DELETE FROM " + m_prefix + "users_settings WHERE user_id=" + pqxx::to_string(id));
-		txn.exec("DELETE FROM " + m_prefix + "buddies_settings WHERE user_id=" + pqxx::to_string(id));
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("remove_user", id);
+		txn.exec_prepared("remove_user_buddies", id);
+		txn.exec_prepared("remove_user_settings", id);
+		recordTiming("remove_user", start);
 
 		return true;
 	}
@@ -382,28 +622,36 @@ bool PQXXBackend::removeUser(long id) {
 	return false;
 }
 
-void PQXXBackend::getUserSetting(long id, const std::string &variable, int &type, std::string &value) {
+bool PQXXBackend::getUserSetting(long id, const std::string &variable, int &type, std::string &value) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
 
-		pqxx::result r = txn.exec("SELECT type, value FROM " + m_prefix + "users_settings WHERE user_id=" + pqxx::to_string(id) + " AND var=" + quote(txn, variable));
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		pqxx::result r = txn.exec_prepared("get_user_setting", id, variable);
+		recordTiming("get_user_setting", start);
 		if (r.size() == 0) {
-			txn.exec("INSERT INTO " + m_prefix + "users_settings (user_id, var, type, value) VALUES(" + pqxx::to_string(id) + "," + quote(txn, variable) + "," + pqxx::to_string((int)type) + "," + quote(txn, value) + ")");
+			start = boost::posix_time::microsec_clock::universal_time();
+			txn.exec_prepared("set_user_setting", id, variable, type, value);
+			recordTiming("set_user_setting", start);
 		}
 		else {
 			type = r[0][0].as<int>();
 			value = r[0][1].as<std::string>();
 		}
+		return true;
 	}
 	catch (std::exception& e) {
 		LOG4CXX_ERROR(logger, e.what());
 	}
+	return false;
 }
 
 void PQXXBackend::updateUserSetting(long id, const std::string &variable, const std::string &value) {
 	try {
 		pqxx::nontransaction txn(*m_conn);
-		txn.exec("UPDATE " + m_prefix + "users_settings SET value=" + quote(txn, value) + " WHERE user_id=" + pqxx::to_string(id) + " AND var=" + quote(txn, variable));
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		txn.exec_prepared("update_user_setting", value, id, variable);
+		recordTiming("update_user_setting", start);
 	}
 	catch (std::exception& e) {
 		LOG4CXX_ERROR(logger, e.what());
@@ -414,8 +662,8 @@ void PQXXBackend::beginTransaction() {
 	exec("BEGIN;");
 }
 
-void PQXXBackend::commitTransaction() {
-	exec("COMMIT;");
+bool PQXXBackend::commitTransaction() {
+	return exec("COMMIT;");
 }
 
 }
@@ -0,0 +1,214 @@
+/**
+ * libtransport -- C++ library for easy XMPP Transports development
+ *
+ * Copyright (C) 2011, Jan Kaluza <hanzz.k@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include "transport/RosterFlusher.h"
+#include "transport/RosterStorage.h"
+#include "transport/AsyncStorageBackend.h"
+#include "transport/Transport.h"
+#include "transport/Logging.h"
+
+#include "Swiften/Network/NetworkFactories.h"
+#include "Swiften/EventLoop/EventLoop.h"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+
+namespace Transport {
+
+DEFINE_LOGGER(logger, "RosterFlusher");
+
+// Retries of failed flush are delayed up to 2^MAX_BACKOFF intervals.
+#define MAX_BACKOFF 4
+
+RosterFlusher::RosterFlusher(Component *component, AsyncStorageBackend *storage, int interval, unsigned long batchSize) {
+	m_component = component;
+	m_storage = storage;
+	m_interval = interval;
+	m_batchSize = batchSize == 0 ? 1 : batchSize;
+	m_queued = 0;
+	m_failures = 0;
+	m_flushPosted = false;
+	m_owner = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::EventOwner>(new Swift::EventOwner());
+}
+
+RosterFlusher::~RosterFlusher() {
+	m_component->getEventLoop()->removeEventsFromOwner(m_owner);
+
+	flush();
+
+	// Failed flush without the pool schedules the retry.
+	if (m_timer) {
+		m_timer->stop();
+		m_timer->onTick.disconnect(boost::bind(&RosterFlusher::scheduledFlush, this));
+	}
+}
+
+void RosterFlusher::handleBuddyQueued(RosterStorage *storage) {
+	m_dirty.insert(storage);
+	m_queued++;
+
+	if (m_queued >= m_batchSize) {
+		// The flush is not done from here, because we are in the middle of
+		// RosterManager changing the buddy.
+		if (!m_flushPosted) {
+			m_flushPosted = true;
+			m_component->getEventLoop()->postEvent(boost::bind(&RosterFlusher::scheduledFlush, this), m_owner);
+		}
+		return;
+	}
+
+	schedule();
+}
+
+void RosterFlusher::removeStorage(RosterStorage *storage) {
+	m_dirty.erase(storage);
+
+	for (std::list<BatchRef>::iterator it = m_pending.begin(); it != m_pending.end(); it++) {
+		std::replace((*it)->storages.begin(), (*it)->storages.end(), storage, (RosterStorage *) NULL);
+	}
+}
+
+void RosterFlusher::schedule() {
+	if (m_timer || m_dirty.empty()) {
+		return;
+	}
+
+	int delay = m_interval * (1 << std::min(m_failures, MAX_BACKOFF));
+	m_timer = m_component->getNetworkFactories()->getTimerFactory()->createTimer(delay * 1000);
+	m_timer->onTick.connect(boost::bind(&RosterFlusher::scheduledFlush, this));
+	m_timer->start();
+}
+
+void RosterFlusher::scheduledFlush() {
+	if (m_timer) {
+		m_timer->stop();
+		m_timer->onTick.disconnect(boost::bind(&RosterFlusher::scheduledFlush, this));
+		m_timer.reset();
+	}
+
+	flush();
+
+	// Buddies which have been queued while their previous version was being
+	// stored.
+	schedule();
+}
+
+void RosterFlusher::flush() {
+	m_flushPosted = false;
+
+	std::set<RosterStorage *> dirty;
+	dirty.swap(m_dirty);
+	m_queued = 0;
+
+	std::vector<RosterStorage *> storages;
+	unsigned long count = 0;
+	for (std::set<RosterStorage *>::const_iterator it = dirty.begin(); it != dirty.end(); it++) {
+		unsigned long size = (*it)->getQueueSize();
+		if (size == 0) {
+			continue;
+		}
+
+		// Buddies of single user are always stored in the same transaction.
+		storages.push_back(*it);
+		count += size;
+		if (count >= m_batchSize) {
+			store(storages);
+			storages.clear();
+			count = 0;
+		}
+	}
+
+	if (!storages.empty()) {
+		store(storages);
+	}
+}
+
+bool RosterFlusher::flush(RosterStorage *storage) {
+	m_dirty.erase(storage);
+	unsigned long size = storage->getQueueSize();
+	if (size == 0) {
+		return false;
+	}
+	m_queued -= std::min(size, m_queued);
+
+	std::vector<RosterStorage *> storages;
+	storages.push_back(storage);
+	store(storages);
+	return true;
+}
+
+void RosterFlusher::removeBuddy(long userId, long id) {
+	m_storage->removeBuddy(userId, id);
+}
+
+void RosterFlusher::store(const std::vector<RosterStorage *> &storages) {
+	BatchRef batch(new Batch());
+	std::list<std::pair<long, BuddyInfo> > buddies;
+	for (std::vector<RosterStorage *>::const_iterator it = storages.begin(); it != storages.end(); it++) {
+		size_t size = (*it)->getQueuedBuddies(buddies);
+		if (size == 0) {
+			// All its buddies are still being added by previous request.
+			m_dirty.insert(*it);
+			continue;
+		}
+		batch->storages.push_back(*it);
+		batch->sizes.push_back(size);
+	}
+
+	if (buddies.empty()) {
+		return;
+	}
+
+	m_pending.push_back(batch);
+	m_storage->storeBuddies(buddies, boost::bind(&RosterFlusher::handleStored, this, batch, _1, _2));
+}
+
+void RosterFlusher::handleStored(BatchRef batch, bool stored, const std::list<std::pair<long, BuddyInfo> > &buddies) {
+	m_pending.remove(batch);
+
+	std::list<std::pair<long, BuddyInfo> >::const_iterator it = buddies.begin();
+	for (size_t i = 0; i < batch->storages.size(); i++) {
+		RosterStorage *storage = batch->storages[i];
+		if (!storage) {
+			std::advance(it, batch->sizes[i]);
+			continue;
+		}
+
+		storage->handleBuddiesStored(it, batch->sizes[i], stored);
+
+		// Failed buddies and buddies changed in the meantime.
+		if (storage->getQueueSize() != 0 && m_dirty.insert(storage).second) {
+			m_queued += storage->getQueueSize();
+		}
+	}
+
+	if (stored) {
+		LOG4CXX_INFO(logger, "Stored " << buddies.size() << " buddies of " << batch->storages.size() << " users");
+		m_failures = 0;
+	}
+	else {
+		LOG4CXX_ERROR(logger, "Storing " << buddies.size() << " buddies failed, will retry later");
+		m_failures++;
+	}
+	schedule();
+}
+
+}
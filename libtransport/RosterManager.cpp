@@ -20,6 +20,8 @@
 
 #include "transport/RosterManager.h"
 #include "transport/RosterStorage.h"
+#include "transport/RosterFlusher.h"
+#include "transport/UserManager.h"
 #include "transport/StorageBackend.h"
 #include "transport/Buddy.h"
 #include "transport/User.h"
@@ -45,6 +47,7 @@ DEFINE_LOGGER(logger, "RosterManager");
 
 RosterManager::RosterManager(User *user, Component *component){
 	m_rosterStorage = NULL;
+	m_batchDepth = 0;
 	m_user = user;
 	m_component = component;
 
@@ -127,7 +130,14 @@ void RosterManager::setBuddy(Buddy *buddy) {
 	m_buddies[name] = buddy;
 	onBuddySet(buddy);
 
-	doAddBuddy(buddy);
+	if (m_batchDepth != 0) {
+		if (m_batchBuddies.insert(buddy).second) {
+			m_batchAdded.push_back(buddy);
+		}
+	}
+	else {
+		doAddBuddy(buddy);
+	}
 
 	if (m_rosterStorage)
 		m_rosterStorage->storeBuddy(buddy);
@@ -139,6 +149,10 @@ void RosterManager::unsetBuddy(Buddy *buddy) {
 	m_buddies.erase(name);
 	if (m_rosterStorage)
 		m_rosterStorage->removeBuddyFromQueue(buddy);
+	if (m_batchBuddies.erase(buddy) != 0) {
+		m_batchAdded.erase(std::remove(m_batchAdded.begin(), m_batchAdded.end(), buddy), m_batchAdded.end());
+		m_batchUpdated.erase(std::remove(m_batchUpdated.begin(), m_batchUpdated.end(), buddy), m_batchUpdated.end());
+	}
 	onBuddyUnset(buddy);
 }
 
@@ -148,6 +162,46 @@ void RosterManager::storeBuddy(Buddy *buddy) {
 	}
 }
 
+void RosterManager::updateBuddy(Buddy *buddy) {
+	if (m_batchDepth == 0) {
+		doUpdateBuddy(buddy);
+		return;
+	}
+
+	// Buddy added in this batch is sent with its current state anyway.
+	if (m_batchBuddies.insert(buddy).second) {
+		m_batchUpdated.push_back(buddy);
+	}
+}
+
+void RosterManager::beginBatch() {
+	m_batchDepth++;
+}
+
+void RosterManager::endBatch() {
+	if (m_batchDepth == 0 || --m_batchDepth != 0) {
+		return;
+	}
+
+	std::vector<Buddy *> added;
+	std::vector<Buddy *> updated;
+	added.swap(m_batchAdded);
+	updated.swap(m_batchUpdated);
+	m_batchBuddies.clear();
+	if (!added.empty() || !updated.empty()) {
+		doUpdateBuddies(added, updated);
+	}
+}
+
+void RosterManager::doUpdateBuddies(const std::vector<Buddy *> &added, const std::vector<Buddy *> &updated) {
+	for (std::vector<Buddy *>::const_iterator it = added.begin(); it != added.end(); it++) {
+		doAddBuddy(*it);
+	}
+	for (std::vector<Buddy *>::const_iterator it = updated.begin(); it != updated.end(); it++) {
+		doUpdateBuddy(*it);
+	}
+}
+
 Buddy *RosterManager::getBuddy(const std::string &_name) {
 	std::string name = _name;
 	name = boost::locale::to_lower(name);
@@ -343,10 +397,22 @@ void RosterManager::setStorageBackend(StorageBackend *storageBackend) {
 	if (m_rosterStorage || !storageBackend) {
 		return;
 	}
-	RosterStorage *storage = new RosterStorage(m_user, storageBackend);
 
 	std::list<BuddyInfo> roster;
 	storageBackend->getBuddies(m_user->getUserInfo().id, roster);
+	setStorageBackend(storageBackend, roster);
+}
+
+void RosterManager::setStorageBackend(StorageBackend *storageBackend, const std::list<BuddyInfo> &roster) {
+	if (m_rosterStorage || !storageBackend) {
+		return;
+	}
+	RosterFlusher *flusher = m_user->getUserManager()->getRosterFlusher();
+	if (!flusher) {
+		LOG4CXX_ERROR(logger, m_user->getJID().toString() << ": Cannot store roster without RosterFlusher");
+		return;
+	}
+	RosterStorage *storage = new RosterStorage(m_user, flusher);
 
 	for (std::list<BuddyInfo>::const_iterator it = roster.begin(); it != roster.end(); it++) {
 		Buddy *buddy = m_component->getFactory()->createBuddy(this, *it);
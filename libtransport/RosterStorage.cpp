@@ -19,13 +19,13 @@
  */
 
 #include "transport/RosterStorage.h"
+#include "transport/RosterFlusher.h"
 #include "transport/Buddy.h"
 #include "transport/User.h"
 #include "transport/StorageBackend.h"
 #include "transport/Logging.h"
 #include "transport/Transport.h"
 
-#include "Swiften/Network/NetworkFactories.h"
 
 DEFINE_LOGGER(logger, "RosterStorage");
 
@@ -80,20 +80,22 @@ namespace Transport {
 // 	return TRUE;
 // }
 
-RosterStorage::RosterStorage(User *user, StorageBackend *storageBackend) {
+RosterStorage::RosterStorage(User *user, RosterFlusher *flusher) {
 	m_user = user;
-	m_storageBackend = storageBackend;
-	m_storageTimer = m_user->getComponent()->getNetworkFactories()->getTimerFactory()->createTimer(5000);
-	m_storageTimer->onTick.connect(boost::bind(&RosterStorage::storeBuddies, this));
+	m_flusher = flusher;
 }
 
 RosterStorage::~RosterStorage() {
-	m_storageTimer->stop();
+	m_flusher->removeStorage(this);
 }
 
 void RosterStorage::removeBuddy(Buddy *buddy) {
 	if (buddy->getID() != -1) {
-		m_storageBackend->removeBuddy(buddy->getID());
+		m_flusher->removeBuddy(m_user->getUserInfo().id, buddy->getID());
+	}
+	else if (m_storing.find(buddy->getName()) != m_storing.end()) {
+		// Removed once we know its ID.
+		m_removed.insert(buddy->getName());
 	}
 }
 
@@ -105,19 +107,29 @@ void RosterStorage::storeBuddy(Buddy *buddy) {
 		return;
 	}
 
-	m_buddies[buddy->getName()] = buddy;
-	m_storageTimer->start();
+	std::pair<std::map<std::string, Buddy *>::iterator, bool> ret = m_buddies.insert(std::make_pair(buddy->getName(), buddy));
+	if (!ret.second) {
+		ret.first->second = buddy;
+		return;
+	}
+	m_flusher->handleBuddyQueued(this);
 }
 
 bool RosterStorage::storeBuddies() {
-	if (m_buddies.size() == 0) {
-		return false;
-	}
-	
-	m_storageBackend->beginTransaction();
+	return m_flusher->flush(this);
+}
 
-	for (std::map<std::string, Buddy *>::const_iterator it = m_buddies.begin(); it != m_buddies.end(); it++) {
+size_t RosterStorage::getQueuedBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	size_t count = 0;
+	std::map<std::string, Buddy *>::iterator it = m_buddies.begin();
+	while (it != m_buddies.end()) {
 		Buddy *buddy = (*it).second;
+		// Storing it now would add it to the database twice.
+		if (buddy->getID() == -1 && m_storing.find(it->first) != m_storing.end()) {
+			it++;
+			continue;
+		}
+
 		BuddyInfo buddyInfo;
 		buddyInfo.alias = buddy->getAlias();
 		buddyInfo.legacyName = buddy->getName();
@@ -127,34 +139,43 @@ bool RosterStorage::storeBuddies() {
 		buddyInfo.flags = buddy->getFlags();
 		buddyInfo.settings["icon_hash"].s = buddy->getIconHash();
 		buddyInfo.settings["icon_hash"].type = TYPE_STRING;
+		buddies.push_back(std::make_pair(m_user->getUserInfo().id, buddyInfo));
+		m_storing[it->first] = buddy;
+		m_buddies.erase(it++);
+		count++;
+	}
+	return count;
+}
 
-		// Buddy is in DB
-		if (buddyInfo.id != -1) {
-			m_storageBackend->updateBuddy(m_user->getUserInfo().id, buddyInfo);
+void RosterStorage::handleBuddiesStored(std::list<std::pair<long, BuddyInfo> >::const_iterator &it, size_t count, bool stored) {
+	for (size_t i = 0; i < count; i++, it++) {
+		const BuddyInfo &buddyInfo = it->second;
+		std::map<std::string, Buddy *>::iterator buddy = m_storing.find(buddyInfo.legacyName);
+		if (buddy == m_storing.end()) {
+			// Even failed store could add the buddy.
+			if (m_removed.erase(buddyInfo.legacyName) != 0 && buddyInfo.id != -1) {
+				m_flusher->removeBuddy(m_user->getUserInfo().id, buddyInfo.id);
+			}
+			continue;
 		}
-		else {
-			buddyInfo.id = m_storageBackend->addBuddy(m_user->getUserInfo().id, buddyInfo);
-			buddy->setID(buddyInfo.id);
+
+		// Even failed store could add some buddies, so their IDs are set
+		// to not add them again on retry.
+		if (buddy->second->getID() == -1) {
+			buddy->second->setID(buddyInfo.id);
 		}
 
-// 		Log("buddyListSaveNode", id << " " << name << " " << alias << " " << s_buddy->getSubscription());
-// 		if (s_buddy->getBuddy() && id != -1) {
-// 			PurpleBuddy *buddy = s_buddy->getBuddy();
-// 			SaveData *s = new SaveData;
-// 			s->user = user;
-// 			s->id = id;
-// 			g_hash_table_foreach(buddy->node.settings, save_settings, s);
-// 			delete s;
-// 		}
+		if (!stored) {
+			// Newer version of the buddy could have been queued already.
+			m_buddies.insert(*buddy);
+		}
+		m_storing.erase(buddy);
 	}
-
-	m_buddies.clear();
-	m_storageBackend->commitTransaction();
-	return true;
 }
 
 void RosterStorage::removeBuddyFromQueue(Buddy *buddy) {
 	m_buddies.erase(buddy->getName());
+	m_storing.erase(buddy->getName());
 }
 
 }
@@ -25,8 +25,13 @@
 #include "transport/Logging.h"
 #include "transport/Config.h"
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
-#define SQLITE_DB_VERSION 3
+#define SQLITE_DB_VERSION 4
+
+// Maximum number of buddies written by single statement in storeBuddies().
+// SQLite3 older than 3.32 allows only 999 parameters per statement.
+#define BULK_SIZE 100
 #define CHECK_DB_RESPONSE(stmt) \
 	if(stmt) { \
 		sqlite3_exec(m_db, "ROLLBACK;", NULL, NULL, NULL); \
@@ -87,13 +92,10 @@ SQLite3Backend::~SQLite3Backend(){
 		FINALIZE_STMT(m_removeUser);
 		FINALIZE_STMT(m_removeUserBuddies);
 		FINALIZE_STMT(m_removeUserSettings);
-		FINALIZE_STMT(m_removeUserBuddiesSettings);
 		FINALIZE_STMT(m_removeBuddy);
-		FINALIZE_STMT(m_removeBuddySettings);
 		FINALIZE_STMT(m_addBuddy);
 		FINALIZE_STMT(m_updateBuddy);
 		FINALIZE_STMT(m_getBuddies);
-		FINALIZE_STMT(m_getBuddiesSettings);
 		FINALIZE_STMT(m_getUserSetting);
 		FINALIZE_STMT(m_setUserSetting);
 		FINALIZE_STMT(m_updateUserSetting);
@@ -124,17 +126,14 @@ bool SQLite3Backend::connect() {
 	PREP_STMT(m_removeUser, "DELETE FROM " + m_prefix + "users WHERE id=?");
 	PREP_STMT(m_removeUserBuddies, "DELETE FROM " + m_prefix + "buddies WHERE user_id=?");
 	PREP_STMT(m_removeUserSettings, "DELETE FROM " + m_prefix + "users_settings WHERE user_id=?");
-	PREP_STMT(m_removeUserBuddiesSettings, "DELETE FROM " + m_prefix + "buddies_settings WHERE user_id=?");
 
 	PREP_STMT(m_removeBuddy, "DELETE FROM " + m_prefix + "buddies WHERE id=?");
-	PREP_STMT(m_removeBuddySettings, "DELETE FROM " + m_prefix + "buddies_settings WHERE buddy_id=?");
 
-	PREP_STMT(m_addBuddy, "INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags) VALUES (?, ?, ?, ?, ?, ?)");
+	PREP_STMT(m_addBuddy, "INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES (?, ?, ?, ?, ?, ?, ?)");
 	PREP_STMT(m_updateBuddy, "UPDATE " + m_prefix + "buddies SET groups=?, nickname=?, flags=?, subscription=? WHERE user_id=? AND uin=?");
-	PREP_STMT(m_getBuddies, "SELECT id, uin, subscription, nickname, groups, flags FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC");
-	PREP_STMT(m_getBuddiesSettings, "SELECT buddy_id, type, var, value FROM " + m_prefix + "buddies_settings WHERE user_id=? ORDER BY buddy_id ASC");
-	PREP_STMT(m_updateBuddySetting, "INSERT OR REPLACE INTO " + m_prefix + "buddies_settings (user_id, buddy_id, var, type, value) VALUES (?, ?, ?, ?, ?)");
-	PREP_STMT(m_getBuddySetting, "SELECT type, value FROM " + m_prefix + "buddies_settings WHERE user_id=? AND buddy_id=? AND var=?");
+	PREP_STMT(m_getBuddies, "SELECT id, uin, subscription, nickname, groups, flags, settings FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC");
+	PREP_STMT(m_updateBuddySetting, "UPDATE " + m_prefix + "buddies SET settings=? WHERE user_id=? AND id=?");
+	PREP_STMT(m_getBuddySetting, "SELECT settings FROM " + m_prefix + "buddies WHERE user_id=? AND id=?");
 	
 	PREP_STMT(m_getUserSetting, "SELECT type, value FROM " + m_prefix + "users_settings WHERE user_id=? AND var=?");
 	PREP_STMT(m_setUserSetting, "INSERT INTO " + m_prefix + "users_settings (user_id, var, type, value) VALUES (?,?,?,?)");
@@ -155,23 +154,13 @@ bool SQLite3Backend::createDatabase() {
 				"  subscription varchar(20) NOT NULL,"
 				"  nickname varchar(255) NOT NULL,"
 				"  groups varchar(255) NOT NULL,"
-				"  flags int(4) NOT NULL DEFAULT '0'"
+				"  flags int(4) NOT NULL DEFAULT '0',"
+				"  settings varchar(4095) NOT NULL DEFAULT ''"
 				");");
 
 	if (not_exist) {
 		exec("CREATE UNIQUE INDEX IF NOT EXISTS user_id ON " + m_prefix + "buddies (user_id, uin);");
 
-		exec("CREATE TABLE IF NOT EXISTS " + m_prefix + "buddies_settings ("
-					"  user_id int(10) NOT NULL,"
-					"  buddy_id int(10) NOT NULL,"
-					"  var varchar(50) NOT NULL,"
-					"  type int(4) NOT NULL,"
-					"  value varchar(255) NOT NULL,"
-					"  PRIMARY KEY (buddy_id, var)"
-					");");
-
-		exec("CREATE INDEX IF NOT EXISTS user_id02 ON " + m_prefix + "buddies_settings (user_id);");
-
 		exec("CREATE TABLE IF NOT EXISTS " + m_prefix + "users ("
 					"  id INTEGER PRIMARY KEY NOT NULL,"
 					"  jid varchar(255) NOT NULL,"
@@ -199,8 +188,92 @@ bool SQLite3Backend::createDatabase() {
 		exec("CREATE TABLE IF NOT EXISTS " + m_prefix + "db_version ("
 			"  ver INTEGER NOT NULL DEFAULT '3'"
 			");");
-		exec("REPLACE INTO " + m_prefix + "db_version (ver) values(3)");
+		exec("DELETE FROM " + m_prefix + "db_version");
+		exec("INSERT INTO " + m_prefix + "db_version (ver) values(" + boost::lexical_cast<std::string>(SQLITE_DB_VERSION) + ")");
+		return true;
+	}
+
+	return upgradeDatabase();
+}
+
+int SQLite3Backend::getDatabaseVersion() {
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(m_db, std::string("SELECT MAX(ver) FROM " + m_prefix + "db_version").c_str(), -1, &stmt, NULL)) {
+		// Databases created before db_version table existed.
+		return 0;
+	}
+
+	int version = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		version = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
+	return version;
+}
+
+bool SQLite3Backend::upgradeDatabase() {
+	int version = getDatabaseVersion();
+	if (version >= SQLITE_DB_VERSION) {
+		return true;
+	}
+
+	LOG4CXX_INFO(logger, "Upgrading database from version " << version << " to " << SQLITE_DB_VERSION);
+	exec("BEGIN TRANSACTION;");
+
+	// Version 4 moves buddies_settings rows to the settings column of buddies
+	// table, so the roster is loaded by single query. The buddies_settings
+	// table is kept, but it is not used anymore.
+	if (!exec("ALTER TABLE " + m_prefix + "buddies ADD COLUMN settings varchar(4095) NOT NULL DEFAULT ''")) {
+		exec("ROLLBACK;");
+		return false;
+	}
+
+	sqlite3_stmt *getSettings = NULL;
+	sqlite3_stmt *setSettings = NULL;
+	bool ret = sqlite3_prepare_v2(m_db, std::string("SELECT buddy_id, type, var, value FROM " + m_prefix + "buddies_settings").c_str(), -1, &getSettings, NULL) == SQLITE_OK
+		&& sqlite3_prepare_v2(m_db, std::string("UPDATE " + m_prefix + "buddies SET settings=? WHERE id=?").c_str(), -1, &setSettings, NULL) == SQLITE_OK;
+	if (!ret) {
+		LOG4CXX_ERROR(logger, "Upgrading database: " << (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+	}
+
+	std::map<long, std::map<std::string, SettingVariableInfo> > settings;
+	while (ret && sqlite3_step(getSettings) == SQLITE_ROW) {
+		long buddy_id = sqlite3_column_int(getSettings, 0);
+		int type = sqlite3_column_int(getSettings, 1);
+		std::string key = (const char *) sqlite3_column_text(getSettings, 2);
+		std::string val = (const char *) sqlite3_column_text(getSettings, 3);
+
+		SettingVariableInfo var;
+		if (StorageBackend::parseSetting(type, val, var)) {
+			settings[buddy_id][key] = var;
+		}
+	}
+
+	for (std::map<long, std::map<std::string, SettingVariableInfo> >::const_iterator it = settings.begin(); it != settings.end() && ret; it++) {
+		std::string data = StorageBackend::serializeSettings(it->second);
+		BEGIN(setSettings);
+		BIND_STR(setSettings, data);
+		BIND_INT(setSettings, it->first);
+		if (sqlite3_step(setSettings) != SQLITE_DONE) {
+			LOG4CXX_ERROR(logger, "Upgrading database: " << (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+			ret = false;
+		}
+	}
+
+	FINALIZE_STMT(getSettings);
+	FINALIZE_STMT(setSettings);
+
+	if (!ret) {
+		exec("ROLLBACK;");
+		return false;
 	}
+
+	exec("CREATE TABLE IF NOT EXISTS " + m_prefix + "db_version ("
+		"  ver INTEGER NOT NULL DEFAULT '3'"
+		");");
+	exec("DELETE FROM " + m_prefix + "db_version");
+	exec("INSERT INTO " + m_prefix + "db_version (ver) values(" + boost::lexical_cast<std::string>(SQLITE_DB_VERSION) + ")");
+	exec("COMMIT;");
 	return true;
 }
 
@@ -260,11 +333,22 @@ bool SQLite3Backend::getUser(const std::string &barejid, UserInfo &user) {
 	return false;
 }
 
-void SQLite3Backend::setUserOnline(long id, bool online) {
+bool SQLite3Backend::setUserOnline(long id, bool online) {
 	BEGIN(m_setUserOnline);
 	BIND_INT(m_setUserOnline, (int)online);
 	BIND_INT(m_setUserOnline, id);
-	EXECUTE_STATEMENT(m_setUserOnline, "setUserOnline query");
+	if(sqlite3_step(m_setUserOnline) != SQLITE_DONE) {
+		LOG4CXX_ERROR(logger, "setUserOnline query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+		return false;
+	}
+	return true;
+}
+
+bool SQLite3Backend::setUsersOnline(const std::vector<long> &ids, bool online) {
+	if (ids.empty()) {
+		return true;
+	}
+	return exec("UPDATE " + m_prefix + "users SET online=" + (online ? "1" : "0") + ", last_login=DATETIME('NOW') WHERE id IN (" + StorageBackend::serializeIds(ids) + ")");
 }
 
 bool SQLite3Backend::getOnlineUsers(std::vector<std::string> &users) {
@@ -302,8 +386,9 @@ bool SQLite3Backend::getUsers(std::vector<std::string> &users) {
 }
 
 long SQLite3Backend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
-// 	"INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags) VALUES (?, ?, ?, ?, ?, ?)"
+// 	"INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES (?, ?, ?, ?, ?, ?, ?)"
 	std::string groups = StorageBackend::serializeGroups(buddyInfo.groups);
+	std::string settings = StorageBackend::serializeSettings(buddyInfo.settings);
 	BEGIN(m_addBuddy);
 	BIND_INT(m_addBuddy, userId);
 	BIND_STR(m_addBuddy, buddyInfo.legacyName);
@@ -311,27 +396,17 @@ long SQLite3Backend::addBuddy(long userId, const BuddyInfo &buddyInfo) {
 	BIND_STR(m_addBuddy, groups);
 	BIND_STR(m_addBuddy, buddyInfo.alias);
 	BIND_INT(m_addBuddy, buddyInfo.flags);
+	BIND_STR(m_addBuddy, settings);
 
 	if(sqlite3_step(m_addBuddy) != SQLITE_DONE) {
 		LOG4CXX_ERROR(logger, "addBuddy query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
 		return -1;
 	}
 
-	long id = (long) sqlite3_last_insert_rowid(m_db);
-
-// 	INSERT OR REPLACE INTO " + m_prefix + "buddies_settings (user_id, buddy_id, var, type, value) VALUES (?, ?, ?, ?, ?)
-	BEGIN(m_updateBuddySetting);
-	BIND_INT(m_updateBuddySetting, userId);
-	BIND_INT(m_updateBuddySetting, id);
-	BIND_STR(m_updateBuddySetting, buddyInfo.settings.find("icon_hash")->first);
-	BIND_INT(m_updateBuddySetting, TYPE_STRING);
-	BIND_STR(m_updateBuddySetting, buddyInfo.settings.find("icon_hash")->second.s);
-
-	EXECUTE_STATEMENT(m_updateBuddySetting, "updateBuddySetting query");
-	return id;
+	return (long) sqlite3_last_insert_rowid(m_db);
 }
 
-void SQLite3Backend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+bool SQLite3Backend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
 // 	UPDATE " + m_prefix + "buddies SET groups=?, nickname=?, flags=?, subscription=? WHERE user_id=? AND uin=?
 	std::string groups = StorageBackend::serializeGroups(buddyInfo.groups);
 	BEGIN(m_updateBuddy);
@@ -342,34 +417,162 @@ void SQLite3Backend::updateBuddy(long userId, const BuddyInfo &buddyInfo) {
 	BIND_INT(m_updateBuddy, userId);
 	BIND_STR(m_updateBuddy, buddyInfo.legacyName);
 
-	EXECUTE_STATEMENT(m_updateBuddy, "updateBuddy query");
+	if(sqlite3_step(m_updateBuddy) != SQLITE_DONE) {
+		LOG4CXX_ERROR(logger, "updateBuddy query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+		return false;
+	}
+
+	// buddyInfo.settings does not have to contain all settings, so they
+	// are merged into the stored ones.
+	if (buddyInfo.settings.empty() || buddyInfo.id == -1) {
+		return true;
+	}
+
+	std::map<std::string, SettingVariableInfo> settings;
+	bool found;
+	if (!getBuddySettings(userId, buddyInfo.id, settings, found)) {
+		return false;
+	}
+	if (!found || !StorageBackend::mergeSettings(settings, buddyInfo.settings)) {
+		return true;
+	}
 
-// 	INSERT OR REPLACE INTO " + m_prefix + "buddies_settings (user_id, buddy_id, var, type, value) VALUES (?, ?, ?, ?, ?)
+	std::string data = StorageBackend::serializeSettings(settings);
 	BEGIN(m_updateBuddySetting);
+	BIND_STR(m_updateBuddySetting, data);
 	BIND_INT(m_updateBuddySetting, userId);
 	BIND_INT(m_updateBuddySetting, buddyInfo.id);
-	BIND_STR(m_updateBuddySetting, buddyInfo.settings.find("icon_hash")->first);
-	BIND_INT(m_updateBuddySetting, TYPE_STRING);
-	BIND_STR(m_updateBuddySetting, buddyInfo.settings.find("icon_hash")->second.s);
+	if(sqlite3_step(m_updateBuddySetting) != SQLITE_DONE) {
+		LOG4CXX_ERROR(logger, "updateBuddy settings query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+		return false;
+	}
+	return true;
+}
+
+bool SQLite3Backend::storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	// Buddies of all users are upserted by multi-row statements, so storing
+	// them costs few statements instead of one or two per buddy.
+	if (!exec("BEGIN TRANSACTION;")) {
+		return false;
+	}
+
+	// IDs are set only once the transaction is committed.
+	std::vector<std::pair<BuddyInfo *, long> > ids;
+	std::list<std::pair<long, BuddyInfo> >::iterator it = buddies.begin();
+	while (it != buddies.end()) {
+		BuddyChunk chunk;
+		for (int i = 0; it != buddies.end() && i < BULK_SIZE; it++, i++) {
+			chunk[std::make_pair(it->first, it->second.legacyName)] = &it->second;
+		}
+
+		// buddyInfo.settings does not have to contain all settings, so
+		// they are merged into the stored ones. New buddies are fetched
+		// again to find out their IDs.
+		std::map<std::pair<long, std::string>, std::pair<long, std::string> > stored;
+		if (!getStoredBuddies(chunk, stored) || !upsertBuddies(chunk, stored) || !getStoredBuddies(chunk, stored)) {
+			exec("ROLLBACK TRANSACTION;");
+			return false;
+		}
 
-	EXECUTE_STATEMENT(m_updateBuddySetting, "updateBuddySetting query");
+		for (BuddyChunk::const_iterator buddy = chunk.begin(); buddy != chunk.end(); buddy++) {
+			std::map<std::pair<long, std::string>, std::pair<long, std::string> >::const_iterator s = stored.find(buddy->first);
+			if (buddy->second->id == -1 && s != stored.end()) {
+				ids.push_back(std::make_pair(buddy->second, s->second.first));
+			}
+		}
+	}
+
+	if (!commitTransaction()) {
+		return false;
+	}
+
+	for (std::vector<std::pair<BuddyInfo *, long> >::iterator id = ids.begin(); id != ids.end(); id++) {
+		id->first->id = id->second;
+	}
+	return true;
+}
+
+bool SQLite3Backend::getStoredBuddies(const BuddyChunk &chunk, std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored) {
+	std::string query = "SELECT id, user_id, uin, settings FROM " + m_prefix + "buddies WHERE (user_id, uin) IN (VALUES ";
+	for (size_t i = 0; i < chunk.size(); i++) {
+		query += i == 0 ? "(?, ?)" : ", (?, ?)";
+	}
+	query += ")";
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(m_db, query.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+		LOG4CXX_ERROR(logger, "getStoredBuddies query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+		return false;
+	}
+
+	int param = 1;
+	for (BuddyChunk::const_iterator it = chunk.begin(); it != chunk.end(); it++) {
+		sqlite3_bind_int(stmt, param++, it->first.first);
+		sqlite3_bind_text(stmt, param++, it->first.second.c_str(), -1, SQLITE_STATIC);
+	}
+
+	int ret;
+	while((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		std::pair<long, std::string> key(sqlite3_column_int(stmt, 1), (const char *) sqlite3_column_text(stmt, 2));
+		stored[key] = std::make_pair((long) sqlite3_column_int(stmt, 0), std::string((const char *) sqlite3_column_text(stmt, 3)));
+	}
+
+	if (ret != SQLITE_DONE) {
+		LOG4CXX_ERROR(logger, "getStoredBuddies query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+	}
+	sqlite3_finalize(stmt);
+	return ret == SQLITE_DONE;
+}
+
+bool SQLite3Backend::upsertBuddies(const BuddyChunk &chunk, const std::map<std::pair<long, std::string>, std::pair<long, std::string> > &stored) {
+	std::string query = "INSERT INTO " + m_prefix + "buddies (user_id, uin, subscription, groups, nickname, flags, settings) VALUES ";
+	for (size_t i = 0; i < chunk.size(); i++) {
+		query += i == 0 ? "(?, ?, ?, ?, ?, ?, ?)" : ", (?, ?, ?, ?, ?, ?, ?)";
+	}
+	// ON CONFLICT keeps the ID of existing buddy, which INSERT OR REPLACE
+	// would change.
+	query += " ON CONFLICT (user_id, uin) DO UPDATE SET subscription=excluded.subscription, groups=excluded.groups,"
+		" nickname=excluded.nickname, flags=excluded.flags, settings=excluded.settings";
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(m_db, query.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+		LOG4CXX_ERROR(logger, "upsertBuddies query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+		return false;
+	}
+
+	int param = 1;
+	for (BuddyChunk::const_iterator it = chunk.begin(); it != chunk.end(); it++) {
+		const BuddyInfo &buddyInfo = *it->second;
+		std::map<std::string, SettingVariableInfo> settings;
+		std::map<std::pair<long, std::string>, std::pair<long, std::string> >::const_iterator s = stored.find(it->first);
+		if (s != stored.end()) {
+			StorageBackend::deserializeSettings(s->second.second, settings);
+		}
+		StorageBackend::mergeSettings(settings, buddyInfo.settings);
+
+		sqlite3_bind_int(stmt, param++, it->first.first);
+		sqlite3_bind_text(stmt, param++, buddyInfo.legacyName.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, param++, buddyInfo.subscription.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, param++, StorageBackend::serializeGroups(buddyInfo.groups).c_str(), -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, param++, buddyInfo.alias.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, param++, buddyInfo.flags);
+		sqlite3_bind_text(stmt, param++, StorageBackend::serializeSettings(settings).c_str(), -1, SQLITE_TRANSIENT);
+	}
+
+	bool ret = sqlite3_step(stmt) == SQLITE_DONE;
+	if (!ret) {
+		LOG4CXX_ERROR(logger, "upsertBuddies query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+	}
+	sqlite3_finalize(stmt);
+	return ret;
 }
 
 bool SQLite3Backend::getBuddies(long id, std::list<BuddyInfo> &roster) {
-//	SELECT id, uin, subscription, nickname, groups, flags FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC
+//	SELECT id, uin, subscription, nickname, groups, flags, settings FROM " + m_prefix + "buddies WHERE user_id=? ORDER BY id ASC
 	BEGIN(m_getBuddies);
 	BIND_INT(m_getBuddies, id);
 
-// 	"SELECT buddy_id, type, var, value FROM " + m_prefix + "buddies_settings WHERE user_id=? ORDER BY buddy_id ASC"
-	BEGIN(m_getBuddiesSettings);
-	BIND_INT(m_getBuddiesSettings, id);
-
-	SettingVariableInfo var;
-	long buddy_id = -1;
-	std::string key;
-
 	int ret;
-	int ret2 = -10;
 	while((ret = sqlite3_step(m_getBuddies)) == SQLITE_ROW) {
 		BuddyInfo b;
 		RESET_GET_COUNTER(m_getBuddies);
@@ -380,47 +583,11 @@ bool SQLite3Backend::getBuddies(long id, std::list<BuddyInfo> &roster) {
 		std::string groups = GET_STR(m_getBuddies);
 		b.groups = StorageBackend::deserializeGroups(groups);
 		b.flags = GET_INT(m_getBuddies);
-
-		if (buddy_id == b.id) {
-			std::cout << "Adding buddy info " << key << "\n";
-			b.settings[key] = var;
-			buddy_id = -1;
+		std::string settings = GET_STR(m_getBuddies);
+		if (!StorageBackend::deserializeSettings(settings, b.settings)) {
+			LOG4CXX_WARN(logger, "Malformed settings of buddy " << b.id);
 		}
 
-		while(buddy_id == -1 && ret2 != SQLITE_DONE && ret2 != SQLITE_ERROR && (ret2 = sqlite3_step(m_getBuddiesSettings)) == SQLITE_ROW) {
-			RESET_GET_COUNTER(m_getBuddiesSettings);
-			buddy_id = GET_INT(m_getBuddiesSettings);
-			
-			var.type = GET_INT(m_getBuddiesSettings);
-			key = GET_STR(m_getBuddiesSettings);
-			std::string val = GET_STR(m_getBuddiesSettings);
-
-			switch (var.type) {
-				case TYPE_BOOLEAN:
-					var.b = atoi(val.c_str());
-					break;
-				case TYPE_STRING:
-					var.s = val;
-					break;
-				default:
-					if (buddy_id == b.id) {
-						buddy_id = -1;
-					}
-					continue;
-					break;
-			}
-			if (buddy_id == b.id) {
-				std::cout << "Adding buddy info " << key << "=" << val << "\n";
-				b.settings[key] = var;
-				buddy_id = -1;
-			}
-		}
-
-// 		if (ret != SQLITE_DONE) {
-// 			LOG4CXX_ERROR(logger, "getBuddiesSettings query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
-// 			return false;
-// 		}
-
 		roster.push_back(b);
 	}
 
@@ -429,21 +596,6 @@ bool SQLite3Backend::getBuddies(long id, std::list<BuddyInfo> &roster) {
 		return false;
 	}
 
-	if (ret2 != SQLITE_DONE) {
-		if (ret2 == SQLITE_ERROR) {
-			LOG4CXX_ERROR(logger, "getBuddiesSettings query "<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
-			return false;
-		}
-
-		while((ret2 = sqlite3_step(m_getBuddiesSettings)) == SQLITE_ROW) {
-		}
-
-		if (ret2 != SQLITE_DONE) {
-			LOG4CXX_ERROR(logger, "getBuddiesSettings query "<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
-			return false;
-		}
-	}
-	
 	return true;
 }
 
@@ -454,13 +606,6 @@ void SQLite3Backend::removeBuddy(long id) {
 		LOG4CXX_ERROR(logger, "removeBuddy query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
 		return;
 	}
-
-	sqlite3_reset(m_removeBuddySettings);
-	sqlite3_bind_int(m_removeBuddySettings, 1, id);
-	if(sqlite3_step(m_removeBuddySettings) != SQLITE_DONE) {
-		LOG4CXX_ERROR(logger, "removeBuddySettings query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
-		return;
-	}
 }
 
 bool SQLite3Backend::removeUser(long id) {
@@ -485,36 +630,37 @@ bool SQLite3Backend::removeUser(long id) {
 		return false;
 	}
 
-	sqlite3_reset(m_removeUserBuddiesSettings);
-	sqlite3_bind_int(m_removeUserBuddiesSettings, 1, id);
-	if(sqlite3_step(m_removeUserBuddiesSettings) != SQLITE_DONE) {
-		LOG4CXX_ERROR(logger, "removeUserBuddiesSettings query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
-		return false;
-	}
-
 	return true;
 }
 
-void SQLite3Backend::getUserSetting(long id, const std::string &variable, int &type, std::string &value) {
+bool SQLite3Backend::getUserSetting(long id, const std::string &variable, int &type, std::string &value) {
 	BEGIN(m_getUserSetting);
 	BIND_INT(m_getUserSetting, id);
 	BIND_STR(m_getUserSetting, variable);
-	if(sqlite3_step(m_getUserSetting) != SQLITE_ROW) {
+	int ret = sqlite3_step(m_getUserSetting);
+	if (ret == SQLITE_DONE) {
 		BEGIN(m_setUserSetting);
 		BIND_INT(m_setUserSetting, id);
 		BIND_STR(m_setUserSetting, variable);
 		BIND_INT(m_setUserSetting, type);
 		BIND_STR(m_setUserSetting, value);
-		EXECUTE_STATEMENT(m_setUserSetting, "m_setUserSetting");
+		if(sqlite3_step(m_setUserSetting) != SQLITE_DONE) {
+			LOG4CXX_ERROR(logger, "m_setUserSetting"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+			return false;
+		}
+		return true;
 	}
-	else {
-		type = GET_INT(m_getUserSetting);
-		value = GET_STR(m_getUserSetting);
+	else if (ret != SQLITE_ROW) {
+		LOG4CXX_ERROR(logger, "getUserSetting query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+		return false;
 	}
 
-	int ret;
+	type = GET_INT(m_getUserSetting);
+	value = GET_STR(m_getUserSetting);
+
 	while((ret = sqlite3_step(m_getUserSetting)) == SQLITE_ROW) {
 	}
+	return true;
 }
 
 void SQLite3Backend::updateUserSetting(long id, const std::string &variable, const std::string &value) {
@@ -525,37 +671,80 @@ void SQLite3Backend::updateUserSetting(long id, const std::string &variable, con
 	EXECUTE_STATEMENT(m_updateUserSetting, "m_updateUserSetting");
 }
 
-void SQLite3Backend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+bool SQLite3Backend::getBuddySettings(long userId, long buddyId, std::map<std::string, SettingVariableInfo> &settings, bool &found) {
 	BEGIN(m_getBuddySetting);
 	BIND_INT(m_getBuddySetting, userId);
 	BIND_INT(m_getBuddySetting, buddyId);
-	BIND_STR(m_getBuddySetting, variable);
-	if(sqlite3_step(m_getBuddySetting) == SQLITE_ROW) {
-		type = GET_INT(m_getBuddySetting);
-		value = GET_STR(m_getBuddySetting);
+	int ret = sqlite3_step(m_getBuddySetting);
+	found = ret == SQLITE_ROW;
+	if (!found) {
+		if (ret != SQLITE_DONE) {
+			LOG4CXX_ERROR(logger, "getBuddySettings query"<< (sqlite3_errmsg(m_db) == NULL ? "" : sqlite3_errmsg(m_db)));
+			return false;
+		}
+		return true;
 	}
 
-	int ret;
+	std::string data = GET_STR(m_getBuddySetting);
+	StorageBackend::deserializeSettings(data, settings);
+
 	while((ret = sqlite3_step(m_getBuddySetting)) == SQLITE_ROW) {
 	}
+	return true;
+}
+
+bool SQLite3Backend::getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+	std::map<std::string, SettingVariableInfo> settings;
+	bool found;
+	if (!getBuddySettings(userId, buddyId, settings, found)) {
+		return false;
+	}
+
+	std::map<std::string, SettingVariableInfo>::const_iterator it = settings.find(variable);
+	if (it != settings.end()) {
+		type = it->second.type;
+		value = it->second.type == TYPE_BOOLEAN ? (it->second.b ? "1" : "0") : it->second.s;
+	}
+	return true;
 }
 
 void SQLite3Backend::updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {
+	std::map<std::string, SettingVariableInfo> settings;
+	bool found;
+	if (!getBuddySettings(userId, buddyId, settings, found) || !found) {
+		return;
+	}
+
+	if (!StorageBackend::parseSetting(type, value, settings[variable])) {
+		return;
+	}
+	std::string data = StorageBackend::serializeSettings(settings);
+
 	BEGIN(m_updateBuddySetting);
+	BIND_STR(m_updateBuddySetting, data);
 	BIND_INT(m_updateBuddySetting, userId);
 	BIND_INT(m_updateBuddySetting, buddyId);
-	BIND_STR(m_updateBuddySetting, variable);
-	BIND_INT(m_updateBuddySetting, type);
-	BIND_STR(m_updateBuddySetting, value);
 	EXECUTE_STATEMENT(m_updateBuddySetting, "m_updateBuddySetting");
 }
 
+bool SQLite3Backend::supportsConnectionPool() {
+	// Empty path opens private temporary database, which is not shared
+	// either.
+	std::string database = CONFIG_STRING(m_config, "database.database");
+	return !database.empty() && database != ":memory:";
+}
+
 void SQLite3Backend::beginTransaction() {
 	exec("BEGIN TRANSACTION;");
 }
 
-void SQLite3Backend::commitTransaction() {
-	exec("COMMIT TRANSACTION;");
+bool SQLite3Backend::commitTransaction() {
+	if (!exec("COMMIT TRANSACTION;")) {
+		// Failed COMMIT can leave the transaction open.
+		exec("ROLLBACK TRANSACTION;");
+		return false;
+	}
+	return true;
 }
 
 }
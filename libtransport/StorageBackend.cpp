@@ -4,7 +4,9 @@
 #include "transport/SQLite3Backend.h"
 #include "transport/MySQLBackend.h"
 #include "transport/PQXXBackend.h"
+#include "transport/LogStorageBackend.h"
 #include "Swiften/StringCodecs/Base64.h"
+#include <boost/lexical_cast.hpp>
 
 
 namespace Transport {
@@ -41,8 +43,19 @@ StorageBackend *StorageBackend::createBackend(Config *config, std::string &error
 	}
 #endif
 
+#ifndef _WIN32
+	if (CONFIG_STRING(config, "database.type") == "log") {
+		storageBackend = new LogStorageBackend(config);
+	}
+#else
+	if (CONFIG_STRING(config, "database.type") == "log") {
+		error = "Log storage backend is not supported on Windows.";
+	}
+#endif
+
 	if (CONFIG_STRING(config, "database.type") != "mysql" && CONFIG_STRING(config, "database.type") != "sqlite3"
-		&& CONFIG_STRING(config, "database.type") != "pqxx" && CONFIG_STRING(config, "database.type") != "none") {
+		&& CONFIG_STRING(config, "database.type") != "pqxx" && CONFIG_STRING(config, "database.type") != "log"
+		&& CONFIG_STRING(config, "database.type") != "none") {
 		error = "Unknown storage backend " + CONFIG_STRING(config, "database.type");
 	}
 
@@ -101,4 +114,151 @@ std::vector<std::string> StorageBackend::deserializeGroups(std::string &groups)
 	return ret;
 }
 
+bool StorageBackend::parseSetting(int type, const std::string &value, SettingVariableInfo &var) {
+	var.type = type;
+	switch (type) {
+		case TYPE_BOOLEAN:
+			var.b = atoi(value.c_str());
+			return true;
+		case TYPE_STRING:
+			var.s = value;
+			return true;
+		default:
+			return false;
+	}
+}
+
+std::string StorageBackend::serializeIds(const std::vector<long> &ids) {
+	std::string ret;
+	for (std::vector<long>::const_iterator it = ids.begin(); it != ids.end(); it++) {
+		if (!ret.empty()) {
+			ret += ",";
+		}
+		ret += boost::lexical_cast<std::string>(*it);
+	}
+	return ret;
+}
+
+std::string StorageBackend::serializeSettings(const std::map<std::string, SettingVariableInfo> &settings) {
+	std::string ret;
+	for (std::map<std::string, SettingVariableInfo>::const_iterator it = settings.begin(); it != settings.end(); it++) {
+		std::string value;
+		switch (it->second.type) {
+			case TYPE_BOOLEAN:
+				value = it->second.b ? "1" : "0";
+				break;
+			case TYPE_STRING:
+				value = it->second.s;
+				break;
+			default:
+				continue;
+		}
+
+		ret += boost::lexical_cast<std::string>(it->second.type) + ":";
+		ret += boost::lexical_cast<std::string>(it->first.size()) + ":" + it->first;
+		ret += boost::lexical_cast<std::string>(value.size()) + ":" + value;
+	}
+	return ret;
+}
+
+// Reads "<number>:" at pos and moves pos past it.
+static bool readNumber(const std::string &data, size_t &pos, size_t &number) {
+	size_t end = data.find(':', pos);
+	if (end == std::string::npos || end == pos || end - pos > 9) {
+		return false;
+	}
+
+	number = 0;
+	for (size_t i = pos; i < end; i++) {
+		if (data[i] < '0' || data[i] > '9') {
+			return false;
+		}
+		number = number * 10 + (data[i] - '0');
+	}
+	pos = end + 1;
+	return true;
+}
+
+bool StorageBackend::deserializeSettings(const std::string &data, std::map<std::string, SettingVariableInfo> &settings) {
+	size_t pos = 0;
+	while (pos < data.size()) {
+		size_t type;
+		size_t size;
+		if (!readNumber(data, pos, type) || !readNumber(data, pos, size) || size > data.size() - pos) {
+			return false;
+		}
+		std::string key = data.substr(pos, size);
+		pos += size;
+
+		if (!readNumber(data, pos, size) || size > data.size() - pos) {
+			return false;
+		}
+
+		SettingVariableInfo var;
+		if (parseSetting(type, data.substr(pos, size), var)) {
+			settings[key] = var;
+		}
+		pos += size;
+	}
+	return true;
+}
+
+bool StorageBackend::mergeSettings(std::map<std::string, SettingVariableInfo> &settings, const std::map<std::string, SettingVariableInfo> &changes) {
+	bool changed = false;
+	for (std::map<std::string, SettingVariableInfo>::const_iterator it = changes.begin(); it != changes.end(); it++) {
+		// Only the values which are serialized are compared.
+		std::map<std::string, SettingVariableInfo>::iterator s = settings.find(it->first);
+		if (s != settings.end() && s->second.type == it->second.type
+			&& (it->second.type == TYPE_BOOLEAN ? s->second.b == it->second.b : s->second.s == it->second.s)) {
+			continue;
+		}
+		settings[it->first] = it->second;
+		changed = true;
+	}
+	return changed;
+}
+
+bool StorageBackend::storeBuddies(std::list<std::pair<long, BuddyInfo> > &buddies) {
+	bool ret = true;
+	std::vector<BuddyInfo *> added;
+	beginTransaction();
+	for (std::list<std::pair<long, BuddyInfo> >::iterator it = buddies.begin(); it != buddies.end(); it++) {
+		// Buddy is in DB
+		if (it->second.id != -1) {
+			if (!updateBuddy(it->first, it->second)) {
+				ret = false;
+			}
+		}
+		else {
+			it->second.id = addBuddy(it->first, it->second);
+			if (it->second.id == -1) {
+				ret = false;
+			}
+			else {
+				added.push_back(&it->second);
+			}
+		}
+	}
+
+	if (!commitTransaction()) {
+		// Added buddies have been rolled back, so they are added again on retry.
+		for (std::vector<BuddyInfo *>::iterator it = added.begin(); it != added.end(); it++) {
+			(*it)->id = -1;
+		}
+		return false;
+	}
+	return ret;
+}
+
+bool StorageBackend::setUsersOnline(const std::vector<long> &ids, bool online) {
+	bool ret = true;
+	beginTransaction();
+	for (std::vector<long>::const_iterator it = ids.begin(); it != ids.end(); it++) {
+		if (!setUserOnline(*it, online)) {
+			ret = false;
+		}
+	}
+	return commitTransaction() && ret;
+}
+
 }
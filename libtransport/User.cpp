@@ -48,6 +48,7 @@ DEFINE_LOGGER(logger, "User");
 User::User(const Swift::JID &jid, UserInfo &userInfo, Component *component, UserManager *userManager) {
 	m_jid = jid.toBare();
 	m_data = NULL;
+	m_sessionId = 0;
 
 	m_cacheMessages = false;
 	m_component = component;
@@ -22,6 +22,9 @@
 #include "transport/User.h"
 #include "transport/Transport.h"
 #include "transport/StorageBackend.h"
+#include "transport/AsyncStorageBackend.h"
+#include "transport/RosterFlusher.h"
+#include "transport/OnlineUsersFlusher.h"
 #include "transport/ConversationManager.h"
 #include "transport/RosterManager.h"
 #include "transport/UserRegistry.h"
@@ -63,20 +66,75 @@ UserManager::UserManager(Component *component, UserRegistry *userRegistry, Stora
 	m_userRegistry->onDisconnectUser.connect(bind(&UserManager::disconnectUser, this, _1));
 
 	m_removeTimer = m_component->getNetworkFactories()->getTimerFactory()->createTimer(1);
+
+	m_asyncStorage = NULL;
+	m_rosterFlusher = NULL;
+	m_onlineUsersFlusher = NULL;
+	if (m_storageBackend) {
+		m_asyncStorage = new AsyncStorageBackend(component->getEventLoop(), component->getConfig(), storageBackend,
+			CONFIG_INT(component->getConfig(), "database.pool_size"));
+		m_rosterFlusher = new RosterFlusher(component, m_asyncStorage,
+			CONFIG_INT(component->getConfig(), "database.roster_flush_interval"),
+			CONFIG_INT(component->getConfig(), "database.roster_flush_size"));
+		m_onlineUsersFlusher = new OnlineUsersFlusher(component, m_asyncStorage,
+			CONFIG_INT(component->getConfig(), "database.online_flush_interval"),
+			CONFIG_STRING(component->getConfig(), "database.online_journal"));
+	}
 }
 
 UserManager::~UserManager() {
-
+	// Starts storing buddies which are still queued.
+	delete m_rosterFlusher;
+	delete m_onlineUsersFlusher;
+	// Pending database requests are finished and their callbacks dropped.
+	delete m_asyncStorage;
 }
 
 void UserManager::addUser(User *user) {
 	m_users[user->getJID().toBare().toString()] = user;
-	if (m_storageBackend) {
-		m_storageBackend->setUserOnline(user->getUserInfo().id, true);
+	addSession(user);
+	if (m_onlineUsersFlusher) {
+		m_onlineUsersFlusher->setUserOnline(user->getUserInfo().id, true);
 	}
 	onUserCreated(user);
 }
 
+void UserManager::addSession(User *user) {
+	unsigned int slot;
+	if (!m_freeSessions.empty()) {
+		slot = m_freeSessions.back();
+		m_freeSessions.pop_back();
+	}
+	else if (m_sessions.size() < SESSION_SLOT_MASK) {
+		slot = m_sessions.size();
+		Session session;
+		session.user = NULL;
+		session.id = slot + 1;
+		m_sessions.push_back(session);
+	}
+	else {
+		// Backends find this user by his JID.
+		user->setSessionId(0);
+		return;
+	}
+
+	Session &session = m_sessions[slot];
+	session.id += 1 << SESSION_SLOT_BITS;
+	session.user = user;
+	user->setSessionId(session.id);
+}
+
+void UserManager::removeSession(User *user) {
+	User *u = getUserBySessionId(user->getSessionId());
+	if (u != user) {
+		return;
+	}
+
+	unsigned int slot = (user->getSessionId() & SESSION_SLOT_MASK) - 1;
+	m_sessions[slot].user = NULL;
+	m_freeSessions.push_back(slot);
+}
+
 User *UserManager::getUser(const std::string &barejid){
 	if (m_cachedUser && barejid == m_cachedUser->getJID().toBare().toString()) {
 		return m_cachedUser;
@@ -115,12 +173,13 @@ void UserManager::removeUser(User *user, bool onUserBehalf) {
 		m_component->getPresenceOracle()->clearPresences(user->getJID().toBare());
 	}
 
-	if (m_storageBackend && onUserBehalf) {
-		m_storageBackend->setUserOnline(user->getUserInfo().id, false);
+	if (m_onlineUsersFlusher && onUserBehalf) {
+		m_onlineUsersFlusher->setUserOnline(user->getUserInfo().id, false);
 	}
 
 	LOG4CXX_INFO(logger, user->getJID().toBare().toString() << ": Disconnecting user");
 	onUserDestroyed(user);
+	removeSession(user);
 	delete user;
 #ifndef WIN32
 #ifndef __FreeBSD__
@@ -133,6 +192,12 @@ void UserManager::removeUser(User *user, bool onUserBehalf) {
 }
 
 void UserManager::removeAllUsers(bool onUserBehalf) {
+	// Store the rosters of all users in few transactions rather than
+	// one by one as the users are removed.
+	if (m_rosterFlusher) {
+		m_rosterFlusher->flush();
+	}
+
 	while(m_users.begin() != m_users.end()) {
 		removeUser((*m_users.begin()).second, onUserBehalf);
 	}
@@ -152,7 +217,6 @@ void UserManager::handleDiscoInfo(const Swift::JID& jid, SWIFTEN_SHRPTR_NAMESPAC
 }
 
 void UserManager::handlePresence(Swift::Presence::ref presence) {
-	std::string barejid = presence->getTo().toBare().toString();
 	std::string userkey = presence->getFrom().toBare().toString();
 
 	User *user = getUser(userkey);
@@ -180,139 +244,198 @@ void UserManager::handlePresence(Swift::Presence::ref presence) {
 		    }
 		}
 
-		UserInfo res;
-		bool registered = m_storageBackend ? m_storageBackend->getUser(userkey, res) : false;
+		// Presences received while the user is being loaded from the database
+		// are handled once the login finishes.
+		std::map<std::string, std::list<Swift::Presence::ref> >::iterator it = m_pendingLogins.find(userkey);
+		if (it != m_pendingLogins.end()) {
+			it->second.push_back(presence);
+			return;
+		}
+
+		if (m_asyncStorage) {
+			m_pendingLogins[userkey];
+			m_asyncStorage->getUser(userkey, boost::bind(&UserManager::handleLoginUserInfo, this, presence, _1, _2));
+		}
+		else {
+			handleLoginUserInfo(presence, false, UserInfo());
+		}
+		return;
+	}
+
+	handleUserPresence(presence);
+}
+
+void UserManager::handleLoginUserInfo(Swift::Presence::ref presence, bool registered, UserInfo res) {
+	std::string userkey = presence->getFrom().toBare().toString();
 
-		// No user and unavailable presence -> answer with unavailable
-		if (presence->getType() == Swift::Presence::Unavailable || presence->getType() == Swift::Presence::Probe) {
+	// No user and unavailable presence -> answer with unavailable
+	if (presence->getType() == Swift::Presence::Unavailable || presence->getType() == Swift::Presence::Probe) {
+		Swift::Presence::ref response = Swift::Presence::create();
+		response->setTo(presence->getFrom());
+		response->setFrom(presence->getTo());
+		response->setType(Swift::Presence::Unavailable);
+		m_component->getFrontend()->sendPresence(response);
+
+		// bother him with probe presence, just to be
+		// sure he is subscribed to us.
+		if (/*registered && */presence->getType() == Swift::Presence::Probe) {
 			Swift::Presence::ref response = Swift::Presence::create();
 			response->setTo(presence->getFrom());
 			response->setFrom(presence->getTo());
-			response->setType(Swift::Presence::Unavailable);
+			response->setType(Swift::Presence::Probe);
 			m_component->getFrontend()->sendPresence(response);
+		}
 
-			// bother him with probe presence, just to be
-			// sure he is subscribed to us.
-			if (/*registered && */presence->getType() == Swift::Presence::Probe) {
-				Swift::Presence::ref response = Swift::Presence::create();
-				response->setTo(presence->getFrom());
-				response->setFrom(presence->getTo());
-				response->setType(Swift::Presence::Probe);
-				m_component->getFrontend()->sendPresence(response);
-			}
-
-			// Set user offline in database
-			if (m_storageBackend) {
-				UserInfo res;
-				bool registered = m_storageBackend->getUser(userkey, res);
-				if (registered) {
-					m_storageBackend->setUserOnline(res.id, false);
-				}
-			}
-			return;
+		// Set user offline in database
+		if (m_onlineUsersFlusher && registered) {
+			m_onlineUsersFlusher->setUserOnline(res.id, false);
 		}
+		finishLogin(presence, false);
+		return;
+	}
 
-		// In server mode, we don't need registration normally, but for networks like IRC
-		// or Twitter where there's no real authorization using password, we have to force
-		// registration otherwise some data (like bookmarked rooms) could leak.
-		if (m_component->inServerMode()) {
-			if (!registered) {
-				// If we need registration, stop login process because user is not registered
-				if (CONFIG_BOOL_DEFAULTED(m_component->getConfig(), "registration.needRegistration", false)
-					&& CONFIG_BOOL_DEFAULTED(m_component->getConfig(), "registration.needPassword", true)) {
-					m_userRegistry->onPasswordInvalid(presence->getFrom());
-					LOG4CXX_INFO(logger, userkey << ": Tried to login, but is not registered.");
-					return;
-				}
-				res.password = "";
-				res.uin = presence->getFrom().getNode();
-				res.jid = userkey;
-				while (res.uin.find_last_of("%") != std::string::npos) { // OK
-					res.uin.replace(res.uin.find_last_of("%"), 1, "@"); // OK
-				}
-				if (m_storageBackend) {
-					// store user and getUser again to get user ID.
-					m_storageBackend->setUser(res);
-					registered = m_storageBackend->getUser(userkey, res);
-				}
-				else {
-					registered = true;
-				}
+	// In server mode, we don't need registration normally, but for networks like IRC
+	// or Twitter where there's no real authorization using password, we have to force
+	// registration otherwise some data (like bookmarked rooms) could leak.
+	if (m_component->inServerMode()) {
+		if (!registered) {
+			// If we need registration, stop login process because user is not registered
+			if (CONFIG_BOOL_DEFAULTED(m_component->getConfig(), "registration.needRegistration", false)
+				&& CONFIG_BOOL_DEFAULTED(m_component->getConfig(), "registration.needPassword", true)) {
+				m_userRegistry->onPasswordInvalid(presence->getFrom());
+				LOG4CXX_INFO(logger, userkey << ": Tried to login, but is not registered.");
+				finishLogin(presence, false);
+				return;
 			}
-			res.password = m_userRegistry->getUserPassword(userkey);
+			res.password = "";
+			res.uin = presence->getFrom().getNode();
+			res.jid = userkey;
+			while (res.uin.find_last_of("%") != std::string::npos) { // OK
+				res.uin.replace(res.uin.find_last_of("%"), 1, "@"); // OK
+			}
+			if (m_asyncStorage) {
+				// store user and getUser again to get user ID.
+				m_asyncStorage->setUser(res, boost::bind(&UserManager::handleLoginUserRegistered, this, presence, _1, _2));
+				return;
+			}
+			registered = true;
 		}
+	}
+	// We allow auto_register feature in gateway-mode. This allows IRC user to register
+	// the transport just by joining the room.
+	else if (!registered && (CONFIG_BOOL(m_component->getConfig(), "registration.auto_register")
+			 || !CONFIG_BOOL_DEFAULTED(m_component->getConfig(), "registration.needRegistration", true))) {
+		res.password = "";
+		res.jid = userkey;
 
-		// We allow auto_register feature in gateway-mode. This allows IRC user to register
-		// the transport just by joining the room.
-		if (!m_component->inServerMode()) {
-			if (!registered && (CONFIG_BOOL(m_component->getConfig(), "registration.auto_register")
-				 || !CONFIG_BOOL_DEFAULTED(m_component->getConfig(), "registration.needRegistration", true))) {
-				res.password = "";
-				res.jid = userkey;
-
-				bool isMUC = presence->getPayload<Swift::MUCPayload>() != NULL || *presence->getTo().getNode().c_str() == '#';
-				if (isMUC) {
-					res.uin = presence->getTo().getResource();
-				}
-				else {
-					res.uin = presence->getFrom().toString();
-				}
-				LOG4CXX_INFO(logger, "Auto-registering user " << userkey << " with uin=" << res.uin);
-
-				if (m_storageBackend) {
-					// store user and getUser again to get user ID.
-					m_storageBackend->setUser(res);
-					registered = m_storageBackend->getUser(userkey, res);
-				}
-				else {
-					registered = true;
-				}
-			}
+		bool isMUC = presence->getPayload<Swift::MUCPayload>() != NULL || *presence->getTo().getNode().c_str() == '#';
+		if (isMUC) {
+			res.uin = presence->getTo().getResource();
+		}
+		else {
+			res.uin = presence->getFrom().toString();
 		}
+		LOG4CXX_INFO(logger, "Auto-registering user " << userkey << " with uin=" << res.uin);
 
-		// Unregistered users are not able to login
-		if (!registered) {
-			LOG4CXX_WARN(logger, "Unregistered user " << userkey << " tried to login");
+		if (m_asyncStorage) {
+			// store user and getUser again to get user ID.
+			m_asyncStorage->setUser(res, boost::bind(&UserManager::handleLoginUserRegistered, this, presence, _1, _2));
 			return;
 		}
+		registered = true;
+	}
 
-		if (CONFIG_BOOL(m_component->getConfig(), "service.vip_only") && res.vip == false) {
-			if (!CONFIG_STRING(m_component->getConfig(), "service.vip_message").empty()) {
-				SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Message> msg(new Swift::Message());
-				msg->setBody(CONFIG_STRING(m_component->getConfig(), "service.vip_message"));
-				msg->setTo(presence->getFrom());
-				msg->setFrom(m_component->getJID());
-				m_component->getFrontend()->sendMessage(msg);
-			}
+	handleLoginUserRegistered(presence, registered, res);
+}
 
-			LOG4CXX_WARN(logger, "Non VIP user " << userkey << " tried to login");
-			if (m_component->inServerMode()) {
-				m_userRegistry->onPasswordInvalid(presence->getFrom());
-			}
-			return;
-		}
+void UserManager::handleLoginUserRegistered(Swift::Presence::ref presence, bool registered, UserInfo res) {
+	std::string userkey = presence->getFrom().toBare().toString();
 
-		bool transport_enabled = true;
-		if (m_storageBackend) {
-			std::string value = "1";
-			int type = (int) TYPE_BOOLEAN;
-			m_storageBackend->getUserSetting(res.id, "enable_transport", type, value);
-			transport_enabled = value == "1";
+	if (m_component->inServerMode()) {
+		res.password = m_userRegistry->getUserPassword(userkey);
+	}
+
+	// Unregistered users are not able to login
+	if (!registered) {
+		LOG4CXX_WARN(logger, "Unregistered user " << userkey << " tried to login");
+		finishLogin(presence, false);
+		return;
+	}
+
+	if (CONFIG_BOOL(m_component->getConfig(), "service.vip_only") && res.vip == false) {
+		if (!CONFIG_STRING(m_component->getConfig(), "service.vip_message").empty()) {
+			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::Message> msg(new Swift::Message());
+			msg->setBody(CONFIG_STRING(m_component->getConfig(), "service.vip_message"));
+			msg->setTo(presence->getFrom());
+			msg->setFrom(m_component->getJID());
+			m_component->getFrontend()->sendMessage(msg);
 		}
-		// User can disabled the transport using adhoc commands
-		if (!transport_enabled) {
-			LOG4CXX_INFO(logger, "User " << userkey << " has disabled transport, not logging");
-			return;
+
+		LOG4CXX_WARN(logger, "Non VIP user " << userkey << " tried to login");
+		if (m_component->inServerMode()) {
+			m_userRegistry->onPasswordInvalid(presence->getFrom());
 		}
+		finishLogin(presence, false);
+		return;
+	}
+
+	if (m_asyncStorage) {
+		m_asyncStorage->getUserSetting(res.id, "enable_transport", (int) TYPE_BOOLEAN, "1",
+			boost::bind(&UserManager::handleLoginTransportEnabled, this, presence, res, _1));
+	}
+	else {
+		handleLoginTransportEnabled(presence, res, "1");
+	}
+}
+
+void UserManager::handleLoginTransportEnabled(Swift::Presence::ref presence, UserInfo res, const std::string &value) {
+	// User can disabled the transport using adhoc commands
+	if (value != "1") {
+		LOG4CXX_INFO(logger, "User " << res.jid << " has disabled transport, not logging");
+		finishLogin(presence, false);
+		return;
+	}
 
-		// Create new user class and set storagebackend
-		user = m_component->getFrontend()->createUser(presence->getFrom(), res, m_component, this);
-		user->getRosterManager()->setStorageBackend(m_storageBackend);
-		addUser(user);
+	if (m_asyncStorage) {
+		m_asyncStorage->getBuddies(res.id, boost::bind(&UserManager::handleLoginRoster, this, presence, res, _1));
+	}
+	else {
+		handleLoginRoster(presence, res, std::list<BuddyInfo>());
 	}
+}
 
+void UserManager::handleLoginRoster(Swift::Presence::ref presence, UserInfo res, const std::list<BuddyInfo> &roster) {
+	// Create new user class and set storagebackend
+	User *user = m_component->getFrontend()->createUser(presence->getFrom(), res, m_component, this);
+	user->getRosterManager()->setStorageBackend(m_storageBackend, roster);
+	addUser(user);
+	finishLogin(presence, true);
+}
+
+void UserManager::finishLogin(Swift::Presence::ref presence, bool created) {
+	std::string userkey = presence->getFrom().toBare().toString();
+
+	if (created) {
+		handleUserPresence(presence);
+	}
+
+	std::map<std::string, std::list<Swift::Presence::ref> >::iterator it = m_pendingLogins.find(userkey);
+	if (it == m_pendingLogins.end()) {
+		return;
+	}
+
+	std::list<Swift::Presence::ref> pending;
+	pending.swap(it->second);
+	m_pendingLogins.erase(it);
+
+	for (std::list<Swift::Presence::ref>::iterator it = pending.begin(); it != pending.end(); it++) {
+		handlePresence(*it);
+	}
+}
+
+void UserManager::handleUserPresence(Swift::Presence::ref presence) {
 	// User can be handleDisconnected in addUser callback, so refresh the pointer
-	user = getUser(userkey);
+	User *user = getUser(presence->getFrom().toBare().toString());
 	if (!user) {
 		m_userRegistry->onPasswordInvalid(presence->getFrom());
 		return;
@@ -468,9 +591,12 @@ void UserManager::handleErrorPresence(Swift::Presence::ref presence) {
 		return;
 	}
 
-	std::string userkey = presence->getFrom().toBare().toString();
-	UserInfo res;
-	bool registered = m_storageBackend ? m_storageBackend->getUser(userkey, res) : false;
+	if (m_asyncStorage) {
+		m_asyncStorage->getUser(presence->getFrom().toBare().toString(), boost::bind(&UserManager::handleSubscribeUserInfo, this, presence, _1));
+	}
+}
+
+void UserManager::handleSubscribeUserInfo(Swift::Presence::ref presence, bool registered) {
 	if (registered) {
 		Swift::Presence::ref response = Swift::Presence::create();
 		response->setFrom(presence->getTo().toBare());
@@ -498,15 +624,8 @@ void UserManager::handleSubscription(Swift::Presence::ref presence) {
 		return;
 	}
 	else if (presence->getType() == Swift::Presence::Unsubscribed && presence->getTo().getNode().empty()) {
-		std::string userkey = presence->getFrom().toBare().toString();
-		UserInfo res;
-		bool registered = m_storageBackend ? m_storageBackend->getUser(userkey, res) : false;
-		if (registered) {
-			Swift::Presence::ref response = Swift::Presence::create();
-			response->setFrom(presence->getTo().toBare());
-			response->setTo(presence->getFrom().toBare());
-			response->setType(Swift::Presence::Subscribe);
-			m_component->getFrontend()->sendPresence(response);
+		if (m_asyncStorage) {
+			m_asyncStorage->getUser(presence->getFrom().toBare().toString(), boost::bind(&UserManager::handleSubscribeUserInfo, this, presence, _1));
 		}
 		return;
 	}
@@ -23,6 +23,7 @@
 #include "transport/Logging.h"
 
 #include <sstream>
+#include <algorithm>
 
 #ifndef WIN32
 #include <arpa/inet.h>
@@ -52,6 +53,16 @@ template <class T> std::string stringOf(T object) {
 
 NetworkPlugin::NetworkPlugin() {
 	m_pingReceived = false;
+	m_apiVersion = 1;
+	m_buddyBatchDepth = 0;
+	m_compressionThreshold = 0;
+	m_compressedBytes = 0;
+	m_uncompressedBytes = 0;
+	m_corked = 0;
+	m_outputFrames = 0;
+	m_outputBufferSize = 65536;
+	m_flushes = 0;
+	m_flushedFrames = 0;
 
 	double shared;
 #ifndef WIN32
@@ -80,23 +91,17 @@ void NetworkPlugin::sendConfig(const PluginConfig &cfg) {
 	pbnetwork::BackendConfig m;
 	m.set_config(data);
 
-	std::string message;
-	m.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BACKEND_CONFIG);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_BACKEND_CONFIG, m);
 }
 
 void NetworkPlugin::sendRawXML(std::string &xml) {
-	WRAP(xml, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML);
-
-	send(xml);
+	send(pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, xml);
 }
 
 void NetworkPlugin::handleMessage(const std::string &user, const std::string &legacyName, const std::string &msg, const std::string &nickname, const std::string &xhtml, const std::string &timestamp, bool headline, bool pm) {
 	pbnetwork::ConversationMessage m;
 	m.set_username(user);
+	m.set_sessionid(getSessionId(user));
 	m.set_buddyname(legacyName);
 	m.set_message(msg);
 	m.set_nickname(nickname);
@@ -105,41 +110,28 @@ void NetworkPlugin::handleMessage(const std::string &user, const std::string &le
 	m.set_headline(headline);
 	m.set_pm(pm);
 
-	std::string message;
-	m.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE, m);
 }
 
 void NetworkPlugin::handleMessageAck(const std::string &user, const std::string &legacyName, const std::string &id) {
 	pbnetwork::ConversationMessage m;
 	m.set_username(user);
+	m.set_sessionid(getSessionId(user));
 	m.set_buddyname(legacyName);
 	m.set_message("");
 	m.set_id(id);
 
-	std::string message;
-	m.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE_ACK);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE_ACK, m);
 }
 
 void NetworkPlugin::handleAttention(const std::string &user, const std::string &buddyName, const std::string &msg) {
 	pbnetwork::ConversationMessage m;
 	m.set_username(user);
+	m.set_sessionid(getSessionId(user));
 	m.set_buddyname(buddyName);
 	m.set_message(msg);
 
-	std::string message;
-	m.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_ATTENTION);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_ATTENTION, m);
 }
 
 void NetworkPlugin::handleVCard(const std::string &user, unsigned int id, const std::string &legacyName, const std::string &fullName, const std::string &nickname, const std::string &photo) {
@@ -151,33 +143,28 @@ void NetworkPlugin::handleVCard(const std::string &user, unsigned int id, const
 	vcard.set_nickname(nickname);
 	vcard.set_photo(photo);
 
-	std::string message;
-	vcard.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_VCARD);
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_VCARD, vcard);
 }
 
 void NetworkPlugin::handleSubject(const std::string &user, const std::string &legacyName, const std::string &msg, const std::string &nickname) {
 	pbnetwork::ConversationMessage m;
 	m.set_username(user);
+	m.set_sessionid(getSessionId(user));
 	m.set_buddyname(legacyName);
 	m.set_message(msg);
 	m.set_nickname(nickname);
 
-	std::string message;
-	m.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED);
 // 	std::cout << "SENDING MESSAGE\n";
 
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED, m);
 }
 
 void NetworkPlugin::handleBuddyChanged(const std::string &user, const std::string &buddyName, const std::string &alias,
 			const std::vector<std::string> &groups, pbnetwork::StatusType status, const std::string &statusMessage, const std::string &iconHash, bool blocked) {
-	pbnetwork::Buddy buddy;
+	pbnetwork::Buddy stackBuddy;
+	pbnetwork::Buddy &buddy = m_buddyBatchDepth == 0 ? stackBuddy : *m_buddyBatch.add_buddy();
 	buddy.set_username(user);
+	buddy.set_sessionid(getSessionId(user));
 	buddy.set_buddyname(buddyName);
 	buddy.set_alias(alias);
 	for (std::vector<std::string>::const_iterator it = groups.begin(); it != groups.end(); it++) {
@@ -188,89 +175,84 @@ void NetworkPlugin::handleBuddyChanged(const std::string &user, const std::strin
 	buddy.set_iconhash(iconHash);
 	buddy.set_blocked(blocked);
 
-	std::string message;
-	buddy.SerializeToString(&message);
+	if (m_buddyBatchDepth == 0) {
+		send(pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED, buddy);
+	}
+}
 
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED);
+void NetworkPlugin::beginBuddyBatch() {
+	m_buddyBatchDepth++;
+}
 
-	send(message);
+void NetworkPlugin::endBuddyBatch() {
+	if (m_buddyBatchDepth == 0 || --m_buddyBatchDepth != 0 || m_buddyBatch.buddy_size() == 0) {
+		return;
+	}
+
+	// Spectrum2 older than API version 4 knows only single buddies.
+	if (m_apiVersion >= 4 && m_buddyBatch.buddy_size() > 1) {
+		send(pbnetwork::WrapperMessage_Type_TYPE_BUDDIES_CHANGED, m_buddyBatch);
+	}
+	else {
+		corkOutput();
+		for (int i = 0; i < m_buddyBatch.buddy_size(); i++) {
+			send(pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED, m_buddyBatch.buddy(i));
+		}
+		uncorkOutput();
+	}
+	m_buddyBatch.Clear();
 }
 
 void NetworkPlugin::handleBuddyRemoved(const std::string &user, const std::string &buddyName) {
 	pbnetwork::Buddy buddy;
 	buddy.set_username(user);
+	buddy.set_sessionid(getSessionId(user));
 	buddy.set_buddyname(buddyName);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED, buddy);
 }
 
 void NetworkPlugin::handleBuddyTyping(const std::string &user, const std::string &buddyName) {
 	pbnetwork::Buddy buddy;
 	buddy.set_username(user);
+	buddy.set_sessionid(getSessionId(user));
 	buddy.set_buddyname(buddyName);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING, buddy);
 }
 
 void NetworkPlugin::handleBuddyTyped(const std::string &user, const std::string &buddyName) {
 	pbnetwork::Buddy buddy;
 	buddy.set_username(user);
+	buddy.set_sessionid(getSessionId(user));
 	buddy.set_buddyname(buddyName);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED, buddy);
 }
 
 void NetworkPlugin::handleBuddyStoppedTyping(const std::string &user, const std::string &buddyName) {
 	pbnetwork::Buddy buddy;
 	buddy.set_username(user);
+	buddy.set_sessionid(getSessionId(user));
 	buddy.set_buddyname(buddyName);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING, buddy);
 }
 
 void NetworkPlugin::handleAuthorization(const std::string &user, const std::string &buddyName) {
 	pbnetwork::Buddy buddy;
 	buddy.set_username(user);
+	buddy.set_sessionid(getSessionId(user));
 	buddy.set_buddyname(buddyName);
 
-	std::string message;
-	buddy.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_AUTH_REQUEST);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_AUTH_REQUEST, buddy);
 }
 
 void NetworkPlugin::handleConnected(const std::string &user) {
 	pbnetwork::Connected d;
 	d.set_user(user);
 
-	std::string message;
-	d.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_CONNECTED);
-
-	send(message);	
+	send(pbnetwork::WrapperMessage_Type_TYPE_CONNECTED, d);	
 }
 
 void NetworkPlugin::handleDisconnected(const std::string &user, int error, const std::string &msg) {
@@ -279,17 +261,13 @@ void NetworkPlugin::handleDisconnected(const std::string &user, int error, const
 	d.set_error(error);
 	d.set_message(msg);
 
-	std::string message;
-	d.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_DISCONNECTED);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_DISCONNECTED, d);
 }
 
 void NetworkPlugin::handleParticipantChanged(const std::string &user, const std::string &nickname, const std::string &room, int flags, pbnetwork::StatusType status, const std::string &statusMessage, const std::string &newname, const std::string &alias) {
 	pbnetwork::Participant d;
 	d.set_username(user);
+	d.set_sessionid(getSessionId(user));
 	d.set_nickname(nickname);
 	d.set_room(room);
 	d.set_flag(flags);
@@ -298,12 +276,7 @@ void NetworkPlugin::handleParticipantChanged(const std::string &user, const std:
 	d.set_statusmessage(statusMessage);
 	d.set_alias(alias);
 
-	std::string message;
-	d.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_PARTICIPANT_CHANGED);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_PARTICIPANT_CHANGED, d);
 }
 
 void NetworkPlugin::handleRoomNicknameChanged(const std::string &user, const std::string &r, const std::string &nickname) {
@@ -313,12 +286,8 @@ void NetworkPlugin::handleRoomNicknameChanged(const std::string &user, const std
 	room.set_room(r);
 	room.set_password("");
 
-	std::string message;
-	room.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_ROOM_NICKNAME_CHANGED);
  
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_ROOM_NICKNAME_CHANGED, room);
 }
 
 void NetworkPlugin::handleFTStart(const std::string &user, const std::string &buddyName, const std::string fileName, unsigned long size) {
@@ -328,12 +297,8 @@ void NetworkPlugin::handleFTStart(const std::string &user, const std::string &bu
 	room.set_filename(fileName);
 	room.set_size(size);
 
-	std::string message;
-	room.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_START);
  
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_FT_START, room);
 }
 
 void NetworkPlugin::handleFTFinish(const std::string &user, const std::string &buddyName, const std::string fileName, unsigned long size, unsigned long ftid) {
@@ -346,12 +311,8 @@ void NetworkPlugin::handleFTFinish(const std::string &user, const std::string &b
 		room.set_ftid(ftid);
 	}
 
-	std::string message;
-	room.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH);
  
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH, room);
 }
 
 void NetworkPlugin::handleFTData(unsigned long ftID, const std::string &data) {
@@ -359,12 +320,8 @@ void NetworkPlugin::handleFTData(unsigned long ftID, const std::string &data) {
 	d.set_ftid(ftID);
 	d.set_data(data);
 
-	std::string message;
-	d.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_FT_DATA);
  
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_FT_DATA, d);
 }
 
 void NetworkPlugin::handleRoomList(const std::string &user, const std::list<std::string> &rooms, const std::list<std::string> &names) {
@@ -379,12 +336,16 @@ void NetworkPlugin::handleRoomList(const std::string &user, const std::list<std:
 
 	d.set_user(user);
 
-	std::string message;
-	d.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_ROOM_LIST);
  
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_ROOM_LIST, d);
+}
+
+unsigned int NetworkPlugin::getSessionId(const std::string &user) {
+	std::map<std::string, unsigned int>::const_iterator it = m_sessionIds.find(user);
+	if (it == m_sessionIds.end()) {
+		return 0;
+	}
+	return it->second;
 }
 
 void NetworkPlugin::handleLoginPayload(const std::string &data) {
@@ -393,6 +354,9 @@ void NetworkPlugin::handleLoginPayload(const std::string &data) {
 		// TODO: ERROR
 		return;
 	}
+	if (payload.sessionid()) {
+		m_sessionIds[payload.user()] = payload.sessionid();
+	}
 	handleLoginRequest(payload.user(), payload.legacyname(), payload.password());
 }
 
@@ -402,11 +366,12 @@ void NetworkPlugin::handleLogoutPayload(const std::string &data) {
 		// TODO: ERROR
 		return;
 	}
+	m_sessionIds.erase(payload.user());
 	handleLogoutRequest(payload.user(), payload.legacyname());
 }
 
 void NetworkPlugin::handleStatusChangedPayload(const std::string &data) {
-	pbnetwork::Status payload;
+	pbnetwork::Status &payload = m_status;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -416,7 +381,7 @@ void NetworkPlugin::handleStatusChangedPayload(const std::string &data) {
 }
 
 void NetworkPlugin::handleConvMessagePayload(const std::string &data) {
-	pbnetwork::ConversationMessage payload;
+	pbnetwork::ConversationMessage &payload = m_conversationMessage;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -426,7 +391,7 @@ void NetworkPlugin::handleConvMessagePayload(const std::string &data) {
 }
 
 void NetworkPlugin::handleRoomSubjectChangedPayload(const std::string &data) {
-	pbnetwork::ConversationMessage payload;
+	pbnetwork::ConversationMessage &payload = m_conversationMessage;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -436,7 +401,7 @@ void NetworkPlugin::handleRoomSubjectChangedPayload(const std::string &data) {
 }
 
 void NetworkPlugin::handleAttentionPayload(const std::string &data) {
-	pbnetwork::ConversationMessage payload;
+	pbnetwork::ConversationMessage &payload = m_conversationMessage;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -521,7 +486,7 @@ void NetworkPlugin::handleVCardPayload(const std::string &data) {
 }
 
 void NetworkPlugin::handleBuddyChangedPayload(const std::string &data) {
-	pbnetwork::Buddy payload;
+	pbnetwork::Buddy &payload = m_buddy;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -539,7 +504,7 @@ void NetworkPlugin::handleBuddyChangedPayload(const std::string &data) {
 }
 
 void NetworkPlugin::handleBuddyRemovedPayload(const std::string &data) {
-	pbnetwork::Buddy payload;
+	pbnetwork::Buddy &payload = m_buddy;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -554,7 +519,7 @@ void NetworkPlugin::handleBuddyRemovedPayload(const std::string &data) {
 }
 
 void NetworkPlugin::handleChatStatePayload(const std::string &data, int type) {
-	pbnetwork::Buddy payload;
+	pbnetwork::Buddy &payload = m_buddy;
 	if (payload.ParseFromString(data) == false) {
 		// TODO: ERROR
 		return;
@@ -576,91 +541,119 @@ void NetworkPlugin::handleChatStatePayload(const std::string &data, int type) {
 }
 
 void NetworkPlugin::handleDataRead(std::string &data) {
-	m_data.insert(m_data.end(), data.begin(), data.end());
-
-	while (m_data.size() != 0) {
-		unsigned int expected_size;
+	m_data.append(data);
+
+	// Everything we send as a reaction to received data is sent at once.
+	corkOutput();
+	handleFrames();
+	uncorkOutput();
+}
+
+void NetworkPlugin::handleFrames() {
+	const char *frame;
+	unsigned int expected_size;
+	int type;
+	pbnetwork::WrapperMessage &wrapper = m_wrapper;
+	std::string &payload = m_payload;
+	if (payload.capacity() > REUSED_BUFFER_LIMIT) {
+		std::string().swap(payload);
+	}
+	if (wrapper.payload().capacity() > REUSED_BUFFER_LIMIT) {
+		std::string().swap(*wrapper.mutable_payload());
+	}
 
-		if (m_data.size() >= 4) {
-			expected_size = *((unsigned int*) &m_data[0]);
-			expected_size = ntohl(expected_size);
-			if (m_data.size() - 4 < expected_size)
+	while (m_data.nextFrame(frame, expected_size, type)) {
+		if (type == -1) {
+			if (wrapper.ParseFromArray(frame, expected_size) == false) {
 				return;
+			}
+			type = wrapper.type();
+			payload.swap(*wrapper.mutable_payload());
 		}
-		else {
-			return;
+		else if (type & NETWORK_FRAME_COMPRESSED) {
+			type &= ~NETWORK_FRAME_COMPRESSED;
+			if (!NetworkFrameBuffer::decompress(frame, expected_size, payload)) {
+				continue;
+			}
+			m_compressedBytes += expected_size;
+			m_uncompressedBytes += payload.size();
 		}
-
-		pbnetwork::WrapperMessage wrapper;
-		if (wrapper.ParseFromArray(&m_data[4], expected_size) == false) {
-			m_data.erase(m_data.begin(), m_data.begin() + 4 + expected_size);
-			return;
+		else {
+			payload.assign(frame, expected_size);
 		}
-		m_data.erase(m_data.begin(), m_data.begin() + 4 + expected_size);
 
-		switch(wrapper.type()) {
+		switch(type) {
 			case pbnetwork::WrapperMessage_Type_TYPE_LOGIN:
-				handleLoginPayload(wrapper.payload());
+				handleLoginPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_LOGOUT:
-				handleLogoutPayload(wrapper.payload());
+				handleLogoutPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_PING:
 				sendPong();
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE:
-				handleConvMessagePayload(wrapper.payload());
+				handleConvMessagePayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_ROOM_SUBJECT_CHANGED:
-				handleRoomSubjectChangedPayload(wrapper.payload());
+				handleRoomSubjectChangedPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_JOIN_ROOM:
-				handleJoinRoomPayload(wrapper.payload());
+				handleJoinRoomPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_LEAVE_ROOM:
-				handleLeaveRoomPayload(wrapper.payload());
+				handleLeaveRoomPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_VCARD:
-				handleVCardPayload(wrapper.payload());
+				handleVCardPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED:
-				handleBuddyChangedPayload(wrapper.payload());
+				handleBuddyChangedPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_REMOVED:
-				handleBuddyRemovedPayload(wrapper.payload());
+				handleBuddyRemovedPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_STATUS_CHANGED:
-				handleStatusChangedPayload(wrapper.payload());
+				handleStatusChangedPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING:
-				handleChatStatePayload(wrapper.payload(), pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING);
+				handleChatStatePayload(payload, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED:
-				handleChatStatePayload(wrapper.payload(), pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED);
+				handleChatStatePayload(payload, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPED);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING:
-				handleChatStatePayload(wrapper.payload(), pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING);
+				handleChatStatePayload(payload, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_STOPPED_TYPING);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_ATTENTION:
-				handleAttentionPayload(wrapper.payload());
+				handleAttentionPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_FT_START:
-				handleFTStartPayload(wrapper.payload());
+				handleFTStartPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_FT_FINISH:
-				handleFTFinishPayload(wrapper.payload());
+				handleFTFinishPayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_FT_PAUSE:
-				handleFTPausePayload(wrapper.payload());
+				handleFTPausePayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_FT_CONTINUE:
-				handleFTContinuePayload(wrapper.payload());
+				handleFTContinuePayload(payload);
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_EXIT:
 				handleExitRequest();
 				break;
 			case pbnetwork::WrapperMessage_Type_TYPE_RAW_XML:
-				handleRawXML(wrapper.payload());
+				handleRawXML(payload);
+				break;
+			case pbnetwork::WrapperMessage_Type_TYPE_API_VERSION:
+				handleAPIVersionPayload(payload);
+				break;
+			case pbnetwork::WrapperMessage_Type_TYPE_EXPORT_SESSION:
+				handleExportSessionPayload(payload);
+				break;
+			case pbnetwork::WrapperMessage_Type_TYPE_IMPORT_SESSION:
+				handleImportSessionPayload(payload);
 				break;
 			default:
 				return;
@@ -668,10 +661,157 @@ void NetworkPlugin::handleDataRead(std::string &data) {
 	}
 }
 
-void NetworkPlugin::send(const std::string &data) {
-	uint32_t size = htonl(data.size());
-	char *header = (char *) &size;
-	sendData(std::string(header, 4) + data);
+void NetworkPlugin::send(int type, const google::protobuf::MessageLite &payload) {
+	// In corked state the frame goes directly to the output buffer.
+	std::string frame;
+	std::string &out = m_corked == 0 ? frame : m_output;
+#if GOOGLE_PROTOBUF_VERSION >= 3001000
+	if (m_compressionThreshold != 0 && payload.ByteSizeLong() > m_compressionThreshold) {
+#else
+	if (m_compressionThreshold != 0 && (unsigned long) payload.ByteSize() > m_compressionThreshold) {
+#endif
+		std::string message;
+		payload.SerializeToString(&message);
+		appendCompressedFrame(out, type, message);
+	}
+	else if (m_apiVersion >= 2) {
+		NetworkFrameBuffer::appendFrame(out, type, payload);
+	}
+	else {
+		std::string message;
+		payload.SerializeToString(&message);
+		WRAP(message, (pbnetwork::WrapperMessage_Type) type);
+		NetworkFrameBuffer::appendFrame(out, message);
+	}
+	queueFrame(frame);
+}
+
+void NetworkPlugin::send(int type, const std::string &payload) {
+	std::string frame;
+	std::string &out = m_corked == 0 ? frame : m_output;
+	if (m_compressionThreshold != 0 && payload.size() > m_compressionThreshold) {
+		appendCompressedFrame(out, type, payload);
+	}
+	else if (m_apiVersion >= 2) {
+		NetworkFrameBuffer::appendFrame(out, type, payload);
+	}
+	else {
+		std::string message = payload;
+		WRAP(message, (pbnetwork::WrapperMessage_Type) type);
+		NetworkFrameBuffer::appendFrame(out, message);
+	}
+	queueFrame(frame);
+}
+
+void NetworkPlugin::appendCompressedFrame(std::string &out, int type, const std::string &payload) {
+	size_t size = out.size();
+	if (NetworkFrameBuffer::appendCompressedFrame(out, type, payload)) {
+		m_compressedBytes += out.size() - size - 6;
+		m_uncompressedBytes += payload.size();
+	}
+	else {
+		NetworkFrameBuffer::appendFrame(out, type, payload);
+	}
+}
+
+void NetworkPlugin::queueFrame(const std::string &frame) {
+	if (m_corked == 0) {
+		sendData(frame);
+		return;
+	}
+
+	m_outputFrames++;
+
+	if (m_output.size() >= m_outputBufferSize) {
+		flushOutput();
+	}
+}
+
+void NetworkPlugin::corkOutput() {
+	m_corked++;
+}
+
+void NetworkPlugin::uncorkOutput() {
+	if (m_corked > 0 && --m_corked == 0) {
+		flushOutput();
+	}
+}
+
+void NetworkPlugin::flushOutput() {
+	if (m_output.empty()) {
+		return;
+	}
+
+	m_flushes++;
+	m_flushedFrames += m_outputFrames;
+	m_outputFrames = 0;
+
+	std::string data;
+	data.swap(m_output);
+	sendData(data);
+}
+
+void NetworkPlugin::handleAPIVersionPayload(const std::string &data) {
+	pbnetwork::APIVersion payload;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	// Reply with our version, so spectrum2 knows it can send v2 frames.
+	// The reply itself is still sent as v1 frame.
+	if (m_apiVersion == 1) {
+		pbnetwork::APIVersion apiver;
+		apiver.set_version(NETWORK_PLUGIN_API_VERSION);
+		if (payload.compressionthreshold() != 0 && NetworkFrameBuffer::isCompressionSupported()) {
+			apiver.set_compressionthreshold(payload.compressionthreshold());
+		}
+		if (supportsSessionResume()) {
+			apiver.set_sessionresume(true);
+		}
+		send(pbnetwork::WrapperMessage_Type_TYPE_API_VERSION, apiver);
+
+		if (apiver.compressionthreshold() != 0) {
+			m_compressionThreshold = apiver.compressionthreshold();
+		}
+	}
+
+	m_apiVersion = std::min((int) payload.version(), NETWORK_PLUGIN_API_VERSION);
+}
+
+void NetworkPlugin::handleExportSessionPayload(const std::string &data) {
+	pbnetwork::SessionState payload;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	std::string state;
+	m_sessionIds.erase(payload.username());
+	handleExportSessionRequest(payload.username(), payload.legacyname(), state);
+	payload.set_data(state);
+	send(pbnetwork::WrapperMessage_Type_TYPE_SESSION_EXPORTED, payload);
+}
+
+void NetworkPlugin::handleImportSessionPayload(const std::string &data) {
+	pbnetwork::SessionState payload;
+	if (payload.ParseFromString(data) == false) {
+		// TODO: ERROR
+		return;
+	}
+
+	if (payload.sessionid()) {
+		m_sessionIds[payload.username()] = payload.sessionid();
+	}
+	handleImportSessionRequest(payload);
+}
+
+void NetworkPlugin::handleImportSessionRequest(const pbnetwork::SessionState &state) {
+	handleLoginRequest(state.username(), state.legacyname(), state.password());
+	for (int i = 0; i < state.room_size(); i++) {
+		const pbnetwork::Room &room = state.room(i);
+		handleJoinRoomRequest(state.username(), room.room(), room.nickname(), room.password());
+	}
 }
 
 void NetworkPlugin::checkPing() {
@@ -684,12 +824,7 @@ void NetworkPlugin::checkPing() {
 
 void NetworkPlugin::sendPong() {
 	m_pingReceived = true;
-	std::string message;
-	pbnetwork::WrapperMessage wrap;
-	wrap.set_type(pbnetwork::WrapperMessage_Type_TYPE_PONG);
-	wrap.SerializeToString(&message);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_PONG);
 	sendMemoryUsage();
 }
 
@@ -711,12 +846,7 @@ void NetworkPlugin::sendMemoryUsage() {
 	stats.set_shared(shared + e_shared);
 	stats.set_id(stringOf(getpid()));
 
-	std::string message;
-	stats.SerializeToString(&message);
-
-	WRAP(message, pbnetwork::WrapperMessage_Type_TYPE_STATS);
-
-	send(message);
+	send(pbnetwork::WrapperMessage_Type_TYPE_STATS, stats);
 }
 
 }
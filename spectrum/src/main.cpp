@@ -6,6 +6,7 @@
 #include "transport/MySQLBackend.h"
 #include "transport/PQXXBackend.h"
 #include "transport/StorageBackend.h"
+#include "transport/CachingStorageBackend.h"
 #include "transport/UserRegistration.h"
 #include "transport/UserRegistry.h"
 #include "transport/NetworkPluginServer.h"
@@ -256,6 +257,11 @@ int mainloop() {
 		return -1;
 	}
 
+	if (storageBackend && CONFIG_INT(config_, "database.settings_cache_size") > 0) {
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> cache(new SettingsCache(CONFIG_INT(config_, "database.settings_cache_size")));
+		storageBackend = new CachingStorageBackend(storageBackend, cache);
+	}
+
 	Logging::redirect_stderr();
 
 	userManager = frontend->createUserManager(&transport, &userRegistry, storageBackend);;
@@ -0,0 +1,134 @@
+#include <sstream>
+#include <iostream>
+#include <sys/time.h>
+#include <unistd.h>
+#include <boost/lexical_cast.hpp>
+#include "transport/StorageBackend.h"
+#include "transport/LogStorageBackend.h"
+#include "transport/Config.h"
+#ifdef WITH_SQLITE
+#include "transport/SQLite3Backend.h"
+#endif
+
+using namespace Transport;
+
+#define LOG_PATH "storage_benchmark.log"
+#define SQLITE_PATH "storage_benchmark.sql"
+
+static long addUser(StorageBackend *storage, const std::string &jid) {
+	UserInfo user;
+	user.jid = jid;
+	user.uin = "uin";
+	user.password = "password";
+	user.language = "en";
+	user.encoding = "utf8";
+	user.vip = false;
+	storage->setUser(user);
+	if (!storage->getUser(jid, user)) {
+		return -1;
+	}
+	return user.id;
+}
+
+static BuddyInfo createBuddy(const std::string &name) {
+	BuddyInfo buddy;
+	buddy.id = -1;
+	buddy.legacyName = name;
+	buddy.alias = "Buddy";
+	buddy.subscription = "both";
+	buddy.groups.push_back("group1");
+	buddy.flags = 0;
+	return buddy;
+}
+
+// Runs the same workload as Spectrum 2 does for logging in users: the user is
+// stored and marked online, roster is stored in bulk by RosterFlusher, then
+// loaded, buddy settings are changed and the user goes offline.
+// Returns the time in milliseconds or -1 if some request failed.
+static double runWorkload(StorageBackend *storage) {
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	for (int u = 0; u < 100; u++) {
+		long userId = addUser(storage, "user" + boost::lexical_cast<std::string>(u) + "@localhost");
+		if (userId == -1) {
+			return -1;
+		}
+
+		std::vector<long> ids(1, userId);
+		if (!storage->setUsersOnline(ids, true)) {
+			return -1;
+		}
+
+		std::list<std::pair<long, BuddyInfo> > buddies;
+		for (int b = 0; b < 50; b++) {
+			buddies.push_back(std::make_pair(userId, createBuddy("buddy" + boost::lexical_cast<std::string>(b))));
+		}
+		if (!storage->storeBuddies(buddies)) {
+			return -1;
+		}
+
+		std::list<BuddyInfo> roster;
+		if (!storage->getBuddies(userId, roster) || roster.size() != 50) {
+			return -1;
+		}
+
+		storage->beginTransaction();
+		for (std::list<BuddyInfo>::const_iterator it = roster.begin(); it != roster.end(); it++) {
+			storage->updateBuddySetting(userId, it->id, "icon_hash", TYPE_STRING, "hash");
+		}
+		if (!storage->commitTransaction()) {
+			return -1;
+		}
+
+		if (!storage->setUsersOnline(ids, false)) {
+			return -1;
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0;
+}
+
+static void report(const std::string &name, double time) {
+	if (time < 0) {
+		std::cout << name << ": failed\n";
+	}
+	else {
+		std::cout << name << ": " << time << " ms\n";
+	}
+}
+
+int main(int argc, char **argv) {
+	unlink(LOG_PATH);
+	{
+		std::istringstream ifs("database.type = log\ndatabase.database = " LOG_PATH "\n");
+		Config config;
+		config.load(ifs);
+		LogStorageBackend storage(&config);
+		if (!storage.connect()) {
+			std::cerr << "Can't open " << LOG_PATH << "\n";
+			return 1;
+		}
+		report("LogStorageBackend", runWorkload(&storage));
+	}
+	unlink(LOG_PATH);
+
+#ifdef WITH_SQLITE
+	unlink(SQLITE_PATH);
+	{
+		std::istringstream ifs("database.type = sqlite3\ndatabase.database = " SQLITE_PATH "\n");
+		Config config;
+		config.load(ifs);
+		SQLite3Backend storage(&config);
+		if (!storage.connect()) {
+			std::cerr << "Can't open " << SQLITE_PATH << "\n";
+			return 1;
+		}
+		report("SQLite3Backend", runWorkload(&storage));
+	}
+	unlink(SQLITE_PATH);
+#endif
+
+	return 0;
+}
@@ -127,6 +127,7 @@ class AdminInterfaceTest : public CPPUNIT_NS :: TestFixture, public BasicSlackTe
 		std::string resp;
 		resp = sendAdminMessage("variables");
 		CPPUNIT_ASSERT(resp.find("backends_count - \"Number of active backends\" Value: \"0\" Read-only: true") != std::string::npos);
+		CPPUNIT_ASSERT(resp.find("backends_queue_size - \"Number of bytes queued for all backends\" Value: \"0\" Read-only: true") != std::string::npos);
 	}
 };
 
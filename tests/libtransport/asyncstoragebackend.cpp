@@ -0,0 +1,103 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "basictest.h"
+#include "transport/AsyncStorageBackend.h"
+
+using namespace Transport;
+
+class AsyncStorageBackendTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
+	CPPUNIT_TEST_SUITE(AsyncStorageBackendTest);
+	CPPUNIT_TEST(inlineRequests);
+#ifdef WITH_SQLITE
+	CPPUNIT_TEST(threadedRequests);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		int called;
+		bool registered;
+		UserInfo info;
+		std::string value;
+
+		void setUp (void) {
+			setMeUp();
+			called = 0;
+			registered = false;
+		}
+
+		void tearDown (void) {
+			tearMeDown();
+		}
+
+		void handleUser(bool r, const UserInfo &user) {
+			called++;
+			registered = r;
+			info = user;
+		}
+
+		void handleSetting(const std::string &v) {
+			called++;
+			value = v;
+		}
+
+		void waitFor(int count) {
+			for (int i = 0; i < 500 && called < count; i++) {
+				boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+				loop->processEvents();
+			}
+		}
+
+		void inlineRequests() {
+			// There is no database configured, so the requests are executed
+			// on the main StorageBackend immediately.
+			AsyncStorageBackend async(loop, cfg, storage, 1);
+			CPPUNIT_ASSERT(!async.isAsync());
+
+			async.getUser("user@localhost", boost::bind(&AsyncStorageBackendTest::handleUser, this, _1, _2));
+			CPPUNIT_ASSERT_EQUAL(1, called);
+			CPPUNIT_ASSERT(!registered);
+
+			addUser();
+			async.getUser("user@localhost", boost::bind(&AsyncStorageBackendTest::handleUser, this, _1, _2));
+			CPPUNIT_ASSERT_EQUAL(2, called);
+			CPPUNIT_ASSERT(registered);
+			CPPUNIT_ASSERT_EQUAL(std::string("legacyname"), info.uin);
+
+			async.getUserSetting(1, "enable_transport", (int) TYPE_BOOLEAN, "1", boost::bind(&AsyncStorageBackendTest::handleSetting, this, _1));
+			CPPUNIT_ASSERT_EQUAL(3, called);
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), value);
+		}
+
+#ifdef WITH_SQLITE
+		void threadedRequests() {
+			std::istringstream ifs("database.type = sqlite3\ndatabase.database = :memory:\n");
+			Config config;
+			config.load(ifs);
+
+			AsyncStorageBackend async(loop, &config, NULL, 1);
+			CPPUNIT_ASSERT(async.isAsync());
+
+			UserInfo user;
+			user.jid = "user@localhost";
+			user.uin = "legacyname";
+			user.password = "password";
+			user.vip = 0;
+			async.setUser(user, boost::bind(&AsyncStorageBackendTest::handleUser, this, _1, _2));
+
+			// Callbacks are called only from the event loop.
+			boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+			CPPUNIT_ASSERT_EQUAL(0, called);
+			waitFor(1);
+			CPPUNIT_ASSERT_EQUAL(1, called);
+			CPPUNIT_ASSERT(registered);
+			CPPUNIT_ASSERT(info.id != 0);
+
+			async.getUserSetting(info.id, "enable_transport", (int) TYPE_BOOLEAN, "0", boost::bind(&AsyncStorageBackendTest::handleSetting, this, _1));
+			waitFor(2);
+			CPPUNIT_ASSERT_EQUAL(2, called);
+			CPPUNIT_ASSERT_EQUAL(std::string("0"), value);
+		}
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (AsyncStorageBackendTest);
@@ -0,0 +1,119 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <Swiften/Swiften.h>
+#include <Swiften/EventLoop/DummyEventLoop.h>
+#include <Swiften/Server/Server.h>
+#include <Swiften/Network/DummyNetworkFactories.h>
+#include <Swiften/Network/DummyConnectionServer.h>
+#include "Swiften/Server/ServerStanzaChannel.h"
+#include "Swiften/Server/ServerFromClientSession.h"
+#include "Swiften/Parser/PayloadParsers/FullPayloadParserFactoryCollection.h"
+#include "basictest.h"
+#include "transport/BackendDecoder.h"
+#include "transport/protocol.pb.h"
+#include <unistd.h>
+
+using namespace Transport;
+
+class BackendDecoderTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
+	CPPUNIT_TEST_SUITE(BackendDecoderTest);
+	CPPUNIT_TEST(decodeFrames);
+	CPPUNIT_TEST(removeBackend);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		NetworkPluginServer::Backend backend1;
+		NetworkPluginServer::Backend backend2;
+		std::vector<NetworkPluginServer::Backend *> backends;
+		std::vector<int> types;
+		std::vector<std::string> payloads;
+
+		void setUp (void) {
+			setMeUp();
+			backends.clear();
+			types.clear();
+			payloads.clear();
+		}
+
+		void tearDown (void) {
+			tearMeDown();
+		}
+
+		void handleFrame(NetworkPluginServer::Backend *c, int type, const std::string &payload) {
+			backends.push_back(c);
+			types.push_back(type);
+			payloads.push_back(payload);
+		}
+
+		// Frames are decoded in other threads, so give them some time.
+		void waitForFrames(size_t count) {
+			for (int i = 0; i < 500 && types.size() < count; i++) {
+				usleep(10000);
+				loop->processEvents();
+			}
+		}
+
+		Swift::SafeByteArray toByteArray(const std::string &data, size_t start, size_t end) {
+			return Swift::SafeByteArray(data.begin() + start, data.begin() + end);
+		}
+
+		void decodeFrames() {
+			BackendDecoder decoder(loop, 2, boost::bind(&BackendDecoderTest::handleFrame, this, _1, _2, _3));
+			decoder.addBackend(&backend1);
+			decoder.addBackend(&backend2);
+
+			std::string stream1;
+			NetworkFrameBuffer::appendFrame(stream1, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, "<presence/>");
+			pbnetwork::WrapperMessage wrapper;
+			wrapper.set_type(pbnetwork::WrapperMessage_Type_TYPE_PONG);
+			std::string message;
+			wrapper.SerializeToString(&message);
+			NetworkFrameBuffer::appendFrame(stream1, message);
+
+			std::string stream2;
+			NetworkFrameBuffer::appendFrame(stream2, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, "<message/>");
+
+			// Frame split across two reads.
+			decoder.decode(&backend1, toByteArray(stream1, 0, 3));
+			decoder.decode(&backend2, toByteArray(stream2, 0, stream2.size()));
+			decoder.decode(&backend1, toByteArray(stream1, 3, stream1.size()));
+			waitForFrames(3);
+
+			CPPUNIT_ASSERT_EQUAL(3, (int) types.size());
+			std::vector<int> types1;
+			for (size_t i = 0; i < types.size(); i++) {
+				if (backends[i] == &backend1) {
+					types1.push_back(types[i]);
+				}
+				else {
+					CPPUNIT_ASSERT_EQUAL((int) pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, types[i]);
+					CPPUNIT_ASSERT_EQUAL(std::string("<message/>"), payloads[i]);
+				}
+			}
+
+			// Frames of single backend keep their order.
+			CPPUNIT_ASSERT_EQUAL(2, (int) types1.size());
+			CPPUNIT_ASSERT_EQUAL((int) pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, types1[0]);
+			CPPUNIT_ASSERT_EQUAL((int) pbnetwork::WrapperMessage_Type_TYPE_PONG, types1[1]);
+		}
+
+		void removeBackend() {
+			BackendDecoder decoder(loop, 1, boost::bind(&BackendDecoderTest::handleFrame, this, _1, _2, _3));
+			decoder.addBackend(&backend1);
+			decoder.addBackend(&backend2);
+
+			std::string stream;
+			NetworkFrameBuffer::appendFrame(stream, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, "<presence/>");
+
+			decoder.decode(&backend1, toByteArray(stream, 0, stream.size()));
+			decoder.removeBackend(&backend1);
+			decoder.decode(&backend1, toByteArray(stream, 0, stream.size()));
+			decoder.decode(&backend2, toByteArray(stream, 0, stream.size()));
+			waitForFrames(1);
+
+			CPPUNIT_ASSERT_EQUAL(1, (int) types.size());
+			CPPUNIT_ASSERT(backends[0] == &backend2);
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (BackendDecoderTest);
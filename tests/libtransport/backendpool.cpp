@@ -0,0 +1,130 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <Swiften/Swiften.h>
+#include <Swiften/EventLoop/DummyEventLoop.h>
+#include <Swiften/Server/Server.h>
+#include <Swiften/Network/DummyNetworkFactories.h>
+#include <Swiften/Network/DummyConnectionServer.h>
+#include "Swiften/Server/ServerStanzaChannel.h"
+#include "Swiften/Server/ServerFromClientSession.h"
+#include "Swiften/Parser/PayloadParsers/FullPayloadParserFactoryCollection.h"
+#include "basictest.h"
+#include "transport/BackendPool.h"
+
+using namespace Transport;
+
+class BackendPoolTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
+	CPPUNIT_TEST_SUITE(BackendPoolTest);
+	CPPUNIT_TEST(firstFit);
+	CPPUNIT_TEST(leastLoaded);
+	CPPUNIT_TEST(memoryWeighted);
+	CPPUNIT_TEST(fullAndDyingBackends);
+	CPPUNIT_TEST(unknownPlacement);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		NetworkPluginServer::Backend backend1;
+		NetworkPluginServer::Backend backend2;
+
+		void setUp (void) {
+			setMeUp();
+			backend1.connection = factories->getConnectionFactory()->createConnection();
+			backend1.willDie = false;
+			backend2.connection = factories->getConnectionFactory()->createConnection();
+			backend2.willDie = false;
+		}
+
+		void tearDown (void) {
+			backend1.connection.reset();
+			backend2.connection.reset();
+			tearMeDown();
+		}
+
+		void addUsers(NetworkPluginServer::Backend &c, int count) {
+			for (int i = 0; i < count; i++) {
+				c.users.push_back(NULL);
+			}
+		}
+
+		void firstFit() {
+			BackendPool pool(BackendPlacement::createPlacement("first_fit"), 10);
+			pool.addBackend(&backend1);
+			pool.addBackend(&backend2);
+
+			// The newest backend is used until it's full.
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend2);
+			addUsers(backend2, 5);
+			pool.updateBackend(&backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, true) == NULL);
+
+			// Backend with users is preferred over the idle one.
+			addUsers(backend1, 1);
+			pool.updateBackend(&backend1);
+			backend2.users.clear();
+			pool.updateBackend(&backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend1);
+		}
+
+		void leastLoaded() {
+			BackendPool pool(BackendPlacement::createPlacement("least_loaded"), 10);
+			addUsers(backend1, 3);
+			addUsers(backend2, 5);
+			pool.addBackend(&backend1);
+			pool.addBackend(&backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend1);
+
+			addUsers(backend1, 3);
+			pool.updateBackend(&backend1);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend2);
+		}
+
+		void memoryWeighted() {
+			BackendPool pool(BackendPlacement::createPlacement("memory"), 10);
+			// backend1 uses 100 per user, backend2 500 per user.
+			backend1.init_res = 1000;
+			backend1.res = 1200;
+			addUsers(backend1, 2);
+			backend2.init_res = 1000;
+			backend2.res = 1500;
+			addUsers(backend2, 1);
+			pool.addBackend(&backend1);
+			pool.addBackend(&backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend1);
+
+			backend1.res = 2000;
+			pool.updateBackend(&backend1);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend2);
+		}
+
+		void fullAndDyingBackends() {
+			BackendPool pool(BackendPlacement::createPlacement("least_loaded"), 2);
+			addUsers(backend1, 2);
+			pool.addBackend(&backend1);
+			pool.addBackend(&backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend2);
+
+			backend2.willDie = true;
+			pool.updateBackend(&backend2);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == NULL);
+
+			backend1.users.pop_back();
+			pool.updateBackend(&backend1);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == &backend1);
+
+			backend1.acceptUsers = false;
+			pool.updateBackend(&backend1);
+			CPPUNIT_ASSERT(pool.getBackend(true, false) == NULL);
+			CPPUNIT_ASSERT(pool.getBackend(false, false) == &backend1);
+
+			pool.removeBackend(&backend1);
+			CPPUNIT_ASSERT(pool.getBackend(false, false) == NULL);
+			CPPUNIT_ASSERT_EQUAL(1, (int) pool.size());
+		}
+
+		void unknownPlacement() {
+			CPPUNIT_ASSERT(BackendPlacement::createPlacement("unknown") == NULL);
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (BackendPoolTest);
@@ -108,10 +108,12 @@ class TestingStorageBackend : public StorageBackend {
 		std::map<std::string, bool> online_users;
 		std::map<int, std::map<std::string, std::string> > settings;
 		long buddyid;
+		bool online_failure;
 
 		TestingStorageBackend() {
 			buddyid = 0;
 			connected = false;
+			online_failure = false;
 		}
 
 		/// connect
@@ -147,12 +149,16 @@ class TestingStorageBackend : public StorageBackend {
 		}
 
 		/// setUserOnline
-		virtual void setUserOnline(long id, bool online) {
+		virtual bool setUserOnline(long id, bool online) {
+			if (online_failure) {
+				return false;
+			}
 			std::string user = findUserByID(id);
 			if (user.empty()) {
-				return;
+				return true;
 			}
 			online_users[user] = online;
+			return true;
 		}
 
 		/// removeUser
@@ -182,23 +188,24 @@ class TestingStorageBackend : public StorageBackend {
 		virtual long addBuddy(long userId, const BuddyInfo &buddyInfo) {
 			return buddyid++;
 		}
-		virtual void updateBuddy(long userId, const BuddyInfo &buddyInfo) {
-			
+		virtual bool updateBuddy(long userId, const BuddyInfo &buddyInfo) {
+			return true;
 		}
 
 		virtual void removeBuddy(long id) {
 			
 		}
 
-		virtual void getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {}
+		virtual bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) { return true; }
 		virtual void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {}
 
-		virtual void getUserSetting(long userId, const std::string &variable, int &type, std::string &value) {
+		virtual bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value) {
 			if (settings[userId].find(variable) == settings[userId].end()) {
 				settings[userId][variable] = value;
-				return;
+				return true;
 			}
 			value = settings[userId][variable];
+			return true;
 		}
 
 		virtual void updateUserSetting(long userId, const std::string &variable, const std::string &value) {
@@ -215,7 +222,7 @@ class TestingStorageBackend : public StorageBackend {
 		}
 
 		virtual void beginTransaction() {}
-		virtual void commitTransaction() {}
+		virtual bool commitTransaction() { return true; }
 };
 
 class BasicTest : public Swift::XMPPParserClient {
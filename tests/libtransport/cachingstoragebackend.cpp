@@ -0,0 +1,180 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <Swiften/Swiften.h>
+#include <Swiften/EventLoop/DummyEventLoop.h>
+#include <Swiften/Server/Server.h>
+#include <Swiften/Network/DummyNetworkFactories.h>
+#include <Swiften/Network/DummyConnectionServer.h>
+#include "Swiften/Server/ServerStanzaChannel.h"
+#include "Swiften/Server/ServerFromClientSession.h"
+#include "Swiften/Parser/PayloadParsers/FullPayloadParserFactoryCollection.h"
+#include "basictest.h"
+#include "transport/CachingStorageBackend.h"
+
+using namespace Transport;
+
+class CountingStorageBackend : public TestingStorageBackend {
+	public:
+		int userSettingRequests;
+		int buddySettingRequests;
+		std::map<std::pair<long, std::string>, std::string> buddySettings;
+		bool failure;
+		// Changes the setting while it's being read, like another thread would.
+		StorageBackend *writer;
+		std::string writtenValue;
+
+		CountingStorageBackend() {
+			userSettingRequests = 0;
+			buddySettingRequests = 0;
+			failure = false;
+			writer = NULL;
+		}
+
+		bool getUserSetting(long userId, const std::string &variable, int &type, std::string &value) {
+			userSettingRequests++;
+			if (failure) {
+				return false;
+			}
+			TestingStorageBackend::getUserSetting(userId, variable, type, value);
+			if (writer) {
+				StorageBackend *w = writer;
+				writer = NULL;
+				w->updateUserSetting(userId, variable, writtenValue);
+			}
+			return true;
+		}
+
+		bool getBuddySetting(long userId, long buddyId, const std::string &variable, int &type, std::string &value) {
+			buddySettingRequests++;
+			if (failure) {
+				return false;
+			}
+			std::map<std::pair<long, std::string>, std::string>::const_iterator it = buddySettings.find(std::make_pair(buddyId, variable));
+			if (it != buddySettings.end()) {
+				type = TYPE_STRING;
+				value = it->second;
+			}
+			return true;
+		}
+
+		void updateBuddySetting(long userId, long buddyId, const std::string &variable, int type, const std::string &value) {
+			buddySettings[std::make_pair(buddyId, variable)] = value;
+		}
+};
+
+class CachingStorageBackendTest : public CPPUNIT_NS :: TestFixture {
+	CPPUNIT_TEST_SUITE(CachingStorageBackendTest);
+	CPPUNIT_TEST(userSettings);
+	CPPUNIT_TEST(buddySettings);
+	CPPUNIT_TEST(evict);
+	CPPUNIT_TEST(failedRead);
+	CPPUNIT_TEST(concurrentWrite);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		CountingStorageBackend *backend;
+		CachingStorageBackend *storage;
+		SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache> cache;
+
+		void setUp (void) {
+			backend = new CountingStorageBackend();
+			cache = SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<SettingsCache>(new SettingsCache(2));
+			storage = new CachingStorageBackend(backend, cache);
+		}
+
+		void tearDown (void) {
+			delete storage;
+		}
+
+		std::string getUserSetting(const std::string &variable, const std::string &def) {
+			int type = TYPE_BOOLEAN;
+			std::string value = def;
+			storage->getUserSetting(1, variable, type, value);
+			return value;
+		}
+
+		void userSettings() {
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), getUserSetting("enable_transport", "1"));
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), getUserSetting("enable_transport", "0"));
+			CPPUNIT_ASSERT_EQUAL(1, backend->userSettingRequests);
+			CPPUNIT_ASSERT_EQUAL(1, (int) cache->getHits());
+			CPPUNIT_ASSERT_EQUAL(1, (int) cache->getMisses());
+
+			// Written to the database and the cache.
+			storage->updateUserSetting(1, "enable_transport", "0");
+			CPPUNIT_ASSERT_EQUAL(std::string("0"), backend->settings[1]["enable_transport"]);
+			CPPUNIT_ASSERT_EQUAL(std::string("0"), getUserSetting("enable_transport", "1"));
+			CPPUNIT_ASSERT_EQUAL(1, backend->userSettingRequests);
+
+			storage->removeUser(1);
+			getUserSetting("enable_transport", "1");
+			CPPUNIT_ASSERT_EQUAL(2, backend->userSettingRequests);
+		}
+
+		void buddySettings() {
+			// Missing setting does not change type and value and is cached too.
+			int type = TYPE_UNKNOWN;
+			std::string value;
+			storage->getBuddySetting(1, 5, "icon_hash", type, value);
+			storage->getBuddySetting(1, 5, "icon_hash", type, value);
+			CPPUNIT_ASSERT_EQUAL((int) TYPE_UNKNOWN, type);
+			CPPUNIT_ASSERT_EQUAL(1, backend->buddySettingRequests);
+
+			storage->updateBuddySetting(1, 5, "icon_hash", TYPE_STRING, "hash1");
+			storage->getBuddySetting(1, 5, "icon_hash", type, value);
+			CPPUNIT_ASSERT_EQUAL((int) TYPE_STRING, type);
+			CPPUNIT_ASSERT_EQUAL(std::string("hash1"), value);
+			CPPUNIT_ASSERT_EQUAL(2, backend->buddySettingRequests);
+
+			backend->buddySettings.clear();
+			storage->removeBuddy(5);
+			value.clear();
+			storage->getBuddySetting(1, 5, "icon_hash", type, value);
+			CPPUNIT_ASSERT_EQUAL(std::string(""), value);
+			CPPUNIT_ASSERT_EQUAL(3, backend->buddySettingRequests);
+		}
+
+		void evict() {
+			getUserSetting("setting1", "1");
+			getUserSetting("setting2", "1");
+			getUserSetting("setting1", "1");
+			getUserSetting("setting3", "1");
+			CPPUNIT_ASSERT_EQUAL(2, (int) cache->size());
+			CPPUNIT_ASSERT_EQUAL(1, (int) cache->getEvicted());
+
+			// setting2 was the least recently used one.
+			getUserSetting("setting1", "1");
+			CPPUNIT_ASSERT_EQUAL(3, backend->userSettingRequests);
+			getUserSetting("setting2", "1");
+			CPPUNIT_ASSERT_EQUAL(4, backend->userSettingRequests);
+		}
+
+		void failedRead() {
+			backend->failure = true;
+			int type = TYPE_BOOLEAN;
+			std::string value = "1";
+			CPPUNIT_ASSERT(!storage->getUserSetting(1, "enable_transport", type, value));
+			CPPUNIT_ASSERT(!storage->getBuddySetting(1, 5, "icon_hash", type, value));
+			CPPUNIT_ASSERT_EQUAL(0, (int) cache->size());
+
+			backend->failure = false;
+			backend->buddySettings[std::make_pair(5, std::string("icon_hash"))] = "hash1";
+			CPPUNIT_ASSERT(storage->getBuddySetting(1, 5, "icon_hash", type, value));
+			CPPUNIT_ASSERT_EQUAL(std::string("hash1"), value);
+			CPPUNIT_ASSERT_EQUAL(2, backend->buddySettingRequests);
+		}
+
+		void concurrentWrite() {
+			// The value read before the write must not be cached.
+			backend->writer = storage;
+			backend->writtenValue = "0";
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), getUserSetting("enable_transport", "1"));
+			CPPUNIT_ASSERT_EQUAL(0, (int) cache->size());
+
+			CPPUNIT_ASSERT_EQUAL(std::string("0"), getUserSetting("enable_transport", "1"));
+			CPPUNIT_ASSERT_EQUAL(std::string("0"), getUserSetting("enable_transport", "1"));
+			CPPUNIT_ASSERT_EQUAL(2, backend->userSettingRequests);
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (CachingStorageBackendTest);
@@ -0,0 +1,99 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include "transport/IQRouteTable.h"
+
+using namespace Transport;
+
+class IQRouteTableTest : public CPPUNIT_NS :: TestFixture {
+	CPPUNIT_TEST_SUITE(IQRouteTableTest);
+	CPPUNIT_TEST(takeRoute);
+	CPPUNIT_TEST(replaceRoute);
+	CPPUNIT_TEST(expireRoutes);
+	CPPUNIT_TEST(evictRoutes);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		void setUp (void) {
+		}
+
+		void tearDown (void) {
+		}
+
+		void takeRoute() {
+			IQRouteTable routes(10, 10);
+			std::string resource;
+			routes.addRoute("user@localhost", "id1", "res1");
+			routes.addRoute("user@localhost", "id2", "res2");
+			CPPUNIT_ASSERT_EQUAL(2, (int) routes.size());
+
+			CPPUNIT_ASSERT(routes.takeRoute("user@localhost", "id2", resource));
+			CPPUNIT_ASSERT_EQUAL(std::string("res2"), resource);
+			CPPUNIT_ASSERT(!routes.takeRoute("user@localhost", "id2", resource));
+			CPPUNIT_ASSERT(!routes.takeRoute("user2@localhost", "id1", resource));
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.size());
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.getHits());
+			CPPUNIT_ASSERT_EQUAL(2, (int) routes.getMisses());
+		}
+
+		void replaceRoute() {
+			IQRouteTable routes(2, 10);
+			std::string resource;
+			routes.addRoute("user@localhost", "id1", "res1");
+			routes.tick();
+			routes.addRoute("user@localhost", "id1", "res2");
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.size());
+
+			// Replaced route expires with the new TTL.
+			routes.tick();
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.size());
+			CPPUNIT_ASSERT(routes.takeRoute("user@localhost", "id1", resource));
+			CPPUNIT_ASSERT_EQUAL(std::string("res2"), resource);
+			CPPUNIT_ASSERT_EQUAL(0, (int) routes.getExpired());
+		}
+
+		void expireRoutes() {
+			IQRouteTable routes(3, 10);
+			std::string resource;
+			routes.addRoute("user@localhost", "id1", "res1");
+			routes.tick();
+			routes.addRoute("user@localhost", "id2", "res2");
+			routes.tick();
+			CPPUNIT_ASSERT_EQUAL(2, (int) routes.size());
+
+			routes.tick();
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.size());
+			CPPUNIT_ASSERT(!routes.takeRoute("user@localhost", "id1", resource));
+
+			routes.tick();
+			CPPUNIT_ASSERT_EQUAL(0, (int) routes.size());
+			CPPUNIT_ASSERT_EQUAL(2, (int) routes.getExpired());
+
+			// Wheel keeps working after it wraps around.
+			for (int i = 0; i < 10; i++) {
+				routes.addRoute("user@localhost", "id", "res");
+				routes.tick();
+			}
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.size());
+		}
+
+		void evictRoutes() {
+			IQRouteTable routes(10, 2);
+			std::string resource;
+			routes.addRoute("user@localhost", "id1", "res1");
+			routes.addRoute("user@localhost", "id2", "res2");
+			routes.addRoute("user@localhost", "id3", "res3");
+			CPPUNIT_ASSERT_EQUAL(2, (int) routes.size());
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.getEvicted());
+			CPPUNIT_ASSERT(!routes.takeRoute("user@localhost", "id1", resource));
+			CPPUNIT_ASSERT(routes.takeRoute("user@localhost", "id3", resource));
+
+			// Evicted route is not expired later.
+			for (int i = 0; i < 20; i++) {
+				routes.tick();
+			}
+			CPPUNIT_ASSERT_EQUAL(0, (int) routes.size());
+			CPPUNIT_ASSERT_EQUAL(1, (int) routes.getExpired());
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (IQRouteTableTest);
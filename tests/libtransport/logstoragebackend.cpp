@@ -0,0 +1,337 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <sstream>
+#include <fstream>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "transport/StorageBackend.h"
+#include "transport/LogStorageBackend.h"
+#include "transport/Config.h"
+
+using namespace Transport;
+
+#define LOG_PATH "logstoragebackend.log"
+
+class LogStorageBackendTest : public CPPUNIT_NS :: TestFixture {
+	CPPUNIT_TEST_SUITE(LogStorageBackendTest);
+	CPPUNIT_TEST(replay);
+	CPPUNIT_TEST(storeBuddies);
+	CPPUNIT_TEST(removeUser);
+	CPPUNIT_TEST(incompleteRecord);
+	CPPUNIT_TEST(corruptedRecord);
+	CPPUNIT_TEST(lock);
+	CPPUNIT_TEST(compact);
+	CPPUNIT_TEST(writeFailure);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		Config *config;
+
+		void setUp (void) {
+			unlink(LOG_PATH);
+			std::istringstream ifs("database.type = log\ndatabase.database = " LOG_PATH "\n");
+			config = new Config();
+			config->load(ifs);
+		}
+
+		void tearDown (void) {
+			delete config;
+			unlink(LOG_PATH);
+		}
+
+		long addUser(StorageBackend *storage, const std::string &jid) {
+			UserInfo user;
+			user.jid = jid;
+			user.uin = "uin";
+			user.password = "password";
+			user.language = "en";
+			user.encoding = "utf8";
+			user.vip = false;
+			storage->setUser(user);
+			CPPUNIT_ASSERT(storage->getUser(jid, user));
+			return user.id;
+		}
+
+		BuddyInfo createBuddy(const std::string &name) {
+			BuddyInfo buddy;
+			buddy.id = -1;
+			buddy.legacyName = name;
+			buddy.alias = "Buddy";
+			buddy.subscription = "both";
+			buddy.groups.push_back("group1");
+			buddy.flags = 0;
+			return buddy;
+		}
+
+		void replay() {
+			long userId;
+			long buddyId;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				userId = addUser(&storage, "user@localhost");
+				storage.setUserOnline(userId, true);
+
+				int type = TYPE_BOOLEAN;
+				std::string value = "0";
+				storage.getUserSetting(userId, "enable_transport", type, value);
+				storage.updateUserSetting(userId, "enable_transport", "1");
+
+				BuddyInfo buddy = createBuddy("buddy1");
+				buddyId = storage.addBuddy(userId, buddy);
+				CPPUNIT_ASSERT(buddyId != -1);
+				CPPUNIT_ASSERT_EQUAL(-1L, storage.addBuddy(userId, buddy));
+				storage.updateBuddySetting(userId, buddyId, "icon_hash", TYPE_STRING, "hash1");
+			}
+
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+
+			UserInfo user;
+			CPPUNIT_ASSERT(storage.getUser("user@localhost", user));
+			CPPUNIT_ASSERT_EQUAL(userId, (long) user.id);
+			CPPUNIT_ASSERT_EQUAL(std::string("password"), user.password);
+
+			std::vector<std::string> online;
+			storage.getOnlineUsers(online);
+			CPPUNIT_ASSERT_EQUAL(1, (int) online.size());
+
+			int type = TYPE_BOOLEAN;
+			std::string value = "0";
+			storage.getUserSetting(userId, "enable_transport", type, value);
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), value);
+
+			std::list<BuddyInfo> roster;
+			CPPUNIT_ASSERT(storage.getBuddies(userId, roster));
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(buddyId, roster.front().id);
+			CPPUNIT_ASSERT_EQUAL(std::string("buddy1"), roster.front().legacyName);
+			CPPUNIT_ASSERT_EQUAL(std::string("group1"), roster.front().groups[0]);
+			CPPUNIT_ASSERT_EQUAL(std::string("hash1"), roster.front().settings["icon_hash"].s);
+
+			// IDs are not reused.
+			CPPUNIT_ASSERT(addUser(&storage, "user2@localhost") > userId);
+			CPPUNIT_ASSERT(storage.addBuddy(userId, createBuddy("buddy2")) > buddyId);
+		}
+
+		void storeBuddies() {
+			std::list<std::pair<long, BuddyInfo> > buddies;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				unsigned long size = storage.getLogSize();
+				buddies.push_back(std::make_pair(1L, createBuddy("buddy1")));
+				buddies.push_back(std::make_pair(2L, createBuddy("buddy1")));
+				CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+				CPPUNIT_ASSERT(buddies.front().second.id != buddies.back().second.id);
+				CPPUNIT_ASSERT(storage.getLogSize() > size);
+
+				storage.updateBuddySetting(1, buddies.front().second.id, "blocked", TYPE_BOOLEAN, "1");
+
+				// Changes are written when the transaction is committed.
+				size = storage.getLogSize();
+				storage.beginTransaction();
+				buddies.front().second.alias = "Changed";
+				buddies.front().second.settings["icon_hash"].type = TYPE_STRING;
+				buddies.front().second.settings["icon_hash"].s = "hash2";
+				storage.updateBuddy(1, buddies.front().second);
+				CPPUNIT_ASSERT_EQUAL(size, storage.getLogSize());
+				storage.commitTransaction();
+				CPPUNIT_ASSERT(storage.getLogSize() > size);
+			}
+
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+			std::list<BuddyInfo> roster;
+			storage.getBuddies(1, roster);
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(buddies.front().second.id, roster.front().id);
+			CPPUNIT_ASSERT_EQUAL(std::string("Changed"), roster.front().alias);
+
+			// updateBuddy() does not drop settings missing in the BuddyInfo.
+			int type = 0;
+			std::string value;
+			storage.getBuddySetting(1, roster.front().id, "blocked", type, value);
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), value);
+			// Settings in the BuddyInfo are merged into the stored ones.
+			storage.getBuddySetting(1, roster.front().id, "icon_hash", type, value);
+			CPPUNIT_ASSERT_EQUAL(std::string("hash2"), value);
+		}
+
+		void removeUser() {
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				long userId = addUser(&storage, "user@localhost");
+				long buddyId = storage.addBuddy(userId, createBuddy("buddy1"));
+				storage.addBuddy(userId, createBuddy("buddy2"));
+				storage.removeBuddy(buddyId);
+
+				std::list<BuddyInfo> roster;
+				storage.getBuddies(userId, roster);
+				CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+				CPPUNIT_ASSERT_EQUAL(std::string("buddy2"), roster.front().legacyName);
+
+				CPPUNIT_ASSERT(storage.removeUser(userId));
+			}
+
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+			UserInfo user;
+			CPPUNIT_ASSERT(!storage.getUser("user@localhost", user));
+			std::vector<std::string> users;
+			storage.getUsers(users);
+			CPPUNIT_ASSERT(users.empty());
+		}
+
+		void incompleteRecord() {
+			unsigned long size;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				addUser(&storage, "user@localhost");
+				size = storage.getLogSize();
+			}
+
+			{
+				std::ofstream f(LOG_PATH, std::ios::app | std::ios::binary);
+				f << std::string("\0\0\0\x40\0\0", 6);
+			}
+
+			UserInfo user;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				CPPUNIT_ASSERT_EQUAL(size, storage.getLogSize());
+				CPPUNIT_ASSERT(storage.getUser("user@localhost", user));
+				addUser(&storage, "user2@localhost");
+			}
+
+			// Records written after the removed one are replayed.
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+			CPPUNIT_ASSERT(storage.getUser("user2@localhost", user));
+		}
+
+		void corruptRecord(unsigned long offset) {
+			std::fstream f(LOG_PATH, std::ios::in | std::ios::out | std::ios::binary);
+			f.seekg(offset);
+			char c = f.get();
+			f.seekp(offset);
+			f.put(c ^ 1);
+		}
+
+		void corruptedRecord() {
+			unsigned long size;
+			unsigned long size2;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				size = storage.getLogSize();
+				addUser(&storage, "user@localhost");
+				size2 = storage.getLogSize();
+				addUser(&storage, "user2@localhost");
+			}
+
+			// Damaged last record is removed like incomplete one.
+			corruptRecord(size2 + 10);
+			UserInfo user;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				CPPUNIT_ASSERT_EQUAL(size2, storage.getLogSize());
+				CPPUNIT_ASSERT(storage.getUser("user@localhost", user));
+				CPPUNIT_ASSERT(!storage.getUser("user2@localhost", user));
+				addUser(&storage, "user2@localhost");
+			}
+
+			// Records after damaged one in the middle are not removed.
+			corruptRecord(size + 10);
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(!storage.connect());
+			}
+			std::ifstream f(LOG_PATH, std::ios::binary | std::ios::ate);
+			CPPUNIT_ASSERT((unsigned long) f.tellg() > size2);
+		}
+
+		void lock() {
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+			CPPUNIT_ASSERT(!storage.supportsConnectionPool());
+
+			LogStorageBackend storage2(config);
+			CPPUNIT_ASSERT(!storage2.connect());
+		}
+
+		void compact() {
+			long userId;
+			unsigned long size;
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+				userId = addUser(&storage, "user@localhost");
+				storage.addBuddy(userId, createBuddy("buddy1"));
+				for (int i = 0; i < 100; i++) {
+					storage.setUserOnline(userId, i % 2 == 0);
+				}
+
+				size = storage.getLogSize();
+				CPPUNIT_ASSERT(storage.compact());
+				CPPUNIT_ASSERT(storage.getLogSize() < size);
+				size = storage.getLogSize();
+
+				// The compacted log is still locked.
+				LogStorageBackend storage2(config);
+				CPPUNIT_ASSERT(!storage2.connect());
+			}
+
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+			CPPUNIT_ASSERT_EQUAL(size, storage.getLogSize());
+			std::vector<std::string> online;
+			storage.getOnlineUsers(online);
+			CPPUNIT_ASSERT(online.empty());
+			std::list<BuddyInfo> roster;
+			storage.getBuddies(userId, roster);
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+		}
+
+		void writeFailure() {
+			std::list<std::pair<long, BuddyInfo> > buddies;
+			buddies.push_back(std::make_pair(1L, createBuddy("buddy1")));
+			{
+				LogStorageBackend storage(config);
+				CPPUNIT_ASSERT(storage.connect());
+
+				// Writes fail with EFBIG once the log reaches the limit.
+				void (*handler)(int) = signal(SIGXFSZ, SIG_IGN);
+				struct rlimit limit, old;
+				getrlimit(RLIMIT_FSIZE, &old);
+				limit = old;
+				limit.rlim_cur = storage.getLogSize();
+				setrlimit(RLIMIT_FSIZE, &limit);
+				bool stored = storage.storeBuddies(buddies);
+				setrlimit(RLIMIT_FSIZE, &old);
+				signal(SIGXFSZ, handler);
+
+				CPPUNIT_ASSERT(!stored);
+				CPPUNIT_ASSERT(buddies.front().second.id != -1);
+
+				// Failed records are written by the retry.
+				buddies.front().second.alias = "Changed";
+				CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+			}
+
+			LogStorageBackend storage(config);
+			CPPUNIT_ASSERT(storage.connect());
+			std::list<BuddyInfo> roster;
+			storage.getBuddies(1, roster);
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(buddies.front().second.id, roster.front().id);
+			CPPUNIT_ASSERT_EQUAL(std::string("Changed"), roster.front().alias);
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (LogStorageBackendTest);
@@ -0,0 +1,97 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <boost/bind.hpp>
+#include "transport/MemoryReadBytestream.h"
+
+using namespace Transport;
+
+class MemoryReadBytestreamTest : public CPPUNIT_NS :: TestFixture {
+	CPPUNIT_TEST_SUITE(MemoryReadBytestreamTest);
+	CPPUNIT_TEST(readChunks);
+	CPPUNIT_TEST(watermarks);
+	CPPUNIT_TEST(spill);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		int dataNeeded;
+		int bufferFull;
+
+		void setUp (void) {
+			dataNeeded = 0;
+			bufferFull = 0;
+		}
+
+		void tearDown (void) {
+		}
+
+		void handleDataNeeded() {
+			dataNeeded++;
+		}
+
+		void handleBufferFull() {
+			bufferFull++;
+		}
+
+		std::string read(MemoryReadBytestream &bytestream, size_t size) {
+			SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<std::vector<unsigned char> > data = bytestream.read(size);
+			return std::string(data->begin(), data->end());
+		}
+
+		void readChunks() {
+			MemoryReadBytestream bytestream(10);
+			bytestream.appendData("abc");
+			bytestream.appendData("defgh");
+			CPPUNIT_ASSERT_EQUAL(8, (int) bytestream.getBufferedSize());
+
+			CPPUNIT_ASSERT_EQUAL(std::string("abc"), read(bytestream, 4));
+			CPPUNIT_ASSERT_EQUAL(std::string("de"), read(bytestream, 2));
+			CPPUNIT_ASSERT_EQUAL(std::string("fgh"), read(bytestream, 4));
+			CPPUNIT_ASSERT_EQUAL(std::string(""), read(bytestream, 4));
+			CPPUNIT_ASSERT(!bytestream.isFinished());
+
+			bytestream.appendData("ij");
+			CPPUNIT_ASSERT_EQUAL(std::string("ij"), read(bytestream, 4));
+			CPPUNIT_ASSERT(bytestream.isFinished());
+		}
+
+		void watermarks() {
+			MemoryReadBytestream bytestream(100, 2, 6);
+			bytestream.onDataNeeded.connect(boost::bind(&MemoryReadBytestreamTest::handleDataNeeded, this));
+			bytestream.onBufferFull.connect(boost::bind(&MemoryReadBytestreamTest::handleBufferFull, this));
+
+			bytestream.appendData("abc");
+			CPPUNIT_ASSERT_EQUAL(0, bufferFull);
+			bytestream.appendData("def");
+			CPPUNIT_ASSERT_EQUAL(1, bufferFull);
+			bytestream.appendData("ghi");
+			CPPUNIT_ASSERT_EQUAL(1, bufferFull);
+
+			read(bytestream, 3);
+			read(bytestream, 3);
+			CPPUNIT_ASSERT_EQUAL(0, dataNeeded);
+			read(bytestream, 1);
+			CPPUNIT_ASSERT_EQUAL(1, dataNeeded);
+			read(bytestream, 2);
+			CPPUNIT_ASSERT_EQUAL(1, dataNeeded);
+		}
+
+		void spill() {
+			MemoryReadBytestream bytestream(100, 0, 0, 4);
+			bytestream.appendData("abc");
+			bytestream.appendData("def");
+			bytestream.appendData("g");
+			CPPUNIT_ASSERT_EQUAL(7, (int) bytestream.getBufferedSize());
+			CPPUNIT_ASSERT_EQUAL(4, (int) bytestream.getSpilledSize());
+
+			CPPUNIT_ASSERT_EQUAL(std::string("abc"), read(bytestream, 5));
+			CPPUNIT_ASSERT_EQUAL(std::string("defg"), read(bytestream, 5));
+			CPPUNIT_ASSERT_EQUAL(0, (int) bytestream.getSpilledSize());
+
+			// Data are kept in memory again once the file is read.
+			bytestream.appendData("hi");
+			CPPUNIT_ASSERT_EQUAL(0, (int) bytestream.getSpilledSize());
+			CPPUNIT_ASSERT_EQUAL(std::string("hi"), read(bytestream, 5));
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (MemoryReadBytestreamTest);
@@ -13,7 +13,13 @@
 #include <cppunit/Test.h>
 #include <time.h>    // for clock()
 #include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <arpa/inet.h>
 #include "transport/protocol.pb.h"
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 using namespace Transport;
 
@@ -39,15 +45,26 @@ class NetworkPluginServerTest : public CPPUNIT_NS :: TestFixture, public BasicTe
 	CPPUNIT_TEST_SUITE(NetworkPluginServerTest);
 	CPPUNIT_TEST(handleBuddyChangedPayload);
 	CPPUNIT_TEST(handleBuddyChangedPayloadNoEscaping);
+	CPPUNIT_TEST(handleBuddyChangedPayloadSessionId);
 	CPPUNIT_TEST(handleBuddyChangedPayloadUserContactInRoster);
+	CPPUNIT_TEST(handleBuddiesChangedPayload);
 	CPPUNIT_TEST(handleMessageHeadline);
 	CPPUNIT_TEST(handleConvMessageAckPayload);
 	CPPUNIT_TEST(handleRawXML);
 	CPPUNIT_TEST(handleRawXMLSplit);
 	CPPUNIT_TEST(handleRawXMLIQ);
+	CPPUNIT_TEST(handleDataReadV2);
+	CPPUNIT_TEST(handleDataReadCompressed);
+	CPPUNIT_TEST(decompressLimit);
+	CPPUNIT_TEST(frameBufferShrink);
+	CPPUNIT_TEST(sendQueuePriority);
+	CPPUNIT_TEST(sendQueueSessionOrder);
+	CPPUNIT_TEST(sendQueueShedding);
+	CPPUNIT_TEST(migrateUser);
 
 	CPPUNIT_TEST(benchmarkHandleBuddyChangedPayload);
 	CPPUNIT_TEST(benchmarkSendUnavailablePresence);
+	CPPUNIT_TEST(benchmarkHandleDataReadChunks);
 	CPPUNIT_TEST_SUITE_END();
 
 	public:
@@ -187,6 +204,301 @@ class NetworkPluginServerTest : public CPPUNIT_NS :: TestFixture, public BasicTe
 			std::cerr << " " << clk.elapsedTime() << " s";
 		}
 
+		void benchmarkHandleDataReadChunks() {
+			Clock clk;
+			pbnetwork::WrapperMessage wrap;
+			wrap.set_type(pbnetwork::WrapperMessage_Type_TYPE_PONG);
+			std::string message;
+			wrap.SerializeToString(&message);
+
+			uint32_t size = htonl(message.size());
+			std::string frame = std::string((char *) &size, 4) + message;
+
+			std::string stream;
+			stream.reserve(frame.size() * 100000);
+			for (int i = 0; i < 100000; i++) {
+				stream += frame;
+			}
+
+			// Split the stream into randomly sized chunks as they could be
+			// received from the socket.
+			srand(1);
+			std::vector<SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray> > chunks;
+			for (size_t pos = 0; pos < stream.size();) {
+				size_t len = std::min<size_t>(1 + rand() % 4096, stream.size() - pos);
+				chunks.push_back(SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray>(new Swift::SafeByteArray(stream.begin() + pos, stream.begin() + pos + len)));
+				pos += len;
+			}
+
+			backend.pongReceived = true;
+			clk.start();
+			for (size_t i = 0; i < chunks.size(); i++) {
+				serv->handleDataRead(&backend, chunks[i]);
+			}
+			clk.end();
+			CPPUNIT_ASSERT_EQUAL(0, (int) backend.data.size());
+			std::cerr << " " << clk.elapsedTime() << " s";
+		}
+
+		void handleDataReadV2() {
+			cfg->updateBackendConfig("[features]\nrawxml=1\n");
+			User *user = userManager->getUser("user@localhost");
+			std::vector<std::string> grp;
+			grp.push_back("group1");
+			LocalBuddy *buddy = new LocalBuddy(user->getRosterManager(), -1, "buddy1@domain.tld", "Buddy 1", grp, BUDDY_JID_ESCAPING);
+			user->getRosterManager()->setBuddy(buddy);
+
+			pbnetwork::APIVersion apiver;
+			apiver.set_version(2);
+			std::string message;
+			apiver.SerializeToString(&message);
+			serv->handleAPIVersionPayload(&backend, message);
+			CPPUNIT_ASSERT_EQUAL(2, backend.apiVersion);
+
+			std::string xml = "<presence from='buddy1@domain.tld/res' to='user@localhost'/>";
+			std::string stream;
+			NetworkFrameBuffer::appendFrame(stream, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, xml);
+
+			received.clear();
+			serv->handleDataRead(&backend, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray>(new Swift::SafeByteArray(stream.begin(), stream.end())));
+
+			CPPUNIT_ASSERT_EQUAL(1, (int) received.size());
+			CPPUNIT_ASSERT(dynamic_cast<Swift::Presence *>(getStanza(received[0])));
+			CPPUNIT_ASSERT_EQUAL(0, (int) backend.data.size());
+		}
+
+		void handleDataReadCompressed() {
+			if (!NetworkFrameBuffer::isCompressionSupported()) {
+				return;
+			}
+
+			cfg->updateBackendConfig("[features]\nrawxml=1\n");
+			User *user = userManager->getUser("user@localhost");
+			std::vector<std::string> grp;
+			grp.push_back("group1");
+			LocalBuddy *buddy = new LocalBuddy(user->getRosterManager(), -1, "buddy1@domain.tld", "Buddy 1", grp, BUDDY_JID_ESCAPING);
+			user->getRosterManager()->setBuddy(buddy);
+
+			std::string xml = "<presence from='buddy1@domain.tld/res' to='user@localhost'><status>" + std::string(1000, 'x') + "</status></presence>";
+			std::string stream;
+			CPPUNIT_ASSERT(NetworkFrameBuffer::appendCompressedFrame(stream, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, xml));
+			CPPUNIT_ASSERT(stream.size() < xml.size());
+
+			received.clear();
+			serv->handleDataRead(&backend, SWIFTEN_SHRPTR_NAMESPACE::shared_ptr<Swift::SafeByteArray>(new Swift::SafeByteArray(stream.begin(), stream.end())));
+
+			CPPUNIT_ASSERT_EQUAL(1, (int) received.size());
+			CPPUNIT_ASSERT(dynamic_cast<Swift::Presence *>(getStanza(received[0])));
+			CPPUNIT_ASSERT_EQUAL(xml.size(), (size_t) backend.uncompressedBytes);
+			CPPUNIT_ASSERT_EQUAL(stream.size() - 6, (size_t) backend.compressedBytes);
+		}
+
+		void frameBufferShrink() {
+			NetworkFrameBuffer buffer;
+			std::string stream;
+			std::string presence;
+			NetworkFrameBuffer::appendFrame(stream, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, std::string(REUSED_BUFFER_LIMIT * 4, 'a'));
+			NetworkFrameBuffer::appendFrame(presence, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, "<presence/>");
+			stream += presence.substr(0, 3);
+			buffer.append(stream);
+
+			const char *frame;
+			unsigned int size;
+			int type;
+			CPPUNIT_ASSERT(buffer.nextFrame(frame, size, type));
+			CPPUNIT_ASSERT_EQUAL(REUSED_BUFFER_LIMIT * 4, (int) size);
+			CPPUNIT_ASSERT(!buffer.nextFrame(frame, size, type));
+			CPPUNIT_ASSERT(buffer.capacity() > REUSED_BUFFER_LIMIT);
+
+			// The big frame has been consumed, so the rest of the data is
+			// moved to smaller buffer.
+			buffer.append(presence.substr(3));
+			CPPUNIT_ASSERT(buffer.capacity() <= REUSED_BUFFER_LIMIT);
+			CPPUNIT_ASSERT(buffer.nextFrame(frame, size, type));
+			CPPUNIT_ASSERT_EQUAL(std::string("<presence/>"), std::string(frame, size));
+		}
+
+		void decompressLimit() {
+#ifdef WITH_ZLIB
+			std::string big(NETWORK_FRAME_MAX_DECOMPRESSED_SIZE + 1, 'x');
+			std::string stream;
+			CPPUNIT_ASSERT(!NetworkFrameBuffer::appendCompressedFrame(stream, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, big));
+			CPPUNIT_ASSERT(stream.empty());
+
+			// Peer which does not respect the limit.
+			std::string compressed(big.size(), 0);
+			z_stream z;
+			memset(&z, 0, sizeof(z));
+			CPPUNIT_ASSERT_EQUAL(Z_OK, deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY));
+			z.next_in = (Bytef *) big.data();
+			z.avail_in = big.size();
+			z.next_out = (Bytef *) &compressed[0];
+			z.avail_out = compressed.size();
+			CPPUNIT_ASSERT_EQUAL(Z_STREAM_END, deflate(&z, Z_FINISH));
+			compressed.resize(compressed.size() - z.avail_out);
+			deflateEnd(&z);
+
+			std::string out;
+			CPPUNIT_ASSERT(!NetworkFrameBuffer::decompress(compressed.data(), compressed.size(), out));
+			CPPUNIT_ASSERT(out.empty());
+
+			big.resize(big.size() - 1);
+			CPPUNIT_ASSERT(NetworkFrameBuffer::appendCompressedFrame(stream, pbnetwork::WrapperMessage_Type_TYPE_RAW_XML, big));
+			CPPUNIT_ASSERT(NetworkFrameBuffer::decompress(stream.data() + 6, stream.size() - 6, out));
+			CPPUNIT_ASSERT(out == big);
+#endif
+		}
+
+		void sendQueuePriority() {
+			pbnetwork::Status status;
+			status.set_username("user@localhost");
+
+			// Connection has not finished previous write, so frames are queued.
+			backend.writing = true;
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_STATUS_CHANGED, status);
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_PING);
+			loop->processEvents();
+			CPPUNIT_ASSERT_EQUAL(2, (int) backend.outputFrames);
+			CPPUNIT_ASSERT(backend.queued != 0);
+
+			serv->handleDataWritten(&backend);
+			loop->processEvents();
+			CPPUNIT_ASSERT_EQUAL(0, (int) backend.queued);
+
+			// PING is written before the status change queued earlier.
+			NetworkFrameBuffer buffer;
+			buffer.append(&protobufData[0], protobufData.size());
+			const char *frame;
+			unsigned int size;
+			int type;
+			pbnetwork::WrapperMessage wrapper;
+			CPPUNIT_ASSERT(buffer.nextFrame(frame, size, type));
+			wrapper.ParseFromArray(frame, size);
+			CPPUNIT_ASSERT_EQUAL(pbnetwork::WrapperMessage_Type_TYPE_PING, wrapper.type());
+			CPPUNIT_ASSERT(buffer.nextFrame(frame, size, type));
+			wrapper.ParseFromArray(frame, size);
+			CPPUNIT_ASSERT_EQUAL(pbnetwork::WrapperMessage_Type_TYPE_STATUS_CHANGED, wrapper.type());
+		}
+
+		void sendQueueSessionOrder() {
+			pbnetwork::ConversationMessage msg;
+			msg.set_username("user@localhost");
+			msg.set_buddyname("buddy1@test");
+			msg.set_message("bye");
+			pbnetwork::Logout logout;
+			logout.set_user("user@localhost");
+			logout.set_legacyname("user");
+			pbnetwork::Login login;
+			login.set_user("user@localhost");
+			login.set_legacyname("user");
+			login.set_password("password");
+			pbnetwork::Buddy buddy;
+			buddy.set_username("user@localhost");
+			buddy.set_buddyname("buddy1@test");
+
+			backend.writing = true;
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING, buddy);
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE, msg);
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_LOGOUT, logout);
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_LOGIN, login);
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_BUDDIES, buddy);
+			serv->handleDataWritten(&backend);
+			loop->processEvents();
+
+			// Session frames keep their order, typing is written after them.
+			int expected[] = {
+				pbnetwork::WrapperMessage_Type_TYPE_CONV_MESSAGE,
+				pbnetwork::WrapperMessage_Type_TYPE_LOGOUT,
+				pbnetwork::WrapperMessage_Type_TYPE_LOGIN,
+				pbnetwork::WrapperMessage_Type_TYPE_BUDDIES,
+				pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING
+			};
+			NetworkFrameBuffer buffer;
+			buffer.append(&protobufData[0], protobufData.size());
+			const char *frame;
+			unsigned int size;
+			int type;
+			pbnetwork::WrapperMessage wrapper;
+			for (int i = 0; i < 5; i++) {
+				CPPUNIT_ASSERT(buffer.nextFrame(frame, size, type));
+				wrapper.ParseFromArray(frame, size);
+				CPPUNIT_ASSERT_EQUAL(expected[i], (int) wrapper.type());
+			}
+		}
+
+		void sendQueueShedding() {
+			pbnetwork::Buddy buddy;
+			buddy.set_username("user@localhost");
+			buddy.set_buddyname("buddy1@test");
+
+			backend.writing = true;
+			backend.congested = true;
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING, buddy);
+			CPPUNIT_ASSERT_EQUAL(1, (int) backend.shed);
+			CPPUNIT_ASSERT_EQUAL(0, (int) backend.queued);
+
+			// Buddy and status changes are never dropped.
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_CHANGED, buddy);
+			CPPUNIT_ASSERT_EQUAL(1, (int) backend.shed);
+			CPPUNIT_ASSERT(backend.queued != 0);
+			pbnetwork::Status status;
+			status.set_username("user@localhost");
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_STATUS_CHANGED, status);
+			CPPUNIT_ASSERT_EQUAL(1, (int) backend.shed);
+
+			// Queue drained under the low watermark.
+			serv->handleDataWritten(&backend);
+			CPPUNIT_ASSERT(!backend.congested);
+			serv->send(&backend, pbnetwork::WrapperMessage_Type_TYPE_BUDDY_TYPING, buddy);
+			CPPUNIT_ASSERT_EQUAL(1, (int) backend.shed);
+		}
+
+		void migrateUser() {
+			User *user = userManager->getUser("user@localhost");
+			backend.users.push_back(user);
+			backend.apiVersion = 3;
+
+			NetworkPluginServer::Backend target;
+			target.connection = factories->getConnectionFactory()->createConnection();
+			target.apiVersion = 3;
+
+			// Without session resume the user would have to log in again.
+			CPPUNIT_ASSERT(!serv->migrateUser(user, &target, false));
+			CPPUNIT_ASSERT(user->getData() == &backend);
+
+			pbnetwork::APIVersion apiver;
+			apiver.set_version(3);
+			apiver.set_sessionresume(true);
+			std::string payload;
+			apiver.SerializeToString(&payload);
+			serv->handleAPIVersionPayload(&backend, payload);
+			serv->handleAPIVersionPayload(&target, payload);
+			CPPUNIT_ASSERT(target.sessionResume);
+
+			// User stays on the old backend until it exports the session.
+			CPPUNIT_ASSERT(serv->migrateUser(user, &target, false));
+			CPPUNIT_ASSERT(user->getData() == &backend);
+			CPPUNIT_ASSERT(!serv->migrateUser(user, &target, false));
+			CPPUNIT_ASSERT_EQUAL(1, (int) target.incoming);
+
+			pbnetwork::SessionState state;
+			state.set_username("user@localhost");
+			state.set_legacyname("user");
+			state.set_data("token");
+			std::string message;
+			state.SerializeToString(&message);
+			serv->handleSessionExportedPayload(&backend, message);
+
+			CPPUNIT_ASSERT(user->getData() == &target);
+			CPPUNIT_ASSERT_EQUAL(0, (int) backend.users.size());
+			CPPUNIT_ASSERT_EQUAL(1, (int) target.users.size());
+			CPPUNIT_ASSERT_EQUAL(0, (int) target.incoming);
+			CPPUNIT_ASSERT_EQUAL(1, (int) target.outputFrames);
+
+			loop->processEvents();
+			user->setData(&backend);
+		}
+
 		void handleBuddyChangedPayload() {
 			User *user = userManager->getUser("user@localhost");
 
@@ -206,6 +518,60 @@ class NetworkPluginServerTest : public CPPUNIT_NS :: TestFixture, public BasicTe
 			CPPUNIT_ASSERT_EQUAL(std::string("buddy1\\40test@localhost"), item.getJID().toString());
 		}
 
+		void handleBuddyChangedPayloadSessionId() {
+			User *user = userManager->getUser("user@localhost");
+			CPPUNIT_ASSERT(user->getSessionId() != 0);
+
+			pbnetwork::Buddy buddy;
+			buddy.set_username("other@localhost");
+			buddy.set_buddyname("buddy1@test");
+			buddy.set_status(pbnetwork::STATUS_NONE);
+			buddy.set_sessionid(user->getSessionId());
+
+			// Session ID of another user.
+			std::string message;
+			buddy.SerializeToString(&message);
+			serv->handleBuddyChangedPayload(message);
+			CPPUNIT_ASSERT_EQUAL(0, (int) received.size());
+
+			buddy.set_username("user@localhost");
+			buddy.SerializeToString(&message);
+			serv->handleBuddyChangedPayload(message);
+			CPPUNIT_ASSERT_EQUAL(1, (int) received.size());
+		}
+
+		void handleBuddiesChangedPayload() {
+			User *user = userManager->getUser("user@localhost");
+			user->getRosterManager()->setBuddy(new LocalBuddy(user->getRosterManager(), -1, "buddy1@test", "Buddy 1", std::vector<std::string>(), BUDDY_JID_ESCAPING));
+			received.clear();
+
+			pbnetwork::Buddies buddies;
+			pbnetwork::Buddy *buddy = buddies.add_buddy();
+			buddy->set_username("user@localhost");
+			buddy->set_buddyname("buddy1@test");
+			buddy->set_alias("Buddy 1 renamed");
+			buddy->set_status(pbnetwork::STATUS_NONE);
+			buddy = buddies.add_buddy();
+			buddy->set_username("user@localhost");
+			buddy->set_buddyname("buddy2@test");
+			buddy->set_status(pbnetwork::STATUS_NONE);
+
+			std::string message;
+			buddies.SerializeToString(&message);
+
+			// Roster push can contain only one item, so every buddy is
+			// pushed separately.
+			serv->handleBuddiesChangedPayload(message);
+			CPPUNIT_ASSERT_EQUAL(2, (int) received.size());
+			Swift::RosterPayload::ref payload1 = getStanza(received[0])->getPayload<Swift::RosterPayload>();
+			CPPUNIT_ASSERT_EQUAL(1, (int) payload1->getItems().size());
+			CPPUNIT_ASSERT_EQUAL(std::string("buddy2\\40test@localhost"), payload1->getItems()[0].getJID().toString());
+			Swift::RosterPayload::ref payload2 = getStanza(received[1])->getPayload<Swift::RosterPayload>();
+			CPPUNIT_ASSERT_EQUAL(1, (int) payload2->getItems().size());
+			CPPUNIT_ASSERT_EQUAL(std::string("buddy1\\40test@localhost"), payload2->getItems()[0].getJID().toString());
+			CPPUNIT_ASSERT_EQUAL(std::string("Buddy 1 renamed"), payload2->getItems()[0].getName());
+		}
+
 		void handleBuddyChangedPayloadNoEscaping() {
 			std::istringstream ifs("service.server_mode = 1\nservice.jid_escaping=0\nservice.jid=localhost\nservice.more_resources=1\n");
 			cfg->load(ifs);
@@ -0,0 +1,178 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <Swiften/Swiften.h>
+#include <Swiften/EventLoop/DummyEventLoop.h>
+#include <Swiften/Server/Server.h>
+#include <Swiften/Network/DummyNetworkFactories.h>
+#include <Swiften/Network/DummyConnectionServer.h>
+#include <Swiften/Network/DummyTimerFactory.h>
+#include "Swiften/Server/ServerStanzaChannel.h"
+#include "Swiften/Server/ServerFromClientSession.h"
+#include "Swiften/Parser/PayloadParsers/FullPayloadParserFactoryCollection.h"
+#include "basictest.h"
+#include "transport/OnlineUsersFlusher.h"
+#include "transport/AsyncStorageBackend.h"
+#include <fstream>
+#include <iterator>
+#include <stdio.h>
+
+using namespace Transport;
+
+#define JOURNAL_PATH "onlineusersflusher.journal"
+
+// Holds setUsersOnline() requests until they are released by the test.
+class DelayedStorageBackend : public AsyncStorageBackend {
+	public:
+		DelayedStorageBackend(Swift::EventLoop *loop, Config *config, StorageBackend *storageBackend) :
+			AsyncStorageBackend(loop, config, storageBackend, 0) {}
+
+		virtual void setUsersOnline(const std::vector<long> &ids, bool online, StoreCallback callback) {
+			requests.push_back(boost::bind(&DelayedStorageBackend::release, this, ids, online, callback));
+		}
+
+		void release(const std::vector<long> &ids, bool online, StoreCallback callback) {
+			AsyncStorageBackend::setUsersOnline(ids, online, callback);
+		}
+
+		std::vector<boost::function<void ()> > requests;
+};
+
+class OnlineUsersFlusherTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
+	CPPUNIT_TEST_SUITE(OnlineUsersFlusherTest);
+	CPPUNIT_TEST(flushOnTimeout);
+	CPPUNIT_TEST(journal);
+	CPPUNIT_TEST(retry);
+	CPPUNIT_TEST(overlappingBatches);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		TestingStorageBackend *testingStorage;
+		AsyncStorageBackend *async;
+
+		void setUp (void) {
+			setMeUp();
+			addUser();
+			testingStorage = dynamic_cast<TestingStorageBackend *>(storage);
+			// Without connections the requests are executed immediately.
+			async = new AsyncStorageBackend(loop, cfg, storage, 0);
+			remove(JOURNAL_PATH);
+		}
+
+		void tearDown (void) {
+			remove(JOURNAL_PATH);
+			delete async;
+			tearMeDown();
+		}
+
+		std::string readJournal() {
+			std::ifstream f(JOURNAL_PATH);
+			return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+		}
+
+		void flushOnTimeout() {
+			OnlineUsersFlusher flusher(component, async, 5, "");
+			flusher.setUserOnline(1, true);
+			flusher.setUserOnline(1, false);
+			flusher.setUserOnline(1, true);
+			CPPUNIT_ASSERT_EQUAL(1, (int) flusher.getQueueSize());
+			loop->processEvents();
+			CPPUNIT_ASSERT(testingStorage->online_users.empty());
+
+			dynamic_cast<Swift::DummyTimerFactory *>(factories->getTimerFactory())->setTime(5000);
+			loop->processEvents();
+			CPPUNIT_ASSERT_EQUAL(0, (int) flusher.getQueueSize());
+			CPPUNIT_ASSERT(testingStorage->online_users["user@localhost"]);
+		}
+
+		void journal() {
+			// Journal left by crashed instance, the last line is incomplete.
+			{
+				std::ofstream f(JOURNAL_PATH);
+				f << "1 0\n1 1\n1";
+			}
+
+			{
+				OnlineUsersFlusher flusher(component, async, 5, JOURNAL_PATH);
+				CPPUNIT_ASSERT(testingStorage->online_users["user@localhost"]);
+				CPPUNIT_ASSERT_EQUAL(std::string(""), readJournal());
+
+				flusher.setUserOnline(1, false);
+				CPPUNIT_ASSERT_EQUAL(std::string("1 0\n"), readJournal());
+				CPPUNIT_ASSERT(testingStorage->online_users["user@localhost"]);
+
+				flusher.flush();
+				CPPUNIT_ASSERT(!testingStorage->online_users["user@localhost"]);
+				CPPUNIT_ASSERT_EQUAL(std::string(""), readJournal());
+			}
+		}
+
+		void retry() {
+			OnlineUsersFlusher flusher(component, async, 5, JOURNAL_PATH);
+			testingStorage->online_failure = true;
+			flusher.setUserOnline(1, true);
+			dynamic_cast<Swift::DummyTimerFactory *>(factories->getTimerFactory())->setTime(5000);
+			loop->processEvents();
+			CPPUNIT_ASSERT(testingStorage->online_users.empty());
+			CPPUNIT_ASSERT_EQUAL(1, (int) flusher.getQueueSize());
+			CPPUNIT_ASSERT_EQUAL(std::string("1 1\n"), readJournal());
+
+			// The retry is delayed twice as long after the failure.
+			testingStorage->online_failure = false;
+			dynamic_cast<Swift::DummyTimerFactory *>(factories->getTimerFactory())->setTime(10000);
+			loop->processEvents();
+			CPPUNIT_ASSERT(testingStorage->online_users.empty());
+
+			dynamic_cast<Swift::DummyTimerFactory *>(factories->getTimerFactory())->setTime(15000);
+			loop->processEvents();
+			CPPUNIT_ASSERT_EQUAL(0, (int) flusher.getQueueSize());
+			CPPUNIT_ASSERT(testingStorage->online_users["user@localhost"]);
+			CPPUNIT_ASSERT_EQUAL(std::string(""), readJournal());
+		}
+
+		void overlappingBatches() {
+			DelayedStorageBackend delayed(loop, cfg, storage);
+			{
+				OnlineUsersFlusher flusher(component, &delayed, 5, JOURNAL_PATH);
+				flusher.setUserOnline(1, true);
+				flusher.flush();
+				flusher.setUserOnline(1, false);
+				flusher.flush();
+				CPPUNIT_ASSERT_EQUAL(2, (int) flusher.getPendingCount());
+				CPPUNIT_ASSERT_EQUAL(2, (int) delayed.requests.size());
+
+				// The newer batch finishes first, so the failed older one
+				// must not overwrite it later.
+				delayed.requests[1]();
+				CPPUNIT_ASSERT(!testingStorage->online_users["user@localhost"]);
+				testingStorage->online_failure = true;
+				delayed.requests[0]();
+				testingStorage->online_failure = false;
+				CPPUNIT_ASSERT_EQUAL(0, (int) flusher.getPendingCount());
+				CPPUNIT_ASSERT_EQUAL(0, (int) flusher.getQueueSize());
+				CPPUNIT_ASSERT_EQUAL(std::string(""), readJournal());
+
+				// Failed newer batch is retried even while the older one
+				// is still in progress.
+				delayed.requests.clear();
+				flusher.setUserOnline(1, true);
+				flusher.flush();
+				flusher.setUserOnline(1, false);
+				flusher.flush();
+				testingStorage->online_failure = true;
+				delayed.requests[1]();
+				testingStorage->online_failure = false;
+				CPPUNIT_ASSERT_EQUAL(1, (int) flusher.getQueueSize());
+				delayed.requests[0]();
+				CPPUNIT_ASSERT_EQUAL(1, (int) flusher.getQueueSize());
+				CPPUNIT_ASSERT_EQUAL(std::string("1 0\n"), readJournal());
+
+				delayed.requests.clear();
+				flusher.flush();
+				delayed.requests[0]();
+				CPPUNIT_ASSERT(!testingStorage->online_users["user@localhost"]);
+				CPPUNIT_ASSERT_EQUAL(0, (int) flusher.getQueueSize());
+			}
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (OnlineUsersFlusherTest);
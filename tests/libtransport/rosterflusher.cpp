@@ -0,0 +1,91 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <Swiften/Swiften.h>
+#include <Swiften/EventLoop/DummyEventLoop.h>
+#include <Swiften/Server/Server.h>
+#include <Swiften/Network/DummyNetworkFactories.h>
+#include <Swiften/Network/DummyConnectionServer.h>
+#include <Swiften/Network/DummyTimerFactory.h>
+#include "Swiften/Server/ServerStanzaChannel.h"
+#include "Swiften/Server/ServerFromClientSession.h"
+#include "Swiften/Parser/PayloadParsers/FullPayloadParserFactoryCollection.h"
+#include "basictest.h"
+#include "transport/RosterFlusher.h"
+#include <boost/lexical_cast.hpp>
+
+using namespace Transport;
+
+class RosterFlusherTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
+	CPPUNIT_TEST_SUITE(RosterFlusherTest);
+	CPPUNIT_TEST(flush);
+	CPPUNIT_TEST(flushOnTimeout);
+	CPPUNIT_TEST(flushOnSize);
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		void setUp (void) {
+			setMeUp();
+			connectUser();
+			received.clear();
+		}
+
+		void tearDown (void) {
+			received.clear();
+			disconnectUser();
+			tearMeDown();
+		}
+
+		LocalBuddy *addBuddy(const std::string &name) {
+			User *user = userManager->getUser("user@localhost");
+			std::vector<std::string> grp;
+			grp.push_back("group1");
+			LocalBuddy *buddy = new LocalBuddy(user->getRosterManager(), -1, name, "Buddy", grp, BUDDY_JID_ESCAPING);
+			user->getRosterManager()->setBuddy(buddy);
+			return buddy;
+		}
+
+		void flush() {
+			RosterFlusher *flusher = userManager->getRosterFlusher();
+			CPPUNIT_ASSERT(flusher);
+
+			LocalBuddy *buddy1 = addBuddy("buddy1");
+			LocalBuddy *buddy2 = addBuddy("buddy2");
+			CPPUNIT_ASSERT_EQUAL(2, (int) flusher->getQueueSize());
+			CPPUNIT_ASSERT_EQUAL(-1, (int) buddy1->getID());
+
+			flusher->flush();
+			CPPUNIT_ASSERT_EQUAL(0, (int) flusher->getQueueSize());
+			CPPUNIT_ASSERT_EQUAL(0, (int) flusher->getPendingCount());
+			CPPUNIT_ASSERT(buddy1->getID() != -1);
+			CPPUNIT_ASSERT(buddy2->getID() != -1);
+			CPPUNIT_ASSERT(buddy1->getID() != buddy2->getID());
+		}
+
+		void flushOnTimeout() {
+			RosterFlusher *flusher = userManager->getRosterFlusher();
+			LocalBuddy *buddy = addBuddy("buddy1");
+			loop->processEvents();
+			CPPUNIT_ASSERT_EQUAL(-1, (int) buddy->getID());
+
+			dynamic_cast<Swift::DummyTimerFactory *>(factories->getTimerFactory())->setTime(10000);
+			loop->processEvents();
+			CPPUNIT_ASSERT(buddy->getID() != -1);
+			CPPUNIT_ASSERT_EQUAL(0, (int) flusher->getQueueSize());
+		}
+
+		void flushOnSize() {
+			// database.roster_flush_size is 1000 by default.
+			std::vector<LocalBuddy *> buddies;
+			for (int i = 0; i < 1000; i++) {
+				buddies.push_back(addBuddy("buddy" + boost::lexical_cast<std::string>(i)));
+			}
+			CPPUNIT_ASSERT_EQUAL(-1, (int) buddies.back()->getID());
+
+			loop->processEvents();
+			for (std::vector<LocalBuddy *>::const_iterator it = buddies.begin(); it != buddies.end(); it++) {
+				CPPUNIT_ASSERT((*it)->getID() != -1);
+			}
+		}
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (RosterFlusherTest);
@@ -0,0 +1,232 @@
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <sstream>
+#include <set>
+#include <boost/lexical_cast.hpp>
+#include "transport/StorageBackend.h"
+#include "transport/Config.h"
+#ifdef WITH_SQLITE
+#include "transport/SQLite3Backend.h"
+#endif
+
+using namespace Transport;
+
+class StorageBackendTest : public CPPUNIT_NS :: TestFixture {
+	CPPUNIT_TEST_SUITE(StorageBackendTest);
+	CPPUNIT_TEST(serializeSettings);
+	CPPUNIT_TEST(deserializeMalformedSettings);
+#ifdef WITH_SQLITE
+	CPPUNIT_TEST(buddySettingsSQLite);
+	CPPUNIT_TEST(buddySettingsAfterStoreSQLite);
+	CPPUNIT_TEST(updateIconHashSQLite);
+	CPPUNIT_TEST(storeManyBuddiesSQLite);
+	CPPUNIT_TEST(connectionPoolSQLite);
+#endif
+	CPPUNIT_TEST_SUITE_END();
+
+	public:
+		void setUp (void) {
+		}
+
+		void tearDown (void) {
+		}
+
+		void serializeSettings() {
+			std::map<std::string, SettingVariableInfo> settings;
+			settings["icon_hash"].type = TYPE_STRING;
+			settings["icon_hash"].s = "a:1";
+			settings["blocked"].type = TYPE_BOOLEAN;
+			settings["blocked"].b = true;
+			settings["object"].type = TYPE_OBJECT;
+
+			std::string data = StorageBackend::serializeSettings(settings);
+			CPPUNIT_ASSERT_EQUAL(std::string("4:7:blocked1:113:9:icon_hash3:a:1"), data);
+
+			std::map<std::string, SettingVariableInfo> parsed;
+			CPPUNIT_ASSERT(StorageBackend::deserializeSettings(data, parsed));
+			CPPUNIT_ASSERT_EQUAL(2, (int) parsed.size());
+			CPPUNIT_ASSERT_EQUAL(std::string("a:1"), parsed["icon_hash"].s);
+			CPPUNIT_ASSERT(parsed["blocked"].b);
+
+			parsed.clear();
+			CPPUNIT_ASSERT(StorageBackend::deserializeSettings("", parsed));
+			CPPUNIT_ASSERT(parsed.empty());
+		}
+
+		void deserializeMalformedSettings() {
+			std::map<std::string, SettingVariableInfo> parsed;
+			CPPUNIT_ASSERT(!StorageBackend::deserializeSettings("13:9:icon_hash5:abc", parsed));
+			CPPUNIT_ASSERT(!StorageBackend::deserializeSettings("13:x:icon_hash", parsed));
+			CPPUNIT_ASSERT(!StorageBackend::deserializeSettings("13:9:icon_hash", parsed));
+			CPPUNIT_ASSERT(parsed.empty());
+		}
+
+#ifdef WITH_SQLITE
+		void buddySettingsSQLite() {
+			std::istringstream ifs("database.type = sqlite3\ndatabase.database = :memory:\n");
+			Config config;
+			config.load(ifs);
+
+			SQLite3Backend storage(&config);
+			CPPUNIT_ASSERT(storage.connect());
+
+			BuddyInfo buddy;
+			buddy.id = -1;
+			buddy.legacyName = "buddy1";
+			buddy.alias = "Buddy 1";
+			buddy.subscription = "both";
+			buddy.flags = 0;
+			buddy.settings["icon_hash"].type = TYPE_STRING;
+			buddy.settings["icon_hash"].s = "hash1";
+			buddy.id = storage.addBuddy(1, buddy);
+			CPPUNIT_ASSERT(buddy.id != -1);
+
+			storage.updateBuddySetting(1, buddy.id, "icon_hash", TYPE_STRING, "hash2");
+			int type = 0;
+			std::string value;
+			storage.getBuddySetting(1, buddy.id, "icon_hash", type, value);
+			CPPUNIT_ASSERT_EQUAL((int) TYPE_STRING, type);
+			CPPUNIT_ASSERT_EQUAL(std::string("hash2"), value);
+
+			std::list<BuddyInfo> roster;
+			CPPUNIT_ASSERT(storage.getBuddies(1, roster));
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(std::string("hash2"), roster.front().settings["icon_hash"].s);
+		}
+
+		void buddySettingsAfterStoreSQLite() {
+			std::istringstream ifs("database.type = sqlite3\ndatabase.database = :memory:\n");
+			Config config;
+			config.load(ifs);
+
+			SQLite3Backend storage(&config);
+			CPPUNIT_ASSERT(storage.connect());
+
+			BuddyInfo buddy;
+			buddy.id = -1;
+			buddy.legacyName = "buddy1";
+			buddy.alias = "Buddy 1";
+			buddy.subscription = "both";
+			buddy.flags = 0;
+			std::list<std::pair<long, BuddyInfo> > buddies;
+			buddies.push_back(std::make_pair(1L, buddy));
+			CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+			buddy.id = buddies.front().second.id;
+			CPPUNIT_ASSERT(buddy.id != -1);
+
+			storage.updateBuddySetting(1, buddy.id, "blocked", TYPE_BOOLEAN, "1");
+
+			// RosterStorage stores only the icon_hash setting.
+			buddies.front().second.alias = "Changed";
+			buddies.front().second.settings["icon_hash"].type = TYPE_STRING;
+			buddies.front().second.settings["icon_hash"].s = "hash1";
+			CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+
+			int type = 0;
+			std::string value;
+			storage.getBuddySetting(1, buddy.id, "blocked", type, value);
+			CPPUNIT_ASSERT_EQUAL((int) TYPE_BOOLEAN, type);
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), value);
+
+			std::list<BuddyInfo> roster;
+			CPPUNIT_ASSERT(storage.getBuddies(1, roster));
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(std::string("Changed"), roster.front().alias);
+		}
+
+		void updateIconHashSQLite() {
+			std::istringstream ifs("database.type = sqlite3\ndatabase.database = :memory:\n");
+			Config config;
+			config.load(ifs);
+
+			SQLite3Backend storage(&config);
+			CPPUNIT_ASSERT(storage.connect());
+
+			BuddyInfo buddy;
+			buddy.id = -1;
+			buddy.legacyName = "buddy1";
+			buddy.alias = "Buddy 1";
+			buddy.subscription = "both";
+			buddy.flags = 0;
+			buddy.settings["icon_hash"].type = TYPE_STRING;
+			buddy.settings["icon_hash"].s = "hash1";
+			std::list<std::pair<long, BuddyInfo> > buddies;
+			buddies.push_back(std::make_pair(1L, buddy));
+			CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+			CPPUNIT_ASSERT(buddies.front().second.id != -1);
+			storage.updateBuddySetting(1, buddies.front().second.id, "blocked", TYPE_BOOLEAN, "1");
+
+			// The changed avatar of existing buddy is stored.
+			buddies.front().second.settings["icon_hash"].s = "hash2";
+			CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+
+			int type = 0;
+			std::string value;
+			storage.getBuddySetting(1, buddies.front().second.id, "icon_hash", type, value);
+			CPPUNIT_ASSERT_EQUAL((int) TYPE_STRING, type);
+			CPPUNIT_ASSERT_EQUAL(std::string("hash2"), value);
+			storage.getBuddySetting(1, buddies.front().second.id, "blocked", type, value);
+			CPPUNIT_ASSERT_EQUAL(std::string("1"), value);
+
+			std::list<BuddyInfo> roster;
+			CPPUNIT_ASSERT(storage.getBuddies(1, roster));
+			CPPUNIT_ASSERT_EQUAL(1, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(std::string("hash2"), roster.front().settings["icon_hash"].s);
+		}
+
+		void storeManyBuddiesSQLite() {
+			std::istringstream ifs("database.type = sqlite3\ndatabase.database = :memory:\n");
+			Config config;
+			config.load(ifs);
+
+			SQLite3Backend storage(&config);
+			CPPUNIT_ASSERT(storage.connect());
+
+			// More buddies than fit into single statement, half of them
+			// is stored already.
+			std::list<std::pair<long, BuddyInfo> > buddies;
+			for (int i = 0; i < 250; i++) {
+				BuddyInfo buddy;
+				buddy.id = -1;
+				buddy.legacyName = "buddy" + boost::lexical_cast<std::string>(i);
+				buddy.alias = "Buddy";
+				buddy.subscription = "both";
+				buddy.flags = 0;
+				buddies.push_back(std::make_pair((long) (i % 2 + 1), buddy));
+				if (i % 2 == 0) {
+					buddies.back().second.id = storage.addBuddy(buddies.back().first, buddy);
+				}
+			}
+			long existing = buddies.front().second.id;
+			CPPUNIT_ASSERT(storage.storeBuddies(buddies));
+			CPPUNIT_ASSERT_EQUAL(existing, buddies.front().second.id);
+
+			std::set<long> ids;
+			for (std::list<std::pair<long, BuddyInfo> >::const_iterator it = buddies.begin(); it != buddies.end(); it++) {
+				CPPUNIT_ASSERT(it->second.id != -1);
+				ids.insert(it->second.id);
+			}
+			CPPUNIT_ASSERT_EQUAL(250, (int) ids.size());
+
+			std::list<BuddyInfo> roster;
+			CPPUNIT_ASSERT(storage.getBuddies(2, roster));
+			CPPUNIT_ASSERT_EQUAL(125, (int) roster.size());
+			CPPUNIT_ASSERT_EQUAL(std::string("buddy1"), roster.front().legacyName);
+		}
+
+		void connectionPoolSQLite() {
+			// Every connection would open its own database in memory.
+			std::istringstream memory("database.type = sqlite3\ndatabase.database = :memory:\n");
+			Config memoryConfig;
+			memoryConfig.load(memory);
+			CPPUNIT_ASSERT(!SQLite3Backend(&memoryConfig).supportsConnectionPool());
+
+			std::istringstream file("database.type = sqlite3\ndatabase.database = storagebackend.db\n");
+			Config fileConfig;
+			fileConfig.load(file);
+			CPPUNIT_ASSERT(SQLite3Backend(&fileConfig).supportsConnectionPool());
+		}
+#endif
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION (StorageBackendTest);
@@ -27,6 +27,7 @@ class UserManagerTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
 	CPPUNIT_TEST(handleProbePresence);
 	CPPUNIT_TEST(disconnectUser);
 	CPPUNIT_TEST(disconnectUserBouncer);
+	CPPUNIT_TEST(sessionId);
 	CPPUNIT_TEST_SUITE_END();
 
 	public:
@@ -220,6 +221,25 @@ class UserManagerTest : public CPPUNIT_NS :: TestFixture, public BasicTest {
 		CPPUNIT_ASSERT_EQUAL(0, userManager->getUserCount());
 	}
 
+	void sessionId() {
+		connectUser();
+		User *user = userManager->getUser("user@localhost");
+		unsigned int sessionId = user->getSessionId();
+		CPPUNIT_ASSERT(sessionId != 0);
+		CPPUNIT_ASSERT(userManager->getUserBySessionId(sessionId) == user);
+		CPPUNIT_ASSERT(userManager->getUserBySessionId(0) == NULL);
+
+		disconnectUser();
+		CPPUNIT_ASSERT(userManager->getUserBySessionId(sessionId) == NULL);
+
+		// Reconnected user gets new ID, so the old one does not match him.
+		connectUser();
+		user = userManager->getUser("user@localhost");
+		CPPUNIT_ASSERT(user->getSessionId() != sessionId);
+		CPPUNIT_ASSERT(userManager->getUserBySessionId(sessionId) == NULL);
+		CPPUNIT_ASSERT(userManager->getUserBySessionId(user->getSessionId()) == user);
+	}
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION (UserManagerTest);